@@ -0,0 +1,406 @@
+#define _POSIX_C_SOURCE				200809L
+/* MAP_ANONYMOUS and the madvise advice values */
+#define _DEFAULT_SOURCE
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "alloc.h"
+#include "stats.h"
+#include "utils.h"
+
+#define PAGE_SIZE					((size_t)4096)
+/* Smallest chunk of scratch space */
+#define SCRATCH_CHUNK				((size_t)1 << 20)
+/* Chunks of one command, each at least twice the previous one */
+#define SCRATCH_CHUNKS				48
+
+/**
+ * A mapped block of the pool
+*/
+typedef struct block_t {
+	void *ptr;
+	size_t size;						/* its size class		*/
+
+	int used;
+	int clean;							/* all pages are zero	*/
+	int advised;						/* pages handed back	*/
+	unsigned long idle_since;			/* command number		*/
+} block_t;
+
+static struct {
+	pthread_mutex_t lock;
+	block_t *blocks;
+	size_t count, capacity;
+
+	size_t idle;						/* bytes of idle blocks	*/
+	unsigned long commands;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * A scratch arena: chunks of pool blocks, filled one after the other
+*/
+struct alloc_arena_t {
+	pthread_mutex_t lock;
+	struct {
+		unsigned char *ptr;
+		size_t size;
+	} chunks[SCRATCH_CHUNKS];
+	size_t count;
+
+	size_t current;						/* chunk being filled	*/
+	size_t used;						/* bytes of it taken	*/
+	size_t want;						/* size of one chunk	*/
+};
+
+/* The arena of the threads that were given none */
+static alloc_arena_t shared = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.want = SCRATCH_CHUNK,
+};
+
+/* The arena of the calling thread, NULL for the shared one */
+static __thread alloc_arena_t *arena;
+
+/**
+ * @return The arena the calling thread takes scratch space from
+*/
+static inline alloc_arena_t *_arena(void)
+{
+	return (arena) ? arena : &shared;
+}
+
+/**
+ * @return The size class of a large block: four classes per power of two,
+ * so at most a quarter is lost
+*/
+static size_t _size_class(size_t size)
+{
+	size_t power = ALLOC_LARGE;
+	while (power <= size / 2)
+		power *= 2;
+
+	size_t step = power / 4;
+	return (size + step - 1) / step * step;
+}
+
+/**
+ * @return Fresh zeroed pages, on a huge page boundary for blocks that can
+ * use huge pages, or NULL if the system has none to give
+*/
+static void *_map(size_t size)
+{
+	size_t extra = (size >= ALLOC_HUGE_PAGE) ? ALLOC_HUGE_PAGE : 0;
+	if (size > SIZE_MAX - extra)
+		return NULL;
+
+	unsigned char *base = (unsigned char *)mmap(NULL, size + extra,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	stats_alloc(size);
+
+	if (!extra)
+		return base;
+
+	/* Trim the mapping to the aligned block */
+	unsigned char *ptr = (unsigned char *)(((uintptr_t)base + extra - 1)
+		& ~(uintptr_t)(extra - 1));
+	if (ptr > base)
+		munmap(base, ptr - base);
+	if (base + extra > ptr)
+		munmap(ptr + size, base + extra - ptr);
+
+#ifdef MADV_HUGEPAGE
+	madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	return ptr;
+}
+
+/**
+ * Lets the kernel take the pages of an idle block, the mapping staying.
+ * MADV_FREE only takes them under memory pressure, so they are not zero.
+*/
+static void _hand_back(block_t *block)
+{
+	block->advised = 1;
+
+#ifdef MADV_FREE
+	if (madvise(block->ptr, block->size, MADV_FREE) == 0)
+		return;
+#endif
+
+	madvise(block->ptr, block->size, MADV_DONTNEED);
+	block->clean = 1;
+}
+
+/**
+ * @return An idle block of the pool of at least @a size bytes, and not
+ * much more, or NULL
+*/
+static block_t *_reuse(size_t size)
+{
+	block_t *best = NULL;
+
+	for (size_t i = 0; i < pool.count; i++) {
+		block_t *block = &pool.blocks[i];
+
+		if (block->used || block->size < size || block->size > size * 3 / 2)
+			continue;
+		if (!best || block->size < best->size)
+			best = block;
+	}
+
+	return best;
+}
+
+void *alloc_block(size_t size, int zero)
+{
+	if (size < ALLOC_LARGE) {
+		void *block = NULL;
+
+		/* Keep one valid block even for empty requests */
+		if (posix_memalign(&block, ALLOC_ALIGNMENT,
+			(size) ? size : ALLOC_ALIGNMENT) != 0)
+			return NULL;
+		stats_alloc((stats_enabled) ? malloc_usable_size(block) : 0);
+
+		if (zero)
+			memset(block, 0, size);
+		return block;
+	}
+
+	/* Past this no size class fits in a size_t */
+	if (size > SIZE_MAX / 2)
+		return NULL;
+	size = _size_class(size);
+
+	pthread_mutex_lock(&pool.lock);
+	block_t *block = _reuse(size);
+	if (block) {
+		block->used = 1;
+		pool.idle -= block->size;
+
+		void *ptr = block->ptr;
+		int clean = block->clean;
+		block->clean = 0;
+		pthread_mutex_unlock(&pool.lock);
+
+		if (zero && !clean)
+			memset(ptr, 0, size);
+		return ptr;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	void *ptr = _map(size);
+	if (!ptr)
+		return NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.count == pool.capacity) {
+		pool.capacity = (pool.capacity) ? 2 * pool.capacity : 16;
+		pool.blocks = (block_t *)realloc(pool.blocks,
+			pool.capacity * sizeof(block_t));
+		DIE(!pool.blocks, "realloc failed");
+	}
+
+	pool.blocks[pool.count++] = (block_t) {
+		.ptr = ptr,
+		.size = size,
+		.used = 1,
+	};
+	pthread_mutex_unlock(&pool.lock);
+
+	return ptr;
+}
+
+void alloc_release(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	for (size_t i = 0; i < pool.count; i++) {
+		block_t *block = &pool.blocks[i];
+		if (block->ptr != ptr)
+			continue;
+
+		block->used = 0;
+		block->advised = 0;
+		block->idle_since = pool.commands;
+		pool.idle += block->size;
+
+		pthread_mutex_unlock(&pool.lock);
+		return;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	stats_free((stats_enabled) ? malloc_usable_size(ptr) : 0);
+	free(ptr);
+}
+
+void alloc_discard(void *ptr, size_t size)
+{
+	uintptr_t begin = ((uintptr_t)ptr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uintptr_t end = ((uintptr_t)ptr + size) & ~(PAGE_SIZE - 1);
+
+	if (end > begin)
+		madvise((void *)begin, end - begin, MADV_DONTNEED);
+}
+
+void *alloc_scratch(size_t size)
+{
+	alloc_arena_t *scratch = _arena();
+	size = (size + ALLOC_ALIGNMENT - 1) / ALLOC_ALIGNMENT * ALLOC_ALIGNMENT;
+
+	pthread_mutex_lock(&scratch->lock);
+
+	/* The next chunk, if the current one is full */
+	if (scratch->count && scratch->used + size
+		> scratch->chunks[scratch->current].size) {
+		scratch->current++;
+		scratch->used = 0;
+	}
+
+	if (scratch->current == scratch->count
+		|| scratch->chunks[scratch->current].size < size) {
+		DIE(scratch->current == SCRATCH_CHUNKS, "too many scratch chunks");
+
+		/* Chunks past the current one are too small, and unused */
+		for (size_t i = scratch->current; i < scratch->count; i++)
+			alloc_release(scratch->chunks[i].ptr);
+
+		size_t chunk = (scratch->current)
+			? 2 * scratch->chunks[scratch->current - 1].size : scratch->want;
+		if (chunk < size)
+			chunk = size;
+
+		scratch->chunks[scratch->current].ptr =
+			(unsigned char *)alloc_block(chunk, 0);
+		DIE(!scratch->chunks[scratch->current].ptr, "alloc_block failed");
+		scratch->chunks[scratch->current].size = chunk;
+		scratch->count = scratch->current + 1;
+	}
+
+	void *ptr = scratch->chunks[scratch->current].ptr + scratch->used;
+	scratch->used += size;
+
+	pthread_mutex_unlock(&scratch->lock);
+	return ptr;
+}
+
+size_t alloc_mark(void)
+{
+	alloc_arena_t *scratch = _arena();
+
+	pthread_mutex_lock(&scratch->lock);
+	size_t mark = scratch->used;
+	for (size_t i = 0; i < scratch->current; i++)
+		mark += scratch->chunks[i].size;
+	pthread_mutex_unlock(&scratch->lock);
+
+	return mark;
+}
+
+void alloc_rewind(size_t mark)
+{
+	alloc_arena_t *scratch = _arena();
+
+	pthread_mutex_lock(&scratch->lock);
+	size_t chunk = 0;
+	while (chunk < scratch->current && mark >= scratch->chunks[chunk].size) {
+		mark -= scratch->chunks[chunk].size;
+		chunk++;
+	}
+
+	scratch->current = chunk;
+	scratch->used = mark;
+	pthread_mutex_unlock(&scratch->lock);
+}
+
+alloc_arena_t *alloc_arena_create(void)
+{
+	alloc_arena_t *scratch = (alloc_arena_t *)calloc(1, sizeof(*scratch));
+	DIE(!scratch, "calloc failed");
+
+	DIE(pthread_mutex_init(&scratch->lock, NULL) != 0,
+		"pthread_mutex_init failed");
+	scratch->want = SCRATCH_CHUNK;
+	return scratch;
+}
+
+void alloc_arena_destroy(alloc_arena_t *scratch)
+{
+	if (!scratch)
+		return;
+
+	for (size_t i = 0; i < scratch->count; i++)
+		alloc_release(scratch->chunks[i].ptr);
+
+	pthread_mutex_destroy(&scratch->lock);
+	free(scratch);
+}
+
+alloc_arena_t *alloc_use(alloc_arena_t *scratch)
+{
+	alloc_arena_t *previous = arena;
+
+	arena = scratch;
+	return previous;
+}
+
+alloc_arena_t *alloc_arena(void)
+{
+	return arena;
+}
+
+void alloc_reset(void)
+{
+	alloc_arena_t *scratch = _arena();
+
+	/* Next time, one chunk holds what all of them did */
+	if (scratch->count > 1) {
+		scratch->want = 0;
+		for (size_t i = 0; i < scratch->count; i++) {
+			scratch->want += scratch->chunks[i].size;
+			alloc_release(scratch->chunks[i].ptr);
+		}
+		scratch->count = 0;
+	}
+
+	scratch->current = 0;
+	scratch->used = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.commands++;
+
+	for (size_t i = 0; i < pool.count; i++) {
+		block_t *block = &pool.blocks[i];
+
+		if (!block->used && !block->advised
+			&& pool.commands - block->idle_since >= ALLOC_IDLE_COMMANDS)
+			_hand_back(block);
+	}
+
+	/* Unmap the blocks idle for longest */
+	while (pool.idle > ALLOC_POOL_LIMIT) {
+		size_t oldest = pool.count;
+		for (size_t i = 0; i < pool.count; i++)
+			if (!pool.blocks[i].used && (oldest == pool.count
+				|| pool.blocks[i].idle_since < pool.blocks[oldest].idle_since))
+				oldest = i;
+
+		block_t *block = &pool.blocks[oldest];
+		munmap(block->ptr, block->size);
+		stats_free(block->size);
+		pool.idle -= block->size;
+		pool.blocks[oldest] = pool.blocks[--pool.count];
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,90 @@
+#ifndef __ALLOC_H
+#define __ALLOC_H	1
+
+#include <stddef.h>
+
+/* Blocks from this size on are mapped and pooled, smaller ones use malloc */
+#define ALLOC_LARGE					((size_t)1 << 18)
+/* Huge page size, large blocks are aligned on it */
+#define ALLOC_HUGE_PAGE				((size_t)1 << 21)
+/* Commands an idle pooled block waits before its pages are handed back */
+#define ALLOC_IDLE_COMMANDS			2
+/* Bytes of idle pooled blocks kept mapped, past which the oldest go */
+#define ALLOC_POOL_LIMIT			((size_t)1 << 30)
+/* Alignment of every block and of every scratch allocation */
+#define ALLOC_ALIGNMENT				64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Scratch space of its own, for a thread running commands next to others
+*/
+typedef struct alloc_arena_t alloc_arena_t;
+
+/**
+ * A block of at least @a size bytes, ALLOC_ALIGNMENT aligned. Large ones
+ * are rounded to a size class and reused from the pool, so that commands
+ * working on images of the same size do not go back to the system.
+ * Zeroed when @a zero is set, unspecified otherwise.
+ *
+ * @return NULL if the system cannot give that much
+*/
+void *alloc_block(size_t size, int zero);
+
+/**
+ * Gives back a block of alloc_block, pooled ones stay mapped for reuse
+*/
+void alloc_release(void *block);
+
+/**
+ * Hands back the whole pages of [@a ptr, @a ptr + @a size), part of a block
+ * whose contents there are no longer needed: they read as zero afterwards,
+ * or as the file for a private mapping
+*/
+void alloc_discard(void *ptr, size_t size);
+
+/**
+ * Room for @a size bytes until the end of the command. Can be called by
+ * the pool threads; nothing is freed one by one. Meant for buffers of a few
+ * rows, the process exits if even that cannot be had.
+*/
+void *alloc_scratch(size_t size);
+
+/**
+ * Scratch space taken after alloc_mark can be given back early with
+ * alloc_rewind, when no other thread is taking any
+*/
+size_t alloc_mark(void);
+void alloc_rewind(size_t mark);
+
+alloc_arena_t *alloc_arena_create(void);
+void alloc_arena_destroy(alloc_arena_t *arena);
+
+/**
+ * Makes the calling thread take its scratch space from @a arena, or from
+ * the shared one when NULL. The pool threads use the arena of the thread
+ * whose job they run.
+ *
+ * @return The arena it used before
+*/
+alloc_arena_t *alloc_use(alloc_arena_t *arena);
+
+/**
+ * @return The arena of the calling thread, NULL for the shared one
+*/
+alloc_arena_t *alloc_arena(void);
+
+/**
+ * Ends a command: the scratch space of the calling thread is reset and the
+ * pages of the blocks idle for ALLOC_IDLE_COMMANDS commands are handed back
+ * with madvise
+*/
+void alloc_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,456 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "alloc.h"
+#include "utils.h"
+
+/**
+ * One run of a script: workers take the files in order
+*/
+typedef struct batch_job_t {
+	batch_t *batch;
+	const batch_ops_t *ops;
+	FILE *report;
+
+	pthread_mutex_t lock;
+	size_t next;						/* first file not taken	*/
+	size_t prefetched;					/* files advised so far	*/
+	size_t failed;
+
+	double *seconds;					/* of every file		*/
+	/* Of every line of the script, summed over the files, and its runs */
+	double *line_seconds;
+	size_t *line_runs;
+} batch_job_t;
+
+static double _clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void _push(char ***items, size_t *count, size_t *capacity,
+	const char *item, size_t length)
+{
+	if (*count == *capacity) {
+		*capacity = (*capacity) ? 2 * *capacity : 64;
+		*items = (char **)realloc(*items, *capacity * sizeof(char *));
+		DIE(!*items, "realloc failed");
+	}
+
+	char *copy = (char *)malloc(length + 1);
+	DIE(!copy, "malloc failed");
+	memcpy(copy, item, length);
+	copy[length] = '\0';
+
+	(*items)[(*count)++] = copy;
+}
+
+/**
+ * @return The length of @a line without its line break
+*/
+static size_t _chomp(const char *line, size_t length)
+{
+	while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+		length--;
+	return length;
+}
+
+int batch_script(batch_t *batch, const char *path)
+{
+	FILE *in = fopen(path, "rt");
+	if (!in) {
+		fprintf(stderr, "Failed to read script %s\n", path);
+		return 0;
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t read;
+	while ((read = getline(&line, &size, in)) != -1) {
+		size_t length = _chomp(line, (size_t)read);
+		size_t blank = strspn(line, " \t");
+
+		if (blank == length || line[blank] == '#')
+			continue;
+		_push(&batch->lines, &batch->line_count, &batch->line_capacity,
+			line, length);
+	}
+
+	free(line);
+	fclose(in);
+	return 1;
+}
+
+static int _compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int batch_add(batch_t *batch, const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		fprintf(stderr, "Failed to read %s\n", path);
+		return 0;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		_push(&batch->files, &batch->file_count, &batch->file_capacity,
+			path, strlen(path));
+		return 1;
+	}
+
+	DIR *dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Failed to read %s\n", path);
+		return 0;
+	}
+
+	size_t first = batch->file_count;
+	size_t length = strlen(path);
+	const char *slash = (length && path[length - 1] == '/') ? "" : "/";
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		char file[BATCH_LINE];
+		int written = snprintf(file, sizeof(file), "%s%s%s", path, slash,
+			entry->d_name);
+		if (written < 0 || (size_t)written >= sizeof(file)
+			|| stat(file, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		_push(&batch->files, &batch->file_count, &batch->file_capacity,
+			file, (size_t)written);
+	}
+	closedir(dir);
+
+	/* By name, so that runs over a directory are in the same order */
+	qsort(batch->files + first, batch->file_count - first, sizeof(char *),
+		_compare);
+	return 1;
+}
+
+int batch_list(batch_t *batch, const char *path)
+{
+	FILE *in = (strcmp(path, "-") == 0) ? stdin : fopen(path, "rt");
+	if (!in) {
+		fprintf(stderr, "Failed to read list %s\n", path);
+		return 0;
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t read;
+	while ((read = getline(&line, &size, in)) != -1) {
+		size_t length = _chomp(line, (size_t)read);
+
+		if (length)
+			_push(&batch->files, &batch->file_count, &batch->file_capacity,
+				line, length);
+	}
+
+	free(line);
+	if (in != stdin)
+		fclose(in);
+	return 1;
+}
+
+void batch_free(batch_t *batch)
+{
+	for (size_t i = 0; i < batch->line_count; i++)
+		free(batch->lines[i]);
+	free(batch->lines);
+
+	for (size_t i = 0; i < batch->file_count; i++)
+		free(batch->files[i]);
+	free(batch->files);
+
+	*batch = (batch_t) { 0 };
+}
+
+/**
+ * Writes @a line to @a out with the placeholders replaced for @a file
+ *
+ * @return 0 if it does not fit in BATCH_LINE bytes
+*/
+static int _expand(char out[BATCH_LINE], const char *line, const char *file)
+{
+	const char *slash = strrchr(file, '/');
+	const char *name = (slash) ? slash + 1 : file;
+	const char *dot = strrchr(name, '.');
+	size_t stem = (dot && dot != name) ? (size_t)(dot - file) : strlen(file);
+	size_t used = 0;
+
+	while (*line) {
+		const char *from = line;
+		size_t length = 1, skip = 1;
+
+		if (strncmp(line, "{}", 2) == 0) {
+			from = file;
+			length = strlen(file);
+			skip = 2;
+		} else if (strncmp(line, "{/}", 3) == 0) {
+			from = name;
+			length = strlen(name);
+			skip = 3;
+		} else if (strncmp(line, "{.}", 3) == 0) {
+			from = file;
+			length = stem;
+			skip = 3;
+		} else if (strncmp(line, "{/.}", 4) == 0) {
+			from = name;
+			length = stem - (size_t)(name - file);
+			skip = 4;
+		}
+
+		/* Room for the line break and the terminator */
+		if (used + length + 2 > BATCH_LINE)
+			return 0;
+
+		memcpy(out + used, from, length);
+		used += length;
+		line += skip;
+	}
+
+	/* Command lines end with a line break, as when read from stdin */
+	out[used++] = '\n';
+	out[used] = '\0';
+	return 1;
+}
+
+/**
+ * Starts reading [@a first, @a last) into the page cache, without waiting
+*/
+static void _prefetch(batch_t *batch, size_t first, size_t last)
+{
+	for (size_t i = first; i < last; i++) {
+		int fd = open(batch->files[i], O_RDONLY);
+		if (fd < 0)
+			continue;
+
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+/**
+ * @return The last line of @a replies, without its line break
+*/
+static const char *_last_reply(char *replies, size_t size)
+{
+	size = _chomp(replies, size);
+	replies[size] = '\0';
+
+	char *line = replies + size;
+	while (line > replies && line[-1] != '\n')
+		line--;
+	return line;
+}
+
+/**
+ * Runs the script on file @a index, adding the time of every line to
+ * @a line_seconds and @a line_runs
+*/
+static void _run_file(batch_job_t *job, size_t index, double *line_seconds,
+	size_t *line_runs)
+{
+	batch_t *batch = job->batch;
+	const char *file = batch->files[index];
+
+	char *replies = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream(&replies, &size);
+	DIE(!out, "open_memstream failed");
+
+	double start = _clock();
+	void *session = job->ops->open(out);
+	batch_result_t result = BATCH_NEXT;
+
+	for (size_t i = 0; i < batch->line_count && result == BATCH_NEXT; i++) {
+		char command_line[BATCH_LINE];
+		if (!_expand(command_line, batch->lines[i], file)) {
+			fputs("Command line too long\n", out);
+			result = BATCH_FAILED;
+			break;
+		}
+
+		double begin = _clock();
+		result = job->ops->run(session, command_line);
+		alloc_reset();
+
+		line_seconds[i] += _clock() - begin;
+		line_runs[i]++;
+	}
+
+	if (job->ops->close(session) == BATCH_FAILED)
+		result = BATCH_FAILED;
+	alloc_reset();
+
+	double seconds = _clock() - start;
+	fclose(out);
+
+	pthread_mutex_lock(&job->lock);
+	job->seconds[index] = seconds;
+	if (result == BATCH_FAILED) {
+		job->failed++;
+		fprintf(job->report, "FAILED %10.3f ms %s: %s\n", seconds * 1e3,
+			file, _last_reply(replies, size));
+	} else {
+		fprintf(job->report, "OK     %10.3f ms %s\n", seconds * 1e3, file);
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	free(replies);
+}
+
+static void *_worker(void *arg)
+{
+	batch_job_t *job = (batch_job_t *)arg;
+	batch_t *batch = job->batch;
+
+	/* Scratch space of its own, kept from one file to the next */
+	alloc_arena_t *arena = alloc_arena_create();
+	alloc_use(arena);
+
+	double *line_seconds = (double *)calloc(batch->line_count + 1,
+		sizeof(double));
+	size_t *line_runs = (size_t *)calloc(batch->line_count + 1,
+		sizeof(size_t));
+	DIE(!line_seconds || !line_runs, "calloc failed");
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		size_t index = job->next;
+		if (index == batch->file_count) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+		job->next++;
+
+		/* This file and the next ones, those not advised yet */
+		size_t first = job->prefetched;
+		size_t last = index + 1 + BATCH_PREFETCH;
+		if (last > batch->file_count)
+			last = batch->file_count;
+		if (first < last)
+			job->prefetched = last;
+		pthread_mutex_unlock(&job->lock);
+
+		_prefetch(batch, first, last);
+		_run_file(job, index, line_seconds, line_runs);
+	}
+
+	pthread_mutex_lock(&job->lock);
+	for (size_t i = 0; i < batch->line_count; i++) {
+		job->line_seconds[i] += line_seconds[i];
+		job->line_runs[i] += line_runs[i];
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	free(line_seconds);
+	free(line_runs);
+
+	alloc_use(NULL);
+	alloc_arena_destroy(arena);
+	return NULL;
+}
+
+static int _compare_seconds(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Writes the totals of a finished run
+*/
+static void _report(batch_job_t *job, double seconds)
+{
+	batch_t *batch = job->batch;
+	size_t count = batch->file_count;
+	FILE *report = job->report;
+
+	fprintf(report, "Files: %zu, %zu done, %zu failed, in %.3f s "
+		"(%.1f files/s)\n", count, count - job->failed, job->failed,
+		seconds, (seconds > 0) ? count / seconds : 0.0);
+	if (!count)
+		return;
+
+	double total = 0;
+	for (size_t i = 0; i < count; i++)
+		total += job->seconds[i];
+
+	qsort(job->seconds, count, sizeof(double), _compare_seconds);
+	fprintf(report, "Per file: mean %.3f ms, median %.3f ms, p95 %.3f ms, "
+		"max %.3f ms\n", total / count * 1e3, job->seconds[count / 2] * 1e3,
+		job->seconds[(count - 1) * 95 / 100] * 1e3,
+		job->seconds[count - 1] * 1e3);
+
+	fputs("Per line:\n", report);
+	for (size_t i = 0; i < batch->line_count; i++) {
+		size_t runs = job->line_runs[i];
+
+		fprintf(report, "%12.3f ms %8zu runs %10.3f ms mean  %s\n",
+			job->line_seconds[i] * 1e3, runs,
+			(runs) ? job->line_seconds[i] / runs * 1e3 : 0.0, batch->lines[i]);
+	}
+}
+
+size_t batch_run(batch_t *batch, const batch_ops_t *ops, size_t workers,
+	FILE *report)
+{
+	batch_job_t job = {
+		.batch = batch,
+		.ops = ops,
+		.report = report,
+	};
+
+	DIE(pthread_mutex_init(&job.lock, NULL) != 0, "pthread_mutex_init failed");
+	job.seconds = (double *)calloc(batch->file_count + 1, sizeof(double));
+	job.line_seconds = (double *)calloc(batch->line_count + 1,
+		sizeof(double));
+	job.line_runs = (size_t *)calloc(batch->line_count + 1, sizeof(size_t));
+	DIE(!job.seconds || !job.line_seconds || !job.line_runs,
+		"calloc failed");
+
+	if (workers > batch->file_count)
+		workers = batch->file_count;
+	if (!workers)
+		workers = 1;
+
+	pthread_t *threads = (pthread_t *)malloc(workers * sizeof(pthread_t));
+	DIE(!threads, "malloc failed");
+
+	double start = _clock();
+	for (size_t i = 0; i < workers; i++)
+		DIE(pthread_create(&threads[i], NULL, _worker, &job) != 0,
+			"pthread_create failed");
+	for (size_t i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+
+	_report(&job, _clock() - start);
+
+	free(threads);
+	free(job.seconds);
+	free(job.line_seconds);
+	free(job.line_runs);
+	pthread_mutex_destroy(&job.lock);
+
+	return job.failed;
+}
@@ -0,0 +1,90 @@
+#ifndef __BATCH_H
+#define __BATCH_H	1
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Longest command line once the placeholders are replaced */
+#define BATCH_LINE					8192
+/* Files past the one a worker takes whose reading is started early */
+#define BATCH_PREFETCH				8
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * What a command line of the script did to the file it ran on
+*/
+typedef enum batch_result_t {
+	BATCH_NEXT,							/* go on with the script	*/
+	BATCH_FAILED,						/* the file is given up		*/
+	BATCH_EXIT,							/* the script is done		*/
+} batch_result_t;
+
+/**
+ * How a program runs its commands: every file gets a session of its own,
+ * which replies to @a out. Closing it tells if work left over by its
+ * commands failed.
+*/
+typedef struct batch_ops_t {
+	void *(*open)(FILE *out);
+	batch_result_t (*run)(void *session, char *command_line);
+	batch_result_t (*close)(void *session);
+} batch_ops_t;
+
+/**
+ * A script and the files to run it on
+*/
+typedef struct batch_t {
+	char **lines;
+	size_t line_count, line_capacity;
+
+	char **files;
+	size_t file_count, file_capacity;
+} batch_t;
+
+/**
+ * Reads the command lines of the script at @a path, blank lines and lines
+ * starting with '#' left out. In every line "{}" is replaced by the path of
+ * the file, "{/}" by its name, "{.}" and "{/.}" by both without extension.
+ *
+ * @return 0 if it cannot be read
+*/
+int batch_script(batch_t *batch, const char *path);
+
+/**
+ * Adds @a path to the files, or the regular files it holds by name when it
+ * is a directory (hidden ones left out)
+ *
+ * @return 0 if it cannot be read
+*/
+int batch_add(batch_t *batch, const char *path);
+
+/**
+ * Adds the paths listed one per line in @a path, "-" being stdin
+ *
+ * @return 0 if it cannot be read
+*/
+int batch_list(batch_t *batch, const char *path);
+
+/**
+ * Runs the script on every file with @a workers threads, each with its own
+ * scratch arena. The files a few places ahead are read by the kernel in the
+ * background while the current ones are worked on. A file fails at the
+ * first command that does, its last reply telling why. One line per file
+ * and then the totals, per file and per line of the script, are written
+ * to @a report.
+ *
+ * @return The number of files that failed
+*/
+size_t batch_run(batch_t *batch, const batch_ops_t *ops, size_t workers,
+	FILE *report);
+
+void batch_free(batch_t *batch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,814 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "alloc.h"
+#include "bitmap.h"
+#include "imt.h"
+#include "netpbm.h"
+#include "thread_pool.h"
+#include "tiles.h"
+#include "utils.h"
+
+#define BENCH_SEED					0x9e3779b97f4a7c15ULL
+#define MAX_RESULTS					128
+#define NAME_SIZE					64
+/* Slowdown over the baseline reported as a regression, in percent */
+#define DEFAULT_TOLERANCE			10.0
+/* The ascii round trip checked before timing: more threads than bands of
+ * text, over a window whose rows are not a multiple of a band */
+#define CHECK_WORKERS				7
+#define CHECK_ROWS					777
+#define CHECK_COLUMNS				1030
+
+typedef struct bench_result_t {
+	char name[NAME_SIZE];
+	double seconds;						/* median of the runs	*/
+	double best;
+	size_t pixels;
+	size_t bytes;						/* moved by one run		*/
+} bench_result_t;
+
+typedef struct bench_t {
+	size_t rows, columns;
+	size_t iterations;
+	char dir[NAME_SIZE];				/* scratch files		*/
+
+	bench_result_t results[MAX_RESULTS];
+	size_t count;
+} bench_t;
+
+/**
+ * One timed operation. @a setup runs untimed before each run.
+*/
+typedef struct bench_case_t {
+	const char *name;
+	image_t *source;
+	size_t bytes;
+
+	void (*setup)(struct bench_case_t *bench_case);
+	void (*run)(struct bench_case_t *bench_case);
+	void (*teardown)(struct bench_case_t *bench_case);
+
+	image_t *image;
+	FILE *file;
+	const char *path;
+	int binary;
+	int angle;
+	equalise_mode_t mode;
+	kernel_t kernel;
+	morph_op_t op;
+	resize_filter_t filter;
+	size_t radius;
+	double sigma;
+} bench_case_t;
+
+static const char *type_names[] = { "pbm", "pgm", "ppm" };
+
+/**
+ * @return Seconds on the monotonic clock
+*/
+static double _now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * xorshift64*, so the images only depend on their size and type
+*/
+static unsigned long long _next_random(unsigned long long *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * Smooth gradients plus noise: kernels and histograms see realistic values
+*/
+static image_t *_synthetic_image(size_t rows, size_t columns,
+	image_type_t type)
+{
+	image_t *image = create_image(rows, columns, type);
+	unsigned long long state = BENCH_SEED + type;
+	size_t depth = (type == PPM) ? COLOR_RANGE : 1;
+
+	for (size_t i = 0; i < rows; i++) {
+		pixel_t *row = image_row(image, i);
+
+		for (size_t j = 0; j < columns; j++)
+			for (size_t k = 0; k < depth; k++) {
+				unsigned noise = (unsigned)(_next_random(&state) >> 59);
+				unsigned value = (unsigned)((i + j * (k + 1)) * 255
+					/ (rows + columns * depth) + noise);
+
+				row[j].rgb[k] = (type == PBM) ? (value >> 7) & 1
+					: (unsigned char)((value > 255) ? 255 : value);
+			}
+	}
+
+	return image;
+}
+
+/**
+ * The synthetic PBM, packed: its values are 0 and 1, 1 being black
+*/
+static image_t *_synthetic_bits(size_t rows, size_t columns)
+{
+	image_t *levels = _synthetic_image(rows, columns, PBM);
+	image_t *image = create_bilevel_image(rows, columns);
+
+	for (size_t i = 0; i < rows; i++) {
+		pixel_t *row = image_row(levels, i);
+		uint64_t *bits = image_bits(image, i);
+
+		for (size_t j = 0; j < columns; j++)
+			bits[j / BITMAP_WORD_BITS] |= (uint64_t)row[j].val
+				<< (BITMAP_WORD_BITS - 1 - j % BITMAP_WORD_BITS);
+	}
+
+	free_image(levels);
+	return image;
+}
+
+static image_t *_clone_image(const image_t *image)
+{
+	if (image->bits) {
+		image_t *clone = create_bilevel_image(image->rows, image->columns);
+
+		memcpy(clone->bits, image->bits,
+			image->rows * image->words * sizeof(uint64_t));
+		return clone;
+	}
+
+	image_t *clone = create_image(image->rows, image->columns, image->type);
+
+	for (size_t i = 0; i < image->rows; i++)
+		memcpy(image_row(clone, i), image_row(image, i),
+			image->columns * sizeof(pixel_t));
+	return clone;
+}
+
+static void _setup_clone(bench_case_t *bench_case)
+{
+	bench_case->image = _clone_image(bench_case->source);
+}
+
+static void _teardown_image(bench_case_t *bench_case)
+{
+	free_image(bench_case->image);
+	bench_case->image = NULL;
+}
+
+/**
+ * Opens the scratch file and moves past its header, like LOAD does
+*/
+static void _setup_read(bench_case_t *bench_case)
+{
+	bench_case->file = fopen(bench_case->path, "rb");
+	DIE(!bench_case->file, "fopen failed");
+
+	unsigned char header_text[BUFSIZ];
+	size_t size = fread(header_text, 1, sizeof(header_text),
+		bench_case->file);
+	netpbm_header_t header;
+	DIE(netpbm_header(header_text, size, &header) != 1, "bad scratch file");
+
+	fseek(bench_case->file, (long)header.offset, SEEK_SET);
+	bench_case->image = (header.max_value == 1)
+		? create_bilevel_image(header.rows, header.columns)
+		: create_image(header.rows, header.columns,
+			TYPE_FROM_CHR(header.format));
+}
+
+static void _run_read(bench_case_t *bench_case)
+{
+	read_pixels(bench_case->file, bench_case->image, bench_case->binary);
+}
+
+static void _teardown_read(bench_case_t *bench_case)
+{
+	fclose(bench_case->file);
+	_teardown_image(bench_case);
+}
+
+static void _run_map(bench_case_t *bench_case)
+{
+	bench_case->image = map_image(bench_case->path);
+	DIE(!bench_case->image, "map_image failed");
+}
+
+/**
+ * A tiled file is decoded as its pixels are read: all of them here
+*/
+static void _run_map_tiled(bench_case_t *bench_case)
+{
+	_run_map(bench_case);
+	tiles_load(bench_case->image);
+}
+
+static void _setup_print(bench_case_t *bench_case)
+{
+	bench_case->file = fopen(bench_case->path, "wb");
+	DIE(!bench_case->file, "fopen failed");
+}
+
+static void _run_print(bench_case_t *bench_case)
+{
+	print_pixels(bench_case->file, bench_case->source, bench_case->binary);
+	fflush(bench_case->file);
+}
+
+static void _run_print_tiled(bench_case_t *bench_case)
+{
+	imt_write(bench_case->file, bench_case->source);
+	fflush(bench_case->file);
+}
+
+static void _teardown_print(bench_case_t *bench_case)
+{
+	fclose(bench_case->file);
+}
+
+static void _run_crop(bench_case_t *bench_case)
+{
+	image_t *image = bench_case->image;
+	image_selection_t selection;
+
+	/* The middle half of each side */
+	update_selection(&selection, image->rows / 4, image->rows * 3 / 4,
+		image->columns / 4, image->columns * 3 / 4);
+	crop_image(image, selection);
+}
+
+static void _run_apply(bench_case_t *bench_case)
+{
+	apply_effect(bench_case->image, bench_case->image->selection,
+		&bench_case->kernel);
+}
+
+static void _run_rotate(bench_case_t *bench_case)
+{
+	rotate_image(bench_case->image, bench_case->angle);
+}
+
+static void _run_rotate_selection(bench_case_t *bench_case)
+{
+	image_t *image = bench_case->image;
+	size_t side = (image->rows < image->columns)
+		? image->rows : image->columns;
+	image_selection_t selection;
+
+	update_selection(&selection, 0, side, 0, side);
+	rotate_selection(image, selection, bench_case->angle);
+}
+
+static void _run_resize(bench_case_t *bench_case)
+{
+	image_t *image = bench_case->image;
+
+	/* Three quarters of each side */
+	resize_image(image, image->rows * 3 / 4, image->columns * 3 / 4,
+		bench_case->filter);
+}
+
+static void _run_blur(bench_case_t *bench_case)
+{
+	blur_image(bench_case->image, bench_case->image->selection,
+		bench_case->radius);
+}
+
+static void _run_gaussian_blur(bench_case_t *bench_case)
+{
+	gaussian_blur_image(bench_case->image, bench_case->image->selection,
+		bench_case->sigma);
+}
+
+static void _run_median(bench_case_t *bench_case)
+{
+	median_image(bench_case->image, bench_case->image->selection,
+		bench_case->radius);
+}
+
+static void _run_morph(bench_case_t *bench_case)
+{
+	morph_image(bench_case->image, bench_case->image->selection,
+		bench_case->op, 1);
+}
+
+static void _run_histogram(bench_case_t *bench_case)
+{
+	unsigned long fq[PIXEL_MAX_VALUE + 1];
+	image_histogram(bench_case->image, fq);
+}
+
+static void _run_equalise(bench_case_t *bench_case)
+{
+	equalise_image(bench_case->image, bench_case->image->selection,
+		bench_case->mode);
+}
+
+static int _compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Times @a iterations runs of a case and records the median
+*/
+static void _run_case(bench_t *bench, bench_case_t *bench_case)
+{
+	DIE(bench->count == MAX_RESULTS, "too many benchmarks");
+
+	double *times = (double *)malloc(bench->iterations * sizeof(double));
+	DIE(!times, "malloc failed");
+
+	for (size_t i = 0; i < bench->iterations; i++) {
+		if (bench_case->setup)
+			bench_case->setup(bench_case);
+
+		double start = _now();
+		bench_case->run(bench_case);
+		times[i] = _now() - start;
+
+		if (bench_case->teardown)
+			bench_case->teardown(bench_case);
+		alloc_reset();
+	}
+
+	qsort(times, bench->iterations, sizeof(double), _compare_doubles);
+
+	bench_result_t *result = &bench->results[bench->count++];
+	snprintf(result->name, NAME_SIZE, "%s", bench_case->name);
+	result->seconds = times[bench->iterations / 2];
+	result->best = times[0];
+	result->pixels = bench_case->source->rows * bench_case->source->columns;
+	result->bytes = bench_case->bytes;
+
+	fprintf(stderr, "%-32s %10.3f ms\n", result->name,
+		result->seconds * 1e3);
+	free(times);
+}
+
+/**
+ * @return The size of a file, 0 if it cannot be read
+*/
+static size_t _file_size(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return 0;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fclose(file);
+
+	return (size > 0) ? (size_t)size : 0;
+}
+
+/**
+ * Every benchmark for one image type, PBM being @a packed or 8-bit
+*/
+static void _bench_type(bench_t *bench, image_type_t type, int packed)
+{
+	const char *type_name = (packed) ? "pbm_bits" : type_names[type];
+	size_t depth = (type == PPM) ? COLOR_RANGE : 1;
+	image_t *source = (packed) ? _synthetic_bits(bench->rows, bench->columns)
+		: _synthetic_image(bench->rows, bench->columns, type);
+	size_t pixel_bytes = (packed)
+		? source->rows * source->words * sizeof(uint64_t)
+		: source->rows * source->columns * depth;
+	char name[NAME_SIZE], path[2 * NAME_SIZE];
+
+	/* Write, then read back, both encodings */
+	for (int binary = 0; binary <= 1; binary++) {
+		const char *encoding = (binary) ? "binary" : "ascii";
+		snprintf(path, sizeof(path), "%s/%s_%s", bench->dir, type_name,
+			encoding);
+
+		bench_case_t print_case = {
+			.name = name, .source = source, .path = path, .binary = binary,
+			.setup = _setup_print, .run = _run_print,
+			.teardown = _teardown_print,
+		};
+		snprintf(name, NAME_SIZE, "%s/print/%s", type_name, encoding);
+		_run_case(bench, &print_case);
+
+		/* Throughput of files is counted in bytes of the file */
+		size_t file_bytes = _file_size(path);
+		bench->results[bench->count - 1].bytes = file_bytes;
+
+		bench_case_t read_case = {
+			.name = name, .source = source, .path = path, .binary = binary,
+			.bytes = file_bytes, .setup = _setup_read, .run = _run_read,
+			.teardown = _teardown_read,
+		};
+		snprintf(name, NAME_SIZE, "%s/read/%s", type_name, encoding);
+		_run_case(bench, &read_case);
+
+		bench_case_t map_case = {
+			.name = name, .source = source, .path = path,
+			.bytes = file_bytes, .run = _run_map,
+			.teardown = _teardown_image,
+		};
+		snprintf(name, NAME_SIZE, "%s/load/%s", type_name, encoding);
+		_run_case(bench, &map_case);
+
+		unlink(path);
+	}
+
+	/* Then the native tiled format */
+	snprintf(path, sizeof(path), "%s/%s%s", bench->dir, type_name,
+		IMT_EXTENSION);
+
+	bench_case_t tile_case = {
+		.name = name, .source = source, .path = path,
+		.setup = _setup_print, .run = _run_print_tiled,
+		.teardown = _teardown_print,
+	};
+	snprintf(name, NAME_SIZE, "%s/print/tiled", type_name);
+	_run_case(bench, &tile_case);
+
+	size_t tiled_bytes = _file_size(path);
+	bench->results[bench->count - 1].bytes = tiled_bytes;
+
+	bench_case_t untile_case = {
+		.name = name, .source = source, .path = path,
+		.bytes = tiled_bytes, .run = _run_map_tiled,
+		.teardown = _teardown_image,
+	};
+	snprintf(name, NAME_SIZE, "%s/load/tiled", type_name);
+	_run_case(bench, &untile_case);
+
+	unlink(path);
+
+	bench_case_t crop_case = {
+		.name = name, .source = source, .bytes = pixel_bytes / 4,
+		.setup = _setup_clone, .run = _run_crop,
+		.teardown = _teardown_image,
+	};
+	snprintf(name, NAME_SIZE, "%s/crop", type_name);
+	_run_case(bench, &crop_case);
+
+	int angles[] = { 90, 180, 270 };
+	for (size_t i = 0; i < ARRAY_SIZE(angles); i++) {
+		bench_case_t rotate_case = {
+			.name = name, .source = source, .bytes = pixel_bytes,
+			.angle = angles[i], .setup = _setup_clone, .run = _run_rotate,
+			.teardown = _teardown_image,
+		};
+		snprintf(name, NAME_SIZE, "%s/rotate/%d", type_name, angles[i]);
+		_run_case(bench, &rotate_case);
+
+		rotate_case.run = _run_rotate_selection;
+		snprintf(name, NAME_SIZE, "%s/rotate_selection/%d", type_name,
+			angles[i]);
+		_run_case(bench, &rotate_case);
+	}
+
+	const char *filters[] = { "nearest", "bilinear", "area" };
+	for (size_t i = 0; i < ARRAY_SIZE(filters); i++) {
+		bench_case_t resize_case = {
+			.name = name, .source = source, .bytes = pixel_bytes,
+			.filter = (resize_filter_t)i, .setup = _setup_clone,
+			.run = _run_resize, .teardown = _teardown_image,
+		};
+		snprintf(name, NAME_SIZE, "%s/resize/%s", type_name, filters[i]);
+		_run_case(bench, &resize_case);
+	}
+
+	/* Blurs on PGM and PPM only, a small and a large radius costing the
+	 * same */
+	size_t radii[] = { 1, 50 };
+	for (size_t i = 0; type != PBM && i < ARRAY_SIZE(radii); i++) {
+		bench_case_t blur_case = {
+			.name = name, .source = source, .bytes = pixel_bytes,
+			.radius = radii[i], .sigma = (double)radii[i],
+			.setup = _setup_clone, .run = _run_blur,
+			.teardown = _teardown_image,
+		};
+		snprintf(name, NAME_SIZE, "%s/blur/%zu", type_name, radii[i]);
+		_run_case(bench, &blur_case);
+
+		blur_case.run = _run_gaussian_blur;
+		snprintf(name, NAME_SIZE, "%s/gaussian_blur/%zu", type_name,
+			radii[i]);
+		_run_case(bench, &blur_case);
+	}
+
+	/* Medians likewise, up to their largest radius */
+	size_t median_radii[] = { 1, 15, MEDIAN_MAX_RADIUS };
+	for (size_t i = 0; type != PBM && i < ARRAY_SIZE(median_radii); i++) {
+		bench_case_t median_case = {
+			.name = name, .source = source, .bytes = pixel_bytes,
+			.radius = median_radii[i], .setup = _setup_clone,
+			.run = _run_median, .teardown = _teardown_image,
+		};
+		snprintf(name, NAME_SIZE, "%s/median/%zu", type_name,
+			median_radii[i]);
+		_run_case(bench, &median_case);
+	}
+
+	/* Same rules as the editor: effects on colour, histograms on greyscale */
+	if (type == PGM) {
+		bench_case_t histogram_case = {
+			.name = name, .source = source, .bytes = pixel_bytes,
+			.setup = _setup_clone, .run = _run_histogram,
+			.teardown = _teardown_image,
+		};
+		snprintf(name, NAME_SIZE, "%s/histogram", type_name);
+		_run_case(bench, &histogram_case);
+
+		histogram_case.run = _run_equalise;
+		snprintf(name, NAME_SIZE, "%s/equalize", type_name);
+		_run_case(bench, &histogram_case);
+	} else {
+		struct {
+			const char *name;
+			kernel_t kernel;
+		} effects[] = {
+			{ "BLUR", { 3, 3, { { 1, 1, 1 }, { 1, 1, 1 }, { 1, 1, 1 } },
+				9.0 } },
+			{ "GAUSSIAN_BLUR", { 3, 3, { { 1, 2, 1 }, { 2, 4, 2 },
+				{ 1, 2, 1 } }, 16.0 } },
+			{ "SHARPEN", { 3, 3, { { 0, -1, 0 }, { -1, 5, -1 },
+				{ 0, -1, 0 } }, 1.0 } },
+			{ "EDGE", { 3, 3, { { -1, -1, -1 }, { -1, 8, -1 },
+				{ -1, -1, -1 } }, 1.0 } },
+			/* Wider kernels, separable or not */
+			{ "GAUSSIAN_5x5", { 5, 5, { { 1, 4, 6, 4, 1 },
+				{ 4, 16, 24, 16, 4 }, { 6, 24, 36, 24, 6 },
+				{ 4, 16, 24, 16, 4 }, { 1, 4, 6, 4, 1 } }, 256.0 } },
+			{ "LAPLACIAN_5x5", { 5, 5, { { 0, 0, -1, 0, 0 },
+				{ 0, -1, -2, -1, 0 }, { -1, -2, 16, -2, -1 },
+				{ 0, -1, -2, -1, 0 }, { 0, 0, -1, 0, 0 } }, 1.0 } },
+			{ "BOX_7x7", { 7, 7, { { 1, 1, 1, 1, 1, 1, 1 },
+				{ 1, 1, 1, 1, 1, 1, 1 }, { 1, 1, 1, 1, 1, 1, 1 },
+				{ 1, 1, 1, 1, 1, 1, 1 }, { 1, 1, 1, 1, 1, 1, 1 },
+				{ 1, 1, 1, 1, 1, 1, 1 }, { 1, 1, 1, 1, 1, 1, 1 } }, 49.0 } },
+		};
+
+		for (size_t i = 0; i < ARRAY_SIZE(effects); i++) {
+			bench_case_t apply_case = {
+				.name = name, .source = source, .bytes = pixel_bytes,
+				.kernel = effects[i].kernel, .setup = _setup_clone,
+				.run = _run_apply, .teardown = _teardown_image,
+			};
+			snprintf(name, NAME_SIZE, "%s/apply/%s", type_name,
+				effects[i].name);
+			_run_case(bench, &apply_case);
+		}
+	}
+
+	if (packed) {
+		const char *ops[] = { "ERODE", "DILATE", "OPEN", "CLOSE" };
+
+		for (size_t i = 0; i < ARRAY_SIZE(ops); i++) {
+			bench_case_t morph_case = {
+				.name = name, .source = source, .bytes = pixel_bytes,
+				.op = (morph_op_t)i, .setup = _setup_clone,
+				.run = _run_morph, .teardown = _teardown_image,
+			};
+			snprintf(name, NAME_SIZE, "%s/%s", type_name, ops[i]);
+			_run_case(bench, &morph_case);
+		}
+	}
+
+	if (type == PPM) {
+		bench_case_t equalise_case = {
+			.name = name, .source = source, .bytes = pixel_bytes,
+			.mode = EQUALISE_LUMA, .setup = _setup_clone,
+			.run = _run_equalise, .teardown = _teardown_image,
+		};
+		snprintf(name, NAME_SIZE, "%s/equalize/luma", type_name);
+		_run_case(bench, &equalise_case);
+
+		equalise_case.mode = EQUALISE_CHANNELS;
+		snprintf(name, NAME_SIZE, "%s/equalize/channels", type_name);
+		_run_case(bench, &equalise_case);
+	}
+
+	free_image(source);
+}
+
+/**
+ * Writes a cropped synthetic image as text, reads it back and compares
+ *
+ * @return 0 if a value came back different
+*/
+static int _check_ascii(bench_t *bench, image_type_t type, int packed)
+{
+	image_t *image = (packed) ? _synthetic_bits(CHECK_ROWS, CHECK_COLUMNS)
+		: _synthetic_image(CHECK_ROWS, CHECK_COLUMNS, type);
+	image_selection_t window;
+	update_selection(&window, 10, CHECK_ROWS - 17, 10, CHECK_COLUMNS - 30);
+	crop_image(image, window);
+
+	char path[NAME_SIZE + 16];
+	snprintf(path, sizeof(path), "%s/check.%s", bench->dir,
+		type_names[type]);
+	FILE *file = fopen(path, "wb");
+	DIE(!file, "fopen failed");
+	print_pixels(file, image, 0);
+	fclose(file);
+
+	image_t *read = map_image(path);
+	int same = read && read->rows == image->rows
+		&& read->columns == image->columns;
+	size_t depth = (type == PPM) ? COLOR_RANGE : 1;
+
+	for (size_t i = 0; same && i < image->rows; i++) {
+		if (packed) {
+			same = memcmp(image_bits(read, i), image_bits(image, i),
+				image->words * sizeof(uint64_t)) == 0;
+			continue;
+		}
+
+		const pixel_t *a = image_row(read, i), *b = image_row(image, i);
+		for (size_t j = 0; same && j < image->columns; j++)
+			for (size_t k = 0; k < depth; k++)
+				same &= a[j].rgb[k] == b[j].rgb[k];
+	}
+
+	if (!same)
+		fprintf(stderr, "ROUND TRIP %s%s/ascii: values differ\n",
+			type_names[type], (packed) ? "_bits" : "");
+
+	free_image(read);
+	free_image(image);
+	unlink(path);
+	return same;
+}
+
+/**
+ * Reads the median time of @a name from a report written by this program
+ *
+ * @return A negative number if the baseline does not have it
+*/
+static double _baseline_seconds(FILE *baseline, const char *name)
+{
+	char line[BUFSIZ], key[NAME_SIZE + 16];
+	snprintf(key, sizeof(key), "\"name\": \"%s\",", name);
+
+	rewind(baseline);
+	while (fgets(line, sizeof(line), baseline)) {
+		char *at = strstr(line, key);
+		char *seconds = strstr(line, "\"seconds\": ");
+		if (!at || !seconds)
+			continue;
+
+		return atof(seconds + strlen("\"seconds\": "));
+	}
+
+	return -1.0;
+}
+
+/**
+ * Writes the report, one result per line so it can be read back
+ *
+ * @return The number of regressions against @a baseline
+*/
+static size_t _report(FILE *out_file, bench_t *bench, FILE *baseline,
+	double tolerance)
+{
+	size_t regressions = 0;
+
+	fprintf(out_file, "{\n\t\"rows\": %zu,\n\t\"columns\": %zu,\n"
+		"\t\"iterations\": %zu,\n\t\"threads\": %zu,\n\t\"results\": [\n",
+		bench->rows, bench->columns, bench->iterations, pool_workers());
+
+	for (size_t i = 0; i < bench->count; i++) {
+		bench_result_t *result = &bench->results[i];
+		double seconds = (result->seconds > 0) ? result->seconds : 1e-9;
+
+		fprintf(out_file, "\t\t{ \"name\": \"%s\", \"seconds\": %.9f, "
+			"\"best\": %.9f, \"ns_per_pixel\": %.4f, \"mb_per_s\": %.2f",
+			result->name, result->seconds, result->best,
+			seconds * 1e9 / result->pixels, result->bytes / seconds / 1e6);
+
+		double before = (baseline) ? _baseline_seconds(baseline, result->name)
+			: -1.0;
+		if (before > 0) {
+			double change = (result->seconds / before - 1.0) * 100.0;
+			int regression = change > tolerance;
+
+			fprintf(out_file, ", \"baseline\": %.9f, \"change\": %.2f, "
+				"\"regression\": %s", before, change,
+				(regression) ? "true" : "false");
+			if (regression) {
+				fprintf(stderr, "REGRESSION %s: %+.1f%%\n", result->name,
+					change);
+				regressions++;
+			}
+		}
+
+		fprintf(out_file, " }%s\n", (i + 1 < bench->count) ? "," : "");
+	}
+
+	fprintf(out_file, "\t],\n\t\"regressions\": %zu\n}\n", regressions);
+	return regressions;
+}
+
+/**
+ * Entry point
+ *
+ * Usage: image_bench [-s columns x rows] [-n iterations] [-j threads]
+ *                    [-o report.json] [-c baseline.json] [-t percent]
+ *
+ * Exits with 2 when an operation got slower than the baseline allows, with
+ * 3 when an image written as text does not read back the same.
+*/
+int main(int argc, char *argv[])
+{
+	bench_t bench = {
+		.rows = 1024,
+		.columns = 1024,
+		.iterations = 5,
+	};
+	const char *out_path = NULL, *baseline_path = NULL;
+	double tolerance = DEFAULT_TOLERANCE;
+	size_t threads = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:n:j:o:c:t:")) != -1) {
+		switch (opt) {
+		case 's':
+			if (sscanf(optarg, "%zux%zu", &bench.columns, &bench.rows) != 2)
+				bench.columns = bench.rows = 0;
+			break;
+		case 'n':
+			bench.iterations = (size_t)atol(optarg);
+			break;
+		case 'j':
+			threads = (size_t)atol(optarg);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'c':
+			baseline_path = optarg;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			bench.iterations = 0;
+		}
+	}
+
+	if (!bench.rows || !bench.columns || !bench.iterations) {
+		fprintf(stderr, "Usage: %s [-s columns x rows] [-n iterations] "
+			"[-j threads] [-o report.json] [-c baseline.json] [-t percent]\n",
+			argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	FILE *baseline = NULL;
+	if (baseline_path) {
+		baseline = fopen(baseline_path, "r");
+		DIE(!baseline, "fopen failed");
+	}
+
+	snprintf(bench.dir, NAME_SIZE, "/tmp/image_bench.XXXXXX");
+	DIE(!mkdtemp(bench.dir), "mkdtemp failed");
+
+	pool_init(CHECK_WORKERS);
+	int checked = _check_ascii(&bench, PBM, 1);
+	for (int type = PGM; type <= PPM; type++)
+		checked &= _check_ascii(&bench, (image_type_t)type, 0);
+	if (!checked) {
+		rmdir(bench.dir);
+		return 3;
+	}
+
+	pool_init(threads);
+	for (int type = PBM; type <= PPM; type++)
+		_bench_type(&bench, (image_type_t)type, 0);
+	_bench_type(&bench, PBM, 1);
+	pool_destroy();
+	rmdir(bench.dir);
+
+	FILE *out_file = (out_path) ? fopen(out_path, "w") : stdout;
+	DIE(!out_file, "fopen failed");
+
+	size_t regressions = _report(out_file, &bench, baseline, tolerance);
+
+	if (out_file != stdout)
+		fclose(out_file);
+	if (baseline)
+		fclose(baseline);
+
+	return (regressions) ? 2 : EXIT_SUCCESS;
+}
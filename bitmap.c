@@ -0,0 +1,469 @@
+#include <string.h>
+
+#include "alloc.h"
+#include "bitmap.h"
+#include "thread_pool.h"
+
+#define ALL_BITS					(~(uint64_t)0)
+/* Pixels per side of a block transposed at once */
+#define BLOCK_SIDE					BITMAP_WORD_BITS
+
+/**
+ * @return The bits of the last word of a row that hold pixels
+*/
+static inline uint64_t _tail(size_t columns)
+{
+	size_t used = columns % BITMAP_WORD_BITS;
+
+	return (used) ? ALL_BITS << (BITMAP_WORD_BITS - used) : ALL_BITS;
+}
+
+/**
+ * @return The bits of word @a word that hold pixels [@a first, @a last)
+*/
+static inline uint64_t _span(size_t word, size_t first, size_t last)
+{
+	size_t lo = word * BITMAP_WORD_BITS, hi = lo + BITMAP_WORD_BITS;
+
+	lo = (first > lo) ? first : lo;
+	hi = (last < hi) ? last : hi;
+	if (lo >= hi)
+		return 0;
+
+	uint64_t mask = ALL_BITS >> (lo % BITMAP_WORD_BITS);
+	if (hi % BITMAP_WORD_BITS)
+		mask &= ALL_BITS << (BITMAP_WORD_BITS - hi % BITMAP_WORD_BITS);
+	return mask;
+}
+
+/**
+ * @return Eight bytes of a P4 row as a word, the first one on top
+*/
+static inline uint64_t _load_word(const unsigned char *bytes)
+{
+	uint64_t word;
+	memcpy(&word, bytes, sizeof(word));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word;
+}
+
+static inline void _store_word(unsigned char *bytes, uint64_t word)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	memcpy(bytes, &word, sizeof(word));
+}
+
+/**
+ * @return @a word with its bits in reverse order
+*/
+static inline uint64_t _reverse(uint64_t word)
+{
+	word = ((word >> 1) & 0x5555555555555555ULL)
+		| ((word & 0x5555555555555555ULL) << 1);
+	word = ((word >> 2) & 0x3333333333333333ULL)
+		| ((word & 0x3333333333333333ULL) << 2);
+	word = ((word >> 4) & 0x0f0f0f0f0f0f0f0fULL)
+		| ((word & 0x0f0f0f0f0f0f0f0fULL) << 4);
+
+	return __builtin_bswap64(word);
+}
+
+void bitmap_pack(uint64_t *bits, const pixel_t *row, size_t columns)
+{
+	for (size_t first = 0; first < columns; first += BITMAP_WORD_BITS) {
+		size_t count = (columns - first < BITMAP_WORD_BITS)
+			? columns - first : BITMAP_WORD_BITS;
+		uint64_t word = 0;
+
+		/* Shifted in from the bottom, the first pixel ends up on top */
+		for (size_t b = 0; b < count; b++)
+			word = (word << 1) | (row[first + b].val < BITMAP_THRESHOLD);
+		*bits++ = word << (BITMAP_WORD_BITS - count);
+	}
+}
+
+void bitmap_unpack(pixel_t *row, const uint64_t *bits, size_t columns)
+{
+	for (size_t first = 0; first < columns; first += BITMAP_WORD_BITS) {
+		size_t count = (columns - first < BITMAP_WORD_BITS)
+			? columns - first : BITMAP_WORD_BITS;
+		uint64_t word = *bits++;
+
+		for (size_t b = 0; b < count; b++, word <<= 1) {
+			int black = (int)(word >> (BITMAP_WORD_BITS - 1));
+
+			row[first + b] = (pixel_t) {
+				.rgb = { (black) ? 0 : PIXEL_MAX_VALUE }
+			};
+		}
+	}
+}
+
+void bitmap_load(uint64_t *bits, const unsigned char *bytes, size_t columns)
+{
+	size_t words = bitmap_words(columns);
+	size_t full = columns / BITMAP_WORD_BITS;
+
+	for (size_t k = 0; k < full; k++)
+		bits[k] = _load_word(bytes + k * sizeof(uint64_t));
+
+	if (full == words)
+		return;
+
+	/* The bytes left of the last word */
+	size_t count = (columns + 7) / 8 - full * sizeof(uint64_t);
+	unsigned char last[sizeof(uint64_t)] = { 0 };
+
+	memcpy(last, bytes + full * sizeof(uint64_t), count);
+	bits[full] = _load_word(last) & _tail(columns);
+}
+
+void bitmap_store(unsigned char *bytes, const uint64_t *bits, size_t columns)
+{
+	size_t words = bitmap_words(columns);
+	size_t full = columns / BITMAP_WORD_BITS;
+
+	for (size_t k = 0; k < full; k++)
+		_store_word(bytes + k * sizeof(uint64_t), bits[k]);
+
+	if (full == words)
+		return;
+
+	unsigned char last[sizeof(uint64_t)];
+	_store_word(last, bits[full]);
+	memcpy(bytes + full * sizeof(uint64_t), last,
+		(columns + 7) / 8 - full * sizeof(uint64_t));
+}
+
+void bitmap_extract(uint64_t *dst, const uint64_t *src, size_t first,
+	size_t columns)
+{
+	if (!columns)
+		return;
+
+	size_t words = bitmap_words(columns);
+	size_t shift = first % BITMAP_WORD_BITS;
+	/* Word holding the last pixel copied */
+	size_t last = (first + columns - 1) / BITMAP_WORD_BITS;
+
+	src += first / BITMAP_WORD_BITS;
+	last -= first / BITMAP_WORD_BITS;
+
+	for (size_t k = 0; k < words; k++) {
+		uint64_t word = src[k] << shift;
+
+		if (shift && k + 1 <= last)
+			word |= src[k + 1] >> (BITMAP_WORD_BITS - shift);
+		dst[k] = word;
+	}
+
+	dst[words - 1] &= _tail(columns);
+}
+
+void bitmap_insert(uint64_t *dst, size_t first, const uint64_t *src,
+	size_t columns)
+{
+	size_t words = bitmap_words(columns);
+	size_t shift = first % BITMAP_WORD_BITS;
+
+	dst += first / BITMAP_WORD_BITS;
+
+	for (size_t k = 0; k < words; k++) {
+		uint64_t mask = (k + 1 == words) ? _tail(columns) : ALL_BITS;
+		uint64_t word = src[k] & mask;
+
+		/* Each word lands across two words of the row */
+		dst[k] = (dst[k] & ~(mask >> shift)) | (word >> shift);
+		if (shift && (mask << (BITMAP_WORD_BITS - shift)))
+			dst[k + 1] = (dst[k + 1] & ~(mask << (BITMAP_WORD_BITS - shift)))
+				| (word << (BITMAP_WORD_BITS - shift));
+	}
+}
+
+/**
+ * Transposes a block of 64 rows of one word, bit 63 - j of row i going to
+ * bit 63 - i of row j, by swapping ever smaller sub-blocks
+*/
+static void _transpose(uint64_t block[BLOCK_SIDE])
+{
+	uint64_t mask = 0x00000000ffffffffULL;
+
+	for (size_t side = BLOCK_SIDE / 2; side; side >>= 1,
+		mask ^= mask << side)
+		for (size_t k = 0; k < BLOCK_SIDE; k = ((k | side) + 1) & ~side) {
+			uint64_t swap = (block[k] ^ (block[k | side] >> side)) & mask;
+
+			block[k] ^= swap;
+			block[k | side] ^= swap << side;
+		}
+}
+
+typedef struct rotate_job_t {
+	uint64_t *dst;
+	size_t dst_words;
+	const uint64_t *src;
+	size_t src_words;
+	size_t rows, columns;
+	int rotations;
+
+	size_t bands;
+} rotate_job_t;
+
+/**
+ * Half a turn: every row reversed, in reverse order. The padding ends up in
+ * front of the reversed words, so they are shifted back over it.
+*/
+static void _reverse_rows(rotate_job_t *job, size_t lo, size_t hi)
+{
+	size_t words = job->src_words;
+	size_t pad = words * BITMAP_WORD_BITS - job->columns;
+
+	for (size_t i = lo; i < hi; i++) {
+		const uint64_t *src = job->src + (job->rows - 1 - i) * words;
+		uint64_t *dst = job->dst + i * job->dst_words;
+
+		for (size_t k = 0; k < words; k++) {
+			uint64_t word = _reverse(src[words - 1 - k]) << pad;
+
+			if (pad && k + 1 < words)
+				word |= _reverse(src[words - 2 - k])
+					>> (BITMAP_WORD_BITS - pad);
+			dst[k] = word;
+		}
+	}
+}
+
+/**
+ * Quarter turns of blocks [@a lo, @a hi) of 64 source rows. Each one is a
+ * word column of the result, so bands write to words of their own.
+ *
+ * Clockwise, (i, j) goes to (j, rows - 1 - i): the rows of a block are
+ * transposed bottom up. Counter-clockwise, (i, j) goes to
+ * (columns - 1 - j, i): the transposed rows are stored bottom up.
+*/
+static void _rotate_blocks(rotate_job_t *job, size_t lo, size_t hi)
+{
+	uint64_t block[BLOCK_SIDE];
+
+	for (size_t bi = lo; bi < hi; bi++)
+		for (size_t bj = 0; bj < job->src_words; bj++) {
+			for (size_t t = 0; t < BLOCK_SIDE; t++) {
+				size_t row = bi * BLOCK_SIDE + t;
+
+				if (row >= job->rows)
+					block[t] = 0;
+				else if (job->rotations == 1)
+					block[t] = job->src[(job->rows - 1 - row) * job->src_words
+						+ bj];
+				else
+					block[t] = job->src[row * job->src_words + bj];
+			}
+
+			_transpose(block);
+
+			for (size_t t = 0; t < BLOCK_SIDE; t++) {
+				size_t column = bj * BLOCK_SIDE + t;
+				if (column >= job->columns)
+					break;
+
+				size_t row = (job->rotations == 1) ? column
+					: job->columns - 1 - column;
+				job->dst[row * job->dst_words + bi] = block[t];
+			}
+		}
+}
+
+static void _rotate_band(void *arg, size_t band)
+{
+	rotate_job_t *job = (rotate_job_t *)arg;
+	size_t lo, hi;
+
+	if (job->rotations == 2) {
+		pool_band(job->rows, job->bands, band, &lo, &hi);
+		_reverse_rows(job, lo, hi);
+		return;
+	}
+
+	pool_band(bitmap_words(job->rows), job->bands, band, &lo, &hi);
+	_rotate_blocks(job, lo, hi);
+}
+
+void bitmap_rotate(uint64_t *dst, size_t dst_words, const uint64_t *src,
+	size_t src_words, size_t rows, size_t columns, int rotations)
+{
+	rotate_job_t job = {
+		.dst = dst,
+		.dst_words = dst_words,
+		.src = src,
+		.src_words = src_words,
+		.rows = rows,
+		.columns = columns,
+		.rotations = rotations,
+	};
+
+	/* A block of 64 rows is a word column of the result */
+	job.bands = (rotations == 2) ? pool_split(rows, POOL_GRAIN)
+		: pool_split(bitmap_words(rows), 1);
+	pool_run(job.bands, _rotate_band, &job);
+}
+
+typedef struct morph_job_t {
+	const uint64_t *bits;
+	size_t words;
+	size_t rows, columns;
+	image_selection_t selection;
+	size_t radius;
+
+	/* Erosion is the dilation of the complement, complemented */
+	int invert;
+
+	/* The rows of the selection, whole */
+	uint64_t *result;
+	size_t bands;
+} morph_job_t;
+
+/**
+ * Sets every pixel of @a row whose one @a shift to the left is set. Going
+ * right to left, the words read are still the old ones.
+*/
+static inline void _or_shifted(uint64_t *row, size_t words, size_t shift)
+{
+	size_t skip = shift / BITMAP_WORD_BITS, bit = shift % BITMAP_WORD_BITS;
+
+	for (size_t k = words; k-- > skip;) {
+		uint64_t word = row[k - skip] >> bit;
+
+		if (bit && k > skip)
+			word |= row[k - skip - 1] << (BITMAP_WORD_BITS - bit);
+		row[k] |= word;
+	}
+}
+
+/**
+ * Dilates rows [@a lo, @a hi) of the selection: the rows around each one
+ * are or-ed together, then runs of pixels in the row, doubling their length
+ * with every shift
+*/
+static void _morph_rows(morph_job_t *job, size_t lo, size_t hi)
+{
+	size_t words = job->words, radius = job->radius;
+	size_t side = 2 * radius + 1;
+	/* Room for the pixels up to radius past the end of the row */
+	size_t span = words + bitmap_words(radius);
+	uint64_t *run = (uint64_t *)alloc_scratch(span * sizeof(uint64_t));
+	uint64_t tail = _tail(job->columns), flip = (job->invert) ? ALL_BITS : 0;
+
+	for (size_t i = job->selection.uprow + lo; i < job->selection.uprow + hi;
+		i++) {
+		size_t first = (i > radius) ? i - radius : 0;
+		size_t last = (i + radius < job->rows) ? i + radius : job->rows - 1;
+
+		memset(run, 0, span * sizeof(uint64_t));
+		for (size_t r = first; r <= last; r++) {
+			const uint64_t *src = job->bits + r * words;
+
+			for (size_t k = 0; k < words; k++)
+				run[k] |= src[k] ^ flip;
+		}
+		run[words - 1] &= tail;
+
+		/* run[j] ends up as the or of the side pixels up to j */
+		size_t length = 1;
+		for (; 2 * length <= side; length *= 2)
+			_or_shifted(run, span, length);
+		if (length < side)
+			_or_shifted(run, span, side - length);
+
+		/* Centred on the pixel: radius pixels to the right */
+		uint64_t *dst = job->result + (i - job->selection.uprow) * words;
+		size_t skip = radius / BITMAP_WORD_BITS;
+		size_t bit = radius % BITMAP_WORD_BITS;
+
+		for (size_t k = 0; k < words; k++) {
+			uint64_t word = run[k + skip] << bit;
+
+			if (bit && k + skip + 1 < span)
+				word |= run[k + skip + 1] >> (BITMAP_WORD_BITS - bit);
+			dst[k] = word ^ flip;
+		}
+		dst[words - 1] &= tail;
+	}
+}
+
+static void _morph_band(void *arg, size_t band)
+{
+	morph_job_t *job = (morph_job_t *)arg;
+	size_t lo, hi;
+
+	pool_band(job->selection.dwrow - job->selection.uprow, job->bands, band,
+		&lo, &hi);
+	_morph_rows(job, lo, hi);
+}
+
+/**
+ * One dilation or erosion of the selection, written back once all of its
+ * rows are computed in @a result
+*/
+static void _morph_pass(image_t *image, image_selection_t selection,
+	size_t radius, int invert, uint64_t *result)
+{
+	size_t rows = selection.dwrow - selection.uprow;
+	morph_job_t job = {
+		.bits = image->bits,
+		.words = image->words,
+		.rows = image->rows,
+		.columns = image->columns,
+		.selection = selection,
+		.radius = radius,
+		.invert = invert,
+		.bands = pool_split(rows, POOL_GRAIN),
+		.result = result,
+	};
+
+	pool_run(job.bands, _morph_band, &job);
+
+	/* Only the selected columns change */
+	uint64_t *mask = (uint64_t *)alloc_scratch(job.words * sizeof(uint64_t));
+	for (size_t k = 0; k < job.words; k++)
+		mask[k] = _span(k, selection.lcol, selection.rcol);
+
+	for (size_t i = 0; i < rows; i++) {
+		uint64_t *dst = image_bits(image, selection.uprow + i);
+		const uint64_t *src = job.result + i * job.words;
+
+		for (size_t k = 0; k < job.words; k++)
+			dst[k] = (dst[k] & ~mask[k]) | (src[k] & mask[k]);
+	}
+}
+
+int bitmap_morph(image_t *image, image_selection_t selection, morph_op_t op,
+	size_t radius)
+{
+	if (selection.dwrow <= selection.uprow || selection.rcol <= selection.lcol)
+		return 1;
+
+	/* The rows of one pass, shared by all of them */
+	uint64_t *result = (uint64_t *)alloc_block((selection.dwrow
+		- selection.uprow) * image->words * sizeof(uint64_t), 0);
+	if (!result)
+		return 0;
+
+	size_t mark = alloc_mark();
+
+	/* Opening erodes then dilates, closing the other way round */
+	if (op == MORPH_ERODE || op == MORPH_OPEN)
+		_morph_pass(image, selection, radius, 1, result);
+	if (op != MORPH_ERODE)
+		_morph_pass(image, selection, radius, 0, result);
+	if (op == MORPH_CLOSE)
+		_morph_pass(image, selection, radius, 1, result);
+
+	alloc_rewind(mark);
+	alloc_release(result);
+	return 1;
+}
@@ -0,0 +1,69 @@
+#ifndef __BITMAP_H
+#define __BITMAP_H	1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+/* Pixels of a packed row per word, the first one in the top bit */
+#define BITMAP_WORD_BITS			64
+/* Values below are black once packed, black being a set bit as in PBM */
+#define BITMAP_THRESHOLD			128
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @return Words of a packed row of @a columns pixels
+*/
+static inline size_t bitmap_words(size_t columns)
+{
+	return (columns + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+/**
+ * Packs a row of pixels, black below BITMAP_THRESHOLD, and back: black is
+ * 0 and white PIXEL_MAX_VALUE
+*/
+void bitmap_pack(uint64_t *bits, const pixel_t *row, size_t columns);
+void bitmap_unpack(pixel_t *row, const uint64_t *bits, size_t columns);
+
+/**
+ * Converts a row from and to the bytes of a P4 file. The padding bits past
+ * the last pixel are cleared when loading, as every packed row has them.
+*/
+void bitmap_load(uint64_t *bits, const unsigned char *bytes, size_t columns);
+void bitmap_store(unsigned char *bytes, const uint64_t *bits, size_t columns);
+
+/**
+ * Copies @a columns pixels of a row starting at pixel @a first to the
+ * start of @a dst, and back
+*/
+void bitmap_extract(uint64_t *dst, const uint64_t *src, size_t first,
+	size_t columns);
+void bitmap_insert(uint64_t *dst, size_t first, const uint64_t *src,
+	size_t columns);
+
+/**
+ * Turns @a rows x @a columns packed pixels clockwise @a rotations quarter
+ * turns (1 to 3) into @a dst, whose rows are @a dst_words apart
+*/
+void bitmap_rotate(uint64_t *dst, size_t dst_words, const uint64_t *src,
+	size_t src_words, size_t rows, size_t columns, int rotations);
+
+/**
+ * Runs @a op with a square of side 2 * @a radius + 1 on @a selection of a
+ * packed image. Pixels outside the image never change the result.
+ *
+ * @return 0 if there is no memory for the rows of a pass, nothing changed
+*/
+int bitmap_morph(image_t *image, image_selection_t selection, morph_op_t op,
+	size_t radius);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
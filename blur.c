@@ -0,0 +1,475 @@
+#include <math.h>
+#include <string.h>
+
+#include "blur.h"
+#include "alloc.h"
+#include "convolution.h"
+#include "thread_pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BLUR_X86	1
+#include <immintrin.h>
+#endif
+
+/**
+ * The mean of a window of count values is (sum + count / 2) * scale >>
+ * shift, the scale being 2^shift / count rounded up and below 2^32
+*/
+typedef struct blur_scale_t {
+	uint32_t scale;
+	uint32_t shift;
+} blur_scale_t;
+
+/**
+ * What a pass does at every position, on @a lanes values side by side:
+ * out = the means of the windows, then the windows slide, @a in coming in
+ * and @a gone leaving
+*/
+typedef void (*blur_mean_t)(uint16_t *out, const uint32_t *sums,
+	size_t lanes, uint32_t half, blur_scale_t scale);
+typedef void (*blur_slide_t)(uint32_t *sums, const uint16_t *in,
+	const uint16_t *gone, size_t lanes);
+
+typedef struct blur_ops_t {
+	blur_mean_t mean;
+	blur_slide_t slide;
+} blur_ops_t;
+
+typedef struct blur_job_t {
+	image_t *image;
+	image_selection_t selection;
+	/* The selection and the pixels around it its result depends on */
+	image_selection_t area;
+
+	const size_t *radii;
+	const blur_scale_t *scales[BLUR_PASSES];
+	size_t passes;
+	size_t lanes;						/* values per pixel		*/
+
+	/* The columns blurred, for the rows of the selection across the area,
+	 * by groups of BLUR_STRIP rows put side by side */
+	uint16_t *columns;
+	size_t groups;
+
+	const blur_ops_t *ops;
+	size_t strips, bands;
+} blur_job_t;
+
+static inline void _mean_tail(uint16_t *out, const uint32_t *sums,
+	size_t from, size_t lanes, uint32_t half, blur_scale_t scale)
+{
+	for (size_t l = from; l < lanes; l++)
+		out[l] = (uint16_t)(((uint64_t)(sums[l] + half) * scale.scale)
+			>> scale.shift);
+}
+
+static inline void _slide_tail(uint32_t *sums, const uint16_t *in,
+	const uint16_t *gone, size_t from, size_t lanes)
+{
+	for (size_t l = from; l < lanes; l++)
+		sums[l] += (uint32_t)in[l] - gone[l];
+}
+
+static void _mean_c(uint16_t *out, const uint32_t *sums,
+	size_t lanes, uint32_t half, blur_scale_t scale)
+{
+	_mean_tail(out, sums, 0, lanes, half, scale);
+}
+
+static void _slide_c(uint32_t *sums, const uint16_t *in,
+	const uint16_t *gone, size_t lanes)
+{
+	_slide_tail(sums, in, gone, 0, lanes);
+}
+
+#ifdef BLUR_X86
+
+/**
+ * mul_epu32 multiplies the even lanes only: the odd ones are moved down
+ * for a second one, and their means, below 2^16, back up
+*/
+static inline __m128i _mean4_sse2(__m128i sums, __m128i half, __m128i scale,
+	__m128i shift)
+{
+	__m128i t = _mm_add_epi32(sums, half);
+	__m128i even = _mm_srl_epi64(_mm_mul_epu32(t, scale), shift);
+	__m128i odd = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(t, 32), scale),
+		shift);
+
+	return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+static void _mean_sse2(uint16_t *out, const uint32_t *sums, size_t lanes,
+	uint32_t half, blur_scale_t scale)
+{
+	const __m128i halves = _mm_set1_epi32((int)half);
+	const __m128i scales = _mm_set1_epi32((int)scale.scale);
+	const __m128i shift = _mm_cvtsi32_si128((int)scale.shift);
+	/* packs saturates signed values: means are moved down and back */
+	const __m128i bias = _mm_set1_epi32(1 << 15);
+	const __m128i flip = _mm_set1_epi16((short)0x8000);
+	size_t l = 0;
+
+	for (; l + 8 <= lanes; l += 8) {
+		__m128i lo = _mean4_sse2(_mm_loadu_si128((const __m128i *)(sums + l)),
+			halves, scales, shift);
+		__m128i hi = _mean4_sse2(_mm_loadu_si128(
+			(const __m128i *)(sums + l + 4)), halves, scales, shift);
+
+		_mm_storeu_si128((__m128i *)(out + l), _mm_xor_si128(_mm_packs_epi32(
+			_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias)), flip));
+	}
+
+	_mean_tail(out, sums, l, lanes, half, scale);
+}
+
+static void _slide_sse2(uint32_t *sums, const uint16_t *in,
+	const uint16_t *gone, size_t lanes)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t l = 0;
+
+	for (; l + 8 <= lanes; l += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(in + l));
+		__m128i b = _mm_loadu_si128((const __m128i *)(gone + l));
+		__m128i *lo = (__m128i *)(sums + l), *hi = (__m128i *)(sums + l + 4);
+
+		_mm_storeu_si128(lo, _mm_sub_epi32(_mm_add_epi32(_mm_loadu_si128(lo),
+			_mm_unpacklo_epi16(a, zero)), _mm_unpacklo_epi16(b, zero)));
+		_mm_storeu_si128(hi, _mm_sub_epi32(_mm_add_epi32(_mm_loadu_si128(hi),
+			_mm_unpackhi_epi16(a, zero)), _mm_unpackhi_epi16(b, zero)));
+	}
+
+	_slide_tail(sums, in, gone, l, lanes);
+}
+
+/**
+ * Eight sums to a register; packus works per 128-bit lane, so the means
+ * are put back in order before being stored
+*/
+__attribute__((target("avx2")))
+static void _mean_avx2(uint16_t *out, const uint32_t *sums, size_t lanes,
+	uint32_t half, blur_scale_t scale)
+{
+	const __m256i halves = _mm256_set1_epi32((int)half);
+	const __m256i scales = _mm256_set1_epi32((int)scale.scale);
+	const __m128i shift = _mm_cvtsi32_si128((int)scale.shift);
+	size_t l = 0;
+
+	for (; l + 8 <= lanes; l += 8) {
+		__m256i t = _mm256_add_epi32(_mm256_loadu_si256(
+			(const __m256i *)(sums + l)), halves);
+		__m256i even = _mm256_srl_epi64(_mm256_mul_epu32(t, scales), shift);
+		__m256i odd = _mm256_srl_epi64(_mm256_mul_epu32(
+			_mm256_srli_epi64(t, 32), scales), shift);
+		__m256i means = _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+
+		means = _mm256_permute4x64_epi64(_mm256_packus_epi32(means, means),
+			0x08);
+		_mm_storeu_si128((__m128i *)(out + l), _mm256_castsi256_si128(means));
+	}
+
+	_mean_tail(out, sums, l, lanes, half, scale);
+}
+
+__attribute__((target("avx2")))
+static void _slide_avx2(uint32_t *sums, const uint16_t *in,
+	const uint16_t *gone, size_t lanes)
+{
+	size_t l = 0;
+
+	for (; l + 8 <= lanes; l += 8) {
+		__m256i *at = (__m256i *)(sums + l);
+
+		_mm256_storeu_si256(at, _mm256_sub_epi32(_mm256_add_epi32(
+			_mm256_loadu_si256(at), _mm256_cvtepu16_epi32(_mm_loadu_si128(
+			(const __m128i *)(in + l)))), _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const __m128i *)(gone + l)))));
+	}
+
+	_slide_tail(sums, in, gone, l, lanes);
+}
+
+#endif
+
+static const blur_ops_t lane_ops[] = {
+	[CONV_SCALAR] = { _mean_c, _slide_c },
+#ifdef BLUR_X86
+	[CONV_SSE2] = { _mean_sse2, _slide_sse2 },
+	[CONV_AVX2] = { _mean_avx2, _slide_avx2 },
+#endif
+};
+
+/**
+ * One pass along @a count positions of @a lanes values each: a value
+ * becomes the mean of those at most @a radius positions away, @a sums
+ * keeping those of the window as it slides. Windows stop at both ends,
+ * @a zeros coming in and leaving instead of the values past them.
+*/
+static void _box_pass(const blur_ops_t *ops, uint16_t *dst,
+	const uint16_t *src, size_t count, size_t lanes, size_t radius,
+	const blur_scale_t *scales, uint32_t *sums, const uint16_t *zeros)
+{
+	/* The window of the first position */
+	size_t end = (radius < count) ? radius + 1 : count;
+
+	memset(sums, 0, lanes * sizeof(*sums));
+	for (size_t p = 0; p < end; p++)
+		ops->slide(sums, src + p * lanes, zeros, lanes);
+
+	for (size_t p = 0; p < count; p++) {
+		size_t taken = end - ((p > radius) ? p - radius : 0);
+
+		ops->mean(dst + p * lanes, sums, lanes, (uint32_t)(taken / 2),
+			scales[taken]);
+		ops->slide(sums, (end < count) ? src + end * lanes : zeros,
+			(p >= radius) ? src + (p - radius) * lanes : zeros, lanes);
+
+		if (end < count)
+			end++;
+	}
+}
+
+/**
+ * Runs the passes on @a src, @a count positions of @a lanes values, back
+ * and forth between @a ping and @a pong, which may be @a src
+ *
+ * @return The result, @a src itself if no pass had a radius
+*/
+static const uint16_t *_box_passes(const blur_job_t *job,
+	const blur_ops_t *ops, const uint16_t *src, uint16_t *ping,
+	uint16_t *pong, size_t count, size_t lanes, uint32_t *sums,
+	const uint16_t *zeros)
+{
+	for (size_t k = 0; k < job->passes; k++) {
+		if (!job->radii[k])
+			continue;
+
+		_box_pass(ops, ping, src, count, lanes, job->radii[k],
+			job->scales[k], sums, zeros);
+		src = ping;
+
+		ping = pong;
+		pong = (uint16_t *)src;
+	}
+
+	return src;
+}
+
+/**
+ * @return The blurred columns of group @a group, @a rows rows of the
+ * selection put side by side
+*/
+static inline uint16_t *_group(const blur_job_t *job, size_t group,
+	size_t *rows)
+{
+	size_t first = group * BLUR_STRIP;
+	size_t left = job->selection.dwrow - job->selection.uprow - first;
+
+	*rows = (left < BLUR_STRIP) ? left : BLUR_STRIP;
+	return job->columns + first * (job->area.rcol - job->area.lcol)
+		* job->lanes;
+}
+
+/**
+ * Down the columns of the area, BLUR_STRIP pixels side by side
+*/
+static void _blur_strips(void *arg, size_t band)
+{
+	const blur_job_t *job = (const blur_job_t *)arg;
+	const image_t *image = job->image;
+	image_selection_t area = job->area, selection = job->selection;
+	size_t rows = area.dwrow - area.uprow;
+	size_t width = BLUR_STRIP * job->lanes;
+	size_t depth = job->lanes, lo, hi;
+
+	uint16_t *ping = (uint16_t *)alloc_scratch(rows * width
+		* sizeof(uint16_t));
+	uint16_t *pong = (uint16_t *)alloc_scratch(rows * width
+		* sizeof(uint16_t));
+	uint32_t *sums = (uint32_t *)alloc_scratch(width * sizeof(uint32_t));
+	uint16_t *zeros = (uint16_t *)alloc_scratch(width * sizeof(uint16_t));
+	memset(zeros, 0, width * sizeof(uint16_t));
+
+	pool_band(job->strips, job->bands, band, &lo, &hi);
+	for (size_t s = lo; s < hi; s++) {
+		size_t first = area.lcol + s * BLUR_STRIP;
+		size_t last = (first + BLUR_STRIP < area.rcol)
+			? first + BLUR_STRIP : area.rcol;
+		size_t lanes = (last - first) * depth;
+
+		/* Colour pixels are read as a run of bytes, greyscale ones every
+		 * third byte */
+		for (size_t i = 0; i < rows; i++) {
+			const unsigned char *from = (const unsigned char *)(image_row(
+				image, area.uprow + i) + first);
+			uint16_t *to = ping + i * lanes;
+
+			if (depth == 1) {
+				for (size_t x = 0; x < lanes; x++)
+					to[x] = (uint16_t)(from[x * COLOR_RANGE]
+						<< BLUR_FRACTION_BITS);
+			} else {
+				for (size_t x = 0; x < lanes; x++)
+					to[x] = (uint16_t)(from[x] << BLUR_FRACTION_BITS);
+			}
+		}
+
+		const uint16_t *blurred = _box_passes(job, job->ops, ping, pong,
+			ping, rows, lanes, sums, zeros);
+
+		/* The rows the selection needs go on to the row passes, a group
+		 * at a time, its rows put side by side */
+		for (size_t g = 0; g < job->groups; g++) {
+			size_t count;
+			uint16_t *to = _group(job, g, &count)
+				+ (first - area.lcol) * count * depth;
+			const uint16_t *from = blurred + (selection.uprow
+				+ g * BLUR_STRIP - area.uprow) * lanes;
+
+			for (size_t j = 0; j < last - first; j++) {
+				const uint16_t *column = from + j * depth;
+
+				if (depth == 1) {
+					for (size_t i = 0; i < count; i++)
+						to[i] = column[i * lanes];
+				} else {
+					for (size_t i = 0; i < count; i++)
+						memcpy(to + i * COLOR_RANGE, column + i * lanes,
+							COLOR_RANGE * sizeof(uint16_t));
+				}
+				to += count * depth;
+			}
+		}
+	}
+}
+
+/**
+ * Along the rows of the selection, BLUR_STRIP rows side by side, into the
+ * pixels
+*/
+static void _blur_rows(void *arg, size_t band)
+{
+	const blur_job_t *job = (const blur_job_t *)arg;
+	image_selection_t area = job->area, selection = job->selection;
+	size_t columns = area.rcol - area.lcol;
+	size_t width = BLUR_STRIP * job->lanes;
+	size_t depth = job->lanes, lo, hi;
+
+	uint16_t *ping = (uint16_t *)alloc_scratch(columns * width
+		* sizeof(uint16_t));
+	uint16_t *pong = (uint16_t *)alloc_scratch(columns * width
+		* sizeof(uint16_t));
+	uint32_t *sums = (uint32_t *)alloc_scratch(width * sizeof(uint32_t));
+	uint16_t *zeros = (uint16_t *)alloc_scratch(width * sizeof(uint16_t));
+	memset(zeros, 0, width * sizeof(uint16_t));
+
+	pool_band(job->groups, job->bands, band, &lo, &hi);
+	for (size_t g = lo; g < hi; g++) {
+		size_t count;
+		const uint16_t *group = _group(job, g, &count);
+		size_t lanes = count * depth;
+		const uint16_t *blurred = _box_passes(job, job->ops, group, ping,
+			pong, columns, lanes, sums, zeros);
+
+		for (size_t i = 0; i < count; i++) {
+			pixel_t *to = image_row(job->image,
+				selection.uprow + g * BLUR_STRIP + i);
+			const uint16_t *from = blurred
+				+ (selection.lcol - area.lcol) * lanes + i * depth;
+
+			for (size_t j = selection.lcol; j < selection.rcol; j++) {
+				for (size_t k = 0; k < depth; k++)
+					to[j].rgb[k] = (unsigned char)((from[k]
+						+ (1 << (BLUR_FRACTION_BITS - 1)))
+						>> BLUR_FRACTION_BITS);
+				from += lanes;
+			}
+		}
+	}
+}
+
+void blur_gaussian_radii(double sigma, size_t radii[BLUR_PASSES])
+{
+	/* Boxes of odd widths w and w + 2 whose variances, (w^2 - 1) / 12,
+	 * add up to the closest to sigma^2 */
+	double variance = 12.0 * sigma * sigma;
+	size_t lower = (size_t)sqrt(variance / BLUR_PASSES + 1.0);
+	if (lower % 2 == 0)
+		lower--;
+
+	double w = (double)lower;
+	double narrow = (variance - BLUR_PASSES * (w * w + 4.0 * w + 3.0))
+		/ (-4.0 * w - 4.0);
+
+	for (size_t k = 0; k < BLUR_PASSES; k++)
+		radii[k] = ((double)k < floor(narrow + 0.5)) ? lower / 2
+			: lower / 2 + 1;
+}
+
+int blur_boxes(image_t *image, image_selection_t selection,
+	const size_t *radii, size_t passes)
+{
+	/* Every pass reads as far again around what the next one needs */
+	size_t reach = 0;
+	for (size_t k = 0; k < passes; k++)
+		reach += radii[k];
+
+	image_selection_t area = {
+		.uprow = (selection.uprow > reach) ? selection.uprow - reach : 0,
+		.dwrow = (selection.dwrow + reach < image->rows)
+			? selection.dwrow + reach : image->rows,
+		.lcol = (selection.lcol > reach) ? selection.lcol - reach : 0,
+		.rcol = (selection.rcol + reach < image->columns)
+			? selection.rcol + reach : image->columns,
+	};
+	size_t rows = area.dwrow - area.uprow, columns = area.rcol - area.lcol;
+	size_t longest = (rows > columns) ? rows : columns;
+
+	blur_job_t job = {
+		.image = image,
+		.selection = selection,
+		.area = area,
+		.radii = radii,
+		.passes = passes,
+		.lanes = (image->type == PPM) ? COLOR_RANGE : 1,
+		.ops = &lane_ops[conv_isa()],
+	};
+
+	/* Windows cut by the edges of the area count fewer pixels */
+	for (size_t k = 0; k < passes; k++) {
+		size_t widest = 2 * radii[k] + 1;
+		if (widest > longest)
+			widest = longest;
+
+		blur_scale_t *scales = (blur_scale_t *)alloc_scratch((widest + 1)
+			* sizeof(blur_scale_t));
+		for (size_t count = 1, bits = 0; count <= widest; count++) {
+			while ((size_t)2 << bits <= count)
+				bits++;
+
+			/* At most 2^31, the sums times it staying below 2^63 */
+			scales[count].shift = (uint32_t)(31 + bits);
+			scales[count].scale = (uint32_t)((((uint64_t)1 << (31 + bits))
+				+ count - 1) / count);
+		}
+		job.scales[k] = scales;
+	}
+
+	job.columns = (uint16_t *)alloc_block((selection.dwrow - selection.uprow)
+		* columns * job.lanes * sizeof(uint16_t), 0);
+	if (!job.columns)
+		return 0;
+
+	job.strips = (columns + BLUR_STRIP - 1) / BLUR_STRIP;
+	job.groups = (selection.dwrow - selection.uprow + BLUR_STRIP - 1)
+		/ BLUR_STRIP;
+	job.bands = pool_split(job.strips, 1);
+	pool_run(job.bands, _blur_strips, &job);
+
+	job.bands = pool_split(job.groups, 1);
+	pool_run(job.bands, _blur_rows, &job);
+
+	alloc_release(job.columns);
+	return 1;
+}
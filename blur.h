@@ -0,0 +1,42 @@
+#ifndef __BLUR_H
+#define __BLUR_H	1
+
+#include <stddef.h>
+
+#include "image.h"
+
+/* Boxes in a row that make up a Gaussian */
+#define BLUR_PASSES					3
+/* Fractional bits of the values between two passes */
+#define BLUR_FRACTION_BITS			8
+/* Pixels side by side that go down the columns together */
+#define BLUR_STRIP					32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Radii of the BLUR_PASSES boxes whose passes one after the other come
+ * closest to a Gaussian of standard deviation @a sigma. Some may be 0.
+*/
+void blur_gaussian_radii(double sigma, size_t radii[BLUR_PASSES]);
+
+/**
+ * Blurs @a selection with @a passes boxes, every pixel becoming the mean of
+ * the 2 * radii[k] + 1 around it on pass k, first down the columns, then
+ * along the rows. Boxes stop at the edges of the image, the mean being of
+ * the pixels inside; those around the selection are read, not changed.
+ * A running sum slides along every column and row, so the cost of a pixel
+ * does not depend on the radii. Greyscale and colour images only.
+ *
+ * @return 0 if there is no memory for the columns, nothing being changed
+*/
+int blur_boxes(image_t *image, image_selection_t selection,
+	const size_t *radii, size_t passes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
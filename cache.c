@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "netpbm.h"
+#include "utils.h"
+
+/**
+ * A decoded file, and what its file was like when it was read
+*/
+typedef struct cache_entry_t {
+	struct cache_entry_t *prev, *next;	/* most recent first	*/
+	char *path;
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	struct timespec modified;
+
+	image_t *image;
+	size_t bytes;
+	size_t readers;						/* copying it now		*/
+	int dropped;						/* out of the list		*/
+} cache_entry_t;
+
+static struct {
+	pthread_mutex_t lock;
+	size_t budget;
+	size_t bytes;
+	cache_entry_t *first, *last;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void cache_budget(size_t bytes)
+{
+	pthread_mutex_lock(&cache.lock);
+	cache.budget = bytes;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static void _free_entry(cache_entry_t *entry)
+{
+	free_image(entry->image);
+	free(entry->path);
+	free(entry);
+}
+
+static void _unlink(cache_entry_t *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache.first = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache.last = entry->prev;
+
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void _push_front(cache_entry_t *entry)
+{
+	entry->next = cache.first;
+	if (cache.first)
+		cache.first->prev = entry;
+	else
+		cache.last = entry;
+	cache.first = entry;
+}
+
+/**
+ * Takes @a entry out of the cache, freeing it unless it is being copied
+*/
+static void _drop(cache_entry_t *entry)
+{
+	_unlink(entry);
+	cache.bytes -= entry->bytes;
+	entry->dropped = 1;
+
+	if (!entry->readers)
+		_free_entry(entry);
+}
+
+/**
+ * @return The entry of @a path if its file is still the one of @a st,
+ * dropping the one it has otherwise
+*/
+static cache_entry_t *_find(const char *path, const struct stat *st)
+{
+	for (cache_entry_t *entry = cache.first; entry; entry = entry->next) {
+		if (strcmp(entry->path, path) != 0)
+			continue;
+
+		if (entry->device == st->st_dev && entry->inode == st->st_ino
+			&& entry->size == st->st_size
+			&& entry->modified.tv_sec == st->st_mtim.tv_sec
+			&& entry->modified.tv_nsec == st->st_mtim.tv_nsec)
+			return entry;
+
+		_drop(entry);
+		return NULL;
+	}
+
+	return NULL;
+}
+
+/**
+ * @return The bytes of the pixels of @a image
+*/
+static size_t _bytes(const image_t *image)
+{
+	if (image->bits)
+		return image->rows * image->words * sizeof(uint64_t);
+	return image->rows * image->stride * sizeof(pixel_t);
+}
+
+image_t *cache_load(const char *path)
+{
+	struct stat st;
+
+	pthread_mutex_lock(&cache.lock);
+	size_t budget = cache.budget;
+	cache_entry_t *entry = NULL;
+	/* Taken before the file is read, so a change while it is is not missed */
+	if (budget && stat(path, &st) == 0) {
+		entry = _find(path, &st);
+		if (entry) {
+			_unlink(entry);
+			_push_front(entry);
+			entry->readers++;
+		}
+	} else {
+		budget = 0;
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	if (entry) {
+		/* Copied outside the lock, the other loads going on meanwhile */
+		image_t *copy = copy_image(entry->image);
+
+		pthread_mutex_lock(&cache.lock);
+		entry->readers--;
+		if (entry->dropped && !entry->readers)
+			_free_entry(entry);
+		pthread_mutex_unlock(&cache.lock);
+		return copy;
+	}
+
+	image_t *image = map_image(path);
+	/* Pixels used in place or decoded on demand are not worth a copy */
+	if (!budget || !image || image->mapping || image->tiles
+		|| _bytes(image) > budget)
+		return image;
+
+	entry = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+	DIE(!entry, "calloc failed");
+	entry->path = strdup(path);
+	DIE(!entry->path, "strdup failed");
+	entry->device = st.st_dev;
+	entry->inode = st.st_ino;
+	entry->size = st.st_size;
+	entry->modified = st.st_mtim;
+	entry->image = copy_image(image);
+	/* No memory for a copy: the image is only not cached */
+	if (!entry->image) {
+		free(entry->path);
+		free(entry);
+		return image;
+	}
+	entry->bytes = _bytes(entry->image);
+
+	pthread_mutex_lock(&cache.lock);
+	/* Another thread may have decoded the same file meanwhile */
+	cache_entry_t *other = _find(path, &st);
+	if (other)
+		_drop(other);
+
+	_push_front(entry);
+	cache.bytes += entry->bytes;
+	while (cache.bytes > cache.budget && cache.last)
+		_drop(cache.last);
+	pthread_mutex_unlock(&cache.lock);
+
+	return image;
+}
+
+void cache_clear(void)
+{
+	pthread_mutex_lock(&cache.lock);
+	while (cache.last)
+		_drop(cache.last);
+	pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,41 @@
+#ifndef __CACHE_H
+#define __CACHE_H	1
+
+#include <stddef.h>
+
+#include "image.h"
+
+/* Bytes of decoded images the server keeps unless -c says otherwise */
+#define CACHE_BUDGET				((size_t)256 << 20)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sets how many bytes of decoded images are kept, 0 (the default) turning
+ * the cache off. The least recently loaded ones go first.
+*/
+void cache_budget(size_t bytes);
+
+/**
+ * Loads @a path like map_image. While the cache is on, a file decoded
+ * before and not changed since (same inode, size and modification time) is
+ * copied from the cache instead; one that has to be decoded is kept there.
+ * Binary colour images used in place from their mapping and images decoded
+ * a tile at a time are not kept. Can be called by many threads at once.
+ *
+ * @return NULL if the file is not a complete image
+*/
+image_t *cache_load(const char *path);
+
+/**
+ * Lets go of every image kept
+*/
+void cache_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,899 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "convolution.h"
+#include "thread_pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONV_X86	1
+#include <immintrin.h>
+#endif
+
+/* Byte distance between tap @a k and the centre one, out of @a n taps */
+#define TAP_OFFSET(k, n)			(((long)(k) - (long)(n) / 2) * COLOR_RANGE)
+#define NARROW_LIMIT				32767
+#define WIDE_SHIFT					40
+
+/* Row primitives of 3, 5 and 7 taps are specialised, others are generic */
+#define FAST_SIZES					4
+
+#if defined(__GNUC__)
+#define CONV_INLINE					static inline __attribute__((always_inline))
+#else
+#define CONV_INLINE					static inline
+#endif
+
+/* Loops over taps are unrolled when their count is known */
+#if defined(__GNUC__) && __GNUC__ >= 8 && !defined(__clang__)
+#define CONV_UNROLL					_Pragma("GCC unroll 8")
+#else
+#define CONV_UNROLL
+#endif
+
+typedef void (*conv_hpass_t)(int16_t *acc, const unsigned char *src,
+	size_t len, const int16_t *coef, size_t taps, int accumulate);
+typedef void (*conv_vpass_t)(int16_t *acc, int16_t *const rows[], size_t len,
+	const int16_t *coef, size_t taps);
+typedef void (*conv_vpass32_t)(int32_t *acc, int16_t *const rows[],
+	size_t len, const int16_t *coef, size_t taps);
+
+/**
+ * Row primitives on bytes of interleaved pixels, one set per instruction
+ * set, each pass once per specialised number of taps
+*/
+typedef struct conv_ops_t {
+	/* acc (+)= sum of coef[k] * src[x + TAP_OFFSET(k, taps)] */
+	conv_hpass_t hpass[FAST_SIZES];
+	/* acc = sum of coef[k] * rows[k][x], in 16 or 32 bits */
+	conv_vpass_t vpass[FAST_SIZES];
+	conv_vpass32_t vpass32[FAST_SIZES];
+	/* dst = clamp(round(acc / divide)) */
+	void (*finish)(unsigned char *dst, const int16_t *acc, size_t len,
+		const conv_kernel_t *conv);
+} conv_ops_t;
+
+static int _gcd(int a, int b)
+{
+	a = abs(a);
+	b = abs(b);
+
+	while (b) {
+		int r = a % b;
+		a = b;
+		b = r;
+	}
+
+	return a;
+}
+
+/**
+ * Looks for integer vectors with values[i][j] == column[i] * row[j]
+*/
+static int _find_separation(conv_kernel_t *conv)
+{
+	size_t pivot = conv->rows;
+	for (size_t i = 0; i < conv->rows && pivot == conv->rows; i++)
+		for (size_t j = 0; j < conv->columns; j++)
+			if (conv->values[i][j]) {
+				pivot = i;
+				break;
+			}
+
+	if (pivot == conv->rows)
+		return 0;
+
+	/* The row vector is the first non-zero row, reduced */
+	int div = 0;
+	for (size_t j = 0; j < conv->columns; j++)
+		div = _gcd(div, conv->values[pivot][j]);
+
+	size_t lead = conv->columns;
+	for (size_t j = 0; j < conv->columns; j++) {
+		conv->row[j] = conv->values[pivot][j] / div;
+		if (conv->row[j] && lead == conv->columns)
+			lead = j;
+	}
+
+	for (size_t i = 0; i < conv->rows; i++) {
+		if (conv->values[i][lead] % conv->row[lead])
+			return 0;
+
+		conv->column[i] = conv->values[i][lead] / conv->row[lead];
+		for (size_t j = 0; j < conv->columns; j++)
+			if (conv->values[i][j] != conv->column[i] * conv->row[j])
+				return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Finds a 16-bit reciprocal of 2 * divide, checked against every numerator
+*/
+static int _find_magic(conv_kernel_t *conv, long max_sum)
+{
+	long div = 2L * conv->divide;
+	long max_num = 2 * max_sum + conv->divide;
+
+	for (int shift = 0; shift < 16; shift++) {
+		unsigned long magic = ((1UL << (16 + shift)) + div - 1) / div;
+		if (magic > UINT16_MAX)
+			break;
+
+		long n;
+		for (n = 0; n <= max_num; n++)
+			if ((long)(((n * magic) >> 16) >> shift) != n / div)
+				break;
+
+		if (n > max_num) {
+			conv->magic = (uint16_t)magic;
+			conv->shift = shift;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int conv_prepare(conv_kernel_t *conv, const kernel_t *kernel)
+{
+	double divide = kernel->divide;
+	if (divide < 1.0 || divide > NARROW_LIMIT || divide != (int)divide)
+		return 0;
+
+	memset(conv, 0, sizeof(*conv));
+	conv->rows = kernel->rows;
+	conv->columns = kernel->columns;
+	conv->divide = (int)divide;
+
+	/* Exact for numerators below 2^24, which 512 * NARROW_LIMIT is */
+	uint64_t div = 2 * (uint64_t)conv->divide;
+	conv->wide_magic = (((uint64_t)1 << WIDE_SHIFT) + div - 1) / div;
+
+	long weight = 0;
+	for (size_t i = 0; i < conv->rows; i++)
+		for (size_t j = 0; j < conv->columns; j++) {
+			conv->values[i][j] = kernel->values[i][j];
+			weight += labs((long)kernel->values[i][j]);
+		}
+
+	/* Bound every partial sum of the pass(es) that will be used */
+	long max_sum = weight * PIXEL_MAX_VALUE;
+	long row_weight = 0, column_weight = 0;
+	conv->separable = _find_separation(conv);
+	if (conv->separable) {
+		for (size_t k = 0; k < conv->columns; k++)
+			row_weight += labs((long)conv->row[k]);
+		for (size_t k = 0; k < conv->rows; k++)
+			column_weight += labs((long)conv->column[k]);
+
+		max_sum = row_weight * column_weight * PIXEL_MAX_VALUE;
+	}
+
+	conv->narrow = (2 * max_sum + conv->divide <= NARROW_LIMIT);
+	if (conv->narrow && conv->divide > 1)
+		conv->narrow = _find_magic(conv, max_sum);
+
+	conv->split = (conv->separable && !conv->narrow
+		&& row_weight * PIXEL_MAX_VALUE <= NARROW_LIMIT
+		&& max_sum <= INT32_MAX / 2);
+
+	/* Every coefficient is within a narrow bound when the sums are */
+	if (conv->narrow)
+		for (size_t i = 0; i < conv->rows; i++)
+			for (size_t j = 0; j < conv->columns; j++)
+				conv->taps[i][j] = (int16_t)kernel->values[i][j];
+
+	return 1;
+}
+
+CONV_INLINE void _hpass_c_body(int16_t *acc, const unsigned char *src,
+	size_t len, const int16_t *coef, size_t taps, int accumulate)
+{
+	for (size_t x = 0; x < len; x++) {
+		int sum = (accumulate) ? acc[x] : 0;
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k++)
+			sum += coef[k] * src[(long)x + TAP_OFFSET(k, taps)];
+		acc[x] = (int16_t)sum;
+	}
+}
+
+CONV_INLINE void _vpass_c_body(int16_t *acc, int16_t *const rows[],
+	size_t len, const int16_t *coef, size_t taps)
+{
+	for (size_t x = 0; x < len; x++) {
+		int sum = 0;
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k++)
+			sum += coef[k] * rows[k][x];
+		acc[x] = (int16_t)sum;
+	}
+}
+
+CONV_INLINE void _vpass32_c_body(int32_t *acc, int16_t *const rows[],
+	size_t len, const int16_t *coef, size_t taps)
+{
+	for (size_t x = 0; x < len; x++) {
+		int32_t sum = 0;
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k++)
+			sum += coef[k] * rows[k][x];
+		acc[x] = sum;
+	}
+}
+
+static void _finish_c(unsigned char *dst, const int16_t *acc, size_t len,
+	const conv_kernel_t *conv)
+{
+	int div = 2 * conv->divide;
+
+	for (size_t x = 0; x < len; x++) {
+		/* Non-positive sums round to a non-positive value, clamped to 0 */
+		int val = (acc[x] > 0) ? (2 * acc[x] + conv->divide) / div : 0;
+		dst[x] = (unsigned char)((val > PIXEL_MAX_VALUE)
+			? PIXEL_MAX_VALUE : val);
+	}
+}
+
+#ifdef CONV_X86
+
+CONV_INLINE void _hpass_sse2_body(int16_t *acc, const unsigned char *src,
+	size_t len, const int16_t *coef, size_t taps, int accumulate)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t x = 0;
+
+	for (; x + 8 <= len; x += 8) {
+		__m128i sum = (accumulate)
+			? _mm_loadu_si128((const __m128i *)(acc + x)) : zero;
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k++) {
+			if (!coef[k])
+				continue;
+
+			__m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64(
+				(const __m128i *)(src + x + TAP_OFFSET(k, taps))), zero);
+			sum = _mm_add_epi16(sum,
+				_mm_mullo_epi16(px, _mm_set1_epi16(coef[k])));
+		}
+
+		_mm_storeu_si128((__m128i *)(acc + x), sum);
+	}
+
+	_hpass_c_body(acc + x, src + x, len - x, coef, taps, accumulate);
+}
+
+CONV_INLINE void _vpass_sse2_body(int16_t *acc, int16_t *const rows[],
+	size_t len, const int16_t *coef, size_t taps)
+{
+	size_t x = 0;
+
+	for (; x + 8 <= len; x += 8) {
+		__m128i sum = _mm_setzero_si128();
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k++)
+			sum = _mm_add_epi16(sum, _mm_mullo_epi16(
+				_mm_loadu_si128((const __m128i *)(rows[k] + x)),
+				_mm_set1_epi16(coef[k])));
+
+		_mm_storeu_si128((__m128i *)(acc + x), sum);
+	}
+
+	int16_t *tail[KERNEL_MAX_SIZE];
+	for (size_t k = 0; k < taps; k++)
+		tail[k] = rows[k] + x;
+	_vpass_c_body(acc + x, tail, len - x, coef, taps);
+}
+
+/**
+ * Rows are taken two at a time: madd multiplies their interleaved sums by
+ * both coefficients and adds the products in 32 bits
+*/
+CONV_INLINE void _vpass32_sse2_body(int32_t *acc, int16_t *const rows[],
+	size_t len, const int16_t *coef, size_t taps)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t x = 0;
+
+	for (; x + 8 <= len; x += 8) {
+		__m128i lo = zero, hi = zero;
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k += 2) {
+			int last = (k + 1 == taps);
+			__m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+			__m128i b = (last) ? zero
+				: _mm_loadu_si128((const __m128i *)(rows[k + 1] + x));
+			int16_t next = (last) ? 0 : coef[k + 1];
+			__m128i pair = _mm_set_epi16(next, coef[k], next, coef[k],
+				next, coef[k], next, coef[k]);
+
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+				pair));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b),
+				pair));
+		}
+
+		_mm_storeu_si128((__m128i *)(acc + x), lo);
+		_mm_storeu_si128((__m128i *)(acc + x + 4), hi);
+	}
+
+	int16_t *tail[KERNEL_MAX_SIZE];
+	for (size_t k = 0; k < taps; k++)
+		tail[k] = rows[k] + x;
+	_vpass32_c_body(acc + x, tail, len - x, coef, taps);
+}
+
+static void _finish_sse2(unsigned char *dst, const int16_t *acc, size_t len,
+	const conv_kernel_t *conv)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i divide = _mm_set1_epi16((int16_t)conv->divide);
+	const __m128i magic = _mm_set1_epi16((int16_t)conv->magic);
+	const __m128i shift = _mm_cvtsi32_si128(conv->shift);
+	size_t x = 0;
+
+	for (; x + 8 <= len; x += 8) {
+		__m128i sum = _mm_loadu_si128((const __m128i *)(acc + x));
+
+		if (conv->divide > 1) {
+			sum = _mm_max_epi16(sum, zero);
+			sum = _mm_add_epi16(_mm_add_epi16(sum, sum), divide);
+			sum = _mm_srl_epi16(_mm_mulhi_epu16(sum, magic), shift);
+		}
+
+		/* Saturation does the clamping */
+		_mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(sum, sum));
+	}
+
+	_finish_c(dst + x, acc + x, len - x, conv);
+}
+
+__attribute__((target("avx2")))
+CONV_INLINE void _hpass_avx2_body(int16_t *acc, const unsigned char *src,
+	size_t len, const int16_t *coef, size_t taps, int accumulate)
+{
+	size_t x = 0;
+
+	for (; x + 16 <= len; x += 16) {
+		__m256i sum = (accumulate)
+			? _mm256_loadu_si256((const __m256i *)(acc + x))
+			: _mm256_setzero_si256();
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k++) {
+			if (!coef[k])
+				continue;
+
+			__m256i px = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+				(const __m128i *)(src + x + TAP_OFFSET(k, taps))));
+			sum = _mm256_add_epi16(sum,
+				_mm256_mullo_epi16(px, _mm256_set1_epi16(coef[k])));
+		}
+
+		_mm256_storeu_si256((__m256i *)(acc + x), sum);
+	}
+
+	_hpass_sse2_body(acc + x, src + x, len - x, coef, taps, accumulate);
+}
+
+__attribute__((target("avx2")))
+CONV_INLINE void _vpass_avx2_body(int16_t *acc, int16_t *const rows[],
+	size_t len, const int16_t *coef, size_t taps)
+{
+	size_t x = 0;
+
+	for (; x + 16 <= len; x += 16) {
+		__m256i sum = _mm256_setzero_si256();
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k++)
+			sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(
+				_mm256_loadu_si256((const __m256i *)(rows[k] + x)),
+				_mm256_set1_epi16(coef[k])));
+
+		_mm256_storeu_si256((__m256i *)(acc + x), sum);
+	}
+
+	int16_t *tail[KERNEL_MAX_SIZE];
+	for (size_t k = 0; k < taps; k++)
+		tail[k] = rows[k] + x;
+	_vpass_sse2_body(acc + x, tail, len - x, coef, taps);
+}
+
+/**
+ * Same as the SSE2 one, unpacking works per 128-bit lane
+*/
+__attribute__((target("avx2")))
+CONV_INLINE void _vpass32_avx2_body(int32_t *acc, int16_t *const rows[],
+	size_t len, const int16_t *coef, size_t taps)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t x = 0;
+
+	for (; x + 16 <= len; x += 16) {
+		__m256i lo = zero, hi = zero;
+
+		CONV_UNROLL
+		for (size_t k = 0; k < taps; k += 2) {
+			int last = (k + 1 == taps);
+			__m256i a = _mm256_loadu_si256((const __m256i *)(rows[k] + x));
+			__m256i b = (last) ? zero
+				: _mm256_loadu_si256((const __m256i *)(rows[k + 1] + x));
+			int16_t next = (last) ? 0 : coef[k + 1];
+			__m256i pair = _mm256_set1_epi32((int32_t)(((uint32_t)(uint16_t)next
+				<< 16) | (uint16_t)coef[k]));
+
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(
+				_mm256_unpacklo_epi16(a, b), pair));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(
+				_mm256_unpackhi_epi16(a, b), pair));
+		}
+
+		_mm256_storeu_si256((__m256i *)(acc + x),
+			_mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(acc + x + 8),
+			_mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+
+	int16_t *tail[KERNEL_MAX_SIZE];
+	for (size_t k = 0; k < taps; k++)
+		tail[k] = rows[k] + x;
+	_vpass32_sse2_body(acc + x, tail, len - x, coef, taps);
+}
+
+__attribute__((target("avx2")))
+static void _finish_avx2(unsigned char *dst, const int16_t *acc, size_t len,
+	const conv_kernel_t *conv)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i divide = _mm256_set1_epi16((int16_t)conv->divide);
+	const __m256i magic = _mm256_set1_epi16((int16_t)conv->magic);
+	const __m128i shift = _mm_cvtsi32_si128(conv->shift);
+	size_t x = 0;
+
+	for (; x + 16 <= len; x += 16) {
+		__m256i sum = _mm256_loadu_si256((const __m256i *)(acc + x));
+
+		if (conv->divide > 1) {
+			sum = _mm256_max_epi16(sum, zero);
+			sum = _mm256_add_epi16(_mm256_add_epi16(sum, sum), divide);
+			sum = _mm256_srl_epi16(_mm256_mulhi_epu16(sum, magic), shift);
+		}
+
+		/* Packing works per 128-bit lane, gather both halves back */
+		sum = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), 0x08);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm256_castsi256_si128(sum));
+	}
+
+	_finish_sse2(dst + x, acc + x, len - x, conv);
+}
+
+#endif
+
+/**
+ * Entry points of the passes of one instruction set: the generic ones, and
+ * ones for a constant number of taps, where the loops over taps unroll
+*/
+#define CONV_HPASS(isa, attr, name, n)									\
+	attr static void name(int16_t *acc, const unsigned char *src,		\
+		size_t len, const int16_t *coef, size_t taps, int accumulate)	\
+	{																	\
+		(void)taps;														\
+		_hpass_##isa##_body(acc, src, len, coef, n, accumulate);		\
+	}
+
+#define CONV_VPASS(isa, attr, name, n)									\
+	attr static void name(int16_t *acc, int16_t *const rows[],			\
+		size_t len, const int16_t *coef, size_t taps)					\
+	{																	\
+		(void)taps;														\
+		_vpass_##isa##_body(acc, rows, len, coef, n);					\
+	}
+
+#define CONV_VPASS32(isa, attr, name, n)								\
+	attr static void name(int32_t *acc, int16_t *const rows[],			\
+		size_t len, const int16_t *coef, size_t taps)					\
+	{																	\
+		(void)taps;														\
+		_vpass32_##isa##_body(acc, rows, len, coef, n);					\
+	}
+
+#define CONV_PASSES(isa, attr)											\
+	CONV_HPASS(isa, attr, _hpass_##isa, taps)							\
+	CONV_HPASS(isa, attr, _hpass_##isa##_3, 3)							\
+	CONV_HPASS(isa, attr, _hpass_##isa##_5, 5)							\
+	CONV_HPASS(isa, attr, _hpass_##isa##_7, 7)							\
+	CONV_VPASS(isa, attr, _vpass_##isa, taps)							\
+	CONV_VPASS(isa, attr, _vpass_##isa##_3, 3)							\
+	CONV_VPASS(isa, attr, _vpass_##isa##_5, 5)							\
+	CONV_VPASS(isa, attr, _vpass_##isa##_7, 7)							\
+	CONV_VPASS32(isa, attr, _vpass32_##isa, taps)						\
+	CONV_VPASS32(isa, attr, _vpass32_##isa##_3, 3)						\
+	CONV_VPASS32(isa, attr, _vpass32_##isa##_5, 5)						\
+	CONV_VPASS32(isa, attr, _vpass32_##isa##_7, 7)
+
+#define CONV_OPS(isa)													\
+	{																	\
+		{ _hpass_##isa, _hpass_##isa##_3, _hpass_##isa##_5,				\
+			_hpass_##isa##_7 },											\
+		{ _vpass_##isa, _vpass_##isa##_3, _vpass_##isa##_5,				\
+			_vpass_##isa##_7 },											\
+		{ _vpass32_##isa, _vpass32_##isa##_3, _vpass32_##isa##_5,		\
+			_vpass32_##isa##_7 },										\
+		_finish_##isa,													\
+	}
+
+CONV_PASSES(c, )
+#ifdef CONV_X86
+CONV_PASSES(sse2, )
+CONV_PASSES(avx2, __attribute__((target("avx2"))))
+#endif
+
+static const conv_ops_t conv_ops[] = {
+	[CONV_SCALAR] = CONV_OPS(c),
+#ifdef CONV_X86
+	[CONV_SSE2] = CONV_OPS(sse2),
+	[CONV_AVX2] = CONV_OPS(avx2),
+#endif
+};
+
+/**
+ * @return The entry of the passes of @a taps taps
+*/
+static inline size_t _fast(size_t taps)
+{
+	return (taps == 3 || taps == 5 || taps == 7) ? taps / 2 : 0;
+}
+
+conv_isa_t conv_isa(void)
+{
+	/* Found once, by any of the threads running commands */
+	static int found = -1;
+	int isa = __atomic_load_n(&found, __ATOMIC_RELAXED);
+	if (isa >= 0)
+		return (conv_isa_t)isa;
+
+	isa = CONV_SCALAR;
+#ifdef CONV_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		isa = CONV_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		isa = CONV_AVX2;
+#endif
+
+	/* Only ever lower the instruction set, never go past what the CPU has */
+	const char *env = getenv("IMAGE_EDITOR_SIMD");
+	if (env && strcmp(env, "scalar") == 0)
+		isa = CONV_SCALAR;
+	else if (env && strcmp(env, "sse2") == 0 && isa > CONV_SSE2)
+		isa = CONV_SSE2;
+
+	__atomic_store_n(&found, isa, __ATOMIC_RELAXED);
+	return (conv_isa_t)isa;
+}
+
+/**
+ * One APPLY split in row bands. Each band writes its rows in place, so the
+ * rows around every band boundary are saved before any band starts.
+*/
+typedef struct conv_job_t {
+	image_t *image;
+	const conv_kernel_t *conv;
+
+	/* Rows and columns that get new values */
+	size_t r0, r1;
+	size_t c0, c1;
+
+	size_t bands;
+	/* 2 * (rows / 2) rows around the start of every band but the first */
+	unsigned char *halo;
+	size_t halo_len;
+} conv_job_t;
+
+/**
+ * @return The bytes of row @a row, starting at pixel @a col
+*/
+static inline unsigned char *_row_bytes(image_t *image, size_t row, size_t col)
+{
+	return (unsigned char *)(image_row(image, row) + col);
+}
+
+/**
+ * @return Original bytes of row @a row at column c0, as seen by the band
+ * [@a lo, @a hi)
+*/
+static const unsigned char *_source_row(const conv_job_t *job, size_t band,
+	size_t lo, size_t hi, size_t row)
+{
+	size_t radius = job->conv->rows / 2;
+	size_t edge = job->conv->columns / 2 * COLOR_RANGE;
+
+	if (row < lo && band > 0)
+		return job->halo + ((band - 1) * 2 * radius + row + radius - lo)
+			* job->halo_len + edge;
+	if (row >= hi && band + 1 < job->bands)
+		return job->halo + (band * 2 * radius + row + radius - hi)
+			* job->halo_len + edge;
+
+	return _row_bytes(job->image, row, job->c0);
+}
+
+/**
+ * 16-bit path: two 1D passes over a ring of horizontal sums when separable,
+ * otherwise one accumulated horizontal pass per kernel row.
+ * Output rows are written back as soon as no later row reads them.
+*/
+static void _conv_narrow(const conv_job_t *job, size_t band,
+	size_t lo, size_t hi)
+{
+	const conv_kernel_t *conv = job->conv;
+	const conv_ops_t *ops = &conv_ops[conv_isa()];
+	conv_hpass_t hpass = ops->hpass[_fast(conv->columns)];
+	size_t size = conv->rows, radius = size / 2;
+	size_t len = (job->c1 - job->c0) * COLOR_RANGE;
+
+	if (conv->separable) {
+		conv_vpass_t vpass = ops->vpass[_fast(size)];
+		int16_t *buf = (int16_t *)alloc_scratch((size + 1) * len
+			* sizeof(int16_t));
+
+		int16_t *acc = buf + size * len;
+		int16_t *ring[KERNEL_MAX_SIZE];
+		for (size_t k = 0; k < size; k++)
+			ring[k] = buf + k * len;
+
+		for (size_t i = lo - radius; i < lo + radius; i++)
+			hpass(ring[i % size], _source_row(job, band, lo, hi, i), len,
+				conv->row, conv->columns, 0);
+
+		for (size_t i = lo; i < hi; i++) {
+			hpass(ring[(i + radius) % size],
+				_source_row(job, band, lo, hi, i + radius), len,
+				conv->row, conv->columns, 0);
+
+			int16_t *rows[KERNEL_MAX_SIZE];
+			for (size_t k = 0; k < size; k++)
+				rows[k] = ring[(i - radius + k) % size];
+
+			/* Row i is not read again, its sums are already in the ring */
+			vpass(acc, rows, len, conv->column, size);
+			ops->finish(_row_bytes(job->image, i, job->c0), acc, len, conv);
+		}
+
+		return;
+	}
+
+	int16_t *acc = (int16_t *)alloc_scratch(len * sizeof(int16_t));
+
+	/* Rows of results waiting until their source rows are no longer read */
+	unsigned char *out = (unsigned char *)alloc_scratch((radius + 1) * len);
+
+	for (size_t i = lo; i < hi + radius; i++) {
+		if (i < hi) {
+			for (size_t k = 0; k < size; k++)
+				hpass(acc, _source_row(job, band, lo, hi, i - radius + k),
+					len, conv->taps[k], conv->columns, k > 0);
+			ops->finish(out + (i % (radius + 1)) * len, acc, len, conv);
+		}
+
+		if (i >= lo + radius)
+			memcpy(_row_bytes(job->image, i - radius, job->c0),
+				out + ((i - radius) % (radius + 1)) * len, len);
+	}
+}
+
+/**
+ * @return clamp(round(@a sum / divide))
+*/
+static inline unsigned char _wide_finish(const conv_kernel_t *conv, long sum)
+{
+	if (sum <= 0)
+		return 0;
+
+	/* Quotients past the clamp need not be exact */
+	uint64_t num = 2 * (uint64_t)sum + conv->divide;
+	if (num >= 2 * (uint64_t)conv->divide * (PIXEL_MAX_VALUE + 1))
+		return PIXEL_MAX_VALUE;
+
+	return (unsigned char)((num * conv->wide_magic) >> WIDE_SHIFT);
+}
+
+/**
+ * One row of the 32-bit path
+*/
+static void _wide_row(const conv_kernel_t *conv, unsigned char *dst,
+	const unsigned char *const src[], size_t len)
+{
+	for (size_t x = 0; x < len; x++) {
+		long sum = 0;
+
+		for (size_t k = 0; k < conv->rows; k++)
+			for (size_t l = 0; l < conv->columns; l++)
+				sum += (long)conv->values[k][l]
+					* src[k][(long)x + TAP_OFFSET(l, conv->columns)];
+
+		dst[x] = _wide_finish(conv, sum);
+	}
+}
+
+/**
+ * Path of split kernels: the ring of horizontal sums of the 16-bit path,
+ * summed vertically in 32 bits
+*/
+static void _conv_split(const conv_job_t *job, size_t band,
+	size_t lo, size_t hi)
+{
+	const conv_kernel_t *conv = job->conv;
+	const conv_ops_t *ops = &conv_ops[conv_isa()];
+	conv_hpass_t hpass = ops->hpass[_fast(conv->columns)];
+	conv_vpass32_t vpass = ops->vpass32[_fast(conv->rows)];
+	size_t size = conv->rows, radius = size / 2;
+	size_t len = (job->c1 - job->c0) * COLOR_RANGE;
+
+	int16_t *buf = (int16_t *)alloc_scratch(size * len * sizeof(int16_t));
+	int32_t *acc = (int32_t *)alloc_scratch(len * sizeof(int32_t));
+	int16_t *ring[KERNEL_MAX_SIZE];
+	for (size_t k = 0; k < size; k++)
+		ring[k] = buf + k * len;
+
+	for (size_t i = lo - radius; i < lo + radius; i++)
+		hpass(ring[i % size], _source_row(job, band, lo, hi, i), len,
+			conv->row, conv->columns, 0);
+
+	for (size_t i = lo; i < hi; i++) {
+		hpass(ring[(i + radius) % size],
+			_source_row(job, band, lo, hi, i + radius), len,
+			conv->row, conv->columns, 0);
+
+		int16_t *rows[KERNEL_MAX_SIZE];
+		for (size_t k = 0; k < size; k++)
+			rows[k] = ring[(i - radius + k) % size];
+
+		unsigned char *dst = _row_bytes(job->image, i, job->c0);
+		vpass(acc, rows, len, conv->column, size);
+		for (size_t x = 0; x < len; x++)
+			dst[x] = _wide_finish(conv, acc[x]);
+	}
+}
+
+/**
+ * 32-bit path for kernels whose sums do not fit the vector lanes
+*/
+static void _conv_wide(const conv_job_t *job, size_t band,
+	size_t lo, size_t hi)
+{
+	const conv_kernel_t *conv = job->conv;
+	size_t radius = conv->rows / 2;
+	size_t len = (job->c1 - job->c0) * COLOR_RANGE;
+
+
+	unsigned char *out = (unsigned char *)alloc_scratch((radius + 1) * len);
+
+	for (size_t i = lo; i < hi + radius; i++) {
+		if (i < hi) {
+			unsigned char *dst = out + (i % (radius + 1)) * len;
+			const unsigned char *src[KERNEL_MAX_SIZE];
+			for (size_t k = 0; k < conv->rows; k++)
+				src[k] = _source_row(job, band, lo, hi, i - radius + k);
+
+			_wide_row(conv, dst, src, len);
+		}
+
+		if (i >= lo + radius)
+			memcpy(_row_bytes(job->image, i - radius, job->c0),
+				out + ((i - radius) % (radius + 1)) * len, len);
+	}
+}
+
+void conv_row(const conv_kernel_t *conv, unsigned char *dst,
+	const unsigned char *const src[], size_t len, int16_t *acc)
+{
+	if (!conv->narrow) {
+		_wide_row(conv, dst, src, len);
+		return;
+	}
+
+	const conv_ops_t *ops = &conv_ops[conv_isa()];
+	conv_hpass_t hpass = ops->hpass[_fast(conv->columns)];
+	for (size_t k = 0; k < conv->rows; k++)
+		hpass(acc, src[k], len, conv->taps[k], conv->columns, k > 0);
+	ops->finish(dst, acc, len, conv);
+}
+
+void conv_hsum(const conv_kernel_t *conv, int16_t *sums,
+	const unsigned char *src, size_t len)
+{
+	conv_ops[conv_isa()].hpass[_fast(conv->columns)](sums, src, len,
+		conv->row, conv->columns, 0);
+}
+
+void conv_vsum(const conv_kernel_t *conv, unsigned char *dst,
+	int16_t *const sums[], size_t len, void *acc)
+{
+	const conv_ops_t *ops = &conv_ops[conv_isa()];
+
+	if (conv->narrow) {
+		ops->vpass[_fast(conv->rows)]((int16_t *)acc, sums, len,
+			conv->column, conv->rows);
+		ops->finish(dst, (const int16_t *)acc, len, conv);
+		return;
+	}
+
+	int32_t *wide = (int32_t *)acc;
+	ops->vpass32[_fast(conv->rows)](wide, sums, len, conv->column,
+		conv->rows);
+	for (size_t x = 0; x < len; x++)
+		dst[x] = _wide_finish(conv, wide[x]);
+}
+
+static void _conv_band(void *arg, size_t band)
+{
+	const conv_job_t *job = (const conv_job_t *)arg;
+	size_t lo, hi;
+
+	pool_band(job->r1 - job->r0, job->bands, band, &lo, &hi);
+	lo += job->r0;
+	hi += job->r0;
+
+	if (job->conv->narrow)
+		_conv_narrow(job, band, lo, hi);
+	else if (job->conv->split)
+		_conv_split(job, band, lo, hi);
+	else
+		_conv_wide(job, band, lo, hi);
+}
+
+void conv_apply(image_t *image, image_selection_t selection,
+	const conv_kernel_t *conv)
+{
+	if (image->rows < conv->rows || image->columns < conv->columns)
+		return;
+
+	/* Edges have no full neighbourhood and stay as they are */
+	size_t ry = conv->rows / 2, rx = conv->columns / 2;
+	conv_job_t job = {
+		.image = image,
+		.conv = conv,
+		.r0 = (selection.uprow > ry) ? selection.uprow : ry,
+		.c0 = (selection.lcol > rx) ? selection.lcol : rx,
+		.r1 = (selection.dwrow < image->rows - ry)
+			? selection.dwrow : image->rows - ry,
+		.c1 = (selection.rcol < image->columns - rx)
+			? selection.rcol : image->columns - rx,
+	};
+
+	if (job.r0 >= job.r1 || job.c0 >= job.c1)
+		return;
+
+	/* Pick the instruction set before other threads ask for it */
+	conv_isa();
+
+	job.bands = pool_split(job.r1 - job.r0, POOL_GRAIN);
+	job.halo_len = (job.c1 - job.c0 + 2 * rx) * COLOR_RANGE;
+	if (job.bands > 1) {
+		job.halo = (unsigned char *)alloc_scratch((job.bands - 1) * 2 * ry
+			* job.halo_len);
+	}
+
+	for (size_t band = 1; band < job.bands; band++) {
+		size_t lo, hi;
+		pool_band(job.r1 - job.r0, job.bands, band, &lo, &hi);
+
+		for (size_t k = 0; k < 2 * ry; k++)
+			memcpy(job.halo + ((band - 1) * 2 * ry + k) * job.halo_len,
+				_row_bytes(image, job.r0 + lo - ry + k, job.c0 - rx),
+				job.halo_len);
+	}
+
+	/* Every byte of a pixel is convolved: unused grey bytes stay zero */
+	pool_run(job.bands, _conv_band, &job);
+}
@@ -0,0 +1,89 @@
+#ifndef __CONVOLUTION_H
+#define __CONVOLUTION_H	1
+
+#include <stdint.h>
+
+#include "image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum conv_isa_t {
+	CONV_SCALAR,						/* plain C				*/
+	CONV_SSE2,							/* 8 lanes of 16 bits	*/
+	CONV_AVX2							/* 16 lanes of 16 bits	*/
+} conv_isa_t;
+
+/**
+ * An integer kernel, prepared once per APPLY
+*/
+typedef struct conv_kernel_t {
+	/* Odd sides: rows / 2 rows and columns / 2 columns around each pixel */
+	size_t rows, columns;
+
+	int values[KERNEL_MAX_SIZE][KERNEL_MAX_SIZE];
+	int16_t taps[KERNEL_MAX_SIZE][KERNEL_MAX_SIZE];
+	int divide;
+
+	/* values[i][j] == column[i] * row[j] when separable */
+	int separable;
+	int16_t row[KERNEL_MAX_SIZE];
+	int16_t column[KERNEL_MAX_SIZE];
+
+	/* All partial sums fit in 16 bits, so the vector kernels can be used */
+	int narrow;
+
+	/* Separable, with horizontal sums in 16 bits and vertical ones in 32 */
+	int split;
+
+	/* n / (2 * divide) == ((n * magic) >> 16) >> shift for every sum */
+	uint16_t magic;
+	int shift;
+
+	/* n / (2 * divide) == (n * wide_magic) >> 40 below 512 * divide */
+	uint64_t wide_magic;
+} conv_kernel_t;
+
+/**
+ * Builds the integer form of @a kernel
+ *
+ * @return 0 if the kernel can only be applied in floating point
+*/
+int conv_prepare(conv_kernel_t *conv, const kernel_t *kernel);
+
+/**
+ * Applies @a conv in place on @a selection, leaving the image edges.
+ * The result is the same as rounding the exact quotient, then clamping.
+*/
+void conv_apply(image_t *image, image_selection_t selection,
+	const conv_kernel_t *conv);
+
+/**
+ * Computes @a len bytes of one row from the @a conv->rows rows around it,
+ * each pointing at the byte above, on or below the first one to compute.
+ * @a acc is room for @a len sums.
+*/
+void conv_row(const conv_kernel_t *conv, unsigned char *dst,
+	const unsigned char *const src[], size_t len, int16_t *acc);
+
+/**
+ * The two halves of conv_row for narrow or split separable kernels:
+ * horizontal sums of one row, then the row out of @a conv->rows rows of
+ * sums. @a acc is room for @a len 32-bit sums.
+*/
+void conv_hsum(const conv_kernel_t *conv, int16_t *sums,
+	const unsigned char *src, size_t len);
+void conv_vsum(const conv_kernel_t *conv, unsigned char *dst,
+	int16_t *const sums[], size_t len, void *acc);
+
+/**
+ * Vector instruction set used by conv_apply (IMAGE_EDITOR_SIMD overrides it)
+*/
+conv_isa_t conv_isa(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,286 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "histogram.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+/* Pixels a band counts in 32 bits before moving them to the totals */
+#define FLUSH_PIXELS				(1UL << 30)
+
+struct histogram_t {
+	unsigned long fq[PIXEL_MAX_VALUE + 1];
+	int valid;
+
+	/* Pixels taken out of @a fq because they changed, counted on refresh */
+	int dirty;
+	image_selection_t region;
+};
+
+typedef struct count_job_t {
+	const image_t *image;
+	image_selection_t region;
+	int channel;
+	size_t bands;
+	unsigned long *partial;				/* one table per band	*/
+} count_job_t;
+
+static void _count_band(void *arg, size_t band)
+{
+	count_job_t *job = (count_job_t *)arg;
+	unsigned long *fq = job->partial + band * (PIXEL_MAX_VALUE + 1);
+	uint32_t tables[HISTOGRAM_TABLES][PIXEL_MAX_VALUE + 1];
+	size_t lo, hi, pending = 0;
+
+	memset(tables, 0, sizeof(tables));
+	pool_band(job->region.dwrow - job->region.uprow, job->bands, band,
+		&lo, &hi);
+
+	size_t width = job->region.rcol - job->region.lcol;
+	for (size_t i = job->region.uprow + lo; i < job->region.uprow + hi; i++) {
+		const pixel_t *row = image_row(job->image, i) + job->region.lcol;
+		size_t j = 0;
+
+		/* Pixel j goes to table j % HISTOGRAM_TABLES */
+		if (job->channel == HISTOGRAM_LUMA) {
+			for (; j + HISTOGRAM_TABLES <= width; j += HISTOGRAM_TABLES)
+				for (size_t k = 0; k < HISTOGRAM_TABLES; k++)
+					tables[k][pixel_luma(&row[j + k])]++;
+			for (; j < width; j++)
+				tables[0][pixel_luma(&row[j])]++;
+		} else {
+			const unsigned char *values =
+				(const unsigned char *)row + job->channel;
+
+			for (; j + HISTOGRAM_TABLES <= width; j += HISTOGRAM_TABLES)
+				for (size_t k = 0; k < HISTOGRAM_TABLES; k++)
+					tables[k][values[(j + k) * COLOR_RANGE]]++;
+			for (; j < width; j++)
+				tables[0][values[j * COLOR_RANGE]]++;
+		}
+
+		pending += width;
+		if (pending < FLUSH_PIXELS && i + 1 < job->region.uprow + hi)
+			continue;
+
+		for (size_t k = 0; k < HISTOGRAM_TABLES; k++)
+			for (size_t v = 0; v <= PIXEL_MAX_VALUE; v++) {
+				fq[v] += tables[k][v];
+				tables[k][v] = 0;
+			}
+		pending = 0;
+	}
+}
+
+void histogram_count(const image_t *image, image_selection_t region,
+	unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	histogram_count_channel(image, region, 0, fq);
+}
+
+void histogram_count_channel(const image_t *image, image_selection_t region,
+	int channel, unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	if (region.uprow >= region.dwrow || region.lcol >= region.rcol)
+		return;
+
+	stats_pixels((region.dwrow - region.uprow) * (region.rcol - region.lcol));
+	count_job_t job = {
+		.image = image,
+		.region = region,
+		.channel = channel,
+		.bands = pool_split(region.dwrow - region.uprow, POOL_GRAIN),
+	};
+
+	size_t size = job.bands * (PIXEL_MAX_VALUE + 1) * sizeof(unsigned long);
+	job.partial = (unsigned long *)alloc_scratch(size);
+	memset(job.partial, 0, size);
+
+	pool_run(job.bands, _count_band, &job);
+
+	/* Merge the tables of every band, in order */
+	for (size_t band = 0; band < job.bands; band++)
+		for (size_t i = 0; i <= PIXEL_MAX_VALUE; i++)
+			fq[i] += job.partial[band * (PIXEL_MAX_VALUE + 1) + i];
+}
+
+/**
+ * Counts @a outer without @a inner, which lies inside it, as four strips
+*/
+static void _count_outside(const image_t *image, image_selection_t outer,
+	image_selection_t inner, unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	image_selection_t strips[4];
+
+	update_selection(&strips[0], outer.uprow, inner.uprow,
+		outer.lcol, outer.rcol);
+	update_selection(&strips[1], inner.dwrow, outer.dwrow,
+		outer.lcol, outer.rcol);
+	update_selection(&strips[2], inner.uprow, inner.dwrow,
+		outer.lcol, inner.lcol);
+	update_selection(&strips[3], inner.uprow, inner.dwrow,
+		inner.rcol, outer.rcol);
+
+	for (size_t i = 0; i < ARRAY_SIZE(strips); i++)
+		histogram_count(image, strips[i], fq);
+}
+
+static inline size_t _area(image_selection_t region)
+{
+	return (region.dwrow - region.uprow) * (region.rcol - region.lcol);
+}
+
+int histogram_cached(const image_t *image,
+	unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	struct histogram_t *cache = image->histogram;
+	if (!cache || !cache->valid || cache->dirty)
+		return 0;
+
+	memcpy(fq, cache->fq, sizeof(cache->fq));
+	return 1;
+}
+
+void histogram_refresh(image_t *image, unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	histogram_settle(image);
+
+	if (!histogram_cached(image, fq)) {
+		image_selection_t all;
+		update_selection(&all, 0, image->rows, 0, image->columns);
+
+		memset(fq, 0, (PIXEL_MAX_VALUE + 1) * sizeof(unsigned long));
+		histogram_count(image, all, fq);
+		histogram_store(image, fq);
+	}
+}
+
+void histogram_store(image_t *image,
+	const unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	if (!image->histogram) {
+		image->histogram = calloc(1, sizeof(struct histogram_t));
+		DIE(!image->histogram, "calloc failed");
+	}
+
+	memcpy(image->histogram->fq, fq, sizeof(image->histogram->fq));
+	image->histogram->valid = 1;
+	image->histogram->dirty = 0;
+}
+
+void histogram_change(image_t *image, image_selection_t region)
+{
+	struct histogram_t *cache = image->histogram;
+	if (!cache || !cache->valid)
+		return;
+
+	/* Streamed pixels cannot be counted here */
+	if (image->source) {
+		histogram_invalidate(image);
+		return;
+	}
+
+	if (region.uprow >= region.dwrow || region.lcol >= region.rcol)
+		return;
+
+	/* The dirty region grows to the box around both */
+	image_selection_t box = region;
+	if (cache->dirty) {
+		image_selection_t old = cache->region;
+
+		box.uprow = (old.uprow < box.uprow) ? old.uprow : box.uprow;
+		box.dwrow = (old.dwrow > box.dwrow) ? old.dwrow : box.dwrow;
+		box.lcol = (old.lcol < box.lcol) ? old.lcol : box.lcol;
+		box.rcol = (old.rcol > box.rcol) ? old.rcol : box.rcol;
+	}
+
+	/* Past half of the image, counting it all again is cheaper */
+	if (2 * _area(box) > image->rows * image->columns) {
+		histogram_invalidate(image);
+		return;
+	}
+
+	/* Take out the pixels of the box not taken out yet */
+	unsigned long fq[PIXEL_MAX_VALUE + 1] = { 0 };
+	if (cache->dirty)
+		_count_outside(image, box, cache->region, fq);
+	else
+		histogram_count(image, box, fq);
+
+	for (size_t i = 0; i <= PIXEL_MAX_VALUE; i++)
+		cache->fq[i] -= fq[i];
+
+	cache->dirty = 1;
+	cache->region = box;
+}
+
+void histogram_crop(image_t *image, image_selection_t selection)
+{
+	struct histogram_t *cache = image->histogram;
+	if (!cache || !cache->valid)
+		return;
+
+	if (image->source) {
+		histogram_invalidate(image);
+		return;
+	}
+
+	histogram_settle(image);
+
+	unsigned long fq[PIXEL_MAX_VALUE + 1] = { 0 };
+	image_selection_t all;
+	update_selection(&all, 0, image->rows, 0, image->columns);
+
+	/* Whichever is smaller: what goes, or what stays */
+	if (2 * _area(selection) > _area(all)) {
+		_count_outside(image, all, selection, fq);
+		for (size_t i = 0; i <= PIXEL_MAX_VALUE; i++)
+			cache->fq[i] -= fq[i];
+	} else {
+		histogram_count(image, selection, fq);
+		memcpy(cache->fq, fq, sizeof(fq));
+	}
+}
+
+void histogram_settle(image_t *image)
+{
+	struct histogram_t *cache = image->histogram;
+
+	if (cache && cache->valid && cache->dirty) {
+		histogram_count(image, cache->region, cache->fq);
+		cache->dirty = 0;
+	}
+}
+
+void histogram_invalidate(image_t *image)
+{
+	if (image->histogram)
+		image->histogram->valid = 0;
+}
+
+void histogram_remap(image_t *image,
+	const unsigned char lut[PIXEL_MAX_VALUE + 1])
+{
+	struct histogram_t *cache = image->histogram;
+	if (!cache || !cache->valid)
+		return;
+
+	if (cache->dirty) {
+		histogram_invalidate(image);
+		return;
+	}
+
+	unsigned long fq[PIXEL_MAX_VALUE + 1] = { 0 };
+	for (size_t i = 0; i <= PIXEL_MAX_VALUE; i++)
+		fq[lut[i]] += cache->fq[i];
+
+	memcpy(cache->fq, fq, sizeof(fq));
+}
+
+void histogram_drop(image_t *image)
+{
+	free(image->histogram);
+	image->histogram = NULL;
+}
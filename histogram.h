@@ -0,0 +1,73 @@
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H	1
+
+#include "image.h"
+
+/* Interleaved tables per band, so neighbouring pixels never wait on the
+ * same counter */
+#define HISTOGRAM_TABLES			4
+/* Channel number asking for the luma of colour pixels */
+#define HISTOGRAM_LUMA				COLOR_RANGE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Adds the frequencies of the first value of the pixels in @a region
+ * to @a fq, in parallel bands
+*/
+void histogram_count(const image_t *image, image_selection_t region,
+	unsigned long fq[PIXEL_MAX_VALUE + 1]);
+
+/**
+ * Same, for value @a channel of every pixel, or HISTOGRAM_LUMA
+*/
+void histogram_count_channel(const image_t *image, image_selection_t region,
+	int channel, unsigned long fq[PIXEL_MAX_VALUE + 1]);
+
+/**
+ * The cache every image owns: the histogram of its pixels, minus the
+ * pixels of one dirty region that changed since it was built
+ *
+ * @return 0 if the cache cannot give @a fq without reading pixels
+*/
+int histogram_cached(const image_t *image,
+	unsigned long fq[PIXEL_MAX_VALUE + 1]);
+
+/**
+ * Brings the cache up to date from the pixels, counting only the dirty
+ * region when there is one, and copies it to @a fq
+*/
+void histogram_refresh(image_t *image, unsigned long fq[PIXEL_MAX_VALUE + 1]);
+
+/**
+ * Replaces the cache by @a fq, the histogram of the whole image
+*/
+void histogram_store(image_t *image,
+	const unsigned long fq[PIXEL_MAX_VALUE + 1]);
+
+/**
+ * Updates of the cache, called before the pixels change
+*/
+void histogram_change(image_t *image, image_selection_t region);
+void histogram_crop(image_t *image, image_selection_t selection);
+void histogram_settle(image_t *image);
+void histogram_invalidate(image_t *image);
+
+/**
+ * Updates the cache after every value v of the image became lut[v]
+*/
+void histogram_remap(image_t *image,
+	const unsigned char lut[PIXEL_MAX_VALUE + 1]);
+
+/**
+ * Frees the cache of an image that is going away
+*/
+void histogram_drop(image_t *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,565 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "histogram.h"
+#include "history.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "stats.h"
+#include "stream.h"
+#include "tiles.h"
+#include "writer.h"
+
+typedef enum step_type_t {
+	STEP_REGION,						/* APPLY, EQUALIZE		*/
+	STEP_WINDOW,						/* CROP					*/
+	STEP_PIXELS,						/* CROP let go, RESIZE	*/
+	STEP_ROTATE,						/* ROTATE				*/
+	STEP_STREAM							/* streamed images		*/
+} step_type_t;
+
+/**
+ * One change, holding whatever the image lacks to go to the other side of
+ * it: undone steps hold what redoing them brings back
+*/
+typedef struct step_t {
+	step_type_t type;
+	size_t size;						/* bytes of pixels held	*/
+
+	/* STEP_REGION: the pixels of @a region, @a region.rcol - lcol apart,
+	 * or the whole rows of it of a packed image */
+	image_selection_t region;
+	pixel_t *pixels;
+	uint64_t *bits;
+
+	/* STEP_WINDOW: the cropped image is @a region of the uncropped one,
+	 * both windows of @a buffer */
+	const void *buffer;
+	unsigned long rows, columns;
+	image_selection_t selection;
+
+	/* STEP_PIXELS: the uncropped image, when the buffer was let go, or the
+	 * image before it was packed or resized. @a whole when it is just that
+	 * image. */
+	image_t *other;
+
+	/* STEP_ROTATE: the rotation as made, of @a region unless @a whole */
+	int angle;
+	int whole;
+
+	/* STEP_STREAM: the recorded stages and window on the other side */
+	stream_mark_t mark;
+} step_t;
+
+struct history_t {
+	/* Oldest first, [0, done) can be undone and [done, count) redone */
+	step_t *steps;
+	size_t count;
+	size_t done;
+	size_t capacity;
+
+	size_t size;						/* bytes of all steps	*/
+};
+
+static size_t budget = HISTORY_BUDGET;
+
+void history_budget(size_t bytes)
+{
+	budget = bytes;
+}
+
+static void _free_step(step_t *step)
+{
+	free_pixels(step->pixels);
+	free_bits(step->bits);
+	free_image(step->other);
+}
+
+/**
+ * Forgets the steps [@a from, @a to), which must be the first or the last ones
+*/
+static void _forget(struct history_t *history, size_t from, size_t to)
+{
+	if (from == to)
+		return;
+
+	for (size_t i = from; i < to; i++) {
+		history->size -= history->steps[i].size;
+		_free_step(&history->steps[i]);
+	}
+
+	memmove(history->steps + from, history->steps + to,
+		(history->count - to) * sizeof(step_t));
+	history->count -= to - from;
+	history->done = (history->done > to) ? history->done - (to - from)
+		: (history->done > from) ? from : history->done;
+}
+
+/**
+ * Makes room for a new step of @a size bytes, dropping what can be redone
+ * and as many old steps as the budget needs
+ *
+ * @return The step to fill in, or NULL if it cannot be kept, in which case
+ * there is nothing left to undo either
+*/
+static step_t *_push(image_t *image, size_t size)
+{
+	struct history_t *history = image->history;
+
+	if (!budget || size > budget) {
+		history_drop(image);
+		return NULL;
+	}
+
+	if (!history) {
+		history = image->history = calloc(1, sizeof(struct history_t));
+		DIE(!history, "calloc failed");
+	}
+
+	_forget(history, history->done, history->count);
+
+	size_t oldest = 0, kept = history->size;
+	while (kept + size > budget)
+		kept -= history->steps[oldest++].size;
+	_forget(history, 0, oldest);
+	history->size += size;
+
+	if (history->count == history->capacity) {
+		history->capacity = (history->capacity) ? history->capacity * 2 : 16;
+		history->steps = realloc(history->steps,
+			history->capacity * sizeof(step_t));
+		DIE(!history->steps, "realloc failed");
+	}
+
+	step_t *step = &history->steps[history->count++];
+	history->done = history->count;
+
+	memset(step, 0, sizeof(step_t));
+	step->size = size;
+	return step;
+}
+
+/**
+ * Records where a streamed image stands before a stage is recorded
+*/
+static int _push_stream(image_t *image)
+{
+	step_t *step = _push(image, 0);
+	if (!step)
+		return 0;
+
+	step->type = STEP_STREAM;
+	stream_mark(image, &step->mark);
+	return 1;
+}
+
+int history_region(image_t *image, image_selection_t region)
+{
+	if (image->source)
+		return _push_stream(image);
+
+	size_t rows = region.dwrow - region.uprow;
+	size_t columns = region.rcol - region.lcol;
+
+	if (image->bits) {
+		step_t *step = _push(image, rows * image->words * sizeof(uint64_t));
+		if (!step)
+			return 0;
+
+		/* No memory for the copy: nothing can be undone from here on */
+		step->bits = create_bits(rows, image->words);
+		if (!step->bits) {
+			history_drop(image);
+			return 0;
+		}
+
+		stats_pixels(rows * columns);
+		step->type = STEP_REGION;
+		step->region = region;
+		memcpy(step->bits, image_bits(image, region.uprow),
+			rows * image->words * sizeof(uint64_t));
+		return 1;
+	}
+
+	step_t *step = _push(image, rows * columns * sizeof(pixel_t));
+	if (!step)
+		return 0;
+
+	step->pixels = create_pixels(rows, columns);
+	if (!step->pixels) {
+		history_drop(image);
+		return 0;
+	}
+
+	pipeline_flush(image);
+	tiles_fetch(image, region, 0);
+	stats_pixels(rows * columns);
+
+	step->type = STEP_REGION;
+	step->region = region;
+	for (size_t i = 0; i < rows; i++)
+		memcpy(step->pixels + i * columns,
+			image_row(image, region.uprow + i) + region.lcol,
+			columns * sizeof(pixel_t));
+	return 1;
+}
+
+void history_cancel(image_t *image)
+{
+	struct history_t *history = image->history;
+
+	if (history && history->count)
+		_forget(history, history->count - 1, history->count);
+}
+
+/**
+ * @return What identifies the block the pixels lie in
+*/
+static inline const void *_buffer(const image_t *image)
+{
+	if (image->bits)
+		return image->bits;
+	return (image->mapping) ? image->mapping : (const void *)image->buffer;
+}
+
+int history_crop(image_t *image, image_selection_t selection)
+{
+	if (image->source) {
+		_push_stream(image);
+		return crop_image(image, selection);
+	}
+
+	step_t *step = _push(image, 0);
+	if (step) {
+		step->type = STEP_WINDOW;
+		step->buffer = _buffer(image);
+		step->rows = image->rows;
+		step->columns = image->columns;
+		step->selection = image->selection;
+		step->region = selection;
+	}
+
+	if (crop_image(image, selection))
+		return 1;
+
+	/* Nothing was cropped after all */
+	if (step)
+		history_cancel(image);
+	return 0;
+}
+
+/**
+ * @return The latest step that can be undone and widens @a image, or NULL
+*/
+static step_t *_window(const image_t *image)
+{
+	struct history_t *history = image->history;
+
+	for (size_t i = (history) ? history->done : 0; i > 0; i--) {
+		step_t *step = &history->steps[i - 1];
+
+		if (step->type == STEP_WINDOW && step->buffer == _buffer(image))
+			return step;
+	}
+
+	return NULL;
+}
+
+int history_window(const image_t *image)
+{
+	return _window(image) != NULL;
+}
+
+int history_adopt(image_t *image)
+{
+	step_t *step = _window(image);
+	if (!step)
+		return 0;
+
+	/* The window the step widens to is what it has to keep */
+	struct history_t *history = image->history;
+	size_t index = step - history->steps;
+	size_t size = (image->bits) ? step->rows * image->words * sizeof(uint64_t)
+		: (image->mapping) ? image->mapping_size
+		: step->rows * image->stride * sizeof(pixel_t);
+
+	size_t oldest = 0, kept = history->size + size;
+	while (kept > budget && oldest < index)
+		kept -= history->steps[oldest++].size;
+
+	if (kept > budget) {
+		_forget(history, 0, index + 1);
+		return 0;
+	}
+
+	_forget(history, 0, oldest);
+	step = &history->steps[index - oldest];
+	step->size = size;
+	history->size += size;
+
+	/* Let go by the CROP itself, which copies narrow windows, or later */
+	int cropped = (image->rows != step->rows
+		|| image->columns != step->columns);
+
+	image_t *other = create_mapped_image(NULL, 0, NULL, step->rows,
+		step->columns, image->type);
+	other->pixels = (image->bits) ? NULL : image->pixels - ((cropped)
+		? step->region.uprow * image->stride + step->region.lcol : 0);
+	other->buffer = image->buffer;
+	other->bits = image->bits;
+	other->words = image->words;
+	other->stride = image->stride;
+	other->mapping = image->mapping;
+	other->mapping_size = image->mapping_size;
+	other->tiles = image->tiles;
+	other->selection = step->selection;
+	image->tiles = NULL;
+
+	/* Packed rows are copied by the CROP itself, as they were */
+	step->type = STEP_PIXELS;
+	step->other = other;
+	step->whole = (image->bits != NULL);
+	return 1;
+}
+
+int history_keep(image_t *image)
+{
+	size_t size = (image->bits) ? image->rows * image->words * sizeof(uint64_t)
+		: (image->mapping) ? image->mapping_size
+		: image->rows * image->stride * sizeof(pixel_t);
+	step_t *step = _push(image, size);
+	if (!step)
+		return 0;
+
+	image_t *other = create_mapped_image(NULL, 0, NULL, image->rows,
+		image->columns, image->type);
+	other->pixels = image->pixels;
+	other->buffer = image->buffer;
+	other->stride = image->stride;
+	other->mapping = image->mapping;
+	other->mapping_size = image->mapping_size;
+	other->bits = image->bits;
+	other->words = image->words;
+	other->selection = image->selection;
+
+	/* Its levels are still those of the pixels kept, and the tiles left
+	 * are still to be decoded into them */
+	other->pyramid = image->pyramid;
+	other->tiles = image->tiles;
+	image->pyramid = NULL;
+	image->tiles = NULL;
+
+	step->type = STEP_PIXELS;
+	step->other = other;
+	step->whole = 1;
+	return 1;
+}
+
+void history_rotate(image_t *image, image_selection_t region, int angle,
+	int whole)
+{
+	step_t *step = _push(image, 0);
+	if (!step)
+		return;
+
+	step->type = STEP_ROTATE;
+	step->region = region;
+	step->angle = angle;
+	step->whole = whole;
+}
+
+/**
+ * @return The bytes of a copy of a streamed image as it was at @a mark
+*/
+static inline size_t _mark_size(const stream_mark_t *mark)
+{
+	return mark->rows * pixel_stride(mark->columns) * sizeof(pixel_t);
+}
+
+void history_unstream(image_t *image)
+{
+	struct history_t *history = image->history;
+	if (!history || !image->source)
+		return;
+
+	/* Every step of a streamed image is a stream step: the undone ones
+	 * closest first, then those to redo, until the budget is spent */
+	size_t kept = history->size, first = history->done;
+	while (first && kept + _mark_size(&history->steps[first - 1].mark)
+		<= budget)
+		kept += _mark_size(&history->steps[--first].mark);
+
+	size_t last = history->done;
+	while (last < history->count
+		&& kept + _mark_size(&history->steps[last].mark) <= budget)
+		kept += _mark_size(&history->steps[last++].mark);
+
+	_forget(history, last, history->count);
+	_forget(history, 0, first);
+
+	for (size_t i = 0; i < history->count; i++) {
+		step_t *step = &history->steps[i];
+		if (step->type != STEP_STREAM)
+			continue;
+
+		/* No memory for the copy: nothing can be undone from here on */
+		step->other = stream_render(image, &step->mark);
+		if (!step->other) {
+			history_drop(image);
+			return;
+		}
+
+		step->type = STEP_PIXELS;
+		step->whole = 1;
+		step->size = _mark_size(&step->mark);
+		history->size += step->size;
+	}
+}
+
+/**
+ * Takes @a image to the other side of @a step, @a sign being -1 on UNDO
+ * and 1 on REDO
+ *
+ * @return 0 if it cannot be taken there
+*/
+static int _cross(image_t *image, step_t *step, int sign)
+{
+	if (step->type == STEP_ROTATE) {
+		if (step->whole)
+			return rotate_image(image, sign * step->angle);
+
+		rotate_selection(image, step->region, sign * step->angle);
+		return 1;
+	}
+
+	if (step->type == STEP_STREAM) {
+		image_selection_t selection = image->selection;
+
+		/* The stages recorded went with the file, once read whole */
+		if (!image->source)
+			return 0;
+
+		/* Only CROP moves the selection */
+		histogram_invalidate(image);
+		stream_swap(image, &step->mark);
+		if (image->rows == step->mark.rows
+			&& image->columns == step->mark.columns)
+			image->selection = selection;
+		return 1;
+	}
+
+	pipeline_flush(image);
+
+	if (step->type == STEP_WINDOW) {
+		image_selection_t region = step->region;
+		size_t offset = region.uprow * image->stride + region.lcol;
+
+		histogram_invalidate(image);
+		pyramid_drop(image);
+		if (sign < 0) {
+			image->pixels -= offset;
+			image->rows = step->rows;
+			image->columns = step->columns;
+			image->selection = step->selection;
+			return 1;
+		}
+
+		/* The same window, of whatever buffer the image has now */
+		step->buffer = _buffer(image);
+		image->pixels += offset;
+		image->rows = region.dwrow - region.uprow;
+		image->columns = region.rcol - region.lcol;
+		update_selection(&image->selection, 0, image->rows, 0, image->columns);
+		return 1;
+	}
+
+	if (step->type == STEP_PIXELS) {
+		image_t *other = step->other;
+
+		/* The buffer was taken as it was let go, the cropped pixels have
+		 * been stepped back since */
+		for (size_t i = 0; sign < 0 && !step->whole && i < image->rows; i++)
+			memcpy(image_row(other, step->region.uprow + i)
+				+ step->region.lcol, image_row(image, i),
+				image->columns * sizeof(pixel_t));
+
+		histogram_invalidate(image);
+		swap_pixels(image, other);
+		return 1;
+	}
+
+	image_selection_t region = step->region;
+	size_t columns = region.rcol - region.lcol;
+
+	if (step->bits) {
+		size_t words = (region.dwrow - region.uprow) * image->words;
+		uint64_t *rows = (uint64_t *)alloc_scratch(words * sizeof(uint64_t));
+
+		stats_pixels((region.dwrow - region.uprow) * columns);
+		memcpy(rows, step->bits, words * sizeof(uint64_t));
+		memcpy(step->bits, image_bits(image, region.uprow),
+			words * sizeof(uint64_t));
+		memcpy(image_bits(image, region.uprow), rows,
+			words * sizeof(uint64_t));
+		return 1;
+	}
+
+	size_t width = columns * sizeof(pixel_t);
+
+	pixel_t *row = (pixel_t *)alloc_scratch(width);
+
+	histogram_change(image, region);
+	pyramid_drop(image);
+	stats_pixels((region.dwrow - region.uprow) * columns);
+
+	for (size_t i = region.uprow; i < region.dwrow; i++) {
+		pixel_t *saved = step->pixels + (i - region.uprow) * columns;
+
+		memcpy(row, saved, width);
+		memcpy(saved, image_row(image, i) + region.lcol, width);
+		memcpy(image_row(image, i) + region.lcol, row, width);
+	}
+
+	return 1;
+}
+
+int history_undo(image_t *image)
+{
+	struct history_t *history = image->history;
+	if (!history || !history->done)
+		return 0;
+
+	writer_detach(image);
+	if (!_cross(image, &history->steps[history->done - 1], -1))
+		return 0;
+
+	history->done--;
+	return 1;
+}
+
+int history_redo(image_t *image)
+{
+	struct history_t *history = image->history;
+	if (!history || history->done == history->count)
+		return 0;
+
+	writer_detach(image);
+	if (!_cross(image, &history->steps[history->done], 1))
+		return 0;
+
+	history->done++;
+	return 1;
+}
+
+void history_drop(image_t *image)
+{
+	struct history_t *history = image->history;
+	if (!history)
+		return;
+
+	_forget(history, 0, history->count);
+	free(history->steps);
+	free(history);
+	image->history = NULL;
+}
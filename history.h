@@ -0,0 +1,97 @@
+#ifndef __HISTORY_H
+#define __HISTORY_H	1
+
+#include "image.h"
+
+/* Bytes of pixels the history of an image keeps by default */
+#define HISTORY_BUDGET				((size_t)256 << 20)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sets the bytes of pixels every image may keep for UNDO, 0 turns the
+ * history off. The oldest steps are forgotten first.
+*/
+void history_budget(size_t bytes);
+
+/**
+ * Records the pixels of @a region, which are about to change in place.
+ * Queued operations are run first, the copy being of the real pixels.
+ * Streamed images only remember how many stages they had. Without memory
+ * for the copy, the history is forgotten.
+ *
+ * @return If a step was recorded
+*/
+int history_region(image_t *image, image_selection_t region);
+
+/**
+ * Forgets the step just recorded, for a command that changed nothing after
+ * all
+*/
+void history_cancel(image_t *image);
+
+/**
+ * Crops @a image like crop_image, remembering the window it had: the
+ * pixels around the new one stay in the buffer for UNDO
+ *
+ * @return 0 if there is no memory for the cropped pixels
+*/
+int history_crop(image_t *image, image_selection_t selection);
+
+/**
+ * @return If UNDO may widen the image again over pixels of its buffer
+ * outside of it
+*/
+int history_window(const image_t *image);
+
+/**
+ * Takes over the buffer of @a image, which is about to be released, if
+ * UNDO needs it
+ *
+ * @return 0 if the buffer can be released
+*/
+int history_adopt(image_t *image);
+
+/**
+ * Takes over the pixels of @a image, which is about to be packed or
+ * resized, and their pyramid: UNDO brings them back as they were
+ *
+ * @return 0 if they can be released
+*/
+int history_keep(image_t *image);
+
+/**
+ * Records a rotation that was just made: undone by the opposite one, it
+ * needs no pixels. @a region is ignored when @a whole is set.
+*/
+void history_rotate(image_t *image, image_selection_t region, int angle,
+	int whole);
+
+/**
+ * Turns the steps of a streamed image about to be read whole, which only
+ * remember the stages it had, into copies of the image on the other side
+ * of each: UNDO steps back over them afterwards. The latest ones are kept
+ * first, as the budget allows.
+*/
+void history_unstream(image_t *image);
+
+/**
+ * Steps back or forward one change
+ *
+ * @return 0 if there was none to step over, or no memory to do it
+*/
+int history_undo(image_t *image);
+int history_redo(image_t *image);
+
+/**
+ * Frees the history of an image that is going away
+*/
+void history_drop(image_t *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
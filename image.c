@@ -1,10 +1,70 @@
+#define _POSIX_C_SOURCE				200809L
+
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "image.h"
+#include "alloc.h"
+#include "bitmap.h"
+#include "blur.h"
+#include "convolution.h"
+#include "histogram.h"
+#include "history.h"
+#include "median.h"
+#include "netpbm.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "resample.h"
+#include "stats.h"
+#include "stream.h"
+#include "thread_pool.h"
+#include "tiles.h"
+#include "writer.h"
 
 #define FULL_ROTATION 				360
 #define CYCLE_ROTATION				90
+#define TEXT_BUFFER					(1 << 16)
+/* Pixels per side of a rotated tile: source and result tiles fit in L1 */
+#define ROTATE_TILE					32
+
+/* Binary rows are copied straight into the buffer, so no padding allowed */
+typedef char pixel_size_check_t[(sizeof(pixel_t) == COLOR_RANGE) ? 1 : -1];
+/* Pixel buffers come from alloc_block */
+typedef char pixel_alignment_check_t[
+	(ALLOC_ALIGNMENT % PIXEL_ALIGNMENT == 0) ? 1 : -1];
+
+/**
+ * Loads streamed pixels and runs the deferred operations before the pixels
+ * are read
+ *
+ * @return 0 if there is no memory for the pixels of a streamed image
+*/
+static inline int _sync(image_t *image)
+{
+	if (image->source && !stream_load(image))
+		return 0;
+	if (image->tiles)
+		tiles_load(image);
+	if (image->pending)
+		pipeline_flush(image);
+	return 1;
+}
+
+/**
+ * As _sync, for a command that only reads @a region and @a reach pixels
+ * around it: only the tiles under those are decoded
+*/
+static inline int _sync_region(image_t *image, image_selection_t region,
+	size_t reach)
+{
+	if (image->source && !stream_load(image))
+		return 0;
+	if (image->pending)
+		pipeline_flush(image);
+	tiles_fetch(image, region, reach);
+	return 1;
+}
 
 /**
  * Initial / Full selection
@@ -28,21 +88,49 @@ inline void update_selection(image_selection_t *selection,
 	selection->rcol = r_col;
 }
 
-pixel_t **create_pixels(size_t rows, size_t columns)
+size_t pixel_stride(size_t columns)
 {
-	pixel_t **pixels = (pixel_t **)malloc(rows * sizeof(pixel_t *));
-	DIE(!pixels, "malloc failed");
+	return (columns + STRIDE_ALIGNMENT - 1) / STRIDE_ALIGNMENT
+		* STRIDE_ALIGNMENT;
+}
 
-	for (size_t i = 0; i < rows; i++) {
-		pixels[i] = (pixel_t *)calloc(columns, sizeof(pixel_t));
-		DIE(!pixels[i], "calloc failed");
-	}
+int image_fits(size_t rows, size_t columns)
+{
+	size_t stride = pixel_stride(columns);
 
-	return pixels;
+	return rows && columns && stride >= columns
+		&& rows <= IMAGE_MAX_BYTES / sizeof(pixel_t) / stride;
+}
+
+pixel_t *create_pixels(size_t rows, size_t stride)
+{
+	/* A product that wraps around would be a buffer too short */
+	if (stride && rows > SIZE_MAX / sizeof(pixel_t) / stride)
+		return NULL;
+
+	return (pixel_t *)alloc_block(rows * stride * sizeof(pixel_t), 1);
+}
+
+/**
+ * As create_pixels, for pixels that are all written before they are read:
+ * they are not zeroed
+*/
+static pixel_t *_result_pixels(size_t rows, size_t stride)
+{
+	if (stride && rows > SIZE_MAX / sizeof(pixel_t) / stride)
+		return NULL;
+
+	return (pixel_t *)alloc_block(rows * stride * sizeof(pixel_t), 0);
 }
 
 image_t *create_image(size_t rows, size_t columns, image_type_t type)
 {
+	size_t stride = pixel_stride(columns);
+	pixel_t *pixels = (stride >= columns) ? create_pixels(rows, stride)
+		: NULL;
+	if (!pixels)
+		return NULL;
+
 	image_t *image = (image_t *)malloc(sizeof(image_t));
 	DIE(!image, "malloc failed");
 
@@ -51,21 +139,121 @@ image_t *create_image(size_t rows, size_t columns, image_type_t type)
 	image->type = type;
 
 	init_selection(&image->selection, rows, columns);
-	image->pixels = create_pixels(rows, columns);
+	image->stride = stride;
+	image->pixels = pixels;
+	image->buffer = image->pixels;
+	image->bits = NULL;
+	image->words = 0;
+	image->mapping = NULL;
+	image->mapping_size = 0;
+	image->pending = NULL;
+	image->source = NULL;
+	image->tiles = NULL;
+	image->histogram = NULL;
+	image->pyramid = NULL;
+	image->history = NULL;
 
 	return image;
 }
 
-void free_pixels(pixel_t **pixels, size_t size)
+image_t *create_mapped_image(void *mapping, size_t mapping_size,
+	pixel_t *pixels, size_t rows, size_t columns, image_type_t type)
 {
-	if (!pixels)
-		return;
+	image_t *image = (image_t *)malloc(sizeof(image_t));
+	DIE(!image, "malloc failed");
+
+	image->rows = rows;
+	image->columns = columns;
+	image->type = type;
+
+	/* File rows are packed one after the other */
+	init_selection(&image->selection, rows, columns);
+	stats_alloc(mapping_size);
+	image->stride = columns;
+	image->pixels = pixels;
+	image->buffer = (mapping) ? NULL : pixels;
+	image->bits = NULL;
+	image->words = 0;
+	image->mapping = mapping;
+	image->mapping_size = mapping_size;
+	image->pending = NULL;
+	image->source = NULL;
+	image->tiles = NULL;
+	image->histogram = NULL;
+	image->pyramid = NULL;
+	image->history = NULL;
+
+	return image;
+}
+
+void free_pixels(pixel_t *pixels)
+{
+	alloc_release(pixels);
+}
 
-	for (size_t i = 0; i < size; i++)
-		free(pixels[i]);
+uint64_t *create_bits(size_t rows, size_t words)
+{
+	if (words && rows > SIZE_MAX / sizeof(uint64_t) / words)
+		return NULL;
+
+	return (uint64_t *)alloc_block(rows * words * sizeof(uint64_t), 1);
+}
+
+void free_bits(uint64_t *bits)
+{
+	alloc_release(bits);
+}
 
-	free(pixels);
-	pixels = NULL;
+image_t *create_bilevel_image(size_t rows, size_t columns)
+{
+	uint64_t *bits = create_bits(rows, bitmap_words(columns));
+	if (!bits)
+		return NULL;
+
+	image_t *image = create_mapped_image(NULL, 0, NULL, rows, columns, PBM);
+
+	image->stride = 0;
+	image->words = bitmap_words(columns);
+	image->bits = bits;
+
+	return image;
+}
+
+/**
+ * Releases the current pixels, whether allocated, mapped or packed, unless
+ * the history still needs them, and the levels made of them
+*/
+static void _release_pixels(image_t *image)
+{
+	pyramid_drop(image);
+
+	/* The history may keep them for longer than a save reads them */
+	if (history_window(image))
+		writer_detach(image);
+
+	if (history_adopt(image)) {
+		/* Owned by the history now */
+	} else if (writer_adopt(image)) {
+		/* Let go once saved */
+	} else if (image->bits) {
+		free_bits(image->bits);
+	} else if (image->mapping) {
+		stats_free(image->mapping_size);
+		munmap(image->mapping, image->mapping_size);
+	} else {
+		free_pixels(image->buffer);
+	}
+
+	image->pixels = NULL;
+	image->buffer = NULL;
+	image->bits = NULL;
+	image->words = 0;
+	image->mapping = NULL;
+	image->mapping_size = 0;
+
+	/* Whatever is left of the file, unless the history took it along */
+	tiles_close(image->tiles);
+	image->tiles = NULL;
 }
 
 void free_image(image_t *image)
@@ -73,98 +261,355 @@ void free_image(image_t *image)
 	if (!image)
 		return;
 
-	free_pixels(image->pixels, image->rows);
+	pipeline_drop(image);
+	stream_close(image);
+	histogram_drop(image);
+	history_drop(image);
+	_release_pixels(image);
 	free(image);
 }
 
+void swap_pixels(image_t *image, image_t *other)
+{
+	SWAP_ANY(image->pixels, other->pixels, pixel_t *);
+	SWAP_NUMERIC(image->stride, other->stride);
+	SWAP_ANY(image->buffer, other->buffer, pixel_t *);
+	SWAP_ANY(image->bits, other->bits, uint64_t *);
+	SWAP_NUMERIC(image->words, other->words);
+	SWAP_ANY(image->mapping, other->mapping, void *);
+	SWAP_NUMERIC(image->mapping_size, other->mapping_size);
+	SWAP_ANY(image->tiles, other->tiles, struct tiles_t *);
+	SWAP_ANY(image->pyramid, other->pyramid, struct pyramid_t *);
+	SWAP_NUMERIC(image->rows, other->rows);
+	SWAP_NUMERIC(image->columns, other->columns);
+	SWAP_ANY(image->selection, other->selection, image_selection_t);
+}
+
+image_t *copy_image(const image_t *image)
+{
+	image_t *copy;
+
+	if (image->bits) {
+		copy = create_bilevel_image(image->rows, image->columns);
+		if (!copy)
+			return NULL;
+		for (size_t i = 0; i < image->rows; i++)
+			memcpy(image_bits(copy, i), image_bits(image, i),
+				image->words * sizeof(uint64_t));
+	} else {
+		copy = create_image(image->rows, image->columns, image->type);
+		if (!copy)
+			return NULL;
+		for (size_t i = 0; i < image->rows; i++)
+			memcpy(image_row(copy, i), image_row(image, i),
+				image->columns * sizeof(pixel_t));
+	}
+
+	copy->selection = image->selection;
+	return copy;
+}
+
+/**
+ * Reads the rows of a P4 file, 8 pixels to a byte
+*/
+static void _read_bits(FILE *in_file, image_t *image)
+{
+	size_t bytes = (image->columns + 7) / 8;
+	unsigned char *line = (unsigned char *)alloc_scratch(bytes + 1);
+
+	for (size_t i = 0; i < image->rows; i++) {
+		size_t ret = fread(line, 1, bytes, in_file);
+
+		memset(line + ret, 0, bytes - ret);
+		bitmap_load(image_bits(image, i), line, image->columns);
+	}
+}
+
 void read_pixels(FILE *in_file, image_t *image, int binary)
 {
-	for (size_t i = 0; i < image->rows; i++)
-		for (size_t j = 0; j < image->columns; j++) {
-			if (image->type == PPM) {
-				if (!binary)
-					fscanf(in_file, "%hhu %hhu %hhu",
-						&image->pixels[i][j].rgb[0],
-						&image->pixels[i][j].rgb[1],
-						&image->pixels[i][j].rgb[2]);
-				else
-					fread(image->pixels[i][j].rgb, sizeof(unsigned char),
-						COLOR_RANGE, in_file);
-			} else {
-				if (!binary)
-					fscanf(in_file, "%hhu", &image->pixels[i][j].val);
-				else
-					fread(&image->pixels[i][j].val, sizeof(unsigned char),
-						1, in_file);
-			}
+	stats_pixels(image->rows * image->columns);
+
+	if (binary && image->bits) {
+		_read_bits(in_file, image);
+		return;
+	}
+
+	if (binary && image->type == PPM) {
+		/* P6 rows have the exact layout of a pixel row */
+		for (size_t i = 0; i < image->rows; i++)
+			fread(image_row(image, i), sizeof(pixel_t),
+				image->columns, in_file);
+		return;
+	}
+
+	if (!binary) {
+		/* Decode the rest of the stream at once */
+		size_t size = 0, capacity = TEXT_BUFFER;
+		unsigned char *text = (unsigned char *)malloc(capacity);
+		DIE(!text, "malloc failed");
+
+		size_t ret;
+		while ((ret = fread(text + size, 1, capacity - size, in_file)) > 0) {
+			size += ret;
+			if (size < capacity)
+				continue;
+
+			capacity *= 2;
+			text = (unsigned char *)realloc(text, capacity);
+			DIE(!text, "realloc failed");
 		}
+
+		netpbm_decode_ascii(image, text, size);
+		free(text);
+		return;
+	}
+
+	unsigned char *line = (unsigned char *)alloc_scratch(image->columns + 1);
+
+	for (size_t i = 0; i < image->rows; i++) {
+		pixel_t *row = image_row(image, i);
+
+		size_t ret = fread(line, sizeof(unsigned char), image->columns,
+			in_file);
+
+		memset(line + ret, 0, image->columns - ret);
+		for (size_t j = 0; j < image->columns; j++)
+			row[j].val = line[j];
+	}
 }
 
-void print_pixels(FILE *out_file, image_t *image, int binary)
+void print_header(FILE *out_file, image_t *image, int binary)
 {
-	/* Magic word is Px, where x is the image type (with added compensation) */
-	fprintf(out_file, "P%d\n%lu %lu\n%d\n",
-		((int)image->type + ((binary) ? 4 : 1)),
-		image->columns, image->rows,
-		PIXEL_MAX_VALUE);
+	/* Magic word is Px, where x is the image type (with added compensation).
+	 * Packed images are plain or raw PBM, which have no maximum value. */
+	if (image->bits)
+		fprintf(out_file, "P%d\n%lu %lu\n", ((binary) ? 4 : 1),
+			image->columns, image->rows);
+	else
+		fprintf(out_file, "P%d\n%lu %lu\n%d\n",
+			((int)image->type + ((binary) ? 4 : 1)),
+			image->columns, image->rows,
+			PIXEL_MAX_VALUE);
+}
 
-	for (size_t i = 0; i < image->rows; i++) {
-		for (size_t j = 0; j < image->columns; j++) {
-			if (image->type == PPM) {
-				if (binary)
-					fwrite(image->pixels[i][j].rgb, sizeof(unsigned char),
-						COLOR_RANGE, out_file);
-				else
-					fprintf(out_file, "%hhu %hhu %hhu ",
-						image->pixels[i][j].rgb[0],
-						image->pixels[i][j].rgb[1],
-						image->pixels[i][j].rgb[2]);
-			} else {
-				if (binary)
-					fwrite(&image->pixels[i][j].val, sizeof(unsigned char),
-						1, out_file);
-				else
-					fprintf(out_file, "%hhu ", image->pixels[i][j].val);
-			}
+int print_pixels(FILE *out_file, image_t *image, int binary)
+{
+	print_header(out_file, image, binary);
+
+	/* Streamed images are written a band of rows at a time */
+	if (image->source)
+		return stream_pixels(out_file, image, binary);
+
+	write_pixels(out_file, image, binary);
+	return 1;
+}
+
+void write_pixels(FILE *out_file, image_t *image, int binary)
+{
+	_sync(image);
+	stats_pixels(image->rows * image->columns);
+
+	if (!binary) {
+		netpbm_write_ascii(out_file, image);
+		return;
+	}
+
+	if (image->type == PPM) {
+		for (size_t i = 0; i < image->rows; i++)
+			fwrite(image_row(image, i), sizeof(pixel_t),
+				image->columns, out_file);
+		return;
+	}
+
+	if (image->bits) {
+		size_t bytes = (image->columns + 7) / 8;
+		unsigned char *line = (unsigned char *)alloc_scratch(bytes + 1);
+
+		for (size_t i = 0; i < image->rows; i++) {
+			bitmap_store(line, image_bits(image, i), image->columns);
+			fwrite(line, 1, bytes, out_file);
 		}
+		return;
+	}
+
+	unsigned char *line = (unsigned char *)alloc_scratch(image->columns + 1);
 
-		if (!binary)
-			fprintf(out_file, "\n");
+	for (size_t i = 0; i < image->rows; i++) {
+		pixel_t *row = image_row(image, i);
+
+		for (size_t j = 0; j < image->columns; j++)
+			line[j] = row[j].val;
+		fwrite(line, sizeof(unsigned char), image->columns, out_file);
 	}
 }
 
-void crop_image(image_t *image, image_selection_t selection)
+/**
+ * Narrows the image to a window of its pixels, with no copy. The rows cut
+ * off above and below are handed back, unless UNDO may bring them back.
+*/
+static void _crop_view(image_t *image, image_selection_t selection)
+{
+	if (!history_window(image)) {
+		writer_detach(image);
+
+		pixel_t *first = image_row(image, selection.uprow);
+		pixel_t *last = image_row(image, image->rows - 1) + image->columns;
+
+		alloc_discard(image->pixels,
+			(first - image->pixels) * sizeof(pixel_t));
+		if (selection.dwrow < image->rows)
+			alloc_discard(image_row(image, selection.dwrow),
+				(last - image_row(image, selection.dwrow)) * sizeof(pixel_t));
+	}
+
+	image->pixels = image_row(image, selection.uprow) + selection.lcol;
+	image->rows = selection.dwrow - selection.uprow;
+	image->columns = selection.rcol - selection.lcol;
+	init_selection(&image->selection, image->rows, image->columns);
+}
+
+/**
+ * Copies the selected pixels of a packed image to the start of new rows:
+ * they are a fraction of the size of pixel rows, so there is no window
+*/
+static int _crop_bits(image_t *image, image_selection_t selection)
+{
+	size_t rows = selection.dwrow - selection.uprow;
+	size_t columns = selection.rcol - selection.lcol;
+	size_t words = bitmap_words(columns);
+	uint64_t *bits = create_bits(rows, words);
+	if (!bits)
+		return 0;
+	stats_pixels(rows * columns);
+
+	for (size_t i = 0; i < rows; i++)
+		bitmap_extract(bits + i * words, image_bits(image, selection.uprow + i),
+			selection.lcol, columns);
+
+	_release_pixels(image);
+	image->bits = bits;
+	image->words = words;
+
+	image->rows = rows;
+	image->columns = columns;
+	init_selection(&image->selection, rows, columns);
+	return 1;
+}
+
+int crop_image(image_t *image, image_selection_t selection)
 {
+	pyramid_drop(image);
+	if (image->source) {
+		histogram_invalidate(image);
+		stream_crop(image, selection);
+		return 1;
+	}
+
+	if (image->bits)
+		return _crop_bits(image, selection);
+
+	/* A window of the buffer decodes nothing, a copy only what it keeps */
+	pipeline_flush(image);
+	histogram_crop(image, selection);
+
 	size_t rows = selection.dwrow - selection.uprow;
 	size_t columns = selection.rcol - selection.lcol;
 
-	pixel_t **pixels = create_pixels(rows, columns);
+	/* Keep a window of the buffer, unless most of each row is cut off */
+	if (image->stride <= 2 * columns) {
+		_crop_view(image, selection);
+		return 1;
+	}
 
-	for (size_t i = selection.uprow; i < selection.dwrow; i++)
-		for (size_t j = selection.lcol; j < selection.rcol; j++)
-			pixels[i - selection.uprow][j - selection.lcol] =
-			image->pixels[i][j];
+	size_t stride = pixel_stride(columns);
+	pixel_t *pixels = create_pixels(rows, stride);
+	if (!pixels)
+		return 0;
+	stats_pixels(rows * columns);
+
+	tiles_fetch(image, selection, 0);
+	for (size_t i = 0; i < rows; i++)
+		memcpy(pixels + i * stride,
+			image_row(image, selection.uprow + i) + selection.lcol,
+			columns * sizeof(pixel_t));
 
-	free_pixels(image->pixels, image->rows);
+	_release_pixels(image);
 	image->pixels = pixels;
+	image->buffer = pixels;
+	image->stride = stride;
 
 	image->rows = rows;
 	image->columns = columns;
 	init_selection(&image->selection, rows, columns);
+	return 1;
 }
 
-void print_histogram(image_t *image, size_t max_stars, size_t bins)
+int image_histogram(image_t *image, unsigned long fq[PIXEL_MAX_VALUE + 1])
 {
-	int fq[PIXEL_MAX_VALUE + 1] = { 0 };
+	/* Unchanged since last time: no pixel is read */
+	if (histogram_cached(image, fq))
+		return 1;
 
-	for (size_t i = 0; i < image->rows; i++)
-		for (size_t j = 0; j < image->columns; j++)
-			fq[(int)image->pixels[i][j].val]++;
+	if (image->source) {
+		image_selection_t all;
+		init_selection(&all, image->rows, image->columns);
+
+		memset(fq, 0, (PIXEL_MAX_VALUE + 1) * sizeof(unsigned long));
+		if (!stream_histogram(image, all, fq))
+			return 0;
+		histogram_store(image, fq);
+		return 1;
+	}
+
+	_sync(image);
+	histogram_refresh(image, fq);
+	return 1;
+}
+
+/**
+ * Counts the values of the smallest level of the pyramid with at least
+ * PYRAMID_PREVIEW pixels: the shape of the histogram of a large image
+ *
+ * @return 0 if there is no such level, or the cache has the histogram
+*/
+static int _preview_histogram(image_t *image,
+	unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	if (!pyramid_enabled() || image->source || histogram_cached(image, fq))
+		return 0;
+
+	size_t rows = image->rows, columns = image->columns;
+	while (pyramid_half(rows) * pyramid_half(columns) >= PYRAMID_PREVIEW
+		&& (pyramid_half(rows) < rows || pyramid_half(columns) < columns)) {
+		rows = pyramid_half(rows);
+		columns = pyramid_half(columns);
+	}
+
+	if (rows == image->rows && columns == image->columns)
+		return 0;
+
+	_sync(image);
+	const image_t *level = pyramid_level(image, rows, columns);
+	image_selection_t all;
+	init_selection(&all, level->rows, level->columns);
 
-	int *hgram = (int *)calloc(bins, sizeof(int));
-	DIE(!hgram, "calloc failed");
+	memset(fq, 0, (PIXEL_MAX_VALUE + 1) * sizeof(unsigned long));
+	histogram_count(level, all, fq);
+	return 1;
+}
+
+int print_histogram(FILE *out, image_t *image, size_t max_stars,
+	size_t bins)
+{
+	unsigned long fq[PIXEL_MAX_VALUE + 1];
+	if (!_preview_histogram(image, fq) && !image_histogram(image, fq))
+		return 0;
 
-	int max_freq = 0;
+	unsigned long *hgram = (unsigned long *)alloc_scratch(bins
+		* sizeof(unsigned long));
+	memset(hgram, 0, bins * sizeof(unsigned long));
+
+	unsigned long max_freq = 0;
 	/* Interval size */
 	size_t size = ARRAY_SIZE(fq) / bins;
 
@@ -182,40 +627,209 @@ void print_histogram(image_t *image, size_t max_stars, size_t bins)
 	for (size_t i = 0; i < bins; i++) {
 		int stars = (hgram[i] * max_stars) / max_freq;
 
-		printf("%d\t|\t", stars);
+		fprintf(out, "%d\t|\t", stars);
 		for (int j = 0; j < stars; j++)
-			printf("*");
-		printf("\n");
+			fputc('*', out);
+		fputc('\n', out);
+	}
+
+	return 1;
+}
+
+/**
+ * @return If @a selection covers the whole image
+*/
+static inline int _whole(const image_t *image, image_selection_t selection)
+{
+	return (selection.uprow == 0 && selection.lcol == 0
+		&& selection.dwrow == image->rows && selection.rcol == image->columns);
+}
+
+/**
+ * Histogram of value @a channel (or HISTOGRAM_LUMA) over @a selection
+ *
+ * @return 0 if there was no memory to read the pixels of a streamed image
+*/
+static int _selection_histogram(image_t *image, image_selection_t selection,
+	int channel, unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	/* The one of the whole image is usually cached */
+	if (channel == 0 && _whole(image, selection))
+		return image_histogram(image, fq);
+
+	memset(fq, 0, (PIXEL_MAX_VALUE + 1) * sizeof(unsigned long));
+	if (image->source && channel == 0)
+		return stream_histogram(image, selection, fq);
+
+	if (!_sync_region(image, selection, 0))
+		return 0;
+	histogram_count_channel(image, selection, channel, fq);
+	return 1;
+}
+
+/**
+ * Equalise with formula (PIXEL_MAX * freq) / surface area of selection
+*/
+static void _equalise_lut(unsigned long hgram[PIXEL_MAX_VALUE + 1],
+	double area, unsigned char lut[PIXEL_MAX_VALUE + 1])
+{
+	/* Cumulative histogram */
+	for (size_t i = 1; i <= PIXEL_MAX_VALUE; i++)
+		hgram[i] += hgram[i - 1];
+
+	for (size_t i = 0; i <= PIXEL_MAX_VALUE; i++)
+		lut[i] = _clamp((PIXEL_MAX_VALUE * (double)hgram[i]) / area,
+			0, PIXEL_MAX_VALUE);
+}
+
+int equalise_table(image_t *image, image_selection_t selection,
+	unsigned char lut[PIXEL_MAX_VALUE + 1])
+{
+	unsigned long hgram[PIXEL_MAX_VALUE + 1];
+
+	if (!_selection_histogram(image, selection, 0, hgram))
+		return 0;
+	_equalise_lut(hgram, (double)(selection.dwrow - selection.uprow)
+		* (selection.rcol - selection.lcol), lut);
+	return 1;
+}
+
+typedef struct equalise_job_t {
+	image_t *image;
+	image_selection_t selection;
+	int grey;
+	equalise_mode_t mode;
+	size_t bands;
+
+	unsigned char lut[COLOR_RANGE][PIXEL_MAX_VALUE + 1];
+	/* Luma mode: what every channel gains, for each luma, and the values
+	 * -255 to 510 kept in range */
+	short delta[PIXEL_MAX_VALUE + 1];
+	unsigned char clamp[3 * (PIXEL_MAX_VALUE + 1)];
+} equalise_job_t;
+
+static void _equalise_band(void *arg, size_t band)
+{
+	equalise_job_t *job = (equalise_job_t *)arg;
+	image_selection_t selection = job->selection;
+	size_t lo, hi;
+
+	pool_band(selection.dwrow - selection.uprow, job->bands, band, &lo, &hi);
+	for (size_t i = selection.uprow + lo; i < selection.uprow + hi; i++) {
+		pixel_t *row = image_row(job->image, i);
+
+		/* Table lookups only, the arithmetic went into the tables */
+		if (job->grey) {
+			for (size_t j = selection.lcol; j < selection.rcol; j++)
+				row[j].val = job->lut[0][row[j].val];
+		} else if (job->mode == EQUALISE_CHANNELS) {
+			for (size_t j = selection.lcol; j < selection.rcol; j++)
+				for (size_t k = 0; k < COLOR_RANGE; k++)
+					row[j].rgb[k] = job->lut[k][row[j].rgb[k]];
+		} else {
+			const unsigned char *clamp = job->clamp + PIXEL_MAX_VALUE + 1;
+
+			for (size_t j = selection.lcol; j < selection.rcol; j++) {
+				const unsigned char *shifted =
+					clamp + job->delta[pixel_luma(&row[j])];
+
+				row[j].rgb[0] = shifted[row[j].rgb[0]];
+				row[j].rgb[1] = shifted[row[j].rgb[1]];
+				row[j].rgb[2] = shifted[row[j].rgb[2]];
+			}
+		}
+	}
+}
+
+int equalise_image(image_t *image, image_selection_t selection,
+	equalise_mode_t mode)
+{
+	/* Only the first value of streamed images is counted by a pass */
+	if (image->source && image->type == PPM && !_sync(image))
+		return 0;
+
+	equalise_job_t job = {
+		.image = image,
+		.selection = selection,
+		.grey = (image->type != PPM),
+		.mode = mode,
+		.bands = pool_split(selection.dwrow - selection.uprow, POOL_GRAIN),
+	};
+	double area = (double)(selection.dwrow - selection.uprow)
+		* (selection.rcol - selection.lcol);
+	unsigned long hgram[PIXEL_MAX_VALUE + 1];
+
+	if (job.grey) {
+		if (!equalise_table(image, selection, job.lut[0]))
+			return 0;
+	} else if (mode == EQUALISE_CHANNELS) {
+		for (int k = 0; k < COLOR_RANGE; k++) {
+			_selection_histogram(image, selection, k, hgram);
+			_equalise_lut(hgram, area, job.lut[k]);
+		}
+	} else {
+		/* Moving every channel by the same amount keeps the chroma */
+		_selection_histogram(image, selection, HISTOGRAM_LUMA, hgram);
+		_equalise_lut(hgram, area, job.lut[0]);
+		for (int i = 0; i <= PIXEL_MAX_VALUE; i++)
+			job.delta[i] = (short)(job.lut[0][i] - i);
+		for (int i = 0; i < (int)sizeof(job.clamp); i++)
+			job.clamp[i] = (unsigned char)_clamp(i - (PIXEL_MAX_VALUE + 1),
+				0, PIXEL_MAX_VALUE);
+	}
+
+	/* The cache follows a full greyscale equalisation through the table */
+	int remap = job.grey && _whole(image, selection);
+	stats_pixels((size_t)area);
+
+	if (image->source) {
+		if (!remap)
+			histogram_invalidate(image);
+		stream_table(image, selection, job.lut[0]);
+	} else {
+		_sync_region(image, selection, 0);
+		writer_detach(image);
+		pyramid_drop(image);
+		if (!remap)
+			histogram_change(image, selection);
+		pool_run(job.bands, _equalise_band, &job);
 	}
+
+	if (remap)
+		histogram_remap(image, job.lut[0]);
+	return 1;
 }
 
 /**
  * @return The resulted pixel after applying an effect on a given position
 */
-pixel_t _apply_on_pixel(pixel_t **pixels, DEF_KERNEL(kernel), double divide,
-	size_t row, size_t col, image_type_t type)
+pixel_t _apply_on_pixel(image_t *image, const kernel_t *kernel,
+	size_t row, size_t col)
 {
 	double buffer[COLOR_RANGE] = { 0 };
 
 	/* Compute sum of neighbours */
-	for (size_t i = 0; i < KERNEL_SIZE; i++)
-		for (size_t j = 0; j < KERNEL_SIZE; j++) {
-			if (type == PPM) {
-				buffer[0] +=
-					kernel[i][j] * pixels[row - 1 + i][col - 1 + j].rgb[0];
-				buffer[1] +=
-					kernel[i][j] * pixels[row - 1 + i][col - 1 + j].rgb[1];
-				buffer[2] +=
-					kernel[i][j] * pixels[row - 1 + i][col - 1 + j].rgb[2];
+	for (size_t i = 0; i < kernel->rows; i++) {
+		pixel_t *line = image_row(image, row - kernel->rows / 2 + i)
+			+ col - kernel->columns / 2;
+
+		for (size_t j = 0; j < kernel->columns; j++) {
+			int value = kernel->values[i][j];
+
+			if (image->type == PPM) {
+				buffer[0] += value * line[j].rgb[0];
+				buffer[1] += value * line[j].rgb[1];
+				buffer[2] += value * line[j].rgb[2];
 			} else {
-				buffer[0] +=
-					kernel[i][j] * pixels[row - 1 + i][col - 1 + j].val;
+				buffer[0] += value * line[j].val;
 			}
 		}
+	}
 
 	/* Copy into result */
-	pixel_t result;
-	if (type == PPM) {
+	double divide = kernel->divide;
+	pixel_t result = { .rgb = { 0 } };
+	if (image->type == PPM) {
 		result.rgb[0] = _clamp(round(buffer[0] / divide), 0, PIXEL_MAX_VALUE);
 		result.rgb[1] = _clamp(round(buffer[1] / divide), 0, PIXEL_MAX_VALUE);
 		result.rgb[2] = _clamp(round(buffer[2] / divide), 0, PIXEL_MAX_VALUE);
@@ -226,122 +840,548 @@ pixel_t _apply_on_pixel(pixel_t **pixels, DEF_KERNEL(kernel), double divide,
 	return result;
 }
 
-void apply_effect(image_t *image, image_selection_t selection,
-	DEF_KERNEL(kernel), double divide)
+typedef struct levels_job_t {
+	image_t *image;
+	image_t *levels;					/* the same rows, unpacked	*/
+	size_t first, last;
+	int pack;
+
+	size_t bands;
+} levels_job_t;
+
+static void _levels_band(void *arg, size_t band)
 {
+	levels_job_t *job = (levels_job_t *)arg;
+	size_t lo, hi;
+
+	pool_band(job->last - job->first, job->bands, band, &lo, &hi);
+	for (size_t i = job->first + lo; i < job->first + hi; i++)
+		if (job->pack)
+			bitmap_pack(image_bits(job->image, i), image_row(job->levels, i),
+				job->image->columns);
+		else
+			bitmap_unpack(image_row(job->levels, i), image_bits(job->image, i),
+				job->image->columns);
+}
+
+/**
+ * Unpacks or packs back rows [@a first, @a last) of a packed image
+*/
+static void _convert_levels(image_t *image, image_t *levels, size_t first,
+	size_t last, int pack)
+{
+	levels_job_t job = {
+		.image = image,
+		.levels = levels,
+		.first = first,
+		.last = last,
+		.pack = pack,
+		.bands = pool_split(last - first, POOL_GRAIN),
+	};
+
+	stats_pixels((last - first) * image->columns);
+	pool_run(job.bands, _levels_band, &job);
+}
+
+/**
+ * Kernels work on levels: the rows a kernel reads are unpacked, black to 0
+ * and white to PIXEL_MAX_VALUE, and the selected ones are packed back
+*/
+static int _apply_bits(image_t *image, image_selection_t selection,
+	const kernel_t *kernel)
+{
+	size_t ry = kernel->rows / 2;
+	size_t first = (selection.uprow > ry) ? selection.uprow - ry : 0;
+	size_t last = (selection.dwrow + ry < image->rows)
+		? selection.dwrow + ry : image->rows;
+
+	/* As tall as the image, for its edges, with only those rows held */
+	image_t *levels = create_image(last - first, image->columns, PBM);
+	if (!levels)
+		return 0;
+	levels->pixels -= first * levels->stride;
+	levels->rows = image->rows;
+
+	_convert_levels(image, levels, first, last, 0);
+	int done = apply_effect(levels, selection, kernel);
+	if (done)
+		_convert_levels(image, levels, selection.uprow, selection.dwrow, 1);
+	free_image(levels);
+	return done;
+}
+
+int apply_effect(image_t *image, image_selection_t selection,
+	const kernel_t *kernel)
+{
+	if (image->source) {
+		histogram_invalidate(image);
+		stream_apply(image, selection, kernel);
+		return 1;
+	}
+
+	writer_detach(image);
+	pyramid_drop(image);
+	if (image->bits)
+		return _apply_bits(image, selection, kernel);
+
+	_sync_region(image, selection, (kernel->rows > kernel->columns)
+		? kernel->rows / 2 : kernel->columns / 2);
+	histogram_change(image, selection);
+	stats_pixels((selection.dwrow - selection.uprow)
+		* (selection.rcol - selection.lcol));
+
+	/* Integer division factors go through the vectorised engine */
+	conv_kernel_t conv;
+	if (conv_prepare(&conv, kernel)) {
+		conv_apply(image, selection, &conv);
+		return 1;
+	}
+
 	size_t rows = selection.dwrow - selection.uprow;
 	size_t columns = selection.rcol - selection.lcol;
+	size_t stride = pixel_stride(columns);
+	size_t ry = kernel->rows / 2, rx = kernel->columns / 2;
 
 	/* Cannot be done in-place */
-	pixel_t **result = create_pixels(rows, columns);
+	pixel_t *result = create_pixels(rows, stride);
+	if (!result)
+		return 0;
 
 	for (size_t i = selection.uprow; i < selection.dwrow; i++) {
+		pixel_t *src = image_row(image, i);
+		pixel_t *dst = result + (i - selection.uprow) * stride
+			- selection.lcol;
+
 		for (size_t j = selection.lcol; j < selection.rcol; j++) {
 			/* Leave edges */
-			if (i == 0 || i >= image->rows - 1 ||
-				j == 0 || j >= image->columns - 1) {
-				result[i - selection.uprow][j - selection.lcol] =
-					image->pixels[i][j];
+			if (i < ry || i + ry >= image->rows ||
+				j < rx || j + rx >= image->columns) {
+				dst[j] = src[j];
 				continue;
 			}
 
-			result[i - selection.uprow][j - selection.lcol] =
-				_apply_on_pixel(image->pixels, kernel, divide,
-					i, j, image->type);
+			dst[j] = _apply_on_pixel(image, kernel, i, j);
 		}
 	}
 
-	for (size_t i = selection.uprow; i < selection.dwrow; i++)
-		for (size_t j = selection.lcol; j < selection.rcol; j++)
-			image->pixels[i][j] =
-			result[i - selection.uprow][j - selection.lcol];
+	for (size_t i = 0; i < rows; i++)
+		memcpy(image_row(image, selection.uprow + i) + selection.lcol,
+			result + i * stride, columns * sizeof(pixel_t));
 
-	free_pixels(result, rows);
+	free_pixels(result);
+	return 1;
 }
 
 /**
- * Performs one rotation to the righ (90 degrees) on the @a selection
+ * Blurs the selection with boxes of @a radii, the pixels being loaded and
+ * the queue run first
 */
-void _rotate_right(image_t *image, image_selection_t selection)
+static int _blur(image_t *image, image_selection_t selection,
+	const size_t *radii, size_t passes)
 {
-	size_t start = selection.uprow;
-	size_t end = selection.dwrow;
-	size_t middle = (start + end) / 2;
+	size_t reach = 0;
+	for (size_t p = 0; p < passes; p++)
+		reach += radii[p];
 
-	/* Sacrifice time for space for large images. For small images, irrelevant. */
-	for (size_t i = start; i < middle; i++) {
-		for (size_t j = i; j < end - i + start; j++)
-			SWAP_ANY(image->pixels[j][i], image->pixels[i][end - j + start - 1],
-				pixel_t);
+	if (!_sync_region(image, selection, reach))
+		return 0;
+	writer_detach(image);
+	pyramid_drop(image);
+	histogram_change(image, selection);
+	stats_pixels((selection.dwrow - selection.uprow)
+		* (selection.rcol - selection.lcol));
 
-		for (size_t j = i + 1; j < end - i + start; j++)
-			SWAP_ANY(image->pixels[end - i + start - 1][j], image->pixels[j][i],
-				pixel_t);
+	return blur_boxes(image, selection, radii, passes);
+}
 
-		for (size_t j = i + 1; j < end - i + start - 1; j++)
-			SWAP_ANY(image->pixels[j][end - i + start - 1],
-				image->pixels[end - i + start - 1][end - j + start - 1],
-				pixel_t);
-	}
+int blur_image(image_t *image, image_selection_t selection, size_t radius)
+{
+	return _blur(image, selection, &radius, 1);
 }
 
-void rotate_selection(image_t *image, image_selection_t selection, int angle)
+int gaussian_blur_image(image_t *image, image_selection_t selection,
+	double sigma)
 {
-	if (angle % FULL_ROTATION == 0)
-		return;
+	size_t radii[BLUR_PASSES];
+
+	blur_gaussian_radii(sigma, radii);
+	return _blur(image, selection, radii, BLUR_PASSES);
+}
+
+int median_image(image_t *image, image_selection_t selection,
+	size_t radius)
+{
+	if (!_sync_region(image, selection, radius))
+		return 0;
+	writer_detach(image);
+	pyramid_drop(image);
+	histogram_change(image, selection);
+	stats_pixels((selection.dwrow - selection.uprow)
+		* (selection.rcol - selection.lcol));
 
+	return median_filter(image, selection, radius);
+}
+
+/**
+ * @return Clockwise quarter turns, 0 to 3, for @a angle
+*/
+static int _quarter_turns(int angle)
+{
 	int rotations = (angle < 0)
 		? FULL_ROTATION + angle % FULL_ROTATION
 		: angle % FULL_ROTATION;
-	rotations /= CYCLE_ROTATION;
 
-	for (int i = 0; i < rotations; i++)
-		_rotate_right(image, selection);
+	return (rotations % FULL_ROTATION) / CYCLE_ROTATION;
 }
 
-void rotate_image(image_t *image, int angle)
+/**
+ * Rotates a square of a packed image: its rows are shifted out, turned by
+ * blocks of words, then shifted back in
+ *
+ * @return 0 if there is no memory for the square
+*/
+static int _rotate_square_bits(image_t *image, image_selection_t selection,
+	int rotations)
 {
-	if (angle % FULL_ROTATION == 0)
+	size_t n = selection.dwrow - selection.uprow;
+	size_t words = bitmap_words(n);
+	uint64_t *square = create_bits(2 * n, words);
+	if (!square)
+		return 0;
+
+	uint64_t *turned = square + n * words;
+	stats_pixels(n * n);
+
+	for (size_t i = 0; i < n; i++)
+		bitmap_extract(square + i * words,
+			image_bits(image, selection.uprow + i), selection.lcol, n);
+
+	bitmap_rotate(turned, words, square, words, n, n, rotations);
+
+	for (size_t i = 0; i < n; i++)
+		bitmap_insert(image_bits(image, selection.uprow + i), selection.lcol,
+			turned + i * words, n);
+	free_bits(square);
+	return 1;
+}
+
+int rotate_selection(image_t *image, image_selection_t selection, int angle)
+{
+	/* The same values, in other places */
+	if (!_sync_region(image, selection, 0))
+		return 0;
+	histogram_settle(image);
+
+	int rotations = _quarter_turns(angle);
+	if (!rotations)
+		return 1;
+
+	writer_detach(image);
+	pyramid_drop(image);
+	if (image->bits)
+		return _rotate_square_bits(image, selection, rotations);
+
+	size_t n = selection.dwrow - selection.uprow;
+	pixel_t *origin = image_row(image, selection.uprow) + selection.lcol;
+	size_t stride = image->stride;
+	stats_pixels(n * n);
+
+	/**
+	 * Every pixel belongs to a cycle of 4 positions, one per quarter turn:
+	 * (i, j), (j, n-1-i), (n-1-i, n-1-j), (n-1-j, i). One pass over the
+	 * cycles starting in the top-left quadrant moves them all, by tiles.
+	*/
+	for (size_t ti = 0; ti < n / 2; ti += ROTATE_TILE)
+		for (size_t tj = 0; tj < (n + 1) / 2; tj += ROTATE_TILE)
+			for (size_t i = ti; i < n / 2 && i < ti + ROTATE_TILE; i++)
+				for (size_t j = tj; j < (n + 1) / 2 && j < tj + ROTATE_TILE;
+					j++) {
+					pixel_t *p0 = origin + i * stride + j;
+					pixel_t *p1 = origin + j * stride + (n - 1 - i);
+					pixel_t *p2 = origin + (n - 1 - i) * stride + (n - 1 - j);
+					pixel_t *p3 = origin + (n - 1 - j) * stride + i;
+					pixel_t tmp = *p0;
+
+					switch (rotations) {
+					case 1:
+						*p0 = *p3;
+						*p3 = *p2;
+						*p2 = *p1;
+						*p1 = tmp;
+						break;
+
+					case 2:
+						*p0 = *p2;
+						*p2 = tmp;
+						SWAP_ANY(*p1, *p3, pixel_t);
+						break;
+
+					case 3:
+						*p0 = *p1;
+						*p1 = *p2;
+						*p2 = *p3;
+						*p3 = tmp;
+						break;
+
+					default:
+						DIE(1, "unexpected case");
+					}
+				}
+	return 1;
+}
+
+typedef struct rotate_job_t {
+	image_t *image;
+	int rotations;
+
+	/* The rotated buffer */
+	pixel_t *result;
+	size_t rows;
+	size_t columns;
+	size_t stride;
+
+	size_t bands;
+} rotate_job_t;
+
+/**
+ * Fills rows [@a lo, @a hi) of the result, one tile at a time so both the
+ * rows read and the columns written stay in cache
+*/
+static void _rotate_tiles(rotate_job_t *job, size_t lo, size_t hi)
+{
+	image_t *image = job->image;
+
+	for (size_t ti = lo; ti < hi; ti += ROTATE_TILE) {
+		size_t ei = (ti + ROTATE_TILE < hi) ? ti + ROTATE_TILE : hi;
+
+		for (size_t tj = 0; tj < job->columns; tj += ROTATE_TILE) {
+			size_t ej = (tj + ROTATE_TILE < job->columns)
+				? tj + ROTATE_TILE : job->columns;
+
+			/* Column j of the tile is (part of) one source row */
+			for (size_t j = tj; j < ej; j++) {
+				pixel_t *dst = job->result + ti * job->stride + j;
+				pixel_t *src;
+
+				if (job->rotations == 1) {
+					src = image_row(image, image->rows - 1 - j);
+					for (size_t i = ti; i < ei; i++, dst += job->stride)
+						*dst = src[i];
+				} else {
+					src = image_row(image, j) + image->columns - 1;
+					for (size_t i = ti; i < ei; i++, dst += job->stride)
+						*dst = *(src - i);
+				}
+			}
+		}
+	}
+}
+
+static void _rotate_band(void *arg, size_t band)
+{
+	rotate_job_t *job = (rotate_job_t *)arg;
+	image_t *image = job->image;
+	size_t lo, hi;
+
+	pool_band(job->rows, job->bands, band, &lo, &hi);
+	if (job->rotations != 2) {
+		_rotate_tiles(job, lo, hi);
 		return;
+	}
 
-	int rotations = (angle < 0)
-		? FULL_ROTATION + angle % FULL_ROTATION
-		: angle % FULL_ROTATION;
-	rotations /= CYCLE_ROTATION;
+	/* Half a turn reverses rows in reverse order */
+	for (size_t i = lo; i < hi; i++) {
+		pixel_t *dst = job->result + i * job->stride;
+		pixel_t *src = image_row(image, image->rows - 1 - i)
+			+ image->columns - 1;
+
+		for (size_t j = 0; j < job->columns; j++)
+			dst[j] = *(src - j);
+	}
+}
+
+int rotate_image(image_t *image, int angle)
+{
+	if (!_sync(image))
+		return 0;
+	histogram_settle(image);
+
+	int rotations = _quarter_turns(angle);
+	if (!rotations)
+		return 1;
 
 	size_t rows = (rotations % 2) ? image->columns : image->rows;
 	size_t columns = (rotations % 2) ? image->rows : image->columns;
 
-	/* Sacrifice space for time out of convenience */
-	pixel_t **result = create_pixels(rows, columns);
+	if (image->bits) {
+		size_t words = bitmap_words(columns);
+		uint64_t *bits = create_bits(rows, words);
+		if (!bits)
+			return 0;
 
-	for (size_t i = 0; i < rows; i++) {
-		for (size_t j = 0; j < columns; j++) {
-			switch (rotations) {
-			case 1:
-				result[i][j] = image->pixels[image->rows - 1 - j][i];
-				break;
+		stats_pixels(rows * columns);
+		bitmap_rotate(bits, words, image->bits, image->words, image->rows,
+			image->columns, rotations);
 
-			case 2:
-				result[i][j] =
-					image->pixels[image->rows - 1 - i][image->columns - 1 - j];
-				break;
+		_release_pixels(image);
+		image->bits = bits;
+		image->words = words;
+		image->rows = rows;
+		image->columns = columns;
+		init_selection(&image->selection, rows, columns);
+		return 1;
+	}
 
-			case 3:
-				result[i][j] = image->pixels[j][image->columns - 1 - i];
-				break;
+	/* Out of place, into a block of the pool */
+	rotate_job_t job = {
+		.image = image,
+		.rotations = rotations,
+		.rows = rows,
+		.columns = columns,
+		.stride = pixel_stride(columns),
+		.bands = pool_split(rows, POOL_GRAIN),
+	};
 
-			default:
-				DIE(1, "unexpected case");
-			}
+	job.result = _result_pixels(rows, job.stride);
+	if (!job.result)
+		return 0;
+	stats_pixels(rows * columns);
+	pool_run(job.bands, _rotate_band, &job);
+
+	_release_pixels(image);
+
+	image->pixels = job.result;
+	image->buffer = job.result;
+	image->stride = job.stride;
+	image->rows = rows;
+	image->columns = columns;
+
+	init_selection(&image->selection, image->rows, image->columns);
+	return 1;
+}
+
+/**
+ * Bilinear and area scaling of a packed image go through levels, black 0
+ * and white PIXEL_MAX_VALUE, packed back into @a packed
+*/
+static int _resize_levels(image_t *packed, image_t *image,
+	resize_filter_t filter)
+{
+	image_t *levels = create_image(image->rows, image->columns, PBM);
+	image_t *scaled = create_image(packed->rows, packed->columns, PBM);
+
+	if (levels && scaled) {
+		_convert_levels(image, levels, 0, image->rows, 0);
+		resample_image(scaled, levels, filter);
+		_convert_levels(packed, scaled, 0, packed->rows, 1);
+	}
+
+	int done = (levels && scaled);
+	free_image(levels);
+	free_image(scaled);
+	return done;
+}
+
+int resize_image(image_t *image, size_t rows, size_t columns,
+	resize_filter_t filter)
+{
+	if (!_sync(image))
+		return 0;
+	if (rows == image->rows && columns == image->columns)
+		return 1;
+
+	histogram_invalidate(image);
+	stats_pixels(rows * columns);
+
+	/* The result, as an image of its own until it replaces the pixels */
+	image_t scaled = {
+		.rows = rows,
+		.columns = columns,
+		.type = image->type,
+	};
+
+	if (image->bits) {
+		scaled.words = bitmap_words(columns);
+		scaled.bits = create_bits(rows, scaled.words);
+		if (!scaled.bits)
+			return 0;
+
+		if (filter == RESIZE_NEAREST) {
+			resample_image(&scaled, image, filter);
+		} else if (!_resize_levels(&scaled, image, filter)) {
+			free_bits(scaled.bits);
+			return 0;
 		}
+	} else {
+		scaled.stride = pixel_stride(columns);
+		scaled.pixels = _result_pixels(rows, scaled.stride);
+		if (!scaled.pixels)
+			return 0;
+
+		/* Downscales read the smallest level of the pyramid they can */
+		const image_t *source = (filter == RESIZE_NEAREST) ? image
+			: pyramid_level(image, rows, columns);
+		resample_image(&scaled, source, filter);
 	}
 
-	free_pixels(image->pixels, image->rows);
+	/* UNDO brings back the pixels as they were. The history may let them
+	 * go before a save is done with them, which then needs a copy. */
+	if (history_keep(image))
+		writer_detach(image);
+	else
+		_release_pixels(image);
 
-	image->pixels = result;
+	image->pixels = scaled.pixels;
+	image->buffer = scaled.pixels;
+	image->stride = scaled.stride;
+	image->bits = scaled.bits;
+	image->words = scaled.words;
+	image->mapping = NULL;
+	image->mapping_size = 0;
 	image->rows = rows;
 	image->columns = columns;
+	init_selection(&image->selection, rows, columns);
+	return 1;
+}
 
-	init_selection(&image->selection, image->rows, image->columns);
+int pack_image(image_t *image)
+{
+	if (image->bits)
+		return 1;
+
+	if (!_sync(image))
+		return 0;
+	writer_detach(image);
+	histogram_invalidate(image);
+	stats_pixels(image->rows * image->columns);
+
+	size_t words = bitmap_words(image->columns);
+	uint64_t *bits = create_bits(image->rows, words);
+	if (!bits)
+		return 0;
+
+	for (size_t i = 0; i < image->rows; i++)
+		bitmap_pack(bits + i * words, image_row(image, i), image->columns);
+
+	/* UNDO brings back the pixels as they were */
+	if (!history_keep(image))
+		_release_pixels(image);
+
+	image->pixels = NULL;
+	image->buffer = NULL;
+	image->stride = 0;
+	image->mapping = NULL;
+	image->mapping_size = 0;
+	image->bits = bits;
+	image->words = words;
+	return 1;
+}
+
+int morph_image(image_t *image, image_selection_t selection, morph_op_t op,
+	size_t radius)
+{
+	writer_detach(image);
+	stats_pixels((selection.dwrow - selection.uprow)
+		* (selection.rcol - selection.lcol));
+	return bitmap_morph(image, selection, op, radius);
 }
@@ -1,14 +1,35 @@
 #ifndef __IMAGE_H
 #define __IMAGE_H	1
 
+#include <stdint.h>
 #include <stdio.h>
 
 #include "utils.h"
 
 #define COLOR_RANGE				3
-#define KERNEL_SIZE				3
+/* Largest side of a convolution kernel, and largest value in one */
+#define KERNEL_MAX_SIZE			15
+#define KERNEL_MAX_VALUE		32767
+/* Largest radius of the square ERODE, DILATE, OPEN and CLOSE work with */
+#define MORPH_MAX_RADIUS		255
+/* Largest radius of BLUR and sigma of GAUSSIAN_BLUR, box sums of 8-bit
+ * values with 8 fractional bits staying in 32 bits */
+#define BLUR_MAX_RADIUS			32767
+#define BLUR_MAX_SIGMA			16384.0
+/* Largest radius of MEDIAN, the counts of its square staying in 16 bits */
+#define MEDIAN_MAX_RADIUS		127
+/* Largest side RESIZE makes */
+#define RESIZE_MAX_SIDE			65536
+/* Largest pixel buffer an image file may ask for, 64 GB */
+#define IMAGE_MAX_BYTES			((size_t)1 << 36)
 #define TYPE_FROM_CHR(chr)		((image_type_t)((((chr) - '1') % 3)))
 #define PIXEL_MAX_VALUE			255
+/* Buffers start on a cache line; 64-pixel strides keep every row on one */
+#define PIXEL_ALIGNMENT			64
+#define STRIDE_ALIGNMENT		64
+
+#define IMAGE_PIXEL(image, row, col)									\
+	((image)->pixels[(row) * (image)->stride + (col)])
 
 #ifdef __cplusplus
 extern "C" {
@@ -25,6 +46,38 @@ typedef union pixel_t {
 	unsigned char rgb[COLOR_RANGE];		/* RGB values		*/
 } pixel_t;
 
+/* What EQUALIZE evens out on colour images, greyscale ones have one value */
+typedef enum equalise_mode_t {
+	EQUALISE_LUMA,						/* brightness only	*/
+	EQUALISE_CHANNELS					/* each on its own	*/
+} equalise_mode_t;
+
+/* What ERODE, DILATE, OPEN and CLOSE do to the black pixels */
+typedef enum morph_op_t {
+	MORPH_ERODE,						/* shrink				*/
+	MORPH_DILATE,						/* grow					*/
+	MORPH_OPEN,							/* drop specks			*/
+	MORPH_CLOSE							/* fill holes			*/
+} morph_op_t;
+
+/* What RESIZE makes a pixel of */
+typedef enum resize_filter_t {
+	RESIZE_NEAREST,						/* the closest one		*/
+	RESIZE_BILINEAR,					/* the 2x2 around it	*/
+	RESIZE_AREA							/* all those it covers	*/
+} resize_filter_t;
+
+/**
+ * A convolution kernel of odd sides, centred on the pixel it computes.
+ * Values are read row by row.
+*/
+typedef struct kernel_t {
+	size_t rows;
+	size_t columns;
+	int values[KERNEL_MAX_SIZE][KERNEL_MAX_SIZE];
+	double divide;
+} kernel_t;
+
 typedef struct image_selection_t {
 	unsigned long uprow;				/* first row		*/
 	unsigned long dwrow;				/* last row			*/
@@ -37,8 +90,39 @@ typedef struct image_t {
 	unsigned long rows;
 	unsigned long columns;
 
-	/* The pixel matrix */
-	pixel_t **pixels;
+	/* The pixels, rows @a stride pixels apart. After a CROP they can be a
+	 * window of @a buffer, the aligned block they were allocated in. */
+	pixel_t *pixels;
+	size_t stride;
+	pixel_t *buffer;
+
+	/* Black and white images are held as rows of bits instead, @a words
+	 * apart, and @a pixels is NULL. Bits past the last pixel are clear. */
+	uint64_t *bits;
+	size_t words;
+
+	/* Set when the pixels lie in a private mapping of the loaded file */
+	void *mapping;
+	size_t mapping_size;
+
+	/* Deferred pixel operations, run before the pixels are next read */
+	struct pipeline_t *pending;
+
+	/* Set while the pixels are only read from the file when needed */
+	struct stream_t *source;
+
+	/* Set while parts of the pixels are only decoded from the mapped file
+	 * once read, a tile at a time */
+	struct tiles_t *tiles;
+
+	/* Cached histogram, kept up to date as the pixels change */
+	struct histogram_t *histogram;
+
+	/* Smaller copies of the pixels, dropped as they change */
+	struct pyramid_t *pyramid;
+
+	/* What UNDO and REDO step through */
+	struct history_t *history;
 
 	/* Other useful information */
 	image_type_t type;
@@ -46,42 +130,148 @@ typedef struct image_t {
 } image_t;
 
 /**
- * Image and pixels creation
+ * @return The first pixel of row @a row
 */
-pixel_t **create_pixels(size_t rows, size_t columns);
+static inline pixel_t *image_row(const image_t *image, size_t row)
+{
+	return image->pixels + row * image->stride;
+}
+
+/**
+ * @return The first word of row @a row of a packed image
+*/
+static inline uint64_t *image_bits(const image_t *image, size_t row)
+{
+	return image->bits + row * image->words;
+}
+
+/**
+ * @return The brightness of a colour pixel, BT.601 weights out of 256
+*/
+static inline unsigned char pixel_luma(const pixel_t *pixel)
+{
+	return (unsigned char)((77 * pixel->rgb[0] + 150 * pixel->rgb[1]
+		+ 29 * pixel->rgb[2] + 128) >> 8);
+}
+
+/**
+ * Image and pixels creation. Pixels, bits and images come back NULL when
+ * their size does not fit in a size_t.
+*/
+size_t pixel_stride(size_t columns);
+pixel_t *create_pixels(size_t rows, size_t stride);
+void free_pixels(pixel_t *pixels);
 image_t *create_image(size_t rows, size_t columns, image_type_t type);
+image_t *create_mapped_image(void *mapping, size_t mapping_size,
+	pixel_t *pixels, size_t rows, size_t columns, image_type_t type);
 void free_image(image_t *image);
+void swap_pixels(image_t *image, image_t *other);
+
+/**
+ * @return If a file may describe an image of @a rows x @a columns: neither
+ * is zero and its pixels take at most IMAGE_MAX_BYTES
+*/
+int image_fits(size_t rows, size_t columns);
+
+/**
+ * @return An image of its own with the pixels (or bits) and the selection
+ * of @a image, which has nothing left to run, stream or decode, or NULL
+*/
+image_t *copy_image(const image_t *image);
+
+/**
+ * Black and white images, packed 64 pixels to a word
+*/
+uint64_t *create_bits(size_t rows, size_t words);
+void free_bits(uint64_t *bits);
+image_t *create_bilevel_image(size_t rows, size_t columns);
+
+/**
+ * Packs an 8-bit PBM image
+ *
+ * @return 0, the image being left as it was, if there is no memory for it
+*/
+int pack_image(image_t *image);
 
 /**
- * Read and write for pixel matrices
+ * Read and write for pixel matrices. print_pixels gives 0 when there was no
+ * memory to read the bands of a streamed image, only part of it written.
 */
 void read_pixels(FILE *in_file, image_t *image, int binary);
-void print_pixels(FILE *out_file, image_t *image, int binary);
+void print_header(FILE *out_file, image_t *image, int binary);
+int print_pixels(FILE *out_file, image_t *image, int binary);
+void write_pixels(FILE *out_file, image_t *image, int binary);
 
 /**
- * Selection operations
+ * Selection operations. The ones that return an int give 0, the image being
+ * left as it was, when there is no memory for the pixels they need.
 */
 void update_selection(image_selection_t *selection,
 	size_t up_row, size_t dw_row,
 	size_t l_col, size_t r_col);
-void crop_image(image_t *image, image_selection_t selection);
+int crop_image(image_t *image, image_selection_t selection);
+
+/**
+ * Image histogram and equalisation. They give 0, nothing being changed or
+ * printed, when there is no memory to read the pixels of a streamed image.
+*/
+int image_histogram(image_t *image, unsigned long fq[PIXEL_MAX_VALUE + 1]);
+int print_histogram(FILE *out, image_t *image, size_t max_stars,
+	size_t bins);
+int equalise_table(image_t *image, image_selection_t selection,
+	unsigned char lut[PIXEL_MAX_VALUE + 1]);
+int equalise_image(image_t *image, image_selection_t selection,
+	equalise_mode_t mode);
+
+/**
+ * Applies an effect using a given image kernel and its division factor
+ *
+ * @return 0 if there is no memory for its result, the pixels being as
+ * they were
+*/
+int apply_effect(image_t *image, image_selection_t selection,
+	const kernel_t *kernel);
+
+/**
+ * Blurs of greyscale and colour images, with a square of side
+ * 2 * @a radius + 1 or a Gaussian of standard deviation @a sigma. Their
+ * cost does not depend on the size. 0 when there is no memory for them.
+*/
+int blur_image(image_t *image, image_selection_t selection, size_t radius);
+int gaussian_blur_image(image_t *image, image_selection_t selection,
+	double sigma);
+
+/**
+ * Median of greyscale and colour images, channel by channel, over a square
+ * of side 2 * @a radius + 1. Its cost does not depend on the size. 0 when
+ * there is no memory for it.
+*/
+int median_image(image_t *image, image_selection_t selection,
+	size_t radius);
 
 /**
- * Image histogram
+ * Morphology on packed images, with a square of side 2 * @a radius + 1
+ *
+ * @return 0 as bitmap_morph does
 */
-void print_histogram(image_t *image, size_t max_stars, size_t bins);
+int morph_image(image_t *image, image_selection_t selection, morph_op_t op,
+	size_t radius);
 
 /**
- * Applies an effect using a given image kernel and division factor
+ * Rotations. Turning the whole image takes a buffer for the result, and a
+ * square of a packed one a copy of it: 0 if there is none to be had, the
+ * image being left as it was.
 */
-void apply_effect(image_t *image, image_selection_t selection,
-	DEF_KERNEL(kernel), double divide);
+int rotate_selection(image_t *image, image_selection_t selection, int angle);
+int rotate_image(image_t *image, int angle);
 
 /**
- * Rotations
+ * Scales the whole image to @a rows x @a columns
+ *
+ * @return 0, the image being left as it was, if there is no memory for it
 */
-void rotate_selection(image_t *image, image_selection_t selection, int angle);
-void rotate_image(image_t *image, int angle);
+int resize_image(image_t *image, size_t rows, size_t columns,
+	resize_filter_t filter);
 
 #ifdef __cplusplus
 }
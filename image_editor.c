@@ -1,29 +1,162 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
 
 #include "image.h"
+#include "alloc.h"
+#include "batch.h"
+#include "cache.h"
+#include "history.h"
+#include "imt.h"
+#include "netpbm.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "server.h"
+#include "stats.h"
+#include "stream.h"
+#include "thread_pool.h"
+#include "tiles.h"
 #include "utils.h"
+#include "writer.h"
 
 #define BUFSIZ					8192
 
+/* Pixel operations are queued and run together (-d) */
+static int deferred;
+/* Images are read from their file a band at a time, when needed (-s) */
+static int streamed;
+
+/**
+ * A kernel APPLY knows by name
+*/
+typedef struct named_kernel_t {
+	char *name;
+	kernel_t kernel;
+} named_kernel_t;
+
+static const named_kernel_t builtin_kernels[] = {
+	{ "BLUR", { 3, 3, { { 1, 1, 1 }, { 1, 1, 1 }, { 1, 1, 1 } }, 9.0 } },
+	{ "GAUSSIAN_BLUR", { 3, 3, { { 1, 2, 1 }, { 2, 4, 2 }, { 1, 2, 1 } },
+		16.0 } },
+	{ "SHARPEN", { 3, 3, { { 0, -1, 0 }, { -1, 5, -1 }, { 0, -1, 0 } },
+		1.0 } },
+	{ "EDGE", { 3, 3, { { -1, -1, -1 }, { -1, 8, -1 }, { -1, -1, -1 } },
+		1.0 } },
+};
+
+/**
+ * What commands work on: the command loop has one, a batch worker one per
+ * file, the server one per name
+*/
+typedef struct session_t {
+	image_t *image;
+	FILE *out;							/* replies				*/
+	int failed;							/* a reply was an error	*/
+
+	/* Kernels defined by KERNEL, found before the built-in ones */
+	named_kernel_t *kernels;
+	size_t kernel_count, kernel_capacity;
+} session_t;
+
+static void _vreply(session_t *session, const char *format, va_list args)
+{
+	vfprintf(session->out, format, args);
+	fputc('\n', session->out);
+}
+
+/**
+ * Writes the line answering a command
+*/
+static void _reply(session_t *session, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	_vreply(session, format, args);
+	va_end(args);
+}
+
+/**
+ * Writes the line answering a command that could not be run
+*/
+static void _fail(session_t *session, const char *format, ...)
+{
+	va_list args;
+
+	session->failed = 1;
+	va_start(args, format);
+	_vreply(session, format, args);
+	va_end(args);
+}
+
+/**
+ * Answers a command that found no memory for its pixels, forgetting the
+ * step of the history it @a recorded
+*/
+static void _no_memory(session_t *session, int recorded)
+{
+	if (recorded)
+		history_cancel(session->image);
+	_fail(session, "Not enough memory");
+}
+
+/**
+ * Reads a streamed image whole, for the commands that cannot stream it
+ *
+ * @return 0, the client being told, if there is no memory for it
+*/
+static int _load_stream(session_t *session)
+{
+	if (!session->image->source || stream_load(session->image))
+		return 1;
+
+	_no_memory(session, 0);
+	return 0;
+}
+
 /**
  * Reads an image from a file
 */
-void read_image(image_t **image, char command_line[BUFSIZ])
+void read_image(session_t *session, char command_line[BUFSIZ])
 {
+	image_t **image = &session->image;
+
 	char args[2][BUFSIZ];
 	if (sscanf(command_line, "%s%s", args[0], args[1]) != 2) {
-		printf("%s\n", "Invalid command");
+		_fail(session, "Invalid command");
 		return;
 	}
 
 	free_image(*image);
 	*image = NULL;
 
+	/* A file saved by an earlier command may not be written yet */
+	writer_wait(args[1]);
+
+	if (streamed) {
+		*image = stream_open(args[1]);
+		if (*image) {
+			_reply(session, "Loaded %s", args[1]);
+			return;
+		}
+	}
+
+	/* Binary images are mapped, the rest go through the stream reader,
+	 * unless the cache holds them decoded */
+	*image = cache_load(args[1]);
+	if (*image) {
+		_reply(session, "Loaded %s", args[1]);
+		return;
+	}
+
 	FILE *in_file = fopen(args[1], "rb");
 	if (!in_file) {
-		printf("Failed to load %s\n", args[1]);
+		_fail(session, "Failed to load %s", args[1]);
 		return;
 	}
 
@@ -37,48 +170,89 @@ void read_image(image_t **image, char command_line[BUFSIZ])
 	 *
 	*/
 	char magic_word[4];
-	fgets(magic_word, 4, in_file);
+	if (!fgets(magic_word, 4, in_file) || magic_word[0] != 'P'
+		|| magic_word[1] < '1' || magic_word[1] > '6') {
+		/* Not a Netpbm file, or a tiled one whose index is not valid */
+		fclose(in_file);
+		_fail(session, "Failed to load %s", args[1]);
+		return;
+	}
 
-	char line[BUFSIZ];
-	while (fgets(line, BUFSIZ, in_file)) {
+	/* PBM has no maximum value, its pixels follow the dimensions */
+	image_type_t type = TYPE_FROM_CHR(magic_word[1]);
+	int rows = 0, columns = 0, max_value = (type == PBM) ? 1 : 0;
+	int complete = 0;
+
+	char line[BUFSIZ], extra;
+	while (!complete && fgets(line, BUFSIZ, in_file)) {
 		if (line[0] == '#')
 			continue;
-		if (strncmp(line, "255", 3) == 0)
+		/* Digits and whitespace only, so that "150+97" is not two numbers */
+		if (line[strspn(line, "0123456789 \t\r\n")] != '\0')
+			break;
+
+		if (!rows) {
+			if (sscanf(line, "%9d %9d %c", &columns, &rows, &extra) != 2
+				|| columns <= 0 || rows <= 0 || !image_fits(rows, columns))
+				break;
+			complete = max_value;
+		} else {
+			complete = sscanf(line, "%d %c", &max_value, &extra) == 1
+				&& max_value == PIXEL_MAX_VALUE;
 			break;
+		}
+	}
 
-		int rows, columns;
-		sscanf(line, "%d%d", &columns, &rows);
+	if (complete)
+		*image = create_image(rows, columns, type);
 
-		*image = create_image(rows, columns, TYPE_FROM_CHR(magic_word[1]));
+	if (!*image) {
+		fclose(in_file);
+		_fail(session, "Failed to load %s", args[1]);
+		return;
 	}
 
 	read_pixels(in_file, *image, magic_word[1] > '3');
 	fclose(in_file);
 
-	printf("Loaded %s\n", args[1]);
+	_reply(session, "Loaded %s", args[1]);
+}
+
+/**
+ * @return If @a path ends with IMT_EXTENSION
+*/
+static int _tiled_path(const char *path)
+{
+	size_t length = strlen(path), extension = strlen(IMT_EXTENSION);
+
+	return length > extension
+		&& strcmp(path + length - extension, IMT_EXTENSION) == 0;
 }
 
 /**
- * Saves an image to a file
+ * Saves an image to a file: SAVE path [ascii | tiled], the native tiled
+ * format being written for IMT_EXTENSION as well
 */
-void save_image(char command_line[BUFSIZ], image_t *image)
+void save_image(session_t *session, char command_line[BUFSIZ])
 {
 	char args[3][BUFSIZ];
 	int read = sscanf(command_line, "%s%s%s",
 		args[0], args[1], args[2]);
 	if (read < 2 || read > 3) {
-		puts("Invalid command");
+		_fail(session, "Invalid command");
 		return;
 	}
 
-	int binary = (read == 2);
-	FILE *out_file = fopen(args[1], (binary) ? "wb" : "wt");
-	DIE(!out_file, "fopen failed");
-
-	print_pixels(out_file, image, binary);
-	fclose(out_file);
+	/* Written in the background, a failure from then on is told later */
+	int tiled = (read == 2) ? _tiled_path(args[1])
+		: strcmp(args[2], "tiled") == 0;
+	int binary = (read == 2 || tiled);
+	if (!writer_save(session->image, args[1], binary, tiled, session)) {
+		_fail(session, "Failed to save %s: %s", args[1], strerror(errno));
+		return;
+	}
 
-	printf("Saved %s\n", args[1]);
+	_reply(session, "Saved %s", args[1]);
 }
 
 /**
@@ -93,31 +267,33 @@ static inline int _valid_coordinate(long coord,
 /**
  * Selects a given range
 */
-void select_range(image_t *image, char command_line[BUFSIZ])
+void select_range(session_t *session, char command_line[BUFSIZ])
 {
+	image_t *image = session->image;
+
 	char args[2][BUFSIZ];
 	int ret = sscanf(command_line, "%s%s", args[0], args[1]);
 	if (ret <= 1) {
-		puts("Invalid command");
+		_fail(session, "Invalid command");
 		return;
 	}
 
 	if (strcmp(args[1], "ALL") == 0) {
 		update_selection(&image->selection, 0, image->rows, 0, image->columns);
-		puts("Selected ALL");
+		_reply(session, "Selected ALL");
 		return;
 	}
 
 	int coord[4];
 	if (sscanf(command_line, "%s%d%d%d%d",
 		args[0], &coord[0], &coord[2], &coord[1], &coord[3]) != 5) {
-		puts("Invalid command");
+		_fail(session, "Invalid command");
 		return;
 	}
 
 	/* Validate and put coordinates in place */
 	if (coord[0] == coord[1] || coord[2] == coord[3]) {
-		puts("Invalid set of coordinates");
+		_fail(session, "Invalid set of coordinates");
 		return;
 	}
 
@@ -125,7 +301,7 @@ void select_range(image_t *image, char command_line[BUFSIZ])
 	for (size_t i = 0; i < size; i++)
 		if (!_valid_coordinate(coord[i], 0, image->columns) ||
 			!_valid_coordinate(coord[i + size], 0, image->rows)) {
-			puts("Invalid set of coordinates");
+			_fail(session, "Invalid set of coordinates");
 			return;
 		}
 
@@ -136,103 +312,358 @@ void select_range(image_t *image, char command_line[BUFSIZ])
 
 	update_selection(&image->selection,
 		coord[2], coord[3], coord[0], coord[1]);
-	printf("Selected %d %d %d %d\n",
+	_reply(session, "Selected %d %d %d %d",
 		coord[0], coord[2], coord[1], coord[3]);
 }
 
 /**
- * Equalises the image histogram
+ * Auxillary that calls equalise_image from image.h
 */
-void equalise_image(image_t *image)
+void _equalise_image(session_t *session, char command_line[BUFSIZ])
 {
-	if (image->type != PGM) {
-		puts("Black and white image needed");
+	image_t *image = session->image;
+
+	char args[3][BUFSIZ];
+	int read = sscanf(command_line, "%s%s%s", args[0], args[1], args[2]);
+	if (read > 2) {
+		_fail(session, "Invalid command");
 		return;
 	}
 
-	int fq[PIXEL_MAX_VALUE + 1] = { 0 };
-	int hgram[PIXEL_MAX_VALUE + 1];
-
-	/* Generate histogram frequencies */
-	for (size_t i = 0; i < image->rows; i++)
-		for (size_t j = 0; j < image->columns; j++)
-			fq[(int)image->pixels[i][j].val]++;
+	/* Colour images are equalised by luma unless asked otherwise */
+	equalise_mode_t mode = EQUALISE_LUMA;
+	if (read == 2 && strcmp(args[1], "CHANNELS") == 0) {
+		mode = EQUALISE_CHANNELS;
+	} else if (read == 2 && strcmp(args[1], "LUMA") != 0) {
+		_fail(session, "EQUALIZE parameter invalid");
+		return;
+	}
 
-	hgram[0] = fq[0];
-	for (size_t i = 1; i < ARRAY_SIZE(fq); i++)
-		hgram[i] = hgram[i - 1] + fq[i];
+	if (image->type == PBM) {
+		_fail(session, "Black and white image needed");
+		return;
+	}
 
-	double area = image->rows * image->columns;
+	/* Streamed colour images are read whole first, a pass only counting
+	 * one value of their pixels */
+	if (image->type == PPM && !_load_stream(session))
+		return;
 
-	/* Equalise with formula (PIXEL_MAX * freq) / surface area of image */
-	for (size_t i = 0; i < image->rows; i++)
-		for (size_t j = 0; j < image->columns; j++) {
-			double freq = hgram[(int)image->pixels[i][j].val];
-			image->pixels[i][j].val = _clamp((PIXEL_MAX_VALUE * freq) / area,
-				0, PIXEL_MAX_VALUE);
-		}
+	int recorded = history_region(image, image->selection);
+	int done = (deferred && !image->source)
+		? pipeline_equalise(image, image->selection, mode)
+		: equalise_image(image, image->selection, mode);
+	if (!done) {
+		_no_memory(session, recorded);
+		return;
+	}
 
-	puts("Equalize done");
+	_reply(session, "Equalize done");
 }
 
 /**
  * Auxillary that calls print_histogram from image.h
 */
-void _print_histogram(image_t *image, char command_line[BUFSIZ])
+void _print_histogram(session_t *session, char command_line[BUFSIZ])
 {
 	char args[4][BUFSIZ];
 	if (sscanf(command_line, "%s%s%s%s",
 		args[0], args[1], args[2], args[3]) != 3) {
-		puts("Invalid command");
+		_fail(session, "Invalid command");
 		return;
 	}
 
-	if (image->type != PGM) {
-		puts("Black and white image needed");
+	if (session->image->type != PGM) {
+		_fail(session, "Black and white image needed");
 		return;
 	}
 
 	int stars = atoi(args[1]);
 	int bins = atoi(args[2]);
 
-	print_histogram(image, stars, bins);
+	if (!print_histogram(session->out, session->image, stars, bins))
+		_no_memory(session, 0);
+}
+
+/**
+ * @return The kernel called @a name, or NULL
+*/
+static const kernel_t *_find_kernel(session_t *session, const char *name)
+{
+	for (size_t i = 0; i < session->kernel_count; i++)
+		if (strcmp(session->kernels[i].name, name) == 0)
+			return &session->kernels[i].kernel;
+
+	for (size_t i = 0; i < ARRAY_SIZE(builtin_kernels); i++)
+		if (strcmp(builtin_kernels[i].name, name) == 0)
+			return &builtin_kernels[i].kernel;
+
+	return NULL;
+}
+
+/**
+ * Defines a kernel for APPLY: KERNEL name rows columns divisor, then the
+ * values row by row. Defining a name again replaces its kernel.
+*/
+void define_kernel(session_t *session, char command_line[BUFSIZ])
+{
+	char args[2][BUFSIZ];
+	int rows, columns, used;
+	double divide;
+	if (sscanf(command_line, "%s%s%d%d%lf%n", args[0], args[1],
+		&rows, &columns, &divide, &used) != 5) {
+		_fail(session, "Invalid command");
+		return;
+	}
+
+	/* Odd sides, so that the kernel has a centre */
+	if (rows <= 0 || rows > KERNEL_MAX_SIZE || rows % 2 == 0
+		|| columns <= 0 || columns > KERNEL_MAX_SIZE || columns % 2 == 0
+		|| divide == 0.0 || !isfinite(divide)) {
+		_fail(session, "Invalid kernel");
+		return;
+	}
+
+	kernel_t kernel = {
+		.rows = (size_t)rows,
+		.columns = (size_t)columns,
+		.divide = divide,
+	};
+
+	const char *values = command_line + used;
+	for (int i = 0; i < rows; i++)
+		for (int j = 0; j < columns; j++) {
+			int *value = &kernel.values[i][j];
+
+			if (sscanf(values, "%d%n", value, &used) != 1
+				|| abs(*value) > KERNEL_MAX_VALUE) {
+				_fail(session, "Invalid kernel");
+				return;
+			}
+			values += used;
+		}
+
+	if (sscanf(values, "%s", args[0]) == 1) {
+		_fail(session, "Invalid kernel");
+		return;
+	}
+
+	named_kernel_t *named = NULL;
+	for (size_t i = 0; i < session->kernel_count && !named; i++)
+		if (strcmp(session->kernels[i].name, args[1]) == 0)
+			named = &session->kernels[i];
+
+	if (!named) {
+		if (session->kernel_count == session->kernel_capacity) {
+			session->kernel_capacity = (session->kernel_capacity)
+				? 2 * session->kernel_capacity : 8;
+			session->kernels = (named_kernel_t *)realloc(session->kernels,
+				session->kernel_capacity * sizeof(named_kernel_t));
+			DIE(!session->kernels, "realloc failed");
+		}
+
+		named = &session->kernels[session->kernel_count++];
+		named->name = strdup(args[1]);
+		DIE(!named->name, "strdup failed");
+	}
+
+	named->kernel = kernel;
+	_reply(session, "Kernel %s defined", args[1]);
+}
+
+/**
+ * Applies a kernel on the selection now, or queues it in deferred mode
+ *
+ * @return 0 if there was no memory to apply it, nothing being recorded
+*/
+static int _run_effect(image_t *image, const kernel_t *kernel)
+{
+	/* Packed images are unpacked only around the selection, right away */
+	int recorded = history_region(image, image->selection);
+	int done = (deferred && !image->source && !image->bits)
+		? pipeline_apply(image, image->selection, kernel)
+		: apply_effect(image, image->selection, kernel);
+
+	if (!done && recorded)
+		history_cancel(image);
+	return done;
 }
 
 /**
  * Auxillary that calls apply_effect from image.h
 */
-void _apply_effect(image_t *image, char command_line[BUFSIZ])
+void _apply_effect(session_t *session, char command_line[BUFSIZ])
 {
+	image_t *image = session->image;
+
 	char args[2][BUFSIZ];
 	if (sscanf(command_line, "%s%s", args[0], args[1]) != 2) {
-		puts("Invalid command");
+		_fail(session, "Invalid command");
 		return;
 	}
 
 	if (image->type == PGM) {
-		puts("Easy, Charlie Chaplin");
-		return;
-	}
-
-	/* Split into cases for kernel and divide factor creation */
-	if (strcmp(args[1], "BLUR") == 0) {
-		DEF_KERNEL(kernel) = { { 1, 1, 1 }, { 1, 1, 1 }, { 1, 1, 1 } };
-		apply_effect(image, image->selection, kernel, 9.0);
-	} else if (strcmp(args[1], "GAUSSIAN_BLUR") == 0) {
-		DEF_KERNEL(kernel) = { { 1, 2, 1 }, { 2, 4, 2 }, { 1, 2, 1 } };
-		apply_effect(image, image->selection, kernel, 16.0);
-	} else if (strcmp(args[1], "SHARPEN") == 0) {
-		DEF_KERNEL(kernel) = { { 0, -1, 0 }, { -1, 5, -1 }, { 0, -1, 0 } };
-		apply_effect(image, image->selection, kernel, 1.0);
-	} else if (strcmp(args[1], "EDGE") == 0) {
-		DEF_KERNEL(kernel) = { { -1, -1, -1 }, { -1, 8, -1 }, { -1, -1, -1 } };
-		apply_effect(image, image->selection, kernel, 1.0);
+		_fail(session, "Easy, Charlie Chaplin");
+		return;
+	}
+
+	const kernel_t *kernel = _find_kernel(session, args[1]);
+	if (!kernel) {
+		_fail(session, "APPLY parameter invalid");
+		return;
+	}
+
+	if (!_run_effect(image, kernel)) {
+		_no_memory(session, 0);
+		return;
+	}
+
+	_reply(session, "APPLY %s done", args[1]);
+}
+
+/**
+ * Auxillary that calls blur_image or gaussian_blur_image from image.h
+*/
+void _blur_image(session_t *session, char command_line[BUFSIZ], int gaussian)
+{
+	image_t *image = session->image;
+
+	char args[3][BUFSIZ];
+	if (sscanf(command_line, "%s%s%s", args[0], args[1], args[2]) != 2) {
+		_fail(session, "Invalid command");
+		return;
+	}
+
+	/* A radius in pixels, or the standard deviation of the Gaussian */
+	char *end;
+	long radius = 0;
+	double sigma = 0.0;
+	int valid;
+	if (gaussian) {
+		sigma = strtod(args[1], &end);
+		valid = (!*end && sigma > 0.0 && sigma <= BLUR_MAX_SIGMA);
 	} else {
-		puts("APPLY parameter invalid");
+		radius = strtol(args[1], &end, 10);
+		valid = (!*end && radius >= 1 && radius <= BLUR_MAX_RADIUS);
+	}
+
+	if (!valid) {
+		_fail(session, "%s parameter invalid", args[0]);
+		return;
+	}
+
+	if (image->type == PBM) {
+		_fail(session, "PGM or PPM image needed");
+		return;
+	}
+
+	/* Streamed images are read whole first, the boxes reaching far */
+	if (!_load_stream(session))
+		return;
+
+	int recorded = history_region(image, image->selection);
+	int done = (gaussian)
+		? gaussian_blur_image(image, image->selection, sigma)
+		: blur_image(image, image->selection, (size_t)radius);
+	if (!done) {
+		_no_memory(session, recorded);
+		return;
+	}
+
+	_reply(session, "%s done", args[0]);
+}
+
+/**
+ * Auxillary that calls median_image from image.h
+*/
+void _median_image(session_t *session, char command_line[BUFSIZ])
+{
+	image_t *image = session->image;
+
+	char args[3][BUFSIZ];
+	int read = sscanf(command_line, "%s%s%s", args[0], args[1], args[2]);
+	if (read > 2) {
+		_fail(session, "Invalid command");
+		return;
+	}
+
+	/* A 3x3 square unless told otherwise */
+	long radius = 1;
+	if (read == 2) {
+		char *end;
+
+		radius = strtol(args[1], &end, 10);
+		if (*end || radius < 1 || radius > MEDIAN_MAX_RADIUS) {
+			_fail(session, "MEDIAN parameter invalid");
+			return;
+		}
+	}
+
+	if (image->type == PBM) {
+		_fail(session, "PGM or PPM image needed");
+		return;
+	}
+
+	/* Streamed images are read whole first, like for the blurs */
+	if (!_load_stream(session))
+		return;
+
+	int recorded = history_region(image, image->selection);
+	if (!median_image(image, image->selection, (size_t)radius)) {
+		_no_memory(session, recorded);
 		return;
 	}
 
-	printf("APPLY %s done\n", args[1]);
+	_reply(session, "MEDIAN done");
+}
+
+/**
+ * Auxillary that calls morph_image from image.h
+*/
+void _morph_image(session_t *session, char command_line[BUFSIZ],
+	morph_op_t op)
+{
+	image_t *image = session->image;
+
+	char args[3][BUFSIZ];
+	int read = sscanf(command_line, "%s%s%s", args[0], args[1], args[2]);
+	if (read > 2) {
+		_fail(session, "Invalid command");
+		return;
+	}
+
+	/* A 3x3 square unless told otherwise */
+	long radius = 1;
+	if (read == 2) {
+		char *end;
+
+		radius = strtol(args[1], &end, 10);
+		if (*end || radius < 1 || radius > MORPH_MAX_RADIUS) {
+			_fail(session, "%s parameter invalid", args[0]);
+			return;
+		}
+	}
+
+	if (image->type != PBM) {
+		_fail(session, "PBM image needed");
+		return;
+	}
+
+	/* 8-bit PBM are packed first, UNDO bringing their pixels back */
+	int recorded = 0;
+	if (image->bits) {
+		recorded = history_region(image, image->selection);
+	} else if (!pack_image(image)) {
+		_no_memory(session, 0);
+		return;
+	}
+
+	if (!morph_image(image, image->selection, op, (size_t)radius)) {
+		_no_memory(session, recorded);
+		return;
+	}
+
+	_reply(session, "%s done", args[0]);
 }
 
 /**
@@ -266,35 +697,88 @@ static inline int _selected_all(image_t *image, image_selection_t selection)
 /**
  * Auxillary that calls rotate_image or rotate_selection from image.h
 */
-void _rotate_selection(image_t *image, char command_line[BUFSIZ])
+void _rotate_selection(session_t *session, char command_line[BUFSIZ])
 {
+	image_t *image = session->image;
+
 	char args[2][BUFSIZ];
 	if (sscanf(command_line, "%s%s", args[0], args[1]) != 2) {
-		puts("Invalid command");
+		_fail(session, "Invalid command");
 		return;
 	}
 
 	int angle = _valid_angle(args[1]);
 	if (angle == -EXIT_FAILURE) {
-		puts("Unsupported rotation angle");
+		_fail(session, "Unsupported rotation angle");
 		return;
 	}
 
 	/* Check which type of rotation */
 	if (_selected_all(image, image->selection)) {
-		rotate_image(image, angle);
-		printf("Rotated %s\n", args[1]);
+		if (!rotate_image(image, angle)) {
+			_no_memory(session, 0);
+			return;
+		}
+
+		history_rotate(image, image->selection, angle, 1);
+		_reply(session, "Rotated %s", args[1]);
 		return;
 	}
 
 	if (image->selection.dwrow - image->selection.uprow
 		!= image->selection.rcol - image->selection.lcol) {
-		puts("The selection must be square");
+		_fail(session, "The selection must be square");
+		return;
+	}
+
+	if (!rotate_selection(image, image->selection, angle)) {
+		_no_memory(session, 0);
+		return;
+	}
+
+	history_rotate(image, image->selection, angle, 0);
+	_reply(session, "Rotated %s", args[1]);
+}
+
+/**
+ * Auxillary that calls resize_image from image.h
+*/
+void _resize_image(session_t *session, char command_line[BUFSIZ])
+{
+	image_t *image = session->image;
+
+	char args[3][BUFSIZ];
+	int width, height;
+	int read = sscanf(command_line, "%s%d%d%s%s", args[0], &width, &height,
+		args[1], args[2]);
+	if (read < 3 || read > 4) {
+		_fail(session, "Invalid command");
+		return;
+	}
+
+	if (width <= 0 || width > RESIZE_MAX_SIDE
+		|| height <= 0 || height > RESIZE_MAX_SIDE) {
+		_fail(session, "Invalid size");
 		return;
 	}
 
-	rotate_selection(image, image->selection, angle);
-	printf("Rotated %s\n", args[1]);
+	/* Bilinear unless told otherwise */
+	resize_filter_t filter = RESIZE_BILINEAR;
+	if (read == 4 && strcmp(args[1], "NEAREST") == 0) {
+		filter = RESIZE_NEAREST;
+	} else if (read == 4 && strcmp(args[1], "AREA") == 0) {
+		filter = RESIZE_AREA;
+	} else if (read == 4 && strcmp(args[1], "BILINEAR") != 0) {
+		_fail(session, "RESIZE parameter invalid");
+		return;
+	}
+
+	if (!resize_image(image, (size_t)height, (size_t)width, filter)) {
+		_no_memory(session, 0);
+		return;
+	}
+
+	_reply(session, "Resized to %d %d", width, height);
 }
 
 /**
@@ -302,63 +786,323 @@ void _rotate_selection(image_t *image, char command_line[BUFSIZ])
  *
  *	@return EXIT_SUCCESS if the exit command was received
 */
-static int execute_command(char command_line[BUFSIZ], image_t **image)
+static int execute_command(char command_line[BUFSIZ], session_t *session)
 {
 	char command[BUFSIZ];
 	if (sscanf(command_line, "%s", command) != 1) {
-		puts("invalid command");
+		_fail(session, "invalid command");
 		return EXIT_FAILURE;
 	}
 
 	/* Split into cases */
 	if (strcmp(command, "LOAD") == 0) {
-		read_image(image, command_line);
+		read_image(session, command_line);
 		return EXIT_FAILURE;
 	}
 
-	if (!(*image)) {
-		puts("No image loaded");
+	if (strcmp(command, "STATS") == 0) {
+		stats_print(session->out);
+		return EXIT_FAILURE;
+	}
+
+	if (strcmp(command, "KERNEL") == 0) {
+		define_kernel(session, command_line);
+		return EXIT_FAILURE;
+	}
+
+	image_t *image = session->image;
+	if (!image) {
+		_fail(session, "No image loaded");
 		return EXIT_FAILURE;
 	}
 
 	if (strcmp(command, "EXIT") == 0) {
-		free_image(*image);
+		if (writer_join(session, session->out))
+			session->failed = 1;
+		free_image(image);
+		session->image = NULL;
 		return EXIT_SUCCESS;
 	} else if (strcmp(command, "SAVE") == 0) {
-		save_image(command_line, *image);
+		save_image(session, command_line);
 	} else if (strcmp(command, "SELECT") == 0) {
-		select_range(*image, command_line);
+		select_range(session, command_line);
 	} else if (strcmp(command, "CROP") == 0) {
-		if (!_selected_all((*image), (*image)->selection))
-			crop_image(*image, (*image)->selection);
-		puts("Image cropped");
+		if (!_selected_all(image, image->selection)
+			&& !history_crop(image, image->selection))
+			_no_memory(session, 0);
+		else
+			_reply(session, "Image cropped");
 	} else if (strcmp(command, "EQUALIZE") == 0) {
-		equalise_image(*image);
+		_equalise_image(session, command_line);
 	} else if (strcmp(command, "HISTOGRAM") == 0) {
-		_print_histogram(*image, command_line);
+		_print_histogram(session, command_line);
 	} else if (strcmp(command, "APPLY") == 0) {
-		_apply_effect(*image, command_line);
+		_apply_effect(session, command_line);
 	} else if (strcmp(command, "ROTATE") == 0) {
-		_rotate_selection(*image, command_line);
+		_rotate_selection(session, command_line);
+	} else if (strcmp(command, "RESIZE") == 0) {
+		_resize_image(session, command_line);
+	} else if (strcmp(command, "BLUR") == 0) {
+		_blur_image(session, command_line, 0);
+	} else if (strcmp(command, "GAUSSIAN_BLUR") == 0) {
+		_blur_image(session, command_line, 1);
+	} else if (strcmp(command, "MEDIAN") == 0) {
+		_median_image(session, command_line);
+	} else if (strcmp(command, "ERODE") == 0) {
+		_morph_image(session, command_line, MORPH_ERODE);
+	} else if (strcmp(command, "DILATE") == 0) {
+		_morph_image(session, command_line, MORPH_DILATE);
+	} else if (strcmp(command, "OPEN") == 0) {
+		_morph_image(session, command_line, MORPH_OPEN);
+	} else if (strcmp(command, "CLOSE") == 0) {
+		_morph_image(session, command_line, MORPH_CLOSE);
+	} else if (strcmp(command, "UNDO") == 0) {
+		_reply(session, (history_undo(image)) ? "Undo done"
+			: "Nothing to undo");
+	} else if (strcmp(command, "REDO") == 0) {
+		_reply(session, (history_redo(image)) ? "Redo done"
+			: "Nothing to redo");
 	} else {
-		puts("Invalid command");
+		_fail(session, "Invalid command");
 	}
 
 	return EXIT_FAILURE;
 }
 
+/**
+ * Frees the image and the kernels of a session
+*/
+static void _session_clear(session_t *session)
+{
+	free_image(session->image);
+	session->image = NULL;
+
+	for (size_t i = 0; i < session->kernel_count; i++)
+		free(session->kernels[i].name);
+	free(session->kernels);
+	session->kernels = NULL;
+	session->kernel_count = 0;
+	session->kernel_capacity = 0;
+}
+
+/**
+ * The sessions of batch workers, one per file
+*/
+static void *_batch_open(FILE *out)
+{
+	session_t *session = (session_t *)calloc(1, sizeof(session_t));
+	DIE(!session, "calloc failed");
+
+	session->out = out;
+	return session;
+}
+
+static batch_result_t _batch_run(void *arg, char *command_line)
+{
+	session_t *session = (session_t *)arg;
+
+	session->failed = 0;
+	int ret = execute_command(command_line, session);
+	if (writer_report(session, session->out))
+		session->failed = 1;
+
+	if (session->failed)
+		return BATCH_FAILED;
+	return (ret == EXIT_SUCCESS) ? BATCH_EXIT : BATCH_NEXT;
+}
+
+static batch_result_t _batch_close(void *arg)
+{
+	session_t *session = (session_t *)arg;
+	size_t failed = writer_join(session, session->out);
+
+	_session_clear(session);
+	free(session);
+	return (failed) ? BATCH_FAILED : BATCH_EXIT;
+}
+
+static const batch_ops_t batch_ops = {
+	.open = _batch_open,
+	.run = _batch_run,
+	.close = _batch_close,
+};
+
+/**
+ * The sessions of the server, one per name
+*/
+static void *_server_open(void)
+{
+	session_t *session = (session_t *)calloc(1, sizeof(session_t));
+	DIE(!session, "calloc failed");
+
+	return session;
+}
+
+static int _server_run(void *arg, char *command_line, FILE *out)
+{
+	session_t *session = (session_t *)arg;
+
+	session->out = out;
+	session->failed = 0;
+	int ret = execute_command(command_line, session);
+	writer_report(session, out);
+
+	return ret == EXIT_SUCCESS;
+}
+
+static void _server_close(void *arg)
+{
+	session_t *session = (session_t *)arg;
+
+	/* Nobody is left to tell */
+	writer_join(session, stderr);
+	_session_clear(session);
+	free(session);
+}
+
+static const server_ops_t server_ops = {
+	.open = _server_open,
+	.run = _server_run,
+	.close = _server_close,
+};
+
+/**
+ * Runs @a script on the files, directories and @@lists of @a inputs, or on
+ * the files listed on stdin when there are none
+ *
+ * @return The exit status
+*/
+static int _batch(const char *script, char *inputs[], size_t count)
+{
+	batch_t batch = { 0 };
+	int ok = batch_script(&batch, script);
+
+	for (size_t i = 0; ok && i < count; i++)
+		ok = (inputs[i][0] == '@') ? batch_list(&batch, inputs[i] + 1)
+			: batch_add(&batch, inputs[i]);
+	if (ok && !count)
+		ok = batch_list(&batch, "-");
+
+	size_t failed = 0;
+	if (ok)
+		failed = batch_run(&batch, &batch_ops, pool_workers(), stdout);
+
+	batch_free(&batch);
+	return (ok && !failed) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 /**
  * Entry point
+ *
+ * Usage: image_editor [-d] [-s] [-t] [-p] [-j threads] [-u megabytes]
+ *	[-c megabytes] [-l socket | -b script [file | directory | @list]...]
 */
-int main(void)
+int main(int argc, char *argv[])
 {
-	image_t *image = NULL;
+	session_t session = {
+		.out = stdout,
+	};
 	char line_buf[BUFSIZ];
 
+	/* 0 lets the pool read IMAGE_EDITOR_THREADS or count the CPUs */
+	size_t threads = 0;
+	const char *script = NULL;
+	const char *listen_path = NULL;
+	/* Off unless asked for, or for a server */
+	long cache = -1;
+	int opt;
+	while ((opt = getopt(argc, argv, "dstpj:u:b:c:l:")) != -1) {
+		if (opt == 'd') {
+			deferred = 1;
+			continue;
+		}
+
+		if (opt == 's') {
+			streamed = 1;
+			continue;
+		}
+
+		if (opt == 't') {
+			tiles_enable(1);
+			continue;
+		}
+
+		if (opt == 'p') {
+			pyramid_enable(1);
+			continue;
+		}
+
+		/* 0 turns UNDO off */
+		if (opt == 'u' && atol(optarg) >= 0) {
+			history_budget((size_t)atol(optarg) << 20);
+			continue;
+		}
+
+		if (opt == 'b') {
+			script = optarg;
+			continue;
+		}
+
+		if (opt == 'c' && atol(optarg) >= 0) {
+			cache = atol(optarg);
+			continue;
+		}
+
+		if (opt == 'l') {
+			listen_path = optarg;
+			continue;
+		}
+
+		if (opt != 'j' || atoi(optarg) <= 0) {
+			fprintf(stderr, "Usage: %s [-d] [-s] [-t] [-p] [-j threads] "
+				"[-u megabytes] [-c megabytes] [-l socket | -b script "
+				"[file | directory | @list]...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		threads = (size_t)atoi(optarg);
+	}
+
+	pool_init(threads);
+	stats_init();
+	if (cache >= 0)
+		cache_budget((size_t)cache << 20);
+	else if (listen_path)
+		cache_budget(CACHE_BUDGET);
+
+	if (script || listen_path) {
+		int status;
+		if (listen_path)
+			status = (server_run(listen_path, &server_ops, pool_workers()))
+				? EXIT_SUCCESS : EXIT_FAILURE;
+		else
+			status = _batch(script, argv + optind, (size_t)(argc - optind));
+
+		writer_stop();
+		cache_clear();
+		stats_finish();
+		pool_destroy();
+		return status;
+	}
+
 	/* Get the commandline then execute */
-	while (fgets(line_buf, BUFSIZ, stdin))
-		if (!execute_command(line_buf, &image))
+	while (fgets(line_buf, BUFSIZ, stdin)) {
+		stats_command_begin(line_buf);
+		int ret = execute_command(line_buf, &session);
+		writer_report(&session, session.out);
+		alloc_reset();
+		stats_command_end();
+
+		if (!ret)
 			break;
+	}
+
+	writer_join(&session, session.out);
+	_session_clear(&session);
+	writer_stop();
+	cache_clear();
 
+	stats_finish();
+	pool_destroy();
 	return 0;
 }
@@ -0,0 +1,505 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "imt.h"
+#include "alloc.h"
+#include "bitmap.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "tiles.h"
+
+/* Longest run of literals and of repeats a control byte codes */
+#define LITERALS_MAX				128
+#define REPEATS_MIN					3
+#define REPEATS_MAX					(REPEATS_MIN + 127)
+
+typedef struct encode_job_t {
+	const imt_output_t *output;
+	const image_t *rows;
+	size_t count;						/* tiles of the band	*/
+	size_t bands;
+
+	unsigned char **blocks;
+	size_t *sizes;
+} encode_job_t;
+
+typedef struct unpack_job_t {
+	const unsigned char *data;
+	image_t *image;
+	size_t side, across, down;
+	size_t bands;
+} unpack_job_t;
+
+static inline void _put16(unsigned char *bytes, uint16_t value)
+{
+	bytes[0] = (unsigned char)value;
+	bytes[1] = (unsigned char)(value >> 8);
+}
+
+static inline uint16_t _get16(const unsigned char *bytes)
+{
+	return (uint16_t)(bytes[0] | bytes[1] << 8);
+}
+
+static inline void _put64(unsigned char *bytes, uint64_t value)
+{
+	for (int i = 0; i < 8; i++)
+		bytes[i] = (unsigned char)(value >> (8 * i));
+}
+
+static inline uint64_t _get64(const unsigned char *bytes)
+{
+	uint64_t value = 0;
+
+	for (int i = 7; i >= 0; i--)
+		value = value << 8 | bytes[i];
+	return value;
+}
+
+/**
+ * @return The pixels of tile @a index on a side of @a length pixels
+*/
+static inline size_t _side(size_t side, size_t index, size_t length)
+{
+	size_t first = index * side;
+
+	return (first + side < length) ? side : length - first;
+}
+
+static inline size_t _channels(char format)
+{
+	return (format == '6') ? COLOR_RANGE : 1;
+}
+
+/**
+ * @return The bytes coded for a row of @a columns pixels of a tile, packed
+ * rows taking those of a P4 row
+*/
+static inline size_t _row_bytes(int packed, size_t columns)
+{
+	return (packed) ? (columns + 7) / 8 : columns;
+}
+
+/**
+ * Run-length codes the @a count bytes at @a values into @a out: a control
+ * byte below LITERALS_MAX is followed by one more bytes as they are, the
+ * others by a byte repeated REPEATS_MIN less than 128 times the control
+ *
+ * @return The bytes written, at most @a count + @a count / 128 + 1
+*/
+static size_t _code_row(const unsigned char *values, size_t count,
+	unsigned char *out)
+{
+	unsigned char *start = out;
+	size_t i = 0;
+
+	while (i < count) {
+		size_t run = 1;
+		while (i + run < count && run < REPEATS_MAX
+			&& values[i + run] == values[i])
+			run++;
+
+		if (run >= REPEATS_MIN) {
+			*out++ = (unsigned char)(LITERALS_MAX + run - REPEATS_MIN);
+			*out++ = values[i];
+			i += run;
+			continue;
+		}
+
+		/* Up to where REPEATS_MIN equal bytes start */
+		size_t first = i;
+		while (i < count && i - first < LITERALS_MAX
+			&& !(i + 2 < count && values[i] == values[i + 1]
+				&& values[i] == values[i + 2]))
+			i++;
+
+		*out++ = (unsigned char)(i - first - 1);
+		memcpy(out, values + first, i - first);
+		out += i - first;
+	}
+
+	return out - start;
+}
+
+/**
+ * Decodes what _code_row made of @a count bytes into @a values
+ *
+ * @return Where the next row starts, or NULL if the block ends too soon or
+ * codes too many bytes
+*/
+static const unsigned char *_decode_row(const unsigned char *in,
+	const unsigned char *end, unsigned char *values, size_t count)
+{
+	size_t i = 0;
+
+	while (i < count) {
+		if (in == end)
+			return NULL;
+
+		size_t control = *in++;
+		if (control < LITERALS_MAX) {
+			size_t length = control + 1;
+			if (length > count - i || length > (size_t)(end - in))
+				return NULL;
+
+			memcpy(values + i, in, length);
+			in += length;
+			i += length;
+			continue;
+		}
+
+		size_t length = control - LITERALS_MAX + REPEATS_MIN;
+		if (length > count - i || in == end)
+			return NULL;
+
+		memset(values + i, *in++, length);
+		i += length;
+	}
+
+	return in;
+}
+
+/**
+ * Decodes a tile of the format into its pixels. A block cut short leaves
+ * the rest of the tile black, as short Netpbm files do.
+*/
+static void _decode_tile(const unsigned char *data, size_t size,
+	const tiles_tile_t *tile)
+{
+	const unsigned char *entry = data + IMT_HEADER + tile->index * IMT_ENTRY;
+	const unsigned char *in = data + _get64(entry);
+	const unsigned char *end = in + _get64(entry + 8);
+	size_t channels = _channels((char)data[4]);
+	unsigned char deltas[IMT_MAX_SIDE];
+	(void)size;
+
+	for (size_t k = 0; k < channels; k++) {
+		unsigned char above = 0;
+
+		for (size_t i = 0; i < tile->rows; i++) {
+			in = _decode_row(in, end, deltas, tile->columns);
+			if (!in)
+				return;
+
+			pixel_t *row = tile->pixels + i * tile->stride;
+			unsigned char value = above;
+
+			for (size_t j = 0; j < tile->columns; j++) {
+				value = (unsigned char)(value + deltas[j]);
+				row[j].rgb[k] = value;
+			}
+			above = row[0].rgb[k];
+		}
+	}
+}
+
+/**
+ * Decodes a tile of a packed image into its place in @a image, each row
+ * the bytes of a P4 row xored with those of the row above. A block cut
+ * short leaves the rest of the tile white, as short P4 files do.
+*/
+static void _decode_bits(const unsigned char *data, const tiles_tile_t *tile,
+	image_t *image, unsigned char *bytes, uint64_t *bits)
+{
+	const unsigned char *entry = data + IMT_HEADER + tile->index * IMT_ENTRY;
+	const unsigned char *in = data + _get64(entry);
+	const unsigned char *end = in + _get64(entry + 8);
+	size_t count = _row_bytes(1, tile->columns);
+	unsigned char *deltas = bytes + count;
+
+	memset(bytes, 0, count);
+	for (size_t i = 0; i < tile->rows; i++) {
+		in = _decode_row(in, end, deltas, count);
+		if (!in)
+			return;
+
+		for (size_t j = 0; j < count; j++)
+			bytes[j] ^= deltas[j];
+
+		bitmap_load(bits, bytes, tile->columns);
+		bitmap_insert(image_bits(image, tile->top + i), tile->left, bits,
+			tile->columns);
+	}
+}
+
+/**
+ * Decodes the rows of tiles of a band of a packed image a tile at a time,
+ * straight into their place
+*/
+static void _unpack_band(void *arg, size_t band)
+{
+	const unpack_job_t *job = (const unpack_job_t *)arg;
+	image_t *image = job->image;
+	size_t side = job->side, lo, hi;
+
+	unsigned char *bytes = (unsigned char *)alloc_scratch(2
+		* _row_bytes(1, side));
+	uint64_t *bits = (uint64_t *)alloc_scratch(bitmap_words(side)
+		* sizeof(uint64_t));
+
+	pool_band(job->down, job->bands, band, &lo, &hi);
+	for (size_t y = lo; y < hi; y++)
+		for (size_t x = 0; x < job->across; x++) {
+			tiles_tile_t tile = {
+				.index = y * job->across + x,
+				.top = y * side,
+				.left = x * side,
+				.rows = _side(side, y, image->rows),
+				.columns = _side(side, x, image->columns),
+				.width = image->columns,
+			};
+
+			/* Tiles of a row share words, hence one band per row */
+			_decode_bits(job->data, &tile, image, bytes, bits);
+		}
+}
+
+int imt_detect(const unsigned char *data, size_t size)
+{
+	return size >= IMT_HEADER && memcmp(data, IMT_MAGIC, 4) == 0;
+}
+
+image_t *imt_map(unsigned char *data, size_t size)
+{
+	char format = (char)data[4];
+	int packed = data[5];
+	size_t side = _get16(data + 6);
+	uint64_t columns = _get64(data + 8), rows = _get64(data + 16);
+	size_t channels = _channels(format);
+
+	/* Dimensions a Netpbm header could not give are not valid either */
+	int valid = format >= '4' && format <= '6' && packed <= (format == '4')
+		&& side && side <= IMT_MAX_SIDE && image_fits(rows, columns);
+
+	size_t across = (valid) ? (columns + side - 1) / side : 0;
+	size_t down = (valid) ? (rows + side - 1) / side : 0;
+	valid = valid && (!across || down <= (size - IMT_HEADER)
+		/ IMT_ENTRY / across);
+
+	/**
+	 * Blocks follow the index in order, each at least as long as its
+	 * rows coded as runs: a small file cannot claim a huge image
+	*/
+	uint64_t next = IMT_HEADER + (uint64_t)across * down * IMT_ENTRY;
+	for (size_t t = 0; valid && t < across * down; t++) {
+		const unsigned char *entry = data + IMT_HEADER + t * IMT_ENTRY;
+		uint64_t offset = _get64(entry), bytes = _get64(entry + 8);
+		size_t width = _row_bytes(packed, _side(side, t % across, columns));
+
+		valid = offset >= next && offset <= size && bytes <= size - offset
+			&& bytes >= channels * _side(side, t / across, rows) * 2
+				* ((width + REPEATS_MAX - 1) / REPEATS_MAX);
+		next = offset + bytes;
+	}
+
+	if (!valid) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	if (!packed)
+		return tiles_open(data, size, 0, rows, columns,
+			TYPE_FROM_CHR(format), side, _decode_tile);
+
+	image_t *image = create_bilevel_image(rows, columns);
+	if (!image) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	unpack_job_t job = {
+		.data = data,
+		.image = image,
+		.side = side,
+		.across = across,
+		.down = down,
+		.bands = pool_split(down, 1),
+	};
+	stats_pixels(rows * columns);
+
+	pool_run(job.bands, _unpack_band, &job);
+	munmap(data, size);
+	return image;
+}
+
+void imt_begin(imt_output_t *output, FILE *file, const image_t *image)
+{
+	unsigned char header[IMT_HEADER];
+
+	output->file = file;
+	output->rows = image->rows;
+	output->columns = image->columns;
+	output->side = TILES_SIDE;
+	output->across = (image->columns + TILES_SIDE - 1) / TILES_SIDE;
+	output->packed = (image->bits != NULL);
+	output->written = 0;
+
+	size_t count = output->across
+		* ((image->rows + TILES_SIDE - 1) / TILES_SIDE);
+	output->index = (unsigned char *)calloc(count + 1, IMT_ENTRY);
+	DIE(!output->index, "calloc failed");
+	output->offset = IMT_HEADER + count * IMT_ENTRY;
+
+	memcpy(header, IMT_MAGIC, 4);
+	header[4] = (unsigned char)((image->bits) ? '4' : '4' + image->type);
+	header[5] = (unsigned char)output->packed;
+	_put16(header + 6, (uint16_t)output->side);
+	_put64(header + 8, image->columns);
+	_put64(header + 16, image->rows);
+
+	fwrite(header, 1, IMT_HEADER, file);
+	fwrite(output->index, IMT_ENTRY, count, file);
+}
+
+/**
+ * Codes a tile of a packed image, whose top left pixel is (@a top, @a left)
+ * in @a rows, each row as the bytes of a P4 row xored with those of the
+ * row above
+ *
+ * @return Where the block ends
+*/
+static unsigned char *_encode_bits(const image_t *rows, size_t top,
+	size_t left, size_t height, size_t width, unsigned char *bytes,
+	uint64_t *bits, unsigned char *out)
+{
+	size_t count = _row_bytes(1, width);
+	unsigned char *above = bytes + count, *deltas = above + count;
+
+	memset(above, 0, count);
+	for (size_t i = top; i < top + height; i++) {
+		bitmap_extract(bits, image_bits(rows, i), left, width);
+		bitmap_store(bytes, bits, width);
+
+		for (size_t j = 0; j < count; j++) {
+			deltas[j] = bytes[j] ^ above[j];
+			above[j] = bytes[j];
+		}
+
+		out += _code_row(deltas, count, out);
+	}
+
+	return out;
+}
+
+/**
+ * Codes the tiles of a band of them
+*/
+static void _encode_band(void *arg, size_t band)
+{
+	const encode_job_t *job = (const encode_job_t *)arg;
+	const imt_output_t *output = job->output;
+	const image_t *rows = job->rows;
+	size_t side = output->side;
+	size_t channels = (output->packed || rows->type != PPM) ? 1
+		: COLOR_RANGE;
+	size_t lo, hi;
+
+	unsigned char *values = (unsigned char *)alloc_scratch(2 * side);
+	unsigned char *deltas = values + side;
+	uint64_t *bits = (output->packed)
+		? (uint64_t *)alloc_scratch(bitmap_words(side) * sizeof(uint64_t))
+		: NULL;
+
+	pool_band(job->count, job->bands, band, &lo, &hi);
+	for (size_t t = lo; t < hi; t++) {
+		size_t top = t / output->across * side;
+		size_t left = t % output->across * side;
+		size_t height = _side(side, t / output->across, rows->rows);
+		size_t width = _side(side, t % output->across, rows->columns);
+		unsigned char *out = job->blocks[t];
+
+		/* The three rows of bytes of a packed tile fit in the values */
+		if (output->packed) {
+			out = _encode_bits(rows, top, left, height, width, values,
+				bits, out);
+			job->sizes[t] = out - job->blocks[t];
+			continue;
+		}
+
+		for (size_t k = 0; k < channels; k++) {
+			unsigned char above = 0;
+
+			for (size_t i = top; i < top + height; i++) {
+				const pixel_t *row = image_row(rows, i) + left;
+
+				for (size_t j = 0; j < width; j++)
+					values[j] = row[j].rgb[k];
+
+				deltas[0] = (unsigned char)(values[0] - above);
+				for (size_t j = 1; j < width; j++)
+					deltas[j] = (unsigned char)(values[j] - values[j - 1]);
+				above = values[0];
+
+				out += _code_row(deltas, width, out);
+			}
+		}
+
+		job->sizes[t] = out - job->blocks[t];
+	}
+}
+
+void imt_write_rows(imt_output_t *output, const image_t *rows)
+{
+	size_t side = output->side;
+	size_t down = (rows->rows + side - 1) / side;
+	size_t count = down * output->across;
+	if (!count)
+		return;
+
+	encode_job_t job = {
+		.output = output,
+		.rows = rows,
+		.count = count,
+		.bands = pool_split(count, 1),
+		.blocks = (unsigned char **)alloc_scratch(count
+			* sizeof(unsigned char *)),
+		.sizes = (size_t *)alloc_scratch(count * sizeof(size_t)),
+	};
+	size_t channels = (output->packed || rows->type != PPM) ? 1
+		: COLOR_RANGE;
+
+	/* Room for the worst case, every value a literal */
+	for (size_t t = 0; t < count; t++) {
+		size_t width = _row_bytes(output->packed,
+			_side(side, t % output->across, rows->columns));
+
+		job.blocks[t] = (unsigned char *)alloc_scratch(channels
+			* _side(side, t / output->across, rows->rows)
+			* (width + width / LITERALS_MAX + 1));
+	}
+
+	stats_pixels(rows->rows * rows->columns);
+	pool_run(job.bands, _encode_band, &job);
+
+	for (size_t t = 0; t < count; t++) {
+		unsigned char *entry = output->index
+			+ (output->written + t) * IMT_ENTRY;
+
+		_put64(entry, output->offset);
+		_put64(entry + 8, job.sizes[t]);
+		fwrite(job.blocks[t], 1, job.sizes[t], output->file);
+		output->offset += job.sizes[t];
+	}
+	output->written += count;
+}
+
+void imt_end(imt_output_t *output)
+{
+	fseek(output->file, IMT_HEADER, SEEK_SET);
+	fwrite(output->index, IMT_ENTRY, output->written, output->file);
+
+	free(output->index);
+	output->index = NULL;
+}
+
+void imt_write(FILE *file, image_t *image)
+{
+	imt_output_t output;
+
+	imt_begin(&output, file, image);
+	imt_write_rows(&output, image);
+	imt_end(&output);
+}
@@ -0,0 +1,90 @@
+#ifndef __IMT_H
+#define __IMT_H	1
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "image.h"
+
+/**
+ * The native tiled format, every number little endian:
+ * - "IMT1", the Netpbm digit of the binary format ('4', '5' or '6'), 1 if
+ *   the image is packed, and the side of the tiles (16 bits)
+ * - columns and rows (64 bits each)
+ * - the index: where the block of every tile starts in the file and its
+ *   bytes (64 bits each), tiles row by row
+ * - the blocks: for every channel, then every row of the tile, the
+ *   differences of each value with the one on its left (the first one with
+ *   the first one of the row above), run-length coded on their own. Rows
+ *   of packed images are the bytes of a P4 row xored with those of the row
+ *   above instead.
+*/
+#define IMT_MAGIC					"IMT1"
+#define IMT_HEADER					24
+#define IMT_ENTRY					16
+/* Largest side of a tile that is read, a row of it decoded on the stack */
+#define IMT_MAX_SIDE				4096
+/* File extension that SAVE writes the format for */
+#define IMT_EXTENSION				".imt"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A file being written, a band of whole rows of tiles at a time
+*/
+typedef struct imt_output_t {
+	FILE *file;
+	size_t rows, columns;
+	size_t side, across;
+	int packed;
+
+	size_t written;						/* tiles				*/
+	uint64_t offset;					/* of the next block	*/
+	unsigned char *index;
+} imt_output_t;
+
+/**
+ * @return If the @a size bytes at @a data start like a file of the format
+*/
+int imt_detect(const unsigned char *data, size_t size);
+
+/**
+ * An image of the file mapped at @a data, which it takes over. Its tiles
+ * are decoded when first read (see tiles.h), on the pool threads; packed
+ * images are decoded and packed right away.
+ *
+ * @return NULL, the mapping being let go, if the header or the index is
+ * not valid
+*/
+image_t *imt_map(unsigned char *data, size_t size);
+
+/**
+ * Writes the header of the format for an image of the size and type of
+ * @a image, and room for the index, to @a file
+*/
+void imt_begin(imt_output_t *output, FILE *file, const image_t *image);
+
+/**
+ * Writes the tiles of @a rows, the next rows of the image. Every band but
+ * the last one is a whole number of rows of tiles. The tiles of a band are
+ * coded on the pool threads.
+*/
+void imt_write_rows(imt_output_t *output, const image_t *rows);
+
+/**
+ * Writes the index over the room left for it and lets @a output go
+*/
+void imt_end(imt_output_t *output);
+
+/**
+ * Writes the whole of @a image in the format, on the spot
+*/
+void imt_write(FILE *file, image_t *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
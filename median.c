@@ -0,0 +1,378 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "median.h"
+#include "alloc.h"
+#include "convolution.h"
+#include "thread_pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MEDIAN_X86	1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define MEDIAN_INLINE				static inline __attribute__((always_inline))
+#else
+#define MEDIAN_INLINE				static inline
+#endif
+
+/* No fine bin of the square brought up to date yet on this row */
+#define STALE						((size_t)-1)
+
+/**
+ * How many pixels of a column, or of the square, have every value, and
+ * every MEDIAN_FINE values in a row. Counts of the square, at most
+ * (2 * MEDIAN_MAX_RADIUS + 1)^2, fit in 16 bits.
+*/
+typedef struct median_hist_t {
+	uint16_t coarse[MEDIAN_COARSE];
+	uint16_t fine[PIXEL_MAX_VALUE + 1];
+} median_hist_t;
+
+/**
+ * The filter of one strip of columns over rows [@a lo, @a hi), for one
+ * channel, in one instruction set
+*/
+struct median_job_t;
+typedef void (*median_strip_t)(const struct median_job_t *job,
+	median_hist_t *hists, size_t lo, size_t hi, size_t first, size_t last,
+	size_t channel);
+
+typedef struct median_job_t {
+	image_t *image;
+	/* The pixels of the selection whose square lies in the image */
+	image_selection_t area;
+	size_t radius;
+	size_t depth;						/* values per pixel		*/
+
+	/* The medians of the area, the image being read until all are found */
+	unsigned char *result;
+
+	median_strip_t strip;
+	size_t bands;
+} median_job_t;
+
+/**
+ * MEDIAN_FINE counts at a time: @a dst += @a in - @a out, or @a dst += @a in
+*/
+MEDIAN_INLINE void _slide_c(uint16_t *dst, const uint16_t *in,
+	const uint16_t *out)
+{
+	for (size_t l = 0; l < MEDIAN_FINE; l++)
+		dst[l] = (uint16_t)(dst[l] + in[l] - out[l]);
+}
+
+MEDIAN_INLINE void _add_c(uint16_t *dst, const uint16_t *in)
+{
+	for (size_t l = 0; l < MEDIAN_FINE; l++)
+		dst[l] = (uint16_t)(dst[l] + in[l]);
+}
+
+/**
+ * @return The first of MEDIAN_FINE bins at which more than @a rank values
+ * have been counted, @a below counting those before it
+*/
+MEDIAN_INLINE size_t _find_c(const uint16_t *counts, uint32_t *below,
+	uint32_t rank)
+{
+	size_t bin = 0;
+
+	while (*below + counts[bin] <= rank)
+		*below += counts[bin++];
+	return bin;
+}
+
+#ifdef MEDIAN_X86
+
+MEDIAN_INLINE void _slide_sse2(uint16_t *dst, const uint16_t *in,
+	const uint16_t *out)
+{
+	for (size_t l = 0; l < MEDIAN_FINE; l += 8) {
+		__m128i *to = (__m128i *)(dst + l);
+
+		_mm_storeu_si128(to, _mm_add_epi16(_mm_loadu_si128(to),
+			_mm_sub_epi16(_mm_loadu_si128((const __m128i *)(in + l)),
+			_mm_loadu_si128((const __m128i *)(out + l)))));
+	}
+}
+
+MEDIAN_INLINE void _add_sse2(uint16_t *dst, const uint16_t *in)
+{
+	for (size_t l = 0; l < MEDIAN_FINE; l += 8) {
+		__m128i *to = (__m128i *)(dst + l);
+
+		_mm_storeu_si128(to, _mm_add_epi16(_mm_loadu_si128(to),
+			_mm_loadu_si128((const __m128i *)(in + l))));
+	}
+}
+
+/**
+ * Running sums of the bins, those not past @a rank being counted, with no
+ * branch to mispredict when the median moves from bin to bin
+*/
+MEDIAN_INLINE size_t _find_sse2(const uint16_t *counts, uint32_t *below,
+	uint32_t rank)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i *)counts);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(counts + 8));
+
+	lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 2));
+	hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 2));
+	lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 4));
+	hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 4));
+	lo = _mm_add_epi16(lo, _mm_slli_si128(lo, 8));
+	hi = _mm_add_epi16(hi, _mm_slli_si128(hi, 8));
+	hi = _mm_add_epi16(hi, _mm_shuffle_epi32(_mm_shufflehi_epi16(lo, 0xff),
+		0xff));
+
+	/* Sums of the square are below 2^16, so saturation compares them */
+	const __m128i left = _mm_set1_epi16((short)(rank - *below));
+	const __m128i zero = _mm_setzero_si128();
+	unsigned mask = (unsigned)_mm_movemask_epi8(_mm_packs_epi16(
+		_mm_cmpeq_epi16(_mm_subs_epu16(lo, left), zero),
+		_mm_cmpeq_epi16(_mm_subs_epu16(hi, left), zero)));
+	size_t bin = (size_t)__builtin_popcount(mask);
+
+	if (bin) {
+		uint16_t sums[MEDIAN_FINE];
+
+		_mm_storeu_si128((__m128i *)sums, lo);
+		_mm_storeu_si128((__m128i *)(sums + 8), hi);
+		*below += sums[bin - 1];
+	}
+	return bin;
+}
+
+__attribute__((target("avx2")))
+MEDIAN_INLINE void _slide_avx2(uint16_t *dst, const uint16_t *in,
+	const uint16_t *out)
+{
+	__m256i *to = (__m256i *)dst;
+
+	_mm256_storeu_si256(to, _mm256_add_epi16(_mm256_loadu_si256(to),
+		_mm256_sub_epi16(_mm256_loadu_si256((const __m256i *)in),
+		_mm256_loadu_si256((const __m256i *)out))));
+}
+
+__attribute__((target("avx2")))
+MEDIAN_INLINE void _add_avx2(uint16_t *dst, const uint16_t *in)
+{
+	__m256i *to = (__m256i *)dst;
+
+	_mm256_storeu_si256(to, _mm256_add_epi16(_mm256_loadu_si256(to),
+		_mm256_loadu_si256((const __m256i *)in)));
+}
+
+#endif
+
+/**
+ * The pixels of @a row, from @a first on, come into the histograms of
+ * @a count columns, those of @a gone (if any) leaving them
+*/
+static void _count(median_hist_t *hists, const image_t *image, size_t row,
+	size_t gone, size_t first, size_t count, size_t channel)
+{
+	const pixel_t *in = image_row(image, row) + first;
+
+	if (gone == STALE) {
+		for (size_t u = 0; u < count; u++) {
+			unsigned char value = in[u].rgb[channel];
+
+			hists[u].coarse[value / MEDIAN_FINE]++;
+			hists[u].fine[value]++;
+		}
+		return;
+	}
+
+	const pixel_t *out = image_row(image, gone) + first;
+	for (size_t u = 0; u < count; u++) {
+		unsigned char value = in[u].rgb[channel];
+		unsigned char old = out[u].rgb[channel];
+
+		hists[u].coarse[old / MEDIAN_FINE]--;
+		hists[u].fine[old]--;
+		hists[u].coarse[value / MEDIAN_FINE]++;
+		hists[u].fine[value]++;
+	}
+}
+
+/**
+ * The medians of columns [@a first, @a last) of rows [@a lo, @a hi), with
+ * @a hists room for the histograms of the columns their squares cover.
+ * The coarse histogram of the square moves along the row at every pixel;
+ * a bin of the fine one is only brought up to date when the median falls
+ * in it, from where it last was, or counted again if that was far.
+*/
+MEDIAN_INLINE void _strip_body(const median_job_t *job, median_hist_t *hists,
+	size_t lo, size_t hi, size_t first, size_t last, size_t channel,
+	void (*slide)(uint16_t *, const uint16_t *, const uint16_t *),
+	void (*add)(uint16_t *, const uint16_t *),
+	size_t (*find)(const uint16_t *, uint32_t *, uint32_t))
+{
+	const image_t *image = job->image;
+	size_t radius = job->radius, side = 2 * radius + 1;
+	size_t count = last - first + 2 * radius, depth = job->depth;
+	size_t columns = job->area.rcol - job->area.lcol;
+	/* Values below the median, in a square of side^2 */
+	uint32_t rank = (uint32_t)(side * side / 2);
+
+	memset(hists, 0, count * sizeof(median_hist_t));
+	for (size_t i = lo - radius; i < lo + radius; i++)
+		_count(hists, image, i, STALE, first - radius, count, channel);
+
+	for (size_t i = lo; i < hi; i++) {
+		_count(hists, image, i + radius, (i > lo) ? i - radius - 1 : STALE,
+			first - radius, count, channel);
+
+		median_hist_t square;
+		size_t done[MEDIAN_COARSE];
+
+		memset(square.coarse, 0, sizeof(square.coarse));
+		for (size_t u = 0; u < side; u++)
+			add(square.coarse, hists[u].coarse);
+		for (size_t c = 0; c < MEDIAN_COARSE; c++)
+			done[c] = STALE;
+
+		unsigned char *out = job->result + ((i - job->area.uprow) * columns
+			+ first - job->area.lcol) * depth + channel;
+
+		/* u is the column of the pixel in the strip, radius more than j */
+		for (size_t u = radius; u < count - radius; u++) {
+			if (u > radius)
+				slide(square.coarse, hists[u + radius].coarse,
+					hists[u - radius - 1].coarse);
+
+			uint32_t below = 0;
+			size_t c = find(square.coarse, &below, rank);
+
+			uint16_t *fine = square.fine + c * MEDIAN_FINE;
+			size_t bin = c * MEDIAN_FINE;
+			if (done[c] == STALE || u - done[c] > radius) {
+				memset(fine, 0, MEDIAN_FINE * sizeof(uint16_t));
+				for (size_t w = u - radius; w <= u + radius; w++)
+					add(fine, hists[w].fine + bin);
+			} else {
+				for (size_t w = done[c] + 1; w <= u; w++)
+					slide(fine, hists[w + radius].fine + bin,
+						hists[w - radius - 1].fine + bin);
+			}
+			done[c] = u;
+
+			*out = (unsigned char)(bin + find(fine, &below, rank));
+			out += depth;
+		}
+	}
+}
+
+/**
+ * Entry points of the strip filter for one instruction set
+*/
+#define MEDIAN_STRIP_OPS(isa, attr)										\
+	attr static void _strip_##isa(const median_job_t *job,				\
+		median_hist_t *hists, size_t lo, size_t hi, size_t first,		\
+		size_t last, size_t channel)									\
+	{																	\
+		_strip_body(job, hists, lo, hi, first, last, channel,			\
+			_slide_##isa, _add_##isa, _find_##isa);						\
+	}
+
+MEDIAN_STRIP_OPS(c, )
+#ifdef MEDIAN_X86
+MEDIAN_STRIP_OPS(sse2, )
+#define _find_avx2					_find_sse2
+MEDIAN_STRIP_OPS(avx2, __attribute__((target("avx2"))))
+#endif
+
+static const median_strip_t strip_ops[] = {
+	[CONV_SCALAR] = _strip_c,
+#ifdef MEDIAN_X86
+	[CONV_SSE2] = _strip_sse2,
+	[CONV_AVX2] = _strip_avx2,
+#endif
+};
+
+/**
+ * The medians of a band of rows of the area, a strip of columns and a
+ * channel at a time, so that their histograms stay in cache
+*/
+static void _median_rows(void *arg, size_t band)
+{
+	const median_job_t *job = (const median_job_t *)arg;
+	image_selection_t area = job->area;
+	size_t lo, hi;
+
+	median_hist_t *hists = (median_hist_t *)alloc_scratch((MEDIAN_STRIP
+		+ 2 * job->radius) * sizeof(median_hist_t));
+
+	pool_band(area.dwrow - area.uprow, job->bands, band, &lo, &hi);
+	for (size_t first = area.lcol; first < area.rcol; first += MEDIAN_STRIP) {
+		size_t last = (first + MEDIAN_STRIP < area.rcol)
+			? first + MEDIAN_STRIP : area.rcol;
+
+		for (size_t k = 0; k < job->depth; k++)
+			job->strip(job, hists, area.uprow + lo, area.uprow + hi, first,
+				last, k);
+	}
+}
+
+/**
+ * Writes the medians of a band of rows back to the image
+*/
+static void _median_store(void *arg, size_t band)
+{
+	const median_job_t *job = (const median_job_t *)arg;
+	image_selection_t area = job->area;
+	size_t columns = area.rcol - area.lcol, depth = job->depth, lo, hi;
+
+	pool_band(area.dwrow - area.uprow, job->bands, band, &lo, &hi);
+	for (size_t i = lo; i < hi; i++) {
+		pixel_t *to = image_row(job->image, area.uprow + i) + area.lcol;
+		const unsigned char *from = job->result + i * columns * depth;
+
+		for (size_t j = 0; j < columns; j++)
+			for (size_t k = 0; k < depth; k++)
+				to[j].rgb[k] = *from++;
+	}
+}
+
+int median_filter(image_t *image, image_selection_t selection,
+	size_t radius)
+{
+	if (image->rows <= 2 * radius || image->columns <= 2 * radius)
+		return 1;
+
+	/* Edges have no full square and stay as they are */
+	image_selection_t area = {
+		.uprow = (selection.uprow > radius) ? selection.uprow : radius,
+		.dwrow = (selection.dwrow < image->rows - radius)
+			? selection.dwrow : image->rows - radius,
+		.lcol = (selection.lcol > radius) ? selection.lcol : radius,
+		.rcol = (selection.rcol < image->columns - radius)
+			? selection.rcol : image->columns - radius,
+	};
+	if (area.uprow >= area.dwrow || area.lcol >= area.rcol)
+		return 1;
+
+	size_t rows = area.dwrow - area.uprow;
+	median_job_t job = {
+		.image = image,
+		.area = area,
+		.radius = radius,
+		.depth = (image->type == PPM) ? COLOR_RANGE : 1,
+		.strip = strip_ops[conv_isa()],
+	};
+
+	job.result = (unsigned char *)alloc_block(rows
+		* (area.rcol - area.lcol) * job.depth, 0);
+	if (!job.result)
+		return 0;
+
+	/* Every band counts the 2 * radius rows around it first */
+	job.bands = pool_split(rows, POOL_GRAIN + 2 * radius);
+	pool_run(job.bands, _median_rows, &job);
+	pool_run(job.bands, _median_store, &job);
+
+	alloc_release(job.result);
+	return 1;
+}
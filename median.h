@@ -0,0 +1,36 @@
+#ifndef __MEDIAN_H
+#define __MEDIAN_H	1
+
+#include <stddef.h>
+
+#include "image.h"
+
+/* Values of a fine histogram under one bin of the coarse one */
+#define MEDIAN_FINE					16
+#define MEDIAN_COARSE				((PIXEL_MAX_VALUE + 1) / MEDIAN_FINE)
+/* Pixels of a row whose column histograms are kept at a time */
+#define MEDIAN_STRIP				256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Replaces every pixel of @a selection by the median of the square of side
+ * 2 * @a radius + 1 around it, channel by channel. As with kernels, pixels
+ * whose square leaves the image stay as they are and those around the
+ * selection are read, not changed. Every column keeps a histogram of its
+ * pixels in the square, moving down a row at a time, and the histogram of
+ * the square moves along the row with them, so the cost of a pixel does
+ * not depend on @a radius. Greyscale and colour images only.
+ *
+ * @return 0 if there is no memory for the result, nothing being changed
+*/
+int median_filter(image_t *image, image_selection_t selection,
+	size_t radius);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
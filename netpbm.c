@@ -0,0 +1,726 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "alloc.h"
+#include "bitmap.h"
+#include "imt.h"
+#include "netpbm.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "tiles.h"
+
+/* Bytes of text handled by one band, when decoding and when formatting */
+#define TEXT_CHUNK					(1 << 20)
+/* Longest formatted value, "255 " */
+#define TEXT_VALUE					4
+
+#define IS_DIGIT(chr)				((unsigned char)((chr) - '0') < 10)
+
+/**
+ * Skips whitespace and comments, then reads one decimal number
+ *
+ * @return 0 if the data ends first, -1 if something else comes first or
+ * the number does not fit in an unsigned long
+*/
+static int _header_number(const unsigned char *data, size_t size,
+	size_t *pos, unsigned long *value)
+{
+	while (*pos < size) {
+		if (data[*pos] == '#') {
+			while (*pos < size && data[*pos] != '\n')
+				(*pos)++;
+		} else if (isspace(data[*pos])) {
+			(*pos)++;
+		} else {
+			break;
+		}
+	}
+
+	if (*pos >= size)
+		return 0;
+	if (!isdigit(data[*pos]))
+		return -1;
+
+	*value = 0;
+	while (*pos < size && isdigit(data[*pos])) {
+		unsigned long digit = data[(*pos)++] - '0';
+
+		if (*value > (ULONG_MAX - digit) / 10)
+			return -1;
+		*value = *value * 10 + digit;
+	}
+
+	return 1;
+}
+
+int netpbm_header(const unsigned char *data, size_t size,
+	netpbm_header_t *header)
+{
+	if (size < 2)
+		return 0;
+	if (data[0] != 'P' || data[1] < '1' || data[1] > '6')
+		return -1;
+
+	size_t pos = 2;
+	unsigned long columns, rows;
+	header->format = (char)data[1];
+
+	int found = _header_number(data, size, &pos, &columns);
+	if (found == 1)
+		found = _header_number(data, size, &pos, &rows);
+	if (found != 1)
+		return found;
+
+	/* Pixels no buffer can hold, or none at all */
+	if (!image_fits(rows, columns))
+		return -1;
+
+	/**
+	 * Plain and raw PBM have no maximum value, their pixels follow the
+	 * dimensions. The 8-bit ones this editor writes have 255, which is how
+	 * the two are told apart.
+	*/
+	size_t pixels = pos;
+	found = _header_number(data, size, &pos, &header->max_value);
+	if (found == 1 && (pos >= size || !isspace(data[pos])))
+		found = (pos < size) ? -1 : 0;
+
+	if (TYPE_FROM_CHR(header->format) == PBM
+		&& (found != 1 || header->max_value != PIXEL_MAX_VALUE)) {
+		pos = pixels;
+		header->max_value = 1;
+	} else if (found != 1) {
+		return found;
+	}
+
+	/* A single whitespace character separates the header from the pixels */
+	if (pos >= size)
+		return 0;
+	if (!isspace(data[pos]))
+		return -1;
+
+	header->columns = columns;
+	header->rows = rows;
+	header->offset = pos + 1;
+	return 1;
+}
+
+/**
+ * @return How many numbers start in [@a begin, @a end)
+*/
+static size_t _count_values(const unsigned char *data, size_t begin,
+	size_t end)
+{
+	size_t count = 0, pos = begin;
+	int prev = (begin > 0) && IS_DIGIT(data[begin - 1]);
+
+#ifdef __SSE2__
+	const __m128i below = _mm_set1_epi8('0' - 1);
+	const __m128i above = _mm_set1_epi8('9' + 1);
+
+	/* A number starts at every digit that follows a non-digit */
+	for (; pos + 16 <= end; pos += 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i *)(data + pos));
+		unsigned digits = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpgt_epi8(chars, below), _mm_cmplt_epi8(chars, above)));
+
+		count += __builtin_popcount(digits & ~((digits << 1) | prev));
+		prev = (digits >> 15) & 1;
+	}
+#endif
+
+	for (; pos < end; pos++) {
+		int digit = IS_DIGIT(data[pos]);
+
+		count += (digit && !prev);
+		prev = digit;
+	}
+
+	return count;
+}
+
+typedef struct decode_job_t {
+	image_t *image;
+	const unsigned char *data;
+	size_t depth;						/* values per pixel		*/
+
+	size_t bands;
+	size_t *bounds;						/* bands + 1 offsets	*/
+	size_t *first;						/* first value index	*/
+} decode_job_t;
+
+static void _count_band(void *arg, size_t band)
+{
+	decode_job_t *job = (decode_job_t *)arg;
+
+	job->first[band] = _count_values(job->data, job->bounds[band],
+		job->bounds[band + 1]);
+}
+
+/**
+ * Decodes the pixels of a plain PBM, every '0' or '1' being one of them
+*/
+static void _decode_bits(image_t *image, const unsigned char *data,
+	size_t size)
+{
+	size_t row = 0, col = 0;
+
+	for (size_t pos = 0; pos < size && row < image->rows; pos++) {
+		if (data[pos] == '#') {
+			while (pos < size && data[pos] != '\n')
+				pos++;
+			continue;
+		}
+
+		if (data[pos] != '0' && data[pos] != '1')
+			continue;
+
+		if (data[pos] == '1')
+			image_bits(image, row)[col / BITMAP_WORD_BITS] |= (uint64_t)1
+				<< (BITMAP_WORD_BITS - 1 - col % BITMAP_WORD_BITS);
+		if (++col == image->columns) {
+			col = 0;
+			row++;
+		}
+	}
+}
+
+static void _decode_band(void *arg, size_t band)
+{
+	decode_job_t *job = (decode_job_t *)arg;
+	image_t *image = job->image;
+	const unsigned char *data = job->data;
+	size_t pos = job->bounds[band], end = job->bounds[band + 1];
+
+	/* Position of the first value of the band */
+	size_t index = job->first[band];
+	size_t channel = index % job->depth;
+	size_t col = index / job->depth % image->columns;
+	size_t row = index / job->depth / image->columns;
+
+	while (row < image->rows) {
+		while (pos < end && !IS_DIGIT(data[pos]))
+			pos++;
+		if (pos >= end)
+			break;
+
+		/* Values wrap around like a %hhu conversion */
+		unsigned value = 0;
+		while (pos < end && IS_DIGIT(data[pos]))
+			value = value * 10 + (data[pos++] - '0');
+
+		image_row(image, row)[col].rgb[channel] = (unsigned char)value;
+		if (++channel == job->depth) {
+			channel = 0;
+			if (++col == image->columns) {
+				col = 0;
+				row++;
+			}
+		}
+	}
+}
+
+void netpbm_decode_ascii(image_t *image, const unsigned char *data,
+	size_t size)
+{
+	if (!image->rows || !image->columns)
+		return;
+
+	double start = stats_start();
+	if (image->bits) {
+		_decode_bits(image, data, size);
+		stats_span("decode ascii", 0, start);
+		return;
+	}
+
+	decode_job_t job = {
+		.image = image,
+		.data = data,
+		.depth = (image->type == PPM) ? COLOR_RANGE : 1,
+		.bands = pool_split(size, TEXT_CHUNK),
+	};
+
+	job.bounds = (size_t *)alloc_scratch((2 * job.bands + 1) * sizeof(size_t));
+	job.first = job.bounds + job.bands + 1;
+
+	/* Cut after whole numbers, so every band starts outside of one */
+	for (size_t band = 0; band < job.bands; band++) {
+		size_t lo, hi;
+		pool_band(size, job.bands, band, &lo, &hi);
+
+		while (lo > 0 && lo < size && IS_DIGIT(data[lo]))
+			lo++;
+		job.bounds[band] = (band && lo < job.bounds[band - 1])
+			? job.bounds[band - 1] : lo;
+	}
+	job.bounds[job.bands] = size;
+
+	/* Count the values of every band, then decode each from its index */
+	pool_run(job.bands, _count_band, &job);
+	size_t total = 0;
+	for (size_t band = 0; band < job.bands; band++) {
+		size_t count = job.first[band];
+
+		job.first[band] = total;
+		total += count;
+	}
+
+	pool_run(job.bands, _decode_band, &job);
+	stats_span("decode ascii", 0, start);
+}
+
+/**
+ * Text of every value followed by a space, padded to TEXT_VALUE bytes
+*/
+static char value_text[PIXEL_MAX_VALUE + 1][TEXT_VALUE];
+static unsigned char value_length[PIXEL_MAX_VALUE + 1];
+static pthread_once_t value_once = PTHREAD_ONCE_INIT;
+
+static void _init_value_text(void)
+{
+	for (int i = 0; i <= PIXEL_MAX_VALUE; i++) {
+		char text[TEXT_VALUE + 2];
+
+		value_length[i] = (unsigned char)sprintf(text, "%d ", i);
+		memcpy(value_text[i], text, TEXT_VALUE);
+	}
+}
+
+typedef struct format_job_t {
+	image_t *image;
+	size_t depth;
+	size_t first;						/* first row of block	*/
+	size_t rows;						/* rows in the block	*/
+
+	size_t bands;
+	char *text;							/* one area per band	*/
+	size_t band_size;
+	size_t *length;
+} format_job_t;
+
+static void _format_band(void *arg, size_t band)
+{
+	format_job_t *job = (format_job_t *)arg;
+	char *text = job->text + band * job->band_size, *out = text;
+	size_t lo, hi;
+
+	pool_band(job->rows, job->bands, band, &lo, &hi);
+	for (size_t i = job->first + lo; i < job->first + hi; i++) {
+		if (job->image->bits) {
+			const uint64_t *bits = image_bits(job->image, i);
+
+			for (size_t j = 0; j < job->image->columns; j++) {
+				*out++ = '0' + ((bits[j / BITMAP_WORD_BITS]
+					>> (BITMAP_WORD_BITS - 1 - j % BITMAP_WORD_BITS)) & 1);
+				*out++ = ' ';
+			}
+
+			*out++ = '\n';
+			continue;
+		}
+
+		const unsigned char *row =
+			(const unsigned char *)image_row(job->image, i);
+		size_t end = job->image->columns * COLOR_RANGE;
+
+		for (size_t j = 0; j < end; j += COLOR_RANGE)
+			for (size_t k = 0; k < job->depth; k++) {
+				memcpy(out, value_text[row[j + k]], TEXT_VALUE);
+				out += value_length[row[j + k]];
+			}
+
+		*out++ = '\n';
+	}
+
+	job->length[band] = out - text;
+}
+
+void netpbm_write_ascii(FILE *out_file, image_t *image)
+{
+	pthread_once(&value_once, _init_value_text);
+
+	double start = stats_start();
+	size_t workers = pool_workers();
+	format_job_t job = {
+		.image = image,
+		.depth = (image->type == PPM) ? COLOR_RANGE : 1,
+	};
+
+	/* Whole rows per band, roughly TEXT_CHUNK bytes of text each */
+	size_t row_size = image->columns * job.depth * TEXT_VALUE + 1;
+	size_t band_rows = (TEXT_CHUNK > row_size) ? TEXT_CHUNK / row_size : 1;
+
+	job.band_size = band_rows * row_size + TEXT_VALUE;
+	job.text = (char *)alloc_scratch(workers * job.band_size);
+	job.length = (size_t *)alloc_scratch(workers * sizeof(size_t));
+
+	for (job.first = 0; job.first < image->rows; job.first += job.rows) {
+		job.rows = image->rows - job.first;
+		if (job.rows > band_rows * workers)
+			job.rows = band_rows * workers;
+
+		/* Format in parallel, write in order: no band gets more rows than
+		 * its slot holds */
+		job.bands = (job.rows + band_rows - 1) / band_rows;
+		pool_run(job.bands, _format_band, &job);
+
+		for (size_t band = 0; band < job.bands; band++)
+			fwrite(job.text + band * job.band_size, 1, job.length[band],
+				out_file);
+	}
+
+	stats_span("format ascii", 0, start);
+}
+
+/**
+ * Packs the pixels of a plain or raw PBM. Those missing from a short file
+ * are white.
+*/
+static image_t *_map_bits(const unsigned char *data, size_t size,
+	const netpbm_header_t *header)
+{
+	image_t *image = create_bilevel_image(header->rows, header->columns);
+	const unsigned char *src = data + header->offset;
+	size_t left = size - header->offset;
+	if (!image)
+		return NULL;
+
+	posix_madvise((void *)data, size, POSIX_MADV_SEQUENTIAL);
+	stats_pixels(image->rows * image->columns);
+
+	if (header->format == '1') {
+		netpbm_decode_ascii(image, src, left);
+		return image;
+	}
+
+	/* Raw rows are packed the same way, a byte per 8 pixels */
+	size_t bytes = (image->columns + 7) / 8;
+	for (size_t i = 0; i < image->rows && left; i++) {
+		if (left < bytes) {
+			unsigned char *line = (unsigned char *)alloc_scratch(bytes);
+
+			memset(line, 0, bytes);
+			memcpy(line, src, left);
+			bitmap_load(image_bits(image, i), line, image->columns);
+			break;
+		}
+
+		bitmap_load(image_bits(image, i), src, image->columns);
+		src += bytes;
+		left -= bytes;
+	}
+
+	return image;
+}
+
+/**
+ * Spreads a tile of a one byte per pixel file over its pixels, the file
+ * having been checked to hold all of them
+*/
+static void _decode_raw_tile(const unsigned char *data, size_t size,
+	const tiles_tile_t *tile)
+{
+	(void)size;
+
+	/* The other bytes of a greyscale pixel are already zero */
+	for (size_t i = 0; i < tile->rows; i++) {
+		const unsigned char *from = data + (tile->top + i) * tile->width
+			+ tile->left;
+		pixel_t *to = tile->pixels + i * tile->stride;
+
+		for (size_t j = 0; j < tile->columns; j++)
+			to[j].val = from[j];
+	}
+}
+
+image_t *map_image(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t size = (size_t)st.st_size;
+	/* Private and writable: edits land in copies of the touched pages */
+	unsigned char *data = (unsigned char *)mmap(NULL, size,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	/* Native tiled files have an index instead of a Netpbm header */
+	if (imt_detect(data, size))
+		return imt_map(data, size);
+
+	netpbm_header_t header;
+	if (netpbm_header(data, size, &header) != 1
+		|| (header.max_value != PIXEL_MAX_VALUE && header.max_value != 1)) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	image_type_t type = TYPE_FROM_CHR(header.format);
+	if (header.max_value == 1) {
+		image_t *image = _map_bits(data, size, &header);
+
+		munmap(data, size);
+		return image;
+	}
+
+	if (header.format <= '3') {
+		image_t *image = create_image(header.rows, header.columns, type);
+		if (!image) {
+			munmap(data, size);
+			return NULL;
+		}
+
+		posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+		stats_pixels(image->rows * image->columns);
+		netpbm_decode_ascii(image, data + header.offset, size - header.offset);
+		munmap(data, size);
+		return image;
+	}
+
+	/* Short files are left to the stream reader, which zero-fills them */
+	size_t depth = (type == PPM) ? COLOR_RANGE : 1;
+	if (header.columns && header.rows > (size - header.offset)
+		/ depth / header.columns) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	if (type == PPM)
+		return create_mapped_image(data, size,
+			(pixel_t *)(data + header.offset),
+			header.rows, header.columns, type);
+
+	/* One byte per pixel, decoded a tile at a time once read (-t) */
+	if (tiles_enabled())
+		return tiles_open(data, size, header.offset, header.rows,
+			header.columns, type, TILES_SIDE, _decode_raw_tile);
+
+	/* One byte per pixel, spread over the pixel buffer */
+	image_t *image = create_image(header.rows, header.columns, type);
+	if (!image) {
+		munmap(data, size);
+		return NULL;
+	}
+	const unsigned char *src = data + header.offset;
+	stats_pixels(image->rows * image->columns);
+
+	posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+	for (size_t i = 0; i < image->rows; i++, src += image->columns) {
+		pixel_t *row = image_row(image, i);
+
+		for (size_t j = 0; j < image->columns; j++)
+			row[j].val = src[j];
+	}
+
+	munmap(data, size);
+	return image;
+}
+
+struct netpbm_reader_t {
+	FILE *file;
+	netpbm_header_t header;
+	size_t depth;						/* values per pixel		*/
+
+	/* Plain files: text not decoded yet, and the number cut by its end */
+	unsigned char *text;
+	size_t pos, size;
+	unsigned value;
+	int digits;
+
+	/* Binary files: bytes of one row */
+	unsigned char *line;
+};
+
+/**
+ * Refills the text of a plain file
+ *
+ * @return 0 at the end of the file
+*/
+static int _read_text(netpbm_reader_t *reader)
+{
+	reader->pos = 0;
+	reader->size = fread(reader->text, 1, TEXT_CHUNK, reader->file);
+
+	return reader->size > 0;
+}
+
+netpbm_reader_t *netpbm_open(const char *path, netpbm_header_t *header)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return NULL;
+
+	netpbm_reader_t *reader =
+		(netpbm_reader_t *)calloc(1, sizeof(netpbm_reader_t));
+	DIE(!reader, "calloc failed");
+
+	reader->file = file;
+	reader->text = (unsigned char *)malloc(TEXT_CHUNK);
+	DIE(!reader->text, "malloc failed");
+
+	/* Headers with long comments may need more than one block */
+	size_t capacity = TEXT_CHUNK;
+	reader->size = fread(reader->text, 1, capacity, file);
+	int found;
+	while ((found = netpbm_header(reader->text, reader->size,
+		&reader->header)) != 1) {
+		if (found < 0 || reader->size < capacity) {
+			netpbm_close(reader);
+			return NULL;
+		}
+
+		/* Comments no memory can hold are not worth reading either */
+		capacity *= 2;
+		unsigned char *text = (unsigned char *)realloc(reader->text,
+			capacity);
+		if (!text) {
+			netpbm_close(reader);
+			return NULL;
+		}
+
+		reader->text = text;
+		reader->size += fread(reader->text + reader->size, 1,
+			capacity - reader->size, file);
+	}
+
+	if (reader->header.max_value != PIXEL_MAX_VALUE) {
+		netpbm_close(reader);
+		return NULL;
+	}
+
+	image_type_t type = TYPE_FROM_CHR(reader->header.format);
+	reader->depth = (type == PPM) ? COLOR_RANGE : 1;
+	reader->pos = reader->header.offset;
+
+	if (reader->header.format > '3') {
+		if (fseeko(file, (off_t)reader->header.offset, SEEK_SET) != 0) {
+			netpbm_close(reader);
+			return NULL;
+		}
+
+		reader->line = (unsigned char *)malloc(reader->header.columns + 1);
+		if (!reader->line) {
+			netpbm_close(reader);
+			return NULL;
+		}
+	}
+
+	*header = reader->header;
+	return reader;
+}
+
+void netpbm_read_row(netpbm_reader_t *reader, pixel_t *row)
+{
+	size_t columns = reader->header.columns;
+
+	if (reader->header.format > '3' && reader->depth == COLOR_RANGE) {
+		size_t ret = fread(row, sizeof(pixel_t), columns, reader->file);
+		memset(row + ret, 0, (columns - ret) * sizeof(pixel_t));
+		return;
+	}
+
+	if (reader->header.format > '3') {
+		size_t ret = fread(reader->line, 1, columns, reader->file);
+		memset(reader->line + ret, 0, columns - ret);
+
+		for (size_t j = 0; j < columns; j++)
+			row[j].val = reader->line[j];
+		return;
+	}
+
+	/* Same rules as netpbm_decode_ascii, one value at a time */
+	size_t count = columns * reader->depth, index = 0;
+	size_t step = COLOR_RANGE / reader->depth;
+	unsigned char *out = (unsigned char *)row;
+
+	while (index < count) {
+		if (reader->pos == reader->size && !_read_text(reader)) {
+			if (reader->digits)
+				out[step * index++] = (unsigned char)reader->value;
+			reader->digits = 0;
+			break;
+		}
+
+		unsigned char chr = reader->text[reader->pos++];
+		if (IS_DIGIT(chr)) {
+			reader->value = reader->value * 10 + (chr - '0');
+			reader->digits = 1;
+		} else if (reader->digits) {
+			out[step * index++] = (unsigned char)reader->value;
+			reader->value = 0;
+			reader->digits = 0;
+		}
+	}
+
+	for (; index < count; index++)
+		out[step * index] = 0;
+}
+
+int netpbm_skip_rows(netpbm_reader_t *reader, size_t rows)
+{
+	if (reader->header.format > '3') {
+		off_t size = (off_t)(reader->header.columns * reader->depth);
+
+		return fseeko(reader->file, size * (off_t)rows, SEEK_CUR) == 0;
+	}
+
+	/* Plain values have to be decoded to be counted */
+	pixel_t *row = create_pixels(1, reader->header.columns);
+	if (!row)
+		return 0;
+	for (size_t i = 0; i < rows; i++)
+		netpbm_read_row(reader, row);
+	free_pixels(row);
+	return 1;
+}
+
+int netpbm_rewind(netpbm_reader_t *reader)
+{
+	if (fseeko(reader->file, (off_t)reader->header.offset, SEEK_SET) != 0)
+		return 0;
+
+	/* The text of a plain file is read again from there */
+	reader->pos = 0;
+	reader->size = 0;
+	reader->value = 0;
+	reader->digits = 0;
+	return 1;
+}
+
+int netpbm_fileno(const netpbm_reader_t *reader)
+{
+	return fileno(reader->file);
+}
+
+void netpbm_close(netpbm_reader_t *reader)
+{
+	if (!reader)
+		return;
+
+	fclose(reader->file);
+	free(reader->line);
+	free(reader->text);
+	free(reader);
+}
@@ -0,0 +1,100 @@
+#ifndef __NETPBM_H
+#define __NETPBM_H	1
+
+#include <stddef.h>
+
+#include "image.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct netpbm_header_t {
+	char format;						/* '1' to '6'			*/
+	size_t columns;
+	size_t rows;
+	unsigned long max_value;			/* 1 for 1-bit PBM		*/
+	size_t offset;						/* first pixel byte		*/
+} netpbm_header_t;
+
+/**
+ * Parses the header at the start of @a data: magic word, dimensions and
+ * maximum value, comments allowed in between. Plain and raw PBM, which
+ * have no maximum value, get 1. Dimensions of zero, or whose pixels do not
+ * fit in IMAGE_MAX_BYTES (image_fits), are not a header.
+ *
+ * @return 1 for a header, 0 if @a data ends before it is complete, -1 if
+ * @a data does not start with one
+*/
+int netpbm_header(const unsigned char *data, size_t size,
+	netpbm_header_t *header);
+
+/**
+ * Decodes the values of a plain (P1, P2, P3) image in parallel, over chunks
+ * of text cut between numbers. Missing values are left as they are.
+ * Packed images take one '0' or '1' per pixel, on the calling thread.
+*/
+void netpbm_decode_ascii(image_t *image, const unsigned char *data,
+	size_t size);
+
+/**
+ * Writes the values of a plain image, formatted a block of rows at a time,
+ * those of a packed one as 0 and 1
+*/
+void netpbm_write_ascii(FILE *out_file, image_t *image);
+
+/**
+ * Reads the rows of a file one after the other, never holding more than a
+ * block of text or one row of bytes
+*/
+typedef struct netpbm_reader_t netpbm_reader_t;
+
+/**
+ * Opens @a path and reads its header
+ *
+ * @return NULL if the file is not an image with values up to 255, or there
+ * is no memory for its header or a row
+*/
+netpbm_reader_t *netpbm_open(const char *path, netpbm_header_t *header);
+
+/**
+ * Reads the next row into @a row. Rows past the end of the file are
+ * zero-filled, like the values missing from a short file.
+*/
+void netpbm_read_row(netpbm_reader_t *reader, pixel_t *row);
+
+/**
+ * Moves past the next @a rows rows without keeping them
+ *
+ * @return 0 if the file cannot be moved in, or there is no memory for a row
+*/
+int netpbm_skip_rows(netpbm_reader_t *reader, size_t rows);
+
+/**
+ * Goes back to the first row, for another pass over the same file
+ *
+ * @return 0 if the file cannot be moved in
+*/
+int netpbm_rewind(netpbm_reader_t *reader);
+
+/**
+ * @return The descriptor the rows are read from
+*/
+int netpbm_fileno(const netpbm_reader_t *reader);
+
+void netpbm_close(netpbm_reader_t *reader);
+
+/**
+ * Loads a file through a private mapping. P6 pixels are used in place,
+ * pages are only copied once an operation writes to them. Plain and raw
+ * PBM are packed. Files of the native tiled format (imt.h) are read too.
+ *
+ * @return NULL if the file is not a complete image
+*/
+image_t *map_image(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,409 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "convolution.h"
+#include "histogram.h"
+#include "pipeline.h"
+#include "pyramid.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "tiles.h"
+#include "writer.h"
+
+typedef enum stage_type_t {
+	STAGE_KERNEL,						/* APPLY				*/
+	STAGE_TABLE							/* EQUALIZE				*/
+} stage_type_t;
+
+typedef struct stage_t {
+	stage_type_t type;
+
+	/* Pixels the stage changes, [r0, r1) x [c0, c1) */
+	size_t r0, r1;
+	size_t c0, c1;
+
+	/* Rows the stage reads on each side, and the ones all later stages do */
+	size_t radius;
+	size_t lead;
+
+	conv_kernel_t conv;
+	unsigned char lut[PIXEL_MAX_VALUE + 1];
+} stage_t;
+
+struct pipeline_t {
+	size_t count;
+	stage_t stages[PIPELINE_STAGES];
+};
+
+/**
+ * One flush, split in row bands. A band reads the radius of every stage
+ * more rows on each side, which other bands may overwrite, so those are
+ * saved first.
+*/
+typedef struct flush_job_t {
+	image_t *image;
+	struct pipeline_t *pipeline;
+
+	/* Rows changed by any stage, and the columns worth carrying */
+	size_t r0, r1;
+	size_t w0, w1;
+	size_t width;						/* bytes of a window	*/
+
+	/* Rows of output every stage keeps, at least the ones the next stage
+	 * reads, and the steps a final row waits before going back */
+	size_t ring;
+	size_t delay;
+
+	size_t bands;
+	size_t halo_rows;					/* per band boundary	*/
+	unsigned char *halo;
+} flush_job_t;
+
+/**
+ * @return A queue with room for one more stage, flushing a full one
+*/
+static stage_t *_next_stage(image_t *image)
+{
+	if (!image->pending) {
+		image->pending = calloc(1, sizeof(struct pipeline_t));
+		DIE(!image->pending, "calloc failed");
+	}
+
+	if (image->pending->count == PIPELINE_STAGES)
+		pipeline_flush(image);
+
+	return &image->pending->stages[image->pending->count];
+}
+
+/**
+ * Tells the histogram cache that @a region is about to change
+*/
+static void _mark_changed(image_t *image, image_selection_t region)
+{
+	/* Outside of the queued tables, the pixels are still the right ones */
+	int remapped = 0;
+	for (size_t s = 0; image->pending && s < image->pending->count; s++)
+		remapped |= (image->pending->stages[s].type == STAGE_TABLE);
+
+	if (remapped)
+		histogram_invalidate(image);
+	else
+		histogram_change(image, region);
+}
+
+int pipeline_apply(image_t *image, image_selection_t selection,
+	const kernel_t *kernel)
+{
+	conv_kernel_t conv;
+	if (!conv_prepare(&conv, kernel))
+		return apply_effect(image, selection, kernel);
+
+	if (image->rows < conv.rows || image->columns < conv.columns)
+		return 1;
+
+	/* Same edges as conv_apply */
+	size_t ry = conv.rows / 2, rx = conv.columns / 2;
+	size_t r0 = (selection.uprow > ry) ? selection.uprow : ry;
+	size_t c0 = (selection.lcol > rx) ? selection.lcol : rx;
+	size_t r1 = (selection.dwrow < image->rows - ry)
+		? selection.dwrow : image->rows - ry;
+	size_t c1 = (selection.rcol < image->columns - rx)
+		? selection.rcol : image->columns - rx;
+
+	if (r0 >= r1 || c0 >= c1)
+		return 1;
+
+	image_selection_t region;
+	update_selection(&region, r0, r1, c0, c1);
+	_mark_changed(image, region);
+
+	stage_t *stage = _next_stage(image);
+	stage->type = STAGE_KERNEL;
+	stage->r0 = r0;
+	stage->r1 = r1;
+	stage->c0 = c0;
+	stage->c1 = c1;
+	stage->radius = ry;
+	stage->conv = conv;
+
+	image->pending->count++;
+	return 1;
+}
+
+int pipeline_equalise(image_t *image, image_selection_t selection,
+	equalise_mode_t mode)
+{
+	if (image->type == PPM)
+		return equalise_image(image, selection, mode);
+
+	/* Unless cached, the histogram flushes the earlier stages */
+	unsigned char lut[PIXEL_MAX_VALUE + 1];
+	if (!equalise_table(image, selection, lut))
+		return 0;
+
+	int whole = (selection.uprow == 0 && selection.lcol == 0
+		&& selection.dwrow == image->rows && selection.rcol == image->columns);
+	if (!whole)
+		_mark_changed(image, selection);
+
+	stage_t *stage = _next_stage(image);
+	stage->type = STAGE_TABLE;
+	stage->r0 = selection.uprow;
+	stage->r1 = selection.dwrow;
+	stage->c0 = selection.lcol;
+	stage->c1 = selection.rcol;
+	stage->radius = 0;
+	memcpy(stage->lut, lut, sizeof(lut));
+
+	image->pending->count++;
+	if (whole)
+		histogram_remap(image, lut);
+	return 1;
+}
+
+/**
+ * @return The unchanged row @a row of the window, as the band
+ * [@a lo, @a hi) should see it
+*/
+static const unsigned char *_source_row(const flush_job_t *job, size_t band,
+	size_t lo, size_t hi, size_t row)
+{
+	size_t half = job->halo_rows / 2;
+
+	if (row < lo && band > 0)
+		return job->halo + ((band - 1) * job->halo_rows + row + half - lo)
+			* job->width;
+	if (row >= hi && band + 1 < job->bands)
+		return job->halo + (band * job->halo_rows + row + half - hi)
+			* job->width;
+
+	return (const unsigned char *)(image_row(job->image, row) + job->w0);
+}
+
+/**
+ * What a band remembers about one stage between rows
+*/
+typedef struct stage_state_t {
+	/* Horizontal sums of the last input rows, when separable */
+	int16_t *sums;
+	long last;							/* last row summed		*/
+} stage_state_t;
+
+/**
+ * Computes row @a row of @a stage from the rows of the previous stage
+*/
+static void _run_stage(const stage_t *stage, const flush_job_t *job,
+	stage_state_t *state, unsigned char *dst,
+	const unsigned char *const src[], size_t row, int16_t *acc)
+{
+	size_t radius = stage->radius;
+
+	if (row < stage->r0 || row >= stage->r1) {
+		memcpy(dst, src[radius], job->width);
+		return;
+	}
+
+	/* Carry the columns the stage leaves alone */
+	size_t offset = (stage->c0 - job->w0) * COLOR_RANGE;
+	size_t len = (stage->c1 - stage->c0) * COLOR_RANGE;
+
+	memcpy(dst, src[radius], offset);
+	memcpy(dst + offset + len, src[radius] + offset + len,
+		job->width - offset - len);
+
+	if (stage->type == STAGE_TABLE) {
+		memcpy(dst + offset, src[radius] + offset, len);
+		for (size_t x = offset; x < offset + len; x += COLOR_RANGE)
+			dst[x] = stage->lut[dst[x]];
+		return;
+	}
+
+	long size = (long)stage->conv.rows;
+	const unsigned char *rows[KERNEL_MAX_SIZE];
+	for (long k = 0; k < size; k++)
+		rows[k] = src[k] + offset;
+
+	if (!stage->conv.separable
+		|| (!stage->conv.narrow && !stage->conv.split)) {
+		conv_row(&stage->conv, dst + offset, rows, len, acc);
+		return;
+	}
+
+	/* Consecutive rows share all but one row of horizontal sums */
+	int16_t *sums[KERNEL_MAX_SIZE];
+	for (long k = 0; k < size; k++) {
+		long at = (long)row - (long)radius + k;
+
+		sums[k] = state->sums + (at % size) * job->width;
+		if (at > state->last || at < state->last - (size - 1))
+			conv_hsum(&stage->conv, sums[k], rows[k], len);
+	}
+
+	state->last = (long)(row + radius);
+	conv_vsum(&stage->conv, dst + offset, sums, len, acc);
+}
+
+/**
+ * Streams the rows of a band through every stage. At step t, every stage
+ * computes its row t + lead, the last row of the previous stage it needs
+ * having been computed earlier in the same step. Final rows go back to the
+ * image once no stage reads the original row any more.
+*/
+static void _flush_band(void *arg, size_t band)
+{
+	flush_job_t *job = (flush_job_t *)arg;
+	const stage_t *stages = job->pipeline->stages;
+	size_t n = job->pipeline->count;
+	long rows = (long)job->image->rows;
+	long ring_rows = (long)job->ring;
+	size_t lo, hi;
+
+	pool_band(job->r1 - job->r0, job->bands, band, &lo, &hi);
+	lo += job->r0;
+	hi += job->r0;
+
+	/* Room for a row of 32-bit sums, then one row per kernel row */
+	size_t sum_rows = 2;
+	for (size_t s = 0; s < n; s++)
+		sum_rows += (stages[s].type == STAGE_KERNEL) ? stages[s].conv.rows : 0;
+
+	unsigned char *ring = (unsigned char *)alloc_scratch(n * job->ring
+		* job->width);
+	int16_t *acc = (int16_t *)alloc_scratch(sum_rows * job->width
+		* sizeof(int16_t));
+	stage_state_t *states = (stage_state_t *)alloc_scratch(n
+		* sizeof(stage_state_t));
+
+	int16_t *sums = acc + 2 * job->width;
+	for (size_t s = 0; s < n; s++) {
+		size_t size = (stages[s].type == STAGE_KERNEL)
+			? stages[s].conv.rows : 0;
+
+		states[s].sums = sums;
+		states[s].last = -(long)size - 1;
+		sums += size * job->width;
+	}
+
+	long first = (long)lo - 2 * (long)stages[0].lead;
+	for (long t = first; t < (long)(hi + job->delay); t++) {
+		for (size_t s = 0; s < n; s++) {
+			const stage_t *stage = &stages[s];
+			long lead = (long)stage->lead, radius = (long)stage->radius;
+			long row = t + lead;
+
+			/* Later stages need the rows lo - lead to hi - 1 + lead */
+			if (row < (long)lo - lead || row > (long)hi - 1 + lead
+				|| row < 0 || row >= rows)
+				continue;
+
+			const unsigned char *src[KERNEL_MAX_SIZE];
+			for (long k = 0; k <= 2 * radius; k++) {
+				long at = row - radius + k;
+
+				/* Edge rows are only copied, their neighbours unused */
+				if (at < 0 || at >= rows)
+					at = row;
+				src[k] = (s == 0)
+					? _source_row(job, band, lo, hi, (size_t)at)
+					: ring + ((s - 1) * job->ring + at % ring_rows)
+						* job->width;
+			}
+
+			_run_stage(stage, job, &states[s],
+				ring + (s * job->ring + row % ring_rows) * job->width,
+				src, (size_t)row, acc);
+		}
+
+		long done = t - (long)job->delay;
+		if (done >= (long)lo && done < (long)hi)
+			memcpy(image_row(job->image, done) + job->w0,
+				ring + ((n - 1) * job->ring + done % ring_rows) * job->width,
+				job->width);
+	}
+}
+
+void pipeline_flush(image_t *image)
+{
+	struct pipeline_t *pipeline = image->pending;
+	if (!pipeline || !pipeline->count)
+		return;
+	writer_detach(image);
+	pyramid_drop(image);
+
+	double start = stats_start();
+	flush_job_t job = {
+		.image = image,
+		.pipeline = pipeline,
+		.r0 = image->rows,
+		.w0 = image->columns,
+		.ring = 1,
+	};
+
+	/* Rows and columns read around the rows the stages change */
+	size_t reach = 0, columns_reach = 0;
+	for (size_t s = pipeline->count; s-- > 0; ) {
+		stage_t *stage = &pipeline->stages[s];
+
+		job.r0 = (stage->r0 < job.r0) ? stage->r0 : job.r0;
+		job.r1 = (stage->r1 > job.r1) ? stage->r1 : job.r1;
+		job.w0 = (stage->c0 < job.w0) ? stage->c0 : job.w0;
+		job.w1 = (stage->c1 > job.w1) ? stage->c1 : job.w1;
+		stats_pixels((stage->r1 - stage->r0) * (stage->c1 - stage->c0));
+
+		stage->lead = reach;
+		reach += stage->radius;
+		if (stage->type == STAGE_KERNEL)
+			columns_reach += stage->conv.columns / 2;
+		if (job.ring < 2 * stage->radius + 1)
+			job.ring = 2 * stage->radius + 1;
+	}
+
+	/* The first stage reads its source rows up to its radius back */
+	const stage_t *first = &pipeline->stages[0];
+	job.delay = (first->radius > first->lead) ? first->radius - first->lead : 0;
+	if (job.ring < job.delay + 1)
+		job.ring = job.delay + 1;
+
+	job.w0 = (job.w0 > columns_reach) ? job.w0 - columns_reach : 0;
+	job.w1 = (job.w1 + columns_reach < image->columns)
+		? job.w1 + columns_reach : image->columns;
+	job.width = (job.w1 - job.w0) * COLOR_RANGE;
+
+	image_selection_t window;
+	update_selection(&window, job.r0, job.r1, job.w0, job.w1);
+	tiles_fetch(image, window, reach);
+
+	job.bands = pool_split(job.r1 - job.r0, POOL_GRAIN);
+	job.halo_rows = 2 * reach;
+	if (job.bands > 1) {
+		job.halo = (unsigned char *)alloc_scratch((job.bands - 1)
+			* job.halo_rows * job.width);
+	}
+
+	for (size_t band = 1; band < job.bands; band++) {
+		size_t lo, hi;
+		pool_band(job.r1 - job.r0, job.bands, band, &lo, &hi);
+
+		for (size_t k = 0; k < job.halo_rows; k++) {
+			long row = (long)(job.r0 + lo) - (long)reach + (long)k;
+			if (row < 0 || row >= (long)image->rows)
+				continue;
+
+			memcpy(job.halo + ((band - 1) * job.halo_rows + k) * job.width,
+				image_row(image, (size_t)row) + job.w0, job.width);
+		}
+	}
+
+	conv_isa();
+	pool_run(job.bands, _flush_band, &job);
+
+	pipeline->count = 0;
+	stats_span("pipeline flush", 0, start);
+}
+
+void pipeline_drop(image_t *image)
+{
+	free(image->pending);
+	image->pending = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef __PIPELINE_H
+#define __PIPELINE_H	1
+
+#include "image.h"
+
+/* Most pixel operations waiting on one image */
+#define PIPELINE_STAGES				16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Queues an APPLY on @a image instead of running it
+ *
+ * @return 0 if the kernel cannot be queued and there was no memory to apply
+ * it right away either
+*/
+int pipeline_apply(image_t *image, image_selection_t selection,
+	const kernel_t *kernel);
+
+/**
+ * Queues an EQUALIZE: the table is built now, its lookups run later.
+ * Colour images are equalised right away.
+ *
+ * @return 0 as equalise_image does
+*/
+int pipeline_equalise(image_t *image, image_selection_t selection,
+	equalise_mode_t mode);
+
+/**
+ * Runs every queued operation in a single pass over the rows they change.
+ * The result is the same as running them one after the other.
+*/
+void pipeline_flush(image_t *image);
+
+/**
+ * Forgets the queued operations of an image that is going away
+*/
+void pipeline_drop(image_t *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
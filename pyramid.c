@@ -0,0 +1,74 @@
+#include <stdlib.h>
+
+#include "pyramid.h"
+#include "resample.h"
+#include "utils.h"
+
+struct pyramid_t {
+	/* Level i is 2^(i + 1) times smaller than the image, on each side */
+	image_t *levels[PYRAMID_LEVELS];
+	size_t count;
+};
+
+static int enabled;
+
+void pyramid_enable(int enable)
+{
+	enabled = enable;
+}
+
+int pyramid_enabled(void)
+{
+	return enabled;
+}
+
+const image_t *pyramid_level(image_t *image, size_t rows, size_t columns)
+{
+	if (!enabled || image->bits || image->source)
+		return image;
+
+	const image_t *level = image;
+	for (size_t i = 0; i < PYRAMID_LEVELS; i++) {
+		size_t half_rows = pyramid_half(level->rows);
+		size_t half_columns = pyramid_half(level->columns);
+
+		/* A single pixel is the last level */
+		if (half_rows < rows || half_columns < columns
+			|| (half_rows == level->rows && half_columns == level->columns))
+			break;
+
+		if (!image->pyramid) {
+			image->pyramid = (struct pyramid_t *)calloc(1,
+				sizeof(struct pyramid_t));
+			DIE(!image->pyramid, "calloc failed");
+		}
+
+		struct pyramid_t *pyramid = image->pyramid;
+		if (i == pyramid->count) {
+			image_t *next = create_image(half_rows, half_columns,
+				image->type);
+			/* No memory for it: the last level there is will do */
+			if (!next)
+				break;
+
+			resample_image(next, level, RESIZE_AREA);
+			pyramid->levels[pyramid->count++] = next;
+		}
+
+		level = pyramid->levels[i];
+	}
+
+	return level;
+}
+
+void pyramid_drop(image_t *image)
+{
+	struct pyramid_t *pyramid = image->pyramid;
+	if (!pyramid)
+		return;
+
+	for (size_t i = 0; i < pyramid->count; i++)
+		free_image(pyramid->levels[i]);
+	free(pyramid);
+	image->pyramid = NULL;
+}
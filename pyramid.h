@@ -0,0 +1,49 @@
+#ifndef __PYRAMID_H
+#define __PYRAMID_H	1
+
+#include <stddef.h>
+
+#include "image.h"
+
+/* Most levels an image keeps, each half the size of the one above */
+#define PYRAMID_LEVELS				16
+/* Fewest pixels of the level HISTOGRAM counts instead of the image */
+#define PYRAMID_PREVIEW				((size_t)1 << 18)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @return The side of the level below one of side @a side
+*/
+static inline size_t pyramid_half(size_t side)
+{
+	return (side + 1) / 2;
+}
+
+/**
+ * Turns the pyramids on (-p), off by default
+*/
+void pyramid_enable(int enable);
+int pyramid_enabled(void);
+
+/**
+ * @return The smallest level of @a image with at least @a rows rows and
+ * @a columns columns, averaged down from the one above when missing and
+ * kept until the pixels change. That is @a image itself when no level is
+ * that large, when the pyramids are off, and for packed or streamed
+ * images. The pixels must be up to date.
+*/
+const image_t *pyramid_level(image_t *image, size_t rows, size_t columns);
+
+/**
+ * Frees the levels of @a image, before its pixels change or go away
+*/
+void pyramid_drop(image_t *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,412 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "resample.h"
+#include "alloc.h"
+#include "bitmap.h"
+#include "convolution.h"
+#include "thread_pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RESAMPLE_X86	1
+#include <immintrin.h>
+#endif
+
+#define RESAMPLE_ONE				(1 << RESAMPLE_BITS)
+/* Blended rows keep RESAMPLE_INTER_BITS of the fraction, columns none */
+#define ROW_SHIFT					(RESAMPLE_BITS - RESAMPLE_INTER_BITS)
+#define COLUMN_SHIFT				(RESAMPLE_BITS + RESAMPLE_INTER_BITS)
+
+/**
+ * Source pixels of every result pixel along one side: @a taps of them from
+ * first[i] on, weighed by weights[i * taps + k], which add up to
+ * RESAMPLE_ONE. Those past the edge of the source are moved in with a
+ * weight of 0.
+*/
+typedef struct resample_axis_t {
+	size_t *first;
+	int16_t *weights;
+	size_t taps;
+} resample_axis_t;
+
+/**
+ * dst = sum of weights[k] * rows[k][x], with RESAMPLE_INTER_BITS of the
+ * fraction left
+*/
+typedef void (*resample_rows_t)(int16_t *dst,
+	const unsigned char *const rows[], const int16_t *weights, size_t taps,
+	size_t len);
+
+typedef struct resample_job_t {
+	image_t *dst;
+	const image_t *src;
+	resize_filter_t filter;
+
+	resample_axis_t rows;
+	resample_axis_t columns;
+
+	size_t bands;
+} resample_job_t;
+
+/**
+ * Source pixels [@a first, @a last] result pixel @a i covers, when @a in
+ * of them make @a out
+*/
+static inline void _area_span(size_t i, size_t in, size_t out,
+	size_t *first, size_t *last)
+{
+	/* In units of 1 / out of a source pixel, the result pixel is [lo, hi) */
+	size_t lo = i * in, hi = (i + 1) * in;
+
+	*first = lo / out;
+	*last = (hi - 1) / out;
+}
+
+/**
+ * Rounds @a exact weights to RESAMPLE_BITS bits, the largest taking what
+ * rounding left over so that they add up to RESAMPLE_ONE
+*/
+static void _quantise(int16_t *weights, const double *exact, size_t taps)
+{
+	size_t largest = 0;
+	int sum = 0;
+
+	for (size_t k = 0; k < taps; k++) {
+		weights[k] = (int16_t)(exact[k] * RESAMPLE_ONE + 0.5);
+		sum += weights[k];
+		if (weights[k] > weights[largest])
+			largest = k;
+	}
+
+	weights[largest] += RESAMPLE_ONE - sum;
+}
+
+/**
+ * Weights of the source pixels along a side of @a in pixels, scaled to
+ * @a out of them
+*/
+static void _build_axis(resample_axis_t *axis, size_t in, size_t out,
+	resize_filter_t filter)
+{
+	size_t taps = 1;
+
+	if (filter == RESIZE_BILINEAR && in > 1) {
+		taps = 2;
+	} else if (filter == RESIZE_AREA) {
+		for (size_t i = 0; i < out; i++) {
+			size_t first, last;
+
+			_area_span(i, in, out, &first, &last);
+			if (last - first + 1 > taps)
+				taps = last - first + 1;
+		}
+	}
+
+	axis->taps = taps;
+	axis->first = (size_t *)alloc_scratch(out * sizeof(size_t));
+	axis->weights = (int16_t *)alloc_scratch(out * taps * sizeof(int16_t));
+	double *exact = (double *)alloc_scratch(taps * sizeof(double));
+
+	for (size_t i = 0; i < out; i++) {
+		size_t first = 0;
+
+		memset(exact, 0, taps * sizeof(double));
+		if (filter == RESIZE_NEAREST) {
+			/* The source pixel under the centre of the result one */
+			first = (2 * i + 1) * in / (2 * out);
+			exact[0] = 1.0;
+		} else if (filter == RESIZE_BILINEAR) {
+			double centre = (i + 0.5) * in / out - 0.5;
+
+			if (centre < 0.0)
+				centre = 0.0;
+			if (centre > in - 1.0)
+				centre = in - 1.0;
+
+			/* The last pixel pairs with the one before it, weighing 0 */
+			first = (size_t)centre;
+			if (taps == 2 && first == in - 1)
+				first--;
+
+			double fraction = centre - first;
+			exact[0] = 1.0 - fraction;
+			if (taps == 2)
+				exact[1] = fraction;
+		} else {
+			size_t last;
+
+			_area_span(i, in, out, &first, &last);
+			for (size_t p = first; p <= last; p++) {
+				size_t lo = (i * in > p * out) ? i * in : p * out;
+				size_t hi = ((i + 1) * in < (p + 1) * out)
+					? (i + 1) * in : (p + 1) * out;
+
+				exact[p - first] = (double)(hi - lo) / in;
+			}
+
+			/* Narrower spans near the edge start earlier, zeros first */
+			if (first + taps > in) {
+				size_t shift = first + taps - in;
+
+				memmove(exact + shift, exact,
+					(taps - shift) * sizeof(double));
+				memset(exact, 0, shift * sizeof(double));
+				first -= shift;
+			}
+		}
+
+		axis->first[i] = first;
+		_quantise(axis->weights + i * taps, exact, taps);
+	}
+}
+
+/**
+ * The last @a len - @a from bytes of a row blend
+*/
+static inline void _rows_tail(int16_t *dst, const unsigned char *const rows[],
+	const int16_t *weights, size_t taps, size_t from, size_t len)
+{
+	for (size_t x = from; x < len; x++) {
+		int32_t sum = 1 << (ROW_SHIFT - 1);
+
+		for (size_t k = 0; k < taps; k++)
+			sum += weights[k] * rows[k][x];
+		dst[x] = (int16_t)(sum >> ROW_SHIFT);
+	}
+}
+
+static void _rows_c(int16_t *dst, const unsigned char *const rows[],
+	const int16_t *weights, size_t taps, size_t len)
+{
+	_rows_tail(dst, rows, weights, taps, 0, len);
+}
+
+#ifdef RESAMPLE_X86
+
+/**
+ * Rows are taken two at a time: madd multiplies their interleaved bytes by
+ * both weights and adds the products in 32 bits
+*/
+static void _rows_sse2_from(int16_t *dst, const unsigned char *const rows[],
+	const int16_t *weights, size_t taps, size_t x, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi32(1 << (ROW_SHIFT - 1));
+
+	for (; x + 8 <= len; x += 8) {
+		__m128i lo = round, hi = round;
+
+		for (size_t k = 0; k < taps; k += 2) {
+			int last = (k + 1 == taps);
+			__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(
+				(const __m128i *)(rows[k] + x)), zero);
+			__m128i b = (last) ? zero : _mm_unpacklo_epi8(_mm_loadl_epi64(
+				(const __m128i *)(rows[k + 1] + x)), zero);
+			int16_t next = (last) ? 0 : weights[k + 1];
+			__m128i pair = _mm_set_epi16(next, weights[k], next, weights[k],
+				next, weights[k], next, weights[k]);
+
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+				pair));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b),
+				pair));
+		}
+
+		lo = _mm_srai_epi32(lo, ROW_SHIFT);
+		hi = _mm_srai_epi32(hi, ROW_SHIFT);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packs_epi32(lo, hi));
+	}
+
+	_rows_tail(dst, rows, weights, taps, x, len);
+}
+
+static void _rows_sse2(int16_t *dst, const unsigned char *const rows[],
+	const int16_t *weights, size_t taps, size_t len)
+{
+	_rows_sse2_from(dst, rows, weights, taps, 0, len);
+}
+
+/**
+ * Same as the SSE2 one: unpacking and packing both work per 128-bit lane,
+ * so the results come out in order
+*/
+__attribute__((target("avx2")))
+static void _rows_avx2(int16_t *dst, const unsigned char *const rows[],
+	const int16_t *weights, size_t taps, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i round = _mm256_set1_epi32(1 << (ROW_SHIFT - 1));
+	size_t x = 0;
+
+	for (; x + 16 <= len; x += 16) {
+		__m256i lo = round, hi = round;
+
+		for (size_t k = 0; k < taps; k += 2) {
+			int last = (k + 1 == taps);
+			__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+				(const __m128i *)(rows[k] + x)));
+			__m256i b = (last) ? zero : _mm256_cvtepu8_epi16(_mm_loadu_si128(
+				(const __m128i *)(rows[k + 1] + x)));
+			int16_t next = (last) ? 0 : weights[k + 1];
+			__m256i pair = _mm256_set1_epi32((int32_t)(((uint32_t)(uint16_t)next
+				<< 16) | (uint16_t)weights[k]));
+
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(
+				_mm256_unpacklo_epi16(a, b), pair));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(
+				_mm256_unpackhi_epi16(a, b), pair));
+		}
+
+		lo = _mm256_srai_epi32(lo, ROW_SHIFT);
+		hi = _mm256_srai_epi32(hi, ROW_SHIFT);
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_packs_epi32(lo, hi));
+	}
+
+	_rows_sse2_from(dst, rows, weights, taps, x, len);
+}
+
+#endif
+
+static const resample_rows_t rows_ops[] = {
+	[CONV_SCALAR] = _rows_c,
+#ifdef RESAMPLE_X86
+	[CONV_SSE2] = _rows_sse2,
+	[CONV_AVX2] = _rows_avx2,
+#endif
+};
+
+/**
+ * The result row out of a row blend, one pixel at a time. Bilinear pairs
+ * and single taps have loops of their own, with the weights in registers.
+*/
+static void _columns(pixel_t *dst, const int16_t *src,
+	const resample_axis_t *axis, size_t columns)
+{
+	const int32_t round = 1 << (COLUMN_SHIFT - 1);
+	size_t taps = axis->taps;
+
+	if (taps == 1) {
+		for (size_t j = 0; j < columns; j++) {
+			const int16_t *from = src + axis->first[j] * COLOR_RANGE;
+
+			for (size_t c = 0; c < COLOR_RANGE; c++)
+				dst[j].rgb[c] = (unsigned char)((from[c] * RESAMPLE_ONE
+					+ round) >> COLUMN_SHIFT);
+		}
+		return;
+	}
+
+	if (taps == 2) {
+		for (size_t j = 0; j < columns; j++) {
+			const int16_t *from = src + axis->first[j] * COLOR_RANGE;
+			int32_t w0 = axis->weights[2 * j], w1 = axis->weights[2 * j + 1];
+
+			for (size_t c = 0; c < COLOR_RANGE; c++)
+				dst[j].rgb[c] = (unsigned char)((w0 * from[c]
+					+ w1 * from[c + COLOR_RANGE] + round) >> COLUMN_SHIFT);
+		}
+		return;
+	}
+
+	for (size_t j = 0; j < columns; j++) {
+		const int16_t *from = src + axis->first[j] * COLOR_RANGE;
+		const int16_t *weights = axis->weights + j * taps;
+		int32_t sum[COLOR_RANGE] = { round, round, round };
+
+		for (size_t k = 0; k < taps; k++, from += COLOR_RANGE)
+			for (size_t c = 0; c < COLOR_RANGE; c++)
+				sum[c] += weights[k] * from[c];
+
+		/* The weights add up to one: no sum goes past the largest value */
+		for (size_t c = 0; c < COLOR_RANGE; c++)
+			dst[j].rgb[c] = (unsigned char)(sum[c] >> COLUMN_SHIFT);
+	}
+}
+
+/**
+ * Rows [@a lo, @a hi) of a packed result, bit by bit
+*/
+static void _nearest_bits(const resample_job_t *job, size_t lo, size_t hi)
+{
+	size_t columns = job->dst->columns;
+
+	for (size_t i = lo; i < hi; i++) {
+		const uint64_t *src = image_bits(job->src, job->rows.first[i]);
+		uint64_t *dst = image_bits(job->dst, i);
+
+		for (size_t w = 0; w < job->dst->words; w++) {
+			uint64_t word = 0;
+
+			for (size_t b = 0; b < BITMAP_WORD_BITS; b++) {
+				size_t j = w * BITMAP_WORD_BITS + b;
+				if (j >= columns)
+					break;
+
+				/* The first pixel of a word is its top bit */
+				size_t x = job->columns.first[j];
+				uint64_t bit = (src[x / BITMAP_WORD_BITS]
+					>> (BITMAP_WORD_BITS - 1 - x % BITMAP_WORD_BITS)) & 1;
+				word |= bit << (BITMAP_WORD_BITS - 1 - b);
+			}
+			dst[w] = word;
+		}
+	}
+}
+
+static void _resample_band(void *arg, size_t band)
+{
+	const resample_job_t *job = (const resample_job_t *)arg;
+	const image_t *src = job->src;
+	image_t *dst = job->dst;
+	size_t lo, hi;
+
+	pool_band(dst->rows, job->bands, band, &lo, &hi);
+	if (src->bits) {
+		_nearest_bits(job, lo, hi);
+		return;
+	}
+
+	if (job->filter == RESIZE_NEAREST) {
+		for (size_t i = lo; i < hi; i++) {
+			const pixel_t *from = image_row(src, job->rows.first[i]);
+			pixel_t *to = image_row(dst, i);
+
+			for (size_t j = 0; j < dst->columns; j++)
+				to[j] = from[job->columns.first[j]];
+		}
+		return;
+	}
+
+	resample_rows_t blend_rows = rows_ops[conv_isa()];
+	size_t taps = job->rows.taps;
+	size_t len = src->columns * COLOR_RANGE;
+	int16_t *blend = (int16_t *)alloc_scratch(len * sizeof(int16_t));
+	const unsigned char **rows = (const unsigned char **)alloc_scratch(taps
+		* sizeof(*rows));
+
+	for (size_t i = lo; i < hi; i++) {
+		for (size_t k = 0; k < taps; k++)
+			rows[k] = (const unsigned char *)image_row(src,
+				job->rows.first[i] + k);
+
+		blend_rows(blend, rows, job->rows.weights + i * taps, taps, len);
+		_columns(image_row(dst, i), blend, &job->columns, dst->columns);
+	}
+}
+
+void resample_image(image_t *dst, const image_t *src, resize_filter_t filter)
+{
+	resample_job_t job = {
+		.dst = dst,
+		.src = src,
+		.filter = (src->bits) ? RESIZE_NEAREST : filter,
+		.bands = pool_split(dst->rows, POOL_GRAIN),
+	};
+
+	_build_axis(&job.rows, src->rows, dst->rows, job.filter);
+	_build_axis(&job.columns, src->columns, dst->columns, job.filter);
+
+	/* Pick the instruction set before other threads ask for it */
+	conv_isa();
+	pool_run(job.bands, _resample_band, &job);
+}
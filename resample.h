@@ -0,0 +1,28 @@
+#ifndef __RESAMPLE_H
+#define __RESAMPLE_H	1
+
+#include "image.h"
+
+/* Fractional bits of the weight of every source pixel */
+#define RESAMPLE_BITS				14
+/* Fractional bits of the values between the two passes */
+#define RESAMPLE_INTER_BITS			7
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Scales @a src to the size of @a dst, which has pixels of its own, in
+ * parallel bands of result rows. The source rows under a result row are
+ * blended first, whole rows at a time in vector lanes, then the columns.
+ * Every byte of a pixel is resampled: unused grey bytes stay zero.
+ * Packed images, both of them, take the nearest pixel whatever @a filter.
+*/
+void resample_image(image_t *dst, const image_t *src, resize_filter_t filter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,573 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "alloc.h"
+#include "utils.h"
+
+/**
+ * A connection, and what was read from it and not run yet
+*/
+typedef struct client_t {
+	struct client_t *next;				/* in the list it is on	*/
+	int fd;
+	int ended;							/* nothing more to read	*/
+	int skipping;						/* a line too long		*/
+
+	char input[SERVER_LINE];
+	size_t length;
+} client_t;
+
+/**
+ * A named session, run by one request at a time
+*/
+typedef struct server_session_t {
+	struct server_session_t *next;
+	char *name;
+	void *session;
+
+	pthread_mutex_t lock;				/* held while run		*/
+	size_t users;						/* requests holding it	*/
+	int closed;							/* ended by a command	*/
+} server_session_t;
+
+static struct {
+	const server_ops_t *ops;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;				/* a client was queued	*/
+	/* Clients with whole lines to run, and those run, for the poll loop */
+	client_t *ready, *ready_last;
+	client_t *done;
+	server_session_t *sessions;
+	int stop;
+
+	/* Written to for the poll loop to look at done and stop */
+	int wake[2];
+} server = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.wake = { -1, -1 },
+};
+
+/* Set by SIGINT and SIGTERM */
+static volatile sig_atomic_t stopped;
+
+static void _wake(void)
+{
+	char byte = 0;
+	ssize_t written = write(server.wake[1], &byte, 1);
+
+	/* A full pipe already wakes the loop */
+	(void)written;
+}
+
+static void _on_signal(int signo)
+{
+	(void)signo;
+	stopped = 1;
+	_wake();
+}
+
+static void _close_client(client_t *client)
+{
+	close(client->fd);
+	free(client);
+}
+
+static void _close_clients(client_t *client)
+{
+	while (client) {
+		client_t *next = client->next;
+
+		_close_client(client);
+		client = next;
+	}
+}
+
+/**
+ * @return The open session named @a name, created if there is none, held
+ * until _detach
+*/
+static server_session_t *_attach(const char *name)
+{
+	pthread_mutex_lock(&server.lock);
+	server_session_t *session = server.sessions;
+	while (session && strcmp(session->name, name) != 0)
+		session = session->next;
+
+	if (!session) {
+		session = (server_session_t *)calloc(1, sizeof(server_session_t));
+		DIE(!session, "calloc failed");
+		session->name = strdup(name);
+		DIE(!session->name, "strdup failed");
+		DIE(pthread_mutex_init(&session->lock, NULL) != 0,
+			"pthread_mutex_init failed");
+		session->session = server.ops->open();
+
+		session->next = server.sessions;
+		server.sessions = session;
+	}
+	session->users++;
+	pthread_mutex_unlock(&server.lock);
+
+	return session;
+}
+
+static void _free_session(server_session_t *session)
+{
+	pthread_mutex_destroy(&session->lock);
+	free(session->name);
+	free(session);
+}
+
+static void _detach(server_session_t *session)
+{
+	pthread_mutex_lock(&server.lock);
+	int unused = !--session->users && session->closed;
+	pthread_mutex_unlock(&server.lock);
+
+	if (unused)
+		_free_session(session);
+}
+
+/**
+ * Takes a session out of the table, requests still waiting for it then
+ * opening a new one
+*/
+static void _remove(server_session_t *session)
+{
+	pthread_mutex_lock(&server.lock);
+	server_session_t **link = &server.sessions;
+	while (*link != session)
+		link = &(*link)->next;
+	*link = session->next;
+	session->closed = 1;
+	pthread_mutex_unlock(&server.lock);
+}
+
+/**
+ * Runs the request @a line, writing its replies to @a out
+*/
+static void _request(char *line, FILE *out)
+{
+	char name[SERVER_LINE];
+	int skip = 0;
+	if (sscanf(line, "%s%n", name, &skip) != 1) {
+		fputs("Invalid request\n", out);
+		return;
+	}
+
+	char *command_line = line + skip;
+	if (command_line[strspn(command_line, " \t\r\n")] == '\0') {
+		if (strcmp(name, "SHUTDOWN") != 0) {
+			fputs("Invalid request\n", out);
+			return;
+		}
+
+		pthread_mutex_lock(&server.lock);
+		server.stop = 1;
+		pthread_mutex_unlock(&server.lock);
+		_wake();
+		fputs("Shutting down\n", out);
+		return;
+	}
+
+	server_session_t *session;
+	for (;;) {
+		session = _attach(name);
+		pthread_mutex_lock(&session->lock);
+		if (!session->closed)
+			break;
+
+		/* Ended while this request waited for it */
+		pthread_mutex_unlock(&session->lock);
+		_detach(session);
+	}
+
+	int ended = server.ops->run(session->session, command_line, out);
+	alloc_reset();
+	if (ended) {
+		_remove(session);
+		server.ops->close(session->session);
+		session->session = NULL;
+	}
+
+	pthread_mutex_unlock(&session->lock);
+	_detach(session);
+}
+
+/**
+ * Writes all of @a data to @a fd
+ *
+ * @return 0 if the connection is gone
+*/
+static int _send(int fd, const char *data, size_t size)
+{
+	while (size) {
+		ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return 0;
+
+		data += sent;
+		size -= (size_t)sent;
+	}
+
+	return 1;
+}
+
+/**
+ * @return The bytes of the next line to run in the input of @a client, 0
+ * if it has to wait for more
+*/
+static size_t _next_line(const client_t *client)
+{
+	const char *end = (const char *)memchr(client->input, '\n',
+		client->length);
+
+	if (end)
+		return (size_t)(end - client->input) + 1;
+	if (client->length == SERVER_LINE || client->ended)
+		return client->length;
+	return 0;
+}
+
+/**
+ * Runs the whole lines read from @a client, answering each
+*/
+static void _run_client(client_t *client)
+{
+	size_t length;
+	while ((length = _next_line(client))) {
+		int whole = client->input[length - 1] == '\n'
+			|| length < SERVER_LINE;
+		char line[SERVER_LINE + 1];
+
+		memcpy(line, client->input, length);
+		line[length] = '\0';
+		client->length -= length;
+		memmove(client->input, client->input + length, client->length);
+
+		/* The rest of a line too long is left out, up to its end */
+		if (client->skipping) {
+			client->skipping = line[length - 1] != '\n';
+			continue;
+		}
+
+		char *replies = NULL;
+		size_t size = 0;
+		FILE *out = open_memstream(&replies, &size);
+		DIE(!out, "open_memstream failed");
+
+		if (whole) {
+			_request(line, out);
+		} else {
+			fputs("Request line too long\n", out);
+			client->skipping = 1;
+		}
+
+		/* An empty line ends the replies of a request */
+		fputc('\n', out);
+		fclose(out);
+
+		int sent = _send(client->fd, replies, size);
+		free(replies);
+		if (!sent) {
+			client->ended = 1;
+			client->length = 0;
+		}
+	}
+}
+
+static void *_worker(void *arg)
+{
+	(void)arg;
+
+	/* Scratch space of its own, kept from one request to the next */
+	alloc_arena_t *arena = alloc_arena_create();
+	alloc_use(arena);
+
+	for (;;) {
+		pthread_mutex_lock(&server.lock);
+		while (!server.ready && !server.stop)
+			pthread_cond_wait(&server.work, &server.lock);
+
+		/* The clients queued before a stop are still answered */
+		client_t *client = server.ready;
+		if (!client) {
+			pthread_mutex_unlock(&server.lock);
+			break;
+		}
+		server.ready = client->next;
+		pthread_mutex_unlock(&server.lock);
+
+		_run_client(client);
+
+		pthread_mutex_lock(&server.lock);
+		client->next = server.done;
+		server.done = client;
+		pthread_mutex_unlock(&server.lock);
+		_wake();
+	}
+
+	alloc_use(NULL);
+	alloc_arena_destroy(arena);
+	return NULL;
+}
+
+/**
+ * Hands @a client, which has a line to run, to the workers
+*/
+static void _queue(client_t *client)
+{
+	client->next = NULL;
+
+	pthread_mutex_lock(&server.lock);
+	if (server.ready)
+		server.ready_last->next = client;
+	else
+		server.ready = client;
+	server.ready_last = client;
+	pthread_cond_signal(&server.work);
+	pthread_mutex_unlock(&server.lock);
+}
+
+/**
+ * Reads what @a client sent, queueing it once it has a line to run and
+ * closing it once it has nothing left
+ *
+ * @return 0 if it still waits for input
+*/
+static int _receive(client_t *client)
+{
+	ssize_t n = read(client->fd, client->input + client->length,
+		SERVER_LINE - client->length);
+	if (n < 0 && errno == EINTR)
+		return 0;
+
+	if (n <= 0)
+		client->ended = 1;
+	else
+		client->length += (size_t)n;
+
+	if (_next_line(client)) {
+		_queue(client);
+		return 1;
+	}
+
+	if (client->ended) {
+		_close_client(client);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Accepts connections and reads those with no request being run, until
+ * told to stop
+ *
+ * @return The connections left waiting for input
+*/
+static client_t *_poll_loop(int listener)
+{
+	client_t *idle = NULL;
+	struct pollfd *fds = NULL;
+	client_t **polled = NULL;
+	size_t capacity = 0;
+
+	while (!stopped) {
+		size_t count = 2;
+		for (client_t *client = idle; client; client = client->next)
+			count++;
+
+		if (count > capacity) {
+			capacity = 2 * count;
+			fds = (struct pollfd *)realloc(fds,
+				capacity * sizeof(struct pollfd));
+			polled = (client_t **)realloc(polled,
+				capacity * sizeof(client_t *));
+			DIE(!fds || !polled, "realloc failed");
+		}
+
+		fds[0] = (struct pollfd) { .fd = listener, .events = POLLIN };
+		fds[1] = (struct pollfd) { .fd = server.wake[0], .events = POLLIN };
+		size_t n = 2;
+		for (client_t *client = idle; client; client = client->next, n++) {
+			fds[n] = (struct pollfd) { .fd = client->fd, .events = POLLIN };
+			polled[n] = client;
+		}
+
+		if (poll(fds, count, -1) < 0) {
+			DIE(errno != EINTR, "poll failed");
+			continue;
+		}
+
+		idle = NULL;
+		for (size_t i = count; i-- > 2;) {
+			client_t *client = polled[i];
+			if (fds[i].revents && _receive(client))
+				continue;
+
+			client->next = idle;
+			idle = client;
+		}
+
+		if (fds[1].revents) {
+			char bytes[64];
+			while (read(server.wake[0], bytes, sizeof(bytes)) > 0)
+				continue;
+
+			pthread_mutex_lock(&server.lock);
+			client_t *done = server.done;
+			server.done = NULL;
+			if (server.stop)
+				stopped = 1;
+			pthread_mutex_unlock(&server.lock);
+
+			/* Their whole lines were run */
+			while (done) {
+				client_t *client = done;
+				done = client->next;
+
+				if (client->ended) {
+					_close_client(client);
+					continue;
+				}
+				client->next = idle;
+				idle = client;
+			}
+		}
+
+		if (fds[0].revents) {
+			int fd = accept(listener, NULL, NULL);
+			if (fd >= 0) {
+				client_t *client = (client_t *)calloc(1, sizeof(client_t));
+				DIE(!client, "calloc failed");
+				client->fd = fd;
+				client->next = idle;
+				idle = client;
+			}
+		}
+	}
+
+	free(fds);
+	free(polled);
+	return idle;
+}
+
+/**
+ * Removes the socket at the path of @a address when no server answers on
+ * it any more
+*/
+static void _reclaim(const struct sockaddr_un *address)
+{
+	struct stat st;
+	if (stat(address->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode))
+		return;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return;
+
+	if (connect(fd, (const struct sockaddr *)address, sizeof(*address)) != 0
+		&& errno == ECONNREFUSED)
+		unlink(address->sun_path);
+	close(fd);
+}
+
+int server_run(const char *path, const server_ops_t *ops, size_t workers)
+{
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	size_t length = strlen(path);
+	if (length >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 0;
+	}
+	memcpy(address.sun_path, path, length + 1);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener >= 0)
+		_reclaim(&address);
+	if (listener < 0
+		|| bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0
+		|| listen(listener, SERVER_BACKLOG) != 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", path,
+			strerror(errno));
+		if (listener >= 0)
+			close(listener);
+		return 0;
+	}
+
+	DIE(pipe(server.wake) != 0, "pipe failed");
+	for (size_t i = 0; i < 2; i++)
+		fcntl(server.wake[i], F_SETFL,
+			fcntl(server.wake[i], F_GETFL) | O_NONBLOCK);
+
+	server.ops = ops;
+	server.stop = 0;
+	stopped = 0;
+
+	struct sigaction action = { .sa_handler = _on_signal };
+	struct sigaction old_int, old_term;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &action, &old_int);
+	sigaction(SIGTERM, &action, &old_term);
+
+	if (!workers)
+		workers = 1;
+	pthread_t *threads = (pthread_t *)malloc(workers * sizeof(pthread_t));
+	DIE(!threads, "malloc failed");
+	for (size_t i = 0; i < workers; i++)
+		DIE(pthread_create(&threads[i], NULL, _worker, NULL) != 0,
+			"pthread_create failed");
+
+	client_t *idle = _poll_loop(listener);
+
+	pthread_mutex_lock(&server.lock);
+	server.stop = 1;
+	pthread_cond_broadcast(&server.work);
+	pthread_mutex_unlock(&server.lock);
+	for (size_t i = 0; i < workers; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	/* Those queued once the workers were done are not answered */
+	_close_clients(idle);
+	_close_clients(server.ready);
+	_close_clients(server.done);
+	server.ready = NULL;
+	server.done = NULL;
+
+	while (server.sessions) {
+		server_session_t *session = server.sessions;
+
+		server.sessions = session->next;
+		ops->close(session->session);
+		_free_session(session);
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	close(listener);
+	unlink(path);
+	close(server.wake[0]);
+	close(server.wake[1]);
+	server.wake[0] = server.wake[1] = -1;
+
+	return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef __SERVER_H
+#define __SERVER_H	1
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Longest request line, the session name included */
+#define SERVER_LINE					8192
+/* Connections the kernel holds until they are accepted */
+#define SERVER_BACKLOG				64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * How a program runs the commands of a session, opened by the first
+ * request naming it. Running a command line writes its replies to @a out
+ * and tells if it ended the session, which is then closed.
+*/
+typedef struct server_ops_t {
+	void *(*open)(void);
+	int (*run)(void *session, char *command_line, FILE *out);
+	void (*close)(void *session);
+} server_ops_t;
+
+/**
+ * Listens on the Unix socket at @a path until a SHUTDOWN request, SIGINT or
+ * SIGTERM. Every request is a line "session command...", answered by the
+ * replies of the command and an empty line. The requests of a connection
+ * are run in order, those of different connections at the same time by
+ * @a workers threads, each with its own scratch arena, one at a time per
+ * session. The sessions left are closed before returning.
+ *
+ * @return 0 if it cannot listen
+*/
+int server_run(const char *path, const server_ops_t *ops, size_t workers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,293 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "utils.h"
+
+#define NAME_SIZE					128
+/* Tries at connecting while the server starts, and the time between two */
+#define CONNECT_TRIES				500
+#define CONNECT_WAIT_NS				10000000L
+/* Past this, the server is taken for stuck and the test fails */
+#define TEST_SECONDS				60
+
+/* The image streamed by one session, and the one another session saves
+ * over its file: other dimensions, which a pass must never see */
+#define OWN_ROWS					6
+#define OWN_COLUMNS					8
+#define OTHER_ROWS					23
+#define OTHER_COLUMNS				37
+
+typedef struct test_t {
+	char dir[NAME_SIZE];
+	char socket[NAME_SIZE];
+	pid_t server;
+	size_t failed;
+} test_t;
+
+/**
+ * One connection to the server
+*/
+typedef struct client_t {
+	FILE *in;
+	FILE *out;
+} client_t;
+
+/**
+ * @return The path of @a name in the scratch directory of @a test
+*/
+static const char *_path(const test_t *test, const char *name)
+{
+	static char path[2][NAME_SIZE];
+	static int next;
+
+	next = !next;
+	snprintf(path[next], NAME_SIZE, "%s/%s", test->dir, name);
+	return path[next];
+}
+
+static void _write_file(const char *path, const void *data, size_t size)
+{
+	FILE *file = fopen(path, "wb");
+	DIE(!file, "fopen failed");
+	DIE(fwrite(data, 1, size, file) != size, "fwrite failed");
+	DIE(fclose(file) != 0, "fclose failed");
+}
+
+/**
+ * Writes a raw greyscale image the way the editor saves one
+ *
+ * @return Its bytes, to be freed
+*/
+static unsigned char *_write_pgm(const char *path, size_t rows,
+	size_t columns, size_t *size)
+{
+	char header[NAME_SIZE];
+	int length = snprintf(header, sizeof(header), "P5\n%zu %zu\n255\n",
+		columns, rows);
+
+	*size = length + rows * columns;
+	unsigned char *data = (unsigned char *)malloc(*size);
+	DIE(!data, "malloc failed");
+
+	memcpy(data, header, length);
+	for (size_t i = 0; i < rows * columns; i++)
+		data[length + i] = (unsigned char)(i * 37 + rows);
+
+	_write_file(path, data, *size);
+	return data;
+}
+
+/**
+ * @return If the file at @a path holds the @a size bytes of @a data
+*/
+static int _same_file(const char *path, const unsigned char *data,
+	size_t size)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return 0;
+
+	int same = 1;
+	for (size_t i = 0; same && i <= size; i++)
+		same = (i < size) ? fgetc(file) == data[i] : fgetc(file) == EOF;
+
+	fclose(file);
+	return same;
+}
+
+static void _start_server(test_t *test, const char *editor)
+{
+	test->server = fork();
+	DIE(test->server < 0, "fork failed");
+
+	if (!test->server) {
+		execl(editor, editor, "-s", "-l", test->socket, (char *)NULL);
+		perror("execl failed");
+		_exit(127);
+	}
+}
+
+static client_t _connect(const test_t *test)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, test->socket, sizeof(address.sun_path) - 1);
+
+	const struct timespec wait = { 0, CONNECT_WAIT_NS };
+	int fd = -1;
+	for (int i = 0; fd < 0 && i < CONNECT_TRIES; i++) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		DIE(fd < 0, "socket failed");
+
+		if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+			close(fd);
+			fd = -1;
+			nanosleep(&wait, NULL);
+		}
+	}
+	DIE(fd < 0, "connect failed");
+
+	client_t client = {
+		.in = fdopen(dup(fd), "r"),
+		.out = fdopen(fd, "w"),
+	};
+	DIE(!client.in || !client.out, "fdopen failed");
+	return client;
+}
+
+static void _disconnect(client_t *client)
+{
+	fclose(client->in);
+	fclose(client->out);
+}
+
+/**
+ * Sends @a request and reads its replies, up to the empty line, the first
+ * one going to @a reply
+ *
+ * @return 0 if the server went away before answering
+*/
+static int _request(client_t *client, const char *request,
+	char reply[SERVER_LINE])
+{
+	char line[SERVER_LINE];
+
+	reply[0] = '\0';
+	if (fprintf(client->out, "%s\n", request) < 0 || fflush(client->out))
+		return 0;
+
+	for (int first = 1; fgets(line, sizeof(line), client->in); first = 0) {
+		if (strcmp(line, "\n") == 0)
+			return 1;
+		if (first)
+			snprintf(reply, SERVER_LINE, "%s", line);
+	}
+
+	return 0;
+}
+
+/**
+ * Sends @a request, whose first reply must start with @a expected
+*/
+static void _expect(test_t *test, client_t *client, const char *request,
+	const char *expected)
+{
+	char reply[SERVER_LINE];
+
+	if (!_request(client, request, reply)) {
+		printf("FAILED %s: no answer\n", request);
+		test->failed++;
+	} else if (strncmp(reply, expected, strlen(expected)) != 0) {
+		printf("FAILED %s: %s", request, (reply[0]) ? reply : "no reply\n");
+		test->failed++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s image_editor\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* Stuck requests end the test, a closed socket only fails a request */
+	alarm(TEST_SECONDS);
+	signal(SIGPIPE, SIG_IGN);
+
+	test_t test;
+	snprintf(test.dir, NAME_SIZE, "/tmp/server_test.XXXXXX");
+	DIE(!mkdtemp(test.dir), "mkdtemp failed");
+	snprintf(test.socket, NAME_SIZE, "%s", _path(&test, "socket"));
+	test.failed = 0;
+
+	/* Pixels no buffer may hold, and a size that wraps around */
+	const char huge[] = "P5\n300000 300000\n255\n";
+	const char wrap[] = "P3\n6148914691236517206 3\n255\n1 2 3\n";
+	_write_file(_path(&test, "huge.pgm"), huge, sizeof(huge) - 1);
+	_write_file(_path(&test, "wrap.ppm"), wrap, sizeof(wrap) - 1);
+
+	size_t own_size, other_size;
+	unsigned char *own = _write_pgm(_path(&test, "own.pgm"), OWN_ROWS,
+		OWN_COLUMNS, &own_size);
+	unsigned char *other = _write_pgm(_path(&test, "other.pgm"),
+		OTHER_ROWS, OTHER_COLUMNS, &other_size);
+
+	_start_server(&test, argv[1]);
+	client_t a = _connect(&test), b = _connect(&test), c = _connect(&test);
+	char request[SERVER_LINE];
+
+	/* One session streams its image from a file */
+	snprintf(request, sizeof(request), "own LOAD %s",
+		_path(&test, "own.pgm"));
+	_expect(&test, &a, request, "Loaded");
+
+	/* Another one asks for more than can be had */
+	snprintf(request, sizeof(request), "big LOAD %s",
+		_path(&test, "huge.pgm"));
+	_expect(&test, &b, request, "Failed to load");
+	snprintf(request, sizeof(request), "big LOAD %s",
+		_path(&test, "wrap.ppm"));
+	_expect(&test, &b, request, "Failed to load");
+	_expect(&test, &b, "big ROTATE 90", "No image loaded");
+
+	/* A third one saves another image over the streamed file */
+	snprintf(request, sizeof(request), "other LOAD %s",
+		_path(&test, "other.pgm"));
+	_expect(&test, &c, request, "Loaded");
+	snprintf(request, sizeof(request), "other SAVE %s",
+		_path(&test, "own.pgm"));
+	_expect(&test, &c, request, "Saved");
+
+	/* The streamed image still reads the file it was loaded from */
+	snprintf(request, sizeof(request), "own SAVE %s",
+		_path(&test, "saved.pgm"));
+	_expect(&test, &a, request, "Saved");
+	_expect(&test, &a, "own EXIT", "");
+	if (!_same_file(_path(&test, "saved.pgm"), own, own_size)) {
+		printf("FAILED own SAVE: not the pixels loaded\n");
+		test.failed++;
+	}
+	if (!_same_file(_path(&test, "own.pgm"), other, other_size)) {
+		printf("FAILED other SAVE: not the pixels saved\n");
+		test.failed++;
+	}
+
+	/* And every session still answers */
+	_expect(&test, &b, "big SELECT ALL", "No image loaded");
+	_expect(&test, &c, "other SELECT ALL", "Selected ALL");
+	_expect(&test, &c, "other EXIT", "");
+	_expect(&test, &b, "SHUTDOWN", "Shutting down");
+
+	_disconnect(&a);
+	_disconnect(&b);
+	_disconnect(&c);
+
+	int status;
+	DIE(waitpid(test.server, &status, 0) != test.server, "waitpid failed");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		printf("FAILED server exit status %d\n", status);
+		test.failed++;
+	}
+
+	const char *names[] = { "huge.pgm", "wrap.ppm", "own.pgm", "other.pgm",
+		"saved.pgm", "socket" };
+	for (size_t i = 0; i < ARRAY_SIZE(names); i++)
+		unlink(_path(&test, names[i]));
+	rmdir(test.dir);
+	free(own);
+	free(other);
+
+	printf("Server test: %zu failed\n", test.failed);
+	return (test.failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
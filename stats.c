@@ -0,0 +1,223 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "utils.h"
+
+/* Distinct command names kept, later ones are counted as "OTHER" */
+#define STATS_COMMANDS				32
+#define STATS_NAME					16
+
+typedef struct command_stats_t {
+	char name[STATS_NAME];
+	unsigned long calls;
+	double wall;						/* seconds				*/
+	double cpu;
+	unsigned long long allocated;		/* bytes of pixels		*/
+	unsigned long long freed;
+	unsigned long long pixels;
+} command_stats_t;
+
+int stats_enabled;
+int stats_tracing;
+
+static struct {
+	double origin;						/* stats_init			*/
+
+	command_stats_t commands[STATS_COMMANDS];
+	size_t count;
+
+	/* The command running, its start and the counters at that time */
+	command_stats_t *current;
+	double wall, cpu;
+	unsigned long long allocated, freed, pixels;
+
+	/* Pixel bytes currently allocated, and the most ever */
+	unsigned long long in_use, peak;
+
+	FILE *trace;
+	pthread_mutex_t trace_lock;
+	int events;
+} stats = {
+	.trace_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static double _clock(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void stats_init(void)
+{
+	const char *trace = getenv("IMAGE_EDITOR_TRACE");
+	const char *enabled = getenv("IMAGE_EDITOR_STATS");
+
+	if (trace && *trace) {
+		stats.trace = fopen(trace, "w");
+		DIE(!stats.trace, "fopen failed");
+
+		fputs("[\n", stats.trace);
+		stats_tracing = 1;
+	}
+
+	stats_enabled = stats_tracing || (enabled && *enabled && *enabled != '0');
+	stats.origin = _clock(CLOCK_MONOTONIC);
+}
+
+void stats_finish(void)
+{
+	if (!stats.trace)
+		return;
+
+	fputs("\n]\n", stats.trace);
+	fclose(stats.trace);
+	stats.trace = NULL;
+	stats_tracing = 0;
+}
+
+/**
+ * Writes one complete event, @a args being the inside of a JSON object
+*/
+static void _trace_event(const char *name, const char *category, size_t tid,
+	double start, double end, const char *args)
+{
+	pthread_mutex_lock(&stats.trace_lock);
+	if (stats.trace)
+		fprintf(stats.trace, "%s{\"name\": \"%s\", \"cat\": \"%s\", "
+			"\"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, "
+			"\"dur\": %.3f, \"args\": {%s}}",
+			(stats.events++) ? ",\n" : "", name, category, tid,
+			start * 1e6, (end - start) * 1e6, args);
+	pthread_mutex_unlock(&stats.trace_lock);
+}
+
+double stats_start(void)
+{
+	if (!stats_tracing)
+		return 0;
+
+	return _clock(CLOCK_MONOTONIC) - stats.origin;
+}
+
+void stats_span(const char *name, size_t tid, double start)
+{
+	if (!stats_tracing)
+		return;
+
+	_trace_event(name, "stage", tid, start,
+		_clock(CLOCK_MONOTONIC) - stats.origin, "");
+}
+
+void _stats_memory(size_t allocated, size_t freed)
+{
+	__atomic_add_fetch(&stats.allocated, allocated, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.freed, freed, __ATOMIC_RELAXED);
+
+	unsigned long long in_use = __atomic_add_fetch(&stats.in_use,
+		allocated - freed, __ATOMIC_RELAXED);
+	unsigned long long peak = __atomic_load_n(&stats.peak, __ATOMIC_RELAXED);
+	while (in_use > peak && !__atomic_compare_exchange_n(&stats.peak, &peak,
+		in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void _stats_pixels(size_t pixels)
+{
+	__atomic_add_fetch(&stats.pixels, pixels, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return The totals of the command named @a name
+*/
+static command_stats_t *_command(const char *name)
+{
+	for (size_t i = 0; i < stats.count; i++)
+		if (strcmp(stats.commands[i].name, name) == 0)
+			return &stats.commands[i];
+
+	if (stats.count == STATS_COMMANDS)
+		return _command("OTHER");
+
+	command_stats_t *command = &stats.commands[stats.count++];
+	snprintf(command->name, STATS_NAME, "%s", name);
+	return command;
+}
+
+void stats_command_begin(const char *command_line)
+{
+	if (!stats_enabled)
+		return;
+
+	char name[STATS_NAME];
+	if (sscanf(command_line, "%15s", name) != 1)
+		snprintf(name, STATS_NAME, "%s", "(empty)");
+
+	stats.current = _command(name);
+	stats.wall = _clock(CLOCK_MONOTONIC);
+	stats.cpu = _clock(CLOCK_PROCESS_CPUTIME_ID);
+	stats.allocated = 0;
+	stats.freed = 0;
+	stats.pixels = 0;
+}
+
+void stats_command_end(void)
+{
+	command_stats_t *command = stats.current;
+	if (!stats_enabled || !command)
+		return;
+
+	double end = _clock(CLOCK_MONOTONIC);
+	double cpu = _clock(CLOCK_PROCESS_CPUTIME_ID) - stats.cpu;
+
+	command->calls++;
+	command->wall += end - stats.wall;
+	command->cpu += cpu;
+	command->allocated += stats.allocated;
+	command->freed += stats.freed;
+	command->pixels += stats.pixels;
+	stats.current = NULL;
+
+	if (!stats_tracing)
+		return;
+
+	char args[BUFSIZ];
+	snprintf(args, sizeof(args), "\"cpu_ms\": %.3f, \"allocated\": %llu, "
+		"\"freed\": %llu, \"pixels\": %llu", cpu * 1e3, stats.allocated,
+		stats.freed, stats.pixels);
+	_trace_event(command->name, "command", 0, stats.wall - stats.origin,
+		end - stats.origin, args);
+}
+
+void stats_print(FILE *out)
+{
+	if (!stats_enabled) {
+		fputs("Stats disabled, set IMAGE_EDITOR_STATS\n", out);
+		return;
+	}
+
+	fprintf(out, "%-16s%8s%12s%12s%14s%14s%14s\n", "COMMAND", "CALLS",
+		"WALL_MS", "CPU_MS", "ALLOCATED", "FREED", "PIXELS");
+	for (size_t i = 0; i < stats.count; i++) {
+		command_stats_t *command = &stats.commands[i];
+
+		/* STATS itself is still running */
+		if (!command->calls)
+			continue;
+
+		fprintf(out, "%-16s%8lu%12.3f%12.3f%14llu%14llu%14llu\n",
+			command->name, command->calls, command->wall * 1e3,
+			command->cpu * 1e3, command->allocated, command->freed,
+			command->pixels);
+	}
+
+	fprintf(out, "Pixel memory: %llu bytes in use, %llu peak\n",
+		stats.in_use, stats.peak);
+}
@@ -0,0 +1,79 @@
+#ifndef __STATS_H
+#define __STATS_H	1
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Set by stats_init when IMAGE_EDITOR_STATS or IMAGE_EDITOR_TRACE is */
+extern int stats_enabled;
+/* Set when spans are written to the IMAGE_EDITOR_TRACE file */
+extern int stats_tracing;
+
+/**
+ * Reads the environment. Does nothing more when both variables are unset,
+ * every other call then costs one test of a flag.
+*/
+void stats_init(void);
+
+/**
+ * Closes the trace, which is a Chrome trace (JSON array of events)
+*/
+void stats_finish(void);
+
+/**
+ * Brackets one command line: wall time, CPU time of every thread, pixel
+ * buffers allocated and freed, and pixels touched are charged to its
+ * first word
+*/
+void stats_command_begin(const char *command_line);
+void stats_command_end(void);
+
+/**
+ * Prints the totals of every command to @a out, for STATS
+*/
+void stats_print(FILE *out);
+
+/**
+ * @return Seconds since stats_init, or 0 when not tracing
+*/
+double stats_start(void);
+
+/**
+ * Writes a span from @a start to now, run by thread @a tid (0 for the main
+ * thread, the pool worker number otherwise)
+*/
+void stats_span(const char *name, size_t tid, double start);
+
+void _stats_memory(size_t allocated, size_t freed);
+void _stats_pixels(size_t pixels);
+
+/**
+ * Counters, for any thread
+*/
+static inline void stats_alloc(size_t bytes)
+{
+	if (stats_enabled)
+		_stats_memory(bytes, 0);
+}
+
+static inline void stats_free(size_t bytes)
+{
+	if (stats_enabled)
+		_stats_memory(0, bytes);
+}
+
+static inline void stats_pixels(size_t pixels)
+{
+	if (stats_enabled)
+		_stats_pixels(pixels);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,450 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "histogram.h"
+#include "history.h"
+#include "netpbm.h"
+#include "stats.h"
+#include "stream.h"
+#include "thread_pool.h"
+
+typedef struct stream_stage_t {
+	/* Pixels the stage changes, in rows and columns of the file */
+	size_t r0, r1;
+	size_t c0, c1;
+
+	/* A kernel, or a lookup table when @a table is set */
+	kernel_t kernel;
+	int table;
+	unsigned char lut[PIXEL_MAX_VALUE + 1];
+} stream_stage_t;
+
+struct stream_t {
+	/* Kept open: a file saved over it leaves the pixels as they were */
+	netpbm_reader_t *reader;
+	netpbm_header_t header;
+	dev_t device;
+	ino_t inode;
+
+	/* File row and column of the top left pixel, moved by CROP */
+	size_t row0, col0;
+
+	stream_stage_t *stages;
+	size_t count, capacity;
+	size_t reach;						/* rows kernels read	*/
+};
+
+/**
+ * Receives the next rows of the result, as an image over a band
+*/
+typedef void (*stream_sink_t)(void *arg, image_t *rows);
+
+image_t *stream_open(const char *path)
+{
+	netpbm_header_t header;
+	netpbm_reader_t *reader = netpbm_open(path, &header);
+	struct stat st;
+	if (!reader || fstat(netpbm_fileno(reader), &st) != 0) {
+		netpbm_close(reader);
+		return NULL;
+	}
+
+	struct stream_t *stream =
+		(struct stream_t *)calloc(1, sizeof(struct stream_t));
+	DIE(!stream, "calloc failed");
+
+	stream->reader = reader;
+	stream->header = header;
+	stream->device = st.st_dev;
+	stream->inode = st.st_ino;
+
+	/* No pixels until something needs all of them */
+	image_t *image = create_mapped_image(NULL, 0, NULL, header.rows,
+		header.columns, TYPE_FROM_CHR(header.format));
+	image->source = stream;
+
+	return image;
+}
+
+/**
+ * @return Room for one more stage
+*/
+static stream_stage_t *_next_stage(struct stream_t *stream)
+{
+	if (stream->count == stream->capacity) {
+		stream->capacity = (stream->capacity) ? 2 * stream->capacity : 8;
+		stream->stages = (stream_stage_t *)realloc(stream->stages,
+			stream->capacity * sizeof(stream_stage_t));
+		DIE(!stream->stages, "realloc failed");
+	}
+
+	return &stream->stages[stream->count++];
+}
+
+void stream_crop(image_t *image, image_selection_t selection)
+{
+	image->source->row0 += selection.uprow;
+	image->source->col0 += selection.lcol;
+
+	image->rows = selection.dwrow - selection.uprow;
+	image->columns = selection.rcol - selection.lcol;
+	update_selection(&image->selection, 0, image->rows, 0, image->columns);
+}
+
+void stream_apply(image_t *image, image_selection_t selection,
+	const kernel_t *kernel)
+{
+	struct stream_t *stream = image->source;
+
+	if (image->rows < kernel->rows || image->columns < kernel->columns)
+		return;
+
+	/* Same edges as apply_effect, the ones of the cropped image */
+	size_t ry = kernel->rows / 2, rx = kernel->columns / 2;
+	size_t r0 = (selection.uprow > ry) ? selection.uprow : ry;
+	size_t c0 = (selection.lcol > rx) ? selection.lcol : rx;
+	size_t r1 = (selection.dwrow < image->rows - ry)
+		? selection.dwrow : image->rows - ry;
+	size_t c1 = (selection.rcol < image->columns - rx)
+		? selection.rcol : image->columns - rx;
+
+	if (r0 >= r1 || c0 >= c1)
+		return;
+
+	stream_stage_t *stage = _next_stage(stream);
+	stage->r0 = stream->row0 + r0;
+	stage->r1 = stream->row0 + r1;
+	stage->c0 = stream->col0 + c0;
+	stage->c1 = stream->col0 + c1;
+	stage->kernel = *kernel;
+	stage->table = 0;
+
+	stream->reach += ry;
+}
+
+void stream_table(image_t *image, image_selection_t selection,
+	const unsigned char lut[PIXEL_MAX_VALUE + 1])
+{
+	struct stream_t *stream = image->source;
+	stream_stage_t *stage = _next_stage(stream);
+
+	stage->r0 = stream->row0 + selection.uprow;
+	stage->r1 = stream->row0 + selection.dwrow;
+	stage->c0 = stream->col0 + selection.lcol;
+	stage->c1 = stream->col0 + selection.rcol;
+	memcpy(stage->lut, lut, sizeof(stage->lut));
+	stage->table = 1;
+}
+
+void stream_mark(const image_t *image, stream_mark_t *mark)
+{
+	const struct stream_t *stream = image->source;
+
+	mark->row0 = stream->row0;
+	mark->col0 = stream->col0;
+	mark->rows = image->rows;
+	mark->columns = image->columns;
+	mark->selection = image->selection;
+	mark->count = stream->count;
+	mark->reach = stream->reach;
+}
+
+void stream_swap(image_t *image, stream_mark_t *mark)
+{
+	struct stream_t *stream = image->source;
+	stream_mark_t now;
+
+	stream_mark(image, &now);
+	stream->row0 = mark->row0;
+	stream->col0 = mark->col0;
+	image->rows = mark->rows;
+	image->columns = mark->columns;
+	image->selection = mark->selection;
+	stream->count = mark->count;
+	stream->reach = mark->reach;
+	*mark = now;
+}
+
+typedef struct table_job_t {
+	image_t *image;
+	image_selection_t selection;
+	const unsigned char *lut;
+	size_t bands;
+} table_job_t;
+
+static void _table_band(void *arg, size_t band)
+{
+	table_job_t *job = (table_job_t *)arg;
+	size_t lo, hi;
+
+	pool_band(job->selection.dwrow - job->selection.uprow, job->bands, band,
+		&lo, &hi);
+	for (size_t i = job->selection.uprow + lo;
+		i < job->selection.uprow + hi; i++) {
+		pixel_t *row = image_row(job->image, i);
+
+		for (size_t j = job->selection.lcol; j < job->selection.rcol; j++)
+			row[j].val = job->lut[row[j].val];
+	}
+}
+
+/**
+ * Runs every recorded stage on @a band, which holds the file rows starting
+ * at @a top. Rows closer than the reach of the kernels to a cut side of the
+ * band come out wrong, the caller only keeps the others.
+ *
+ * @return 0 if there was no memory to run a kernel
+*/
+static int _run_stages(struct stream_t *stream, image_t *band, size_t top)
+{
+	for (size_t s = 0; s < stream->count; s++) {
+		stream_stage_t *stage = &stream->stages[s];
+		size_t r0 = (stage->r0 > top) ? stage->r0 : top;
+		size_t r1 = (stage->r1 < top + band->rows)
+			? stage->r1 : top + band->rows;
+
+		if (r0 >= r1)
+			continue;
+
+		image_selection_t selection;
+		update_selection(&selection, r0 - top, r1 - top,
+			stage->c0, stage->c1);
+
+		if (!stage->table) {
+			if (!apply_effect(band, selection, &stage->kernel))
+				return 0;
+			continue;
+		}
+
+		table_job_t job = {
+			.image = band,
+			.selection = selection,
+			.lut = stage->lut,
+			.bands = pool_split(r1 - r0, POOL_GRAIN),
+		};
+		stats_pixels((r1 - r0) * (stage->c1 - stage->c0));
+		pool_run(job.bands, _table_band, &job);
+	}
+
+	return 1;
+}
+
+/**
+ * Reads the file once more, from the first row the image needs to its
+ * last, and hands the result to @a sink a band at a time. Consecutive bands
+ * overlap by the rows the kernels read around them.
+ *
+ * @return 0 if there was no memory for the bands, or the file could not be
+ * gone back over, @a sink having had only some of them
+*/
+static int _stream_run(image_t *image, stream_sink_t sink, void *arg)
+{
+	struct stream_t *stream = image->source;
+	double start = stats_start();
+	netpbm_reader_t *reader = stream->reader;
+	netpbm_header_t header = stream->header;
+
+	size_t reach = stream->reach;
+	size_t first = stream->row0, last = stream->row0 + image->rows;
+
+	size_t row_size = pixel_stride(header.columns) * sizeof(pixel_t);
+	size_t height = (row_size) ? STREAM_BAND_SIZE / row_size : 1;
+	if (height < POOL_GRAIN * pool_workers())
+		height = POOL_GRAIN * pool_workers();
+
+	/* File rows as read, and the same rows going through the stages */
+	image_t *source = create_image(height + 2 * reach, header.columns,
+		image->type);
+	image_t *band = create_image(height + 2 * reach, header.columns,
+		image->type);
+
+	/* @a source holds the file rows [top, loaded) */
+	size_t top = (first > reach) ? first - reach : 0;
+	size_t loaded = top;
+	int done = (source && band && netpbm_rewind(reader)
+		&& netpbm_skip_rows(reader, top));
+
+	/* The scratch space of one band is not needed by the next one */
+	size_t mark = alloc_mark();
+	for (size_t lo = first; done && lo < last; lo += height) {
+		size_t hi = (lo + height < last) ? lo + height : last;
+		size_t begin = (lo > reach) ? lo - reach : 0;
+		size_t end = (hi + reach < header.rows) ? hi + reach : header.rows;
+
+		/* Keep the rows shared with the previous band, read the others */
+		if (begin > top) {
+			memmove(source->pixels, image_row(source, begin - top),
+				(loaded - begin) * source->stride * sizeof(pixel_t));
+			top = begin;
+		}
+
+		for (; loaded < end; loaded++)
+			netpbm_read_row(reader, image_row(source, loaded - top));
+
+		band->rows = end - begin;
+		memcpy(band->pixels, source->pixels,
+			band->rows * band->stride * sizeof(pixel_t));
+		if (!_run_stages(stream, band, begin)) {
+			done = 0;
+			break;
+		}
+
+		image_t rows = *band;
+		rows.pixels = image_row(band, lo - begin) + stream->col0;
+		rows.rows = hi - lo;
+		rows.columns = image->columns;
+		update_selection(&rows.selection, 0, rows.rows, 0, rows.columns);
+
+		sink(arg, &rows);
+		alloc_rewind(mark);
+	}
+
+	free_image(band);
+	free_image(source);
+	stats_span("stream pass", 0, start);
+	return done;
+}
+
+typedef struct histogram_sink_t {
+	image_selection_t region;
+	size_t row;							/* of the next rows		*/
+	unsigned long *fq;
+} histogram_sink_t;
+
+static void _histogram_rows(void *arg, image_t *rows)
+{
+	histogram_sink_t *job = (histogram_sink_t *)arg;
+	size_t lo = job->row, hi = job->row + rows->rows;
+
+	/* The part of the region in these rows */
+	image_selection_t region = job->region;
+	region.uprow = (region.uprow > lo) ? region.uprow - lo : 0;
+	region.dwrow = (region.dwrow < hi) ? region.dwrow - lo : rows->rows;
+	if (job->region.dwrow > lo && job->region.uprow < hi)
+		histogram_count(rows, region, job->fq);
+
+	job->row = hi;
+}
+
+int stream_histogram(image_t *image, image_selection_t region,
+	unsigned long fq[PIXEL_MAX_VALUE + 1])
+{
+	histogram_sink_t job = {
+		.region = region,
+		.fq = fq,
+	};
+
+	return _stream_run(image, _histogram_rows, &job);
+}
+
+typedef struct pixels_sink_t {
+	FILE *out_file;
+	int binary;
+} pixels_sink_t;
+
+static void _write_rows(void *arg, image_t *rows)
+{
+	pixels_sink_t *job = (pixels_sink_t *)arg;
+
+	write_pixels(job->out_file, rows, job->binary);
+}
+
+int stream_pixels(FILE *out_file, image_t *image, int binary)
+{
+	pixels_sink_t job = {
+		.out_file = out_file,
+		.binary = binary,
+	};
+
+	return _stream_run(image, _write_rows, &job);
+}
+
+typedef struct load_sink_t {
+	pixel_t *pixels;
+	size_t stride;
+	size_t done;						/* rows copied so far	*/
+} load_sink_t;
+
+static void _load_rows(void *arg, image_t *rows)
+{
+	load_sink_t *job = (load_sink_t *)arg;
+
+	for (size_t i = 0; i < rows->rows; i++, job->done++)
+		memcpy(job->pixels + job->done * job->stride, image_row(rows, i),
+			rows->columns * sizeof(pixel_t));
+}
+
+image_t *stream_render(image_t *image, const stream_mark_t *mark)
+{
+	stream_mark_t now = *mark;
+
+	/* Taken back to the mark for one pass, then forward again */
+	stream_swap(image, &now);
+	image_t *copy = create_image(image->rows, image->columns, image->type);
+	if (copy) {
+		load_sink_t job = {
+			.pixels = copy->pixels,
+			.stride = copy->stride,
+		};
+
+		if (_stream_run(image, _load_rows, &job)) {
+			copy->selection = image->selection;
+		} else {
+			free_image(copy);
+			copy = NULL;
+		}
+	}
+	stream_swap(image, &now);
+
+	return copy;
+}
+
+int stream_reads(const image_t *image, const char *path)
+{
+	struct stat target;
+
+	return image->source && stat(path, &target) == 0
+		&& image->source->device == target.st_dev
+		&& image->source->inode == target.st_ino;
+}
+
+int stream_load(image_t *image)
+{
+	load_sink_t job = {
+		.stride = pixel_stride(image->columns),
+	};
+
+	job.pixels = create_pixels(image->rows, job.stride);
+	if (!job.pixels)
+		return 0;
+
+	/* The stages the history holds no longer have a file to run on */
+	history_unstream(image);
+	if (!_stream_run(image, _load_rows, &job)) {
+		alloc_release(job.pixels);
+		history_drop(image);
+		return 0;
+	}
+	stream_close(image);
+
+	image->pixels = job.pixels;
+	image->buffer = job.pixels;
+	image->stride = job.stride;
+	return 1;
+}
+
+void stream_close(image_t *image)
+{
+	struct stream_t *stream = image->source;
+	if (!stream)
+		return;
+
+	netpbm_close(stream->reader);
+	free(stream->stages);
+	free(stream);
+	image->source = NULL;
+}
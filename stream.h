@@ -0,0 +1,94 @@
+#ifndef __STREAM_H
+#define __STREAM_H	1
+
+#include <stdio.h>
+
+#include "image.h"
+
+/* Bytes of pixels in one band of rows, halo rows not included */
+#define STREAM_BAND_SIZE			(1 << 23)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Where a streamed image stands: its window of the file, its selection, how
+ * many stages are recorded and how far their kernels reach
+*/
+typedef struct stream_mark_t {
+	size_t row0, col0;
+	size_t rows, columns;
+	image_selection_t selection;
+	size_t count, reach;
+} stream_mark_t;
+
+/**
+ * Opens @a path as a streamed image: only the header is read. CROP, APPLY
+ * and EQUALIZE are recorded, and every pass over the pixels (SAVE,
+ * HISTOGRAM, the histogram of EQUALIZE) reads the file again in bands of
+ * rows, so memory does not grow with the height of the image. The file
+ * stays open: one renamed over its path is not the one read.
+ *
+ * @return NULL if the file is not an image with values up to 255
+*/
+image_t *stream_open(const char *path);
+
+/**
+ * Operations recorded on a streamed image
+*/
+void stream_crop(image_t *image, image_selection_t selection);
+void stream_apply(image_t *image, image_selection_t selection,
+	const kernel_t *kernel);
+void stream_table(image_t *image, image_selection_t selection,
+	const unsigned char lut[PIXEL_MAX_VALUE + 1]);
+
+/**
+ * Exchanges where @a image stands with @a mark, for UNDO and REDO. The
+ * stages past the shorter of both are kept until another one is recorded.
+*/
+void stream_mark(const image_t *image, stream_mark_t *mark);
+void stream_swap(image_t *image, stream_mark_t *mark);
+
+/**
+ * @return The pixels of @a image as it stood at @a mark, read whole, or NULL
+ * if there is no memory for them
+*/
+image_t *stream_render(image_t *image, const stream_mark_t *mark);
+
+/**
+ * Passes over the pixels of a streamed image
+ *
+ * @return 0 if there was no memory for a band of rows, the pass left half
+ * done
+*/
+int stream_histogram(image_t *image, image_selection_t region,
+	unsigned long fq[PIXEL_MAX_VALUE + 1]);
+int stream_pixels(FILE *out_file, image_t *image, int binary);
+
+/**
+ * @return If @a image is streamed from the file at @a path, which a save
+ * must not replace while it is still read
+*/
+int stream_reads(const image_t *image, const char *path);
+
+/**
+ * Reads the whole image into memory, for the operations that cannot be
+ * streamed. The image is an ordinary one afterwards, its history holding
+ * whole copies of it instead of stages (history_unstream).
+ *
+ * @return 0 if there is no memory for the pixels, the image still being
+ * streamed
+*/
+int stream_load(image_t *image);
+
+/**
+ * Forgets the file and operations of an image that is going away
+*/
+void stream_close(image_t *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+#define MAX_WORKERS					1024
+
+typedef struct thread_pool_t {
+	pthread_t *threads;
+	size_t workers;						/* including the caller	*/
+
+	/* Only one job at a time, later callers run their own */
+	pthread_mutex_t submit;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+
+	/* The current job */
+	pool_task_t task;
+	void *arg;
+	alloc_arena_t *arena;				/* of the caller		*/
+	size_t bands;
+	unsigned long generation;
+	size_t pending;
+	int stop;
+} thread_pool_t;
+
+static thread_pool_t pool = {
+	.workers = 1,
+	.submit = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Worker @a id runs bands id, id + workers, ...
+*/
+static void _run_bands(size_t id)
+{
+	for (size_t band = id; band < pool.bands; band += pool.workers) {
+		double start = stats_start();
+
+		pool.task(pool.arg, band);
+		stats_span("pool band", id, start);
+	}
+}
+
+static void *_worker(void *arg)
+{
+	size_t id = (size_t)arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (!pool.stop && pool.generation == seen)
+			pthread_cond_wait(&pool.start, &pool.lock);
+		if (pool.stop)
+			break;
+
+		seen = pool.generation;
+		alloc_use(pool.arena);
+		pthread_mutex_unlock(&pool.lock);
+
+		_run_bands(id);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+void pool_init(size_t workers)
+{
+	if (!workers) {
+		const char *env = getenv("IMAGE_EDITOR_THREADS");
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (env && atol(env) > 0)
+			workers = (size_t)atol(env);
+		else
+			workers = (online > 0) ? (size_t)online : 1;
+	}
+
+	if (workers > MAX_WORKERS)
+		workers = MAX_WORKERS;
+
+	pool_destroy();
+	if (workers == 1)
+		return;
+
+	pool.threads = (pthread_t *)malloc(workers * sizeof(pthread_t));
+	DIE(!pool.threads, "malloc failed");
+
+	pool.stop = 0;
+	pool.workers = workers;
+	for (size_t i = 1; i < workers; i++)
+		DIE(pthread_create(&pool.threads[i], NULL, _worker, (void *)i) != 0,
+			"pthread_create failed");
+}
+
+void pool_destroy(void)
+{
+	if (!pool.threads)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (size_t i = 1; i < pool.workers; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.workers = 1;
+}
+
+size_t pool_workers(void)
+{
+	return pool.workers;
+}
+
+size_t pool_split(size_t count, size_t grain)
+{
+	size_t bands = (grain) ? count / grain : count;
+
+	if (bands > pool.workers)
+		bands = pool.workers;
+	return (bands) ? bands : 1;
+}
+
+void pool_band(size_t count, size_t bands, size_t band,
+	size_t *begin, size_t *end)
+{
+	size_t size = count / bands;
+	size_t extra = count % bands;
+
+	/* The first @a extra bands take one more item */
+	*begin = band * size + ((band < extra) ? band : extra);
+	*end = *begin + size + ((band < extra) ? 1 : 0);
+}
+
+void pool_run(size_t bands, pool_task_t task, void *arg)
+{
+	if (bands <= 1 || pool.workers <= 1
+		|| pthread_mutex_trylock(&pool.submit) != 0) {
+		for (size_t band = 0; band < bands; band++)
+			task(arg, band);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.task = task;
+	pool.arg = arg;
+	pool.arena = alloc_arena();
+	pool.bands = bands;
+	pool.pending = pool.workers - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	_run_bands(0);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool.submit);
+}
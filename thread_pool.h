@@ -0,0 +1,53 @@
+#ifndef __THREAD_POOL_H
+#define __THREAD_POOL_H	1
+
+#include <stddef.h>
+
+/* Fewest rows worth handing to another thread */
+#define POOL_GRAIN					64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Runs band @a band of a job. Bands are independent of the thread they run
+ * on, so results only depend on how the work was split.
+*/
+typedef void (*pool_task_t)(void *arg, size_t band);
+
+/**
+ * Starts the process-wide pool, @a workers counting the calling thread.
+ * 0 means the IMAGE_EDITOR_THREADS variable, or one per online CPU.
+*/
+void pool_init(size_t workers);
+void pool_destroy(void);
+
+/**
+ * @return The number of threads taking part in a job
+*/
+size_t pool_workers(void);
+
+/**
+ * @return How many bands to cut @a count items into, at least @a grain each
+*/
+size_t pool_split(size_t count, size_t grain);
+
+/**
+ * Bounds [@a begin, @a end) of band @a band when @a count items are
+ * cut into @a bands equal parts
+*/
+void pool_band(size_t count, size_t bands, size_t band,
+	size_t *begin, size_t *end);
+
+/**
+ * Runs @a task on every band and returns once all of them are done.
+ * Nested or concurrent calls run on the calling thread alone.
+*/
+void pool_run(size_t bands, pool_task_t task, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
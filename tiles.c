@@ -0,0 +1,215 @@
+#define _POSIX_C_SOURCE				200809L
+/* MAP_ANONYMOUS, MAP_NORESERVE and the madvise advice values */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "tiles.h"
+#include "alloc.h"
+#include "stats.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+struct tiles_t {
+	/* The private mapping of the file, and what the tiles are read from */
+	unsigned char *data;
+	size_t size;
+	const unsigned char *values;
+	size_t length;
+	tiles_decode_t decode;
+
+	/* Pixel (0, 0) of the file in the buffer, whose rows are those of the
+	 * file: windows of it are found by where they start */
+	pixel_t *base;
+	size_t rows, columns;
+
+	/* Tiles of @a side across and down, set once decoded, and how many
+	 * are not */
+	size_t side, across, down;
+	unsigned char *decoded;
+	size_t left;
+};
+
+typedef struct fetch_job_t {
+	const struct tiles_t *tiles;
+	const size_t *list;					/* tiles to decode		*/
+	size_t count;
+	size_t bands;
+} fetch_job_t;
+
+static int enabled;
+
+void tiles_enable(int enable)
+{
+	enabled = enable;
+}
+
+int tiles_enabled(void)
+{
+	return enabled;
+}
+
+image_t *tiles_open(unsigned char *data, size_t size, size_t offset,
+	size_t rows, size_t columns, image_type_t type, size_t side,
+	tiles_decode_t decode)
+{
+	void *pixels = MAP_FAILED;
+	size_t bytes = rows * columns * sizeof(pixel_t);
+	if (!columns || rows <= SIZE_MAX / sizeof(pixel_t) / columns)
+		pixels = mmap(NULL, (bytes) ? bytes : 1, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (pixels == MAP_FAILED) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	/* A tile is a few bytes of every row it covers: huge pages would take
+	 * rows of the whole width */
+#ifdef MADV_NOHUGEPAGE
+	madvise(pixels, (bytes) ? bytes : 1, MADV_NOHUGEPAGE);
+#endif
+
+	struct tiles_t *tiles = (struct tiles_t *)calloc(1,
+		sizeof(struct tiles_t));
+	DIE(!tiles, "calloc failed");
+
+	tiles->data = data;
+	tiles->size = size;
+	tiles->values = data + offset;
+	tiles->length = size - offset;
+	tiles->decode = decode;
+	tiles->base = (pixel_t *)pixels;
+	tiles->rows = rows;
+	tiles->columns = columns;
+	tiles->side = side;
+	tiles->across = (columns + side - 1) / side;
+	tiles->down = (rows + side - 1) / side;
+	tiles->left = tiles->across * tiles->down;
+	tiles->decoded = (unsigned char *)calloc(tiles->left + 1, 1);
+	DIE(!tiles->decoded, "calloc failed");
+
+	/* Read a tile at a time, wherever the commands go */
+	posix_madvise(data, size, POSIX_MADV_RANDOM);
+
+	image_t *image = create_mapped_image(pixels, (bytes) ? bytes : 1,
+		(pixel_t *)pixels, rows, columns, type);
+	/* Nothing to decode in an empty image */
+	if (!tiles->left) {
+		tiles_close(tiles);
+		tiles = NULL;
+	}
+	image->tiles = tiles;
+
+	return image;
+}
+
+/**
+ * @return The pixels of tile @a index on a side of @a length pixels
+*/
+static inline size_t _side(const struct tiles_t *tiles, size_t index,
+	size_t length)
+{
+	size_t first = index * tiles->side;
+
+	return (first + tiles->side < length) ? tiles->side : length - first;
+}
+
+static void _fetch_band(void *arg, size_t band)
+{
+	const fetch_job_t *job = (const fetch_job_t *)arg;
+	const struct tiles_t *tiles = job->tiles;
+	size_t lo, hi;
+
+	pool_band(job->count, job->bands, band, &lo, &hi);
+	for (size_t t = lo; t < hi; t++) {
+		size_t y = job->list[t] / tiles->across;
+		size_t x = job->list[t] % tiles->across;
+		tiles_tile_t tile = {
+			.index = job->list[t],
+			.top = y * tiles->side,
+			.left = x * tiles->side,
+			.rows = _side(tiles, y, tiles->rows),
+			.columns = _side(tiles, x, tiles->columns),
+			.width = tiles->columns,
+			.stride = tiles->columns,
+		};
+
+		tile.pixels = tiles->base + tile.top * tiles->columns + tile.left;
+		tiles->decode(tiles->values, tiles->length, &tile);
+	}
+}
+
+void tiles_fetch(image_t *image, image_selection_t region, size_t reach)
+{
+	struct tiles_t *tiles = image->tiles;
+	if (!tiles || region.uprow >= region.dwrow || region.lcol >= region.rcol)
+		return;
+
+	/* Where the window of the image starts in the file */
+	size_t offset = image->pixels - tiles->base;
+	size_t top = offset / tiles->columns, left = offset % tiles->columns;
+
+	size_t r0 = top + ((region.uprow > reach) ? region.uprow - reach : 0);
+	size_t r1 = top + ((region.dwrow + reach < image->rows)
+		? region.dwrow + reach : image->rows);
+	size_t c0 = left + ((region.lcol > reach) ? region.lcol - reach : 0);
+	size_t c1 = left + ((region.rcol + reach < image->columns)
+		? region.rcol + reach : image->columns);
+
+	size_t side = tiles->side;
+	size_t *list = (size_t *)alloc_scratch(((r1 - 1) / side - r0 / side + 1)
+		* ((c1 - 1) / side - c0 / side + 1) * sizeof(size_t));
+	size_t count = 0, pixels = 0;
+
+	for (size_t y = r0 / side; y <= (r1 - 1) / side; y++)
+		for (size_t x = c0 / side; x <= (c1 - 1) / side; x++) {
+			size_t tile = y * tiles->across + x;
+			if (tiles->decoded[tile])
+				continue;
+
+			tiles->decoded[tile] = 1;
+			list[count++] = tile;
+			pixels += _side(tiles, y, tiles->rows)
+				* _side(tiles, x, tiles->columns);
+		}
+
+	if (!count)
+		return;
+
+	double start = stats_start();
+	fetch_job_t job = {
+		.tiles = tiles,
+		.list = list,
+		.count = count,
+		.bands = pool_split(count, 1),
+	};
+	pool_run(job.bands, _fetch_band, &job);
+	stats_pixels(pixels);
+	stats_span("decode tiles", 0, start);
+
+	tiles->left -= count;
+	if (!tiles->left) {
+		tiles_close(tiles);
+		image->tiles = NULL;
+	}
+}
+
+void tiles_load(image_t *image)
+{
+	image_selection_t all;
+
+	update_selection(&all, 0, image->rows, 0, image->columns);
+	tiles_fetch(image, all, 0);
+}
+
+void tiles_close(struct tiles_t *tiles)
+{
+	if (!tiles)
+		return;
+
+	munmap(tiles->data, tiles->size);
+	free(tiles->decoded);
+	free(tiles);
+}
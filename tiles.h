@@ -0,0 +1,75 @@
+#ifndef __TILES_H
+#define __TILES_H	1
+
+#include <stddef.h>
+
+#include "image.h"
+
+/* Side of the squares the pixels of a tiled image are decoded in */
+#define TILES_SIDE					256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A tile to decode: @a rows by @a columns pixels from (@a top, @a left) of
+ * an image @a width pixels wide, going to @a pixels, @a stride apart
+*/
+typedef struct tiles_tile_t {
+	size_t index;						/* row by row			*/
+	size_t top, left;
+	size_t rows, columns;
+	size_t width;
+	pixel_t *pixels;
+	size_t stride;
+} tiles_tile_t;
+
+/**
+ * Decodes @a tile from the @a size bytes of a file at @a data. Run by the
+ * pool threads, on other tiles at the same time. The pixel bytes it does
+ * not set stay zero.
+*/
+typedef void (*tiles_decode_t)(const unsigned char *data, size_t size,
+	const tiles_tile_t *tile);
+
+/**
+ * Turns tiled loading on (-t), off by default
+*/
+void tiles_enable(int enable);
+int tiles_enabled(void);
+
+/**
+ * An image of the file mapped at @a data, which it takes over, @a decode
+ * reading its tiles of @a side pixels from @a offset on. Its pixels lie in
+ * a mapping whose pages are only used once written; no tile is decoded
+ * until tiles_fetch asks for it.
+ *
+ * @return NULL, the file being unmapped, if there is no room for the pixels
+*/
+image_t *tiles_open(unsigned char *data, size_t size, size_t offset,
+	size_t rows, size_t columns, image_type_t type, size_t side,
+	tiles_decode_t decode);
+
+/**
+ * Decodes the tiles under @a region of @a image, and @a reach pixels around
+ * it, that were not decoded yet. Once all are, the file is let go.
+*/
+void tiles_fetch(image_t *image, image_selection_t region, size_t reach);
+
+/**
+ * Decodes every tile under @a image, before all its pixels are read
+*/
+void tiles_load(image_t *image);
+
+/**
+ * Lets go of the file and of what was decoded of it, the pixels going
+ * their own way
+*/
+void tiles_close(struct tiles_t *tiles);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,9 +32,6 @@
 #define ARRAY_SIZE(static_arr)											\
 	(sizeof((static_arr)) / sizeof(*(static_arr)))
 
-#define DEF_KERNEL(var)													\
-	int (var)[KERNEL_SIZE][KERNEL_SIZE]
-
 #ifdef __cplusplus
 extern "C" {
 #endif
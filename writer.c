@@ -0,0 +1,576 @@
+#define _POSIX_C_SOURCE				200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "writer.h"
+#include "alloc.h"
+#include "imt.h"
+#include "pipeline.h"
+#include "stream.h"
+#include "tiles.h"
+#include "utils.h"
+
+/**
+ * Pixels the saves of an image hold once it let them go
+*/
+typedef struct held_t {
+	image_t *image;
+	size_t saves;
+} held_t;
+
+typedef enum job_state_t {
+	JOB_QUEUED,
+	JOB_WRITING,
+} job_state_t;
+
+typedef struct writer_job_t {
+	struct writer_job_t *next;
+	const void *client;
+	char *path;
+	FILE *file;
+	char *temp;							/* renamed over @a path	*/
+	int binary;
+	int tiled;							/* IMT_MAGIC format		*/
+
+	/* The image as saved, its rows from @a base on. Its pixels are those
+	 * of @a owner until it changes them or lets them go. */
+	image_t view;
+	size_t rows, base;
+	const image_t *owner;
+	held_t *held;
+
+	size_t written;						/* rows					*/
+	job_state_t state;
+	int busy;							/* encoding a band		*/
+	int error;
+} writer_job_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;				/* a save was queued	*/
+	pthread_cond_t changed;				/* a band or save done	*/
+	pthread_t thread;
+	int started, stop;
+
+	/* Saves not done yet, oldest first, and their number */
+	writer_job_t *jobs;
+	size_t pending;
+
+	/* Saves that failed, not reported yet */
+	writer_job_t *failed;
+} writer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.changed = PTHREAD_COND_INITIALIZER,
+};
+
+static void _free_job(writer_job_t *job)
+{
+	free(job->path);
+	free(job);
+}
+
+/**
+ * Creates the file a save to @a path writes: a new one next to it, renamed
+ * over it once complete (@a temp), unless @a path is not a regular file.
+ * The file it replaces may still be read by an image (mapped, or decoded a
+ * tile at a time), and is never truncated under it.
+ *
+ * @return NULL if it cannot be created, errno telling why
+*/
+static FILE *_create(const char *path, char **temp)
+{
+	static size_t created;
+	struct stat st;
+	int exists = (stat(path, &st) == 0);
+
+	*temp = NULL;
+	if (exists && !S_ISREG(st.st_mode))
+		return fopen(path, "wb");
+
+	size_t size = strlen(path) + 64;
+	*temp = (char *)malloc(size);
+	DIE(!*temp, "malloc failed");
+	snprintf(*temp, size, "%s.%ld.%zu.tmp", path, (long)getpid(),
+		__atomic_fetch_add(&created, 1, __ATOMIC_RELAXED));
+
+	/* The mode of the file replaced, or that of a new one */
+	int fd = open(*temp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd >= 0 && exists)
+		fchmod(fd, st.st_mode & 07777);
+
+	FILE *file = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+	if (!file) {
+		int error = errno;
+
+		if (fd >= 0) {
+			close(fd);
+			unlink(*temp);
+		}
+		free(*temp);
+		*temp = NULL;
+		errno = error;
+	}
+
+	return file;
+}
+
+/**
+ * Closes @a file, renaming it over @a path if it is a new one, or removing
+ * it after @a error
+ *
+ * @return The error of the save, 0 if none
+*/
+static int _finish(FILE *file, char *temp, const char *path, int error)
+{
+	if (ferror(file) && !error)
+		error = (errno) ? errno : EIO;
+	if (fclose(file) != 0 && !error)
+		error = errno;
+
+	if (temp) {
+		if (!error && rename(temp, path) != 0)
+			error = errno;
+		if (error)
+			unlink(temp);
+		free(temp);
+	}
+
+	return error;
+}
+
+/**
+ * @return If @a job is the oldest save of its client still pending: the
+ * saves of a client are written one after the other, in order, as they may
+ * be to the same file
+*/
+static int _ready(const writer_job_t *job)
+{
+	for (writer_job_t *other = writer.jobs; other != job; other = other->next)
+		if (other->client == job->client)
+			return 0;
+	return job->state == JOB_QUEUED;
+}
+
+/**
+ * Writes the file of @a job, which the calling thread took, and lets it go
+*/
+static void _write_job(writer_job_t *job)
+{
+	FILE *file = job->file;
+	imt_output_t output;
+
+	/* Its size and type only, which a copy keeps */
+	pthread_mutex_lock(&writer.lock);
+	image_t header = job->view;
+	pthread_mutex_unlock(&writer.lock);
+	header.rows = job->rows;
+
+	/* Whole aligned blocks go to the system, not the rows one by one */
+	unsigned char *buffer = (unsigned char *)alloc_block(WRITER_BUFFER, 0);
+	if (buffer)
+		setvbuf(file, (char *)buffer, _IOFBF, WRITER_BUFFER);
+	if (job->tiled)
+		imt_begin(&output, file, &header);
+	else
+		print_header(file, &header, job->binary);
+
+	size_t row_size = (header.bits) ? header.words * sizeof(uint64_t)
+		: header.columns * sizeof(pixel_t);
+	size_t band = (row_size) ? WRITER_BAND / row_size : job->rows;
+	if (!band)
+		band = 1;
+	/* Whole rows of tiles, but for the last band */
+	if (job->tiled)
+		band = (band + TILES_SIDE - 1) / TILES_SIDE * TILES_SIDE;
+
+	size_t mark = alloc_mark();
+	pthread_mutex_lock(&writer.lock);
+	while (job->written < job->rows) {
+		size_t first = job->written;
+		size_t last = (first + band < job->rows) ? first + band : job->rows;
+
+		/* The view may be switched to a copy between two bands */
+		image_t rows = job->view;
+		rows.rows = last - first;
+		if (rows.bits)
+			rows.bits = image_bits(&job->view, first - job->base);
+		else
+			rows.pixels = image_row(&job->view, first - job->base);
+
+		job->busy = 1;
+		pthread_mutex_unlock(&writer.lock);
+
+		if (job->tiled)
+			imt_write_rows(&output, &rows);
+		else
+			write_pixels(file, &rows, job->binary);
+		alloc_rewind(mark);
+
+		pthread_mutex_lock(&writer.lock);
+		job->written = last;
+		job->busy = 0;
+		pthread_cond_broadcast(&writer.changed);
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	if (job->tiled)
+		imt_end(&output);
+	int error = _finish(file, job->temp, job->path, 0);
+	job->file = NULL;
+	job->temp = NULL;
+	alloc_release(buffer);
+
+	pthread_mutex_lock(&writer.lock);
+	writer_job_t **link = &writer.jobs;
+	while (*link != job)
+		link = &(*link)->next;
+	*link = job->next;
+	__atomic_store_n(&writer.pending, writer.pending - 1, __ATOMIC_RELEASE);
+
+	held_t *held = job->held;
+	if (held && --held->saves)
+		held = NULL;
+
+	job->error = error;
+	if (error) {
+		job->next = writer.failed;
+		writer.failed = job;
+	}
+	pthread_cond_broadcast(&writer.changed);
+	pthread_mutex_unlock(&writer.lock);
+
+	if (held) {
+		free_image(held->image);
+		free(held);
+	}
+	if (!error)
+		_free_job(job);
+}
+
+static void *_writer(void *arg)
+{
+	(void)arg;
+
+	/* Scratch space of its own, next to the commands running */
+	alloc_arena_t *arena = alloc_arena_create();
+	alloc_use(arena);
+
+	pthread_mutex_lock(&writer.lock);
+	for (;;) {
+		writer_job_t *job = writer.jobs;
+		while (job && !_ready(job))
+			job = job->next;
+
+		if (!job) {
+			if (writer.stop)
+				break;
+			pthread_cond_wait(&writer.work, &writer.lock);
+			continue;
+		}
+
+		job->state = JOB_WRITING;
+		pthread_mutex_unlock(&writer.lock);
+		_write_job(job);
+		pthread_mutex_lock(&writer.lock);
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	alloc_use(NULL);
+	alloc_arena_destroy(arena);
+	return NULL;
+}
+
+/**
+ * Waits until @a client (any when NULL) has at most @a limit saves
+ * pending, writing those the background thread has not started yet.
+ * Called with the lock held.
+*/
+static void _settle(const void *client, size_t limit)
+{
+	for (;;) {
+		size_t count = 0;
+		writer_job_t *ready = NULL;
+
+		for (writer_job_t *job = writer.jobs; job; job = job->next) {
+			if (client && job->client != client)
+				continue;
+
+			count++;
+			if (!ready && _ready(job))
+				ready = job;
+		}
+
+		if (count <= limit)
+			return;
+
+		if (!ready) {
+			pthread_cond_wait(&writer.changed, &writer.lock);
+			continue;
+		}
+
+		ready->state = JOB_WRITING;
+		pthread_mutex_unlock(&writer.lock);
+		_write_job(ready);
+		pthread_mutex_lock(&writer.lock);
+	}
+}
+
+int writer_save(image_t *image, const char *path, int binary, int tiled,
+	const void *client)
+{
+	/* Saved over the file it is streamed from, which is renamed over once
+	 * the save is done: the pixels are read from it first */
+	if (stream_reads(image, path) && !stream_load(image)) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	/* Streamed images are read from their file as they are written, unless
+	 * tiled, whose index only comes at the end */
+	if (image->source && !tiled) {
+		char *temp;
+		FILE *file = _create(path, &temp);
+		if (!file)
+			return 0;
+
+		int error = _finish(file, temp, path,
+			(print_pixels(file, image, binary)) ? 0 : ENOMEM);
+		errno = error;
+		return !error;
+	}
+
+	/* Created now so that a bad path is told right away, written later */
+	char *temp;
+	FILE *file = _create(path, &temp);
+	if (!file)
+		return 0;
+
+	/* The pixels are read by another thread from now on */
+	if (image->source && !stream_load(image)) {
+		_finish(file, temp, path, ENOMEM);
+		errno = ENOMEM;
+		return 0;
+	}
+	pipeline_flush(image);
+	tiles_load(image);
+
+	writer_job_t *job = (writer_job_t *)calloc(1, sizeof(writer_job_t));
+	DIE(!job, "calloc failed");
+	job->path = strdup(path);
+	DIE(!job->path, "strdup failed");
+
+	job->client = client;
+	job->file = file;
+	job->temp = temp;
+	job->binary = binary;
+	job->tiled = tiled;
+	job->view = *image;
+	job->view.pending = NULL;
+	job->view.histogram = NULL;
+	job->view.pyramid = NULL;
+	job->view.history = NULL;
+	job->rows = image->rows;
+	job->owner = image;
+	job->state = JOB_QUEUED;
+
+	pthread_mutex_lock(&writer.lock);
+	_settle(client, WRITER_QUEUE - 1);
+
+	if (!writer.started) {
+		DIE(pthread_create(&writer.thread, NULL, _writer, NULL) != 0,
+			"pthread_create failed");
+		writer.started = 1;
+	}
+
+	writer_job_t **link = &writer.jobs;
+	while (*link)
+		link = &(*link)->next;
+	*link = job;
+	__atomic_store_n(&writer.pending, writer.pending + 1, __ATOMIC_RELEASE);
+
+	pthread_cond_signal(&writer.work);
+	pthread_mutex_unlock(&writer.lock);
+	return 1;
+}
+
+void writer_detach(image_t *image)
+{
+	/* Only the thread of an image saves it, so its saves are counted */
+	if (!__atomic_load_n(&writer.pending, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&writer.lock);
+	writer_job_t *job = writer.jobs;
+	while (job) {
+		if (job->owner != image) {
+			job = job->next;
+			continue;
+		}
+
+		/* Saves may end while waiting for the band, so look again */
+		if (job->busy) {
+			pthread_cond_wait(&writer.changed, &writer.lock);
+			job = writer.jobs;
+			continue;
+		}
+
+		size_t first = job->written, rows = job->rows - first;
+		if (!rows) {
+			job->owner = NULL;
+			job = job->next;
+			continue;
+		}
+
+		/* Only the rows not written yet, or, with no memory for them, the
+		 * image is left alone until they are */
+		image_t *copy = (job->view.bits)
+			? create_bilevel_image(rows, job->view.columns)
+			: create_image(rows, job->view.columns, job->view.type);
+		if (!copy) {
+			pthread_cond_wait(&writer.changed, &writer.lock);
+			job = writer.jobs;
+			continue;
+		}
+
+		job->owner = NULL;
+		for (size_t i = 0; i < rows; i++)
+			if (copy->bits)
+				memcpy(image_bits(copy, i),
+					image_bits(&job->view, first - job->base + i),
+					copy->words * sizeof(uint64_t));
+			else
+				memcpy(image_row(copy, i),
+					image_row(&job->view, first - job->base + i),
+					copy->columns * sizeof(pixel_t));
+
+		job->held = (held_t *)malloc(sizeof(held_t));
+		DIE(!job->held, "malloc failed");
+		job->held->image = copy;
+		job->held->saves = 1;
+
+		job->view = *copy;
+		job->base = first;
+		job = job->next;
+	}
+	pthread_mutex_unlock(&writer.lock);
+}
+
+int writer_adopt(image_t *image)
+{
+	if (!__atomic_load_n(&writer.pending, __ATOMIC_ACQUIRE))
+		return 0;
+
+	held_t *held = NULL;
+
+	pthread_mutex_lock(&writer.lock);
+	for (writer_job_t *job = writer.jobs; job; job = job->next) {
+		if (job->owner != image)
+			continue;
+
+		if (!held) {
+			held = (held_t *)malloc(sizeof(held_t));
+			DIE(!held, "malloc failed");
+
+			image_t *other = create_mapped_image(NULL, 0, NULL, image->rows,
+				image->columns, image->type);
+			other->pixels = image->pixels;
+			other->stride = image->stride;
+			other->buffer = image->buffer;
+			other->bits = image->bits;
+			other->words = image->words;
+			other->mapping = image->mapping;
+			other->mapping_size = image->mapping_size;
+
+			held->image = other;
+			held->saves = 0;
+		}
+
+		job->owner = NULL;
+		job->held = held;
+		held->saves++;
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	return held != NULL;
+}
+
+size_t writer_report(const void *client, FILE *out)
+{
+	size_t failed = 0;
+
+	pthread_mutex_lock(&writer.lock);
+	writer_job_t **link = &writer.failed;
+	while (*link) {
+		writer_job_t *job = *link;
+		if (client && job->client != client) {
+			link = &job->next;
+			continue;
+		}
+
+		*link = job->next;
+		fprintf(out, "Failed to save %s: %s\n", job->path,
+			strerror(job->error));
+		_free_job(job);
+		failed++;
+	}
+	pthread_mutex_unlock(&writer.lock);
+
+	return failed;
+}
+
+size_t writer_join(const void *client, FILE *out)
+{
+	pthread_mutex_lock(&writer.lock);
+	_settle(client, 0);
+	pthread_mutex_unlock(&writer.lock);
+
+	return writer_report(client, out);
+}
+
+void writer_wait(const char *path)
+{
+	pthread_mutex_lock(&writer.lock);
+	for (;;) {
+		writer_job_t *job = writer.jobs;
+		while (job && strcmp(job->path, path) != 0)
+			job = job->next;
+
+		if (!job)
+			break;
+
+		if (!_ready(job)) {
+			pthread_cond_wait(&writer.changed, &writer.lock);
+			continue;
+		}
+
+		job->state = JOB_WRITING;
+		pthread_mutex_unlock(&writer.lock);
+		_write_job(job);
+		pthread_mutex_lock(&writer.lock);
+	}
+	pthread_mutex_unlock(&writer.lock);
+}
+
+void writer_stop(void)
+{
+	pthread_mutex_lock(&writer.lock);
+	if (!writer.started) {
+		pthread_mutex_unlock(&writer.lock);
+		return;
+	}
+
+	writer.stop = 1;
+	pthread_cond_signal(&writer.work);
+	pthread_mutex_unlock(&writer.lock);
+
+	pthread_join(writer.thread, NULL);
+	writer.started = 0;
+	writer.stop = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef __WRITER_H
+#define __WRITER_H	1
+
+#include <stdio.h>
+
+#include "image.h"
+
+/* Bytes handed to the system at a time, from an aligned buffer */
+#define WRITER_BUFFER				((size_t)1 << 20)
+/* Bytes of pixels encoded at a time: a change waits for one band at most */
+#define WRITER_BAND					((size_t)4 << 20)
+/* Saves waiting, past which SAVE writes the file itself */
+#define WRITER_QUEUE				4
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Writes @a image to @a path on a background thread, the caller going on
+ * right away, in the native tiled format (imt.h) if @a tiled. Queued
+ * operations are run first; the pixels are not copied but shared with the
+ * save until the image changes (writer_detach) or lets them go
+ * (writer_adopt). Saves of one @a client are told apart from those of
+ * other ones. The file is written under another name and renamed over
+ * @a path once complete.
+ *
+ * @return 0 if the file cannot be created, or a streamed image cannot be
+ * read for want of memory, errno telling why
+*/
+int writer_save(image_t *image, const char *path, int binary, int tiled,
+	const void *client);
+
+/**
+ * Called before the pixels of @a image change in place: the rows its
+ * saves have not written yet are copied for them
+*/
+void writer_detach(image_t *image);
+
+/**
+ * Takes over the pixels of @a image, which are about to be released, if a
+ * save still reads them: they are let go once it is done
+ *
+ * @return 0 if they can be released
+*/
+int writer_adopt(image_t *image);
+
+/**
+ * Writes a line to @a out for every save of @a client that failed since
+ * the last call. writer_join waits for (or writes itself) the saves still
+ * pending first, those of every client when @a client is NULL.
+ *
+ * @return The number of failed saves
+*/
+size_t writer_report(const void *client, FILE *out);
+size_t writer_join(const void *client, FILE *out);
+
+/**
+ * Waits for (or writes itself) the saves to @a path still pending, before
+ * the file is read back
+*/
+void writer_wait(const char *path);
+
+/**
+ * Waits for every save and stops the background thread
+*/
+void writer_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif